@@ -0,0 +1,866 @@
+#ifndef BPLUSTREE_HPP
+#define BPLUSTREE_HPP
+
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <cassert>
+#include <random>
+
+template<typename K, typename V>
+class BPlusTree {
+private:
+    static const int DEFAULT_DEGREE = 3;  // 默认度数（最小子节点数）
+    const int degree;  // B+树的度数（最小子节点数）
+    
+    // B+树节点基类
+    class Node {
+    public:
+        bool is_leaf;
+        std::vector<K> keys;
+        const int degree_ref;  // 引用外部B+树的degree
+        
+        Node(bool leaf, int deg) : is_leaf(leaf), degree_ref(deg) {}
+        
+        size_t max_keys() const { return 2 * (size_t)degree_ref - 1; }
+        size_t min_keys() const { return (size_t)degree_ref - 1; }
+        virtual ~Node() = default;
+        
+        virtual bool is_full() const = 0;
+        virtual bool is_underflow() const = 0;
+        virtual bool can_borrow() const = 0;
+        virtual void insert_key(const K& key, const V& value) = 0;
+        virtual void remove_key(const K& key) = 0;
+        virtual bool contains(const K& key) const = 0;
+        virtual V* find(const K& key) = 0;
+        virtual std::vector<V> range_query(const K& start, const K& end) const = 0;
+        virtual void print() const = 0;
+    };
+    
+    // 内部节点
+    class InternalNode : public Node {
+    public:
+        std::vector<std::shared_ptr<Node>> children;
+        
+        InternalNode(int deg) : Node(false, deg) {}
+        
+        bool is_full() const override {
+            return Node::keys.size() >= Node::max_keys();
+        }
+        
+        bool is_underflow() const override {
+            // 根节点可以有最少1个键，其他内部节点至少需要degree-1个键
+            return Node::keys.size() < Node::min_keys();
+        }
+        
+        bool can_borrow() const override {
+            return Node::keys.size() > Node::min_keys();
+        }
+        
+        void insert_key(const K& key, const V& value) override {
+            // 内部节点不存储值
+            (void)value;
+            (void)key;
+        }
+        
+        void remove_key(const K& key) override {
+            // 内部节点不直接存储值
+            (void)key;
+        }
+        
+        bool contains(const K& key) const override {
+            (void)key;
+            return false;  // 内部节点不存储值
+        }
+        
+        V* find(const K& key) override {
+            (void)key;
+            return nullptr;  // 内部节点不存储值
+        }
+        
+        std::vector<V> range_query(const K& start, const K& end) const override {
+            (void)start;
+            (void)end;
+            return {};  // 内部节点不存储值
+        }
+        
+        void print() const override {
+            std::cout << "[Internal: ";
+            for (size_t i = 0; i < Node::keys.size(); i++) {
+                std::cout << Node::keys[i];
+                if (i < Node::keys.size() - 1) std::cout << "|";
+            }
+            std::cout << "]";
+        }
+        
+        // 找到应插入的子节点索引（等于分隔键的key属于右子树）
+        // Q 可以是 K 本身，也可以是能与 K 比较的视图类型（如 std::string_view）
+        template<typename Q>
+        size_t find_child_index(const Q& key) const {
+            return std::upper_bound(Node::keys.begin(), Node::keys.end(), key) - Node::keys.begin();
+        }
+        
+        // 分裂节点，中间键通过 mid_key 返回给父节点
+        std::shared_ptr<InternalNode> split(K& mid_key) {
+            auto new_right = std::make_shared<InternalNode>(Node::degree_ref);
+            
+            // 移动一半的键和子节点到新节点
+            int mid = Node::keys.size() / 2;
+            mid_key = Node::keys[mid];
+            
+            // 新节点获取右半部分的键
+            new_right->keys.assign(Node::keys.begin() + mid + 1, Node::keys.end());
+            
+            // 新节点获取右半部分的子节点
+            new_right->children.assign(children.begin() + mid + 1, children.end());
+            
+            // 调整原节点
+            Node::keys.resize(mid);
+            children.resize(mid + 1);
+            
+            return new_right;
+        }
+        
+        // 在指定位置插入键和子节点
+        void insert_child(size_t idx, const K& key, std::shared_ptr<Node> child) {
+            if (idx < Node::keys.size()) {
+                Node::keys.insert(Node::keys.begin() + idx, key);
+                children.insert(children.begin() + idx + 1, child);
+            } else {
+                Node::keys.push_back(key);
+                children.push_back(child);
+            }
+        }
+    };
+    
+    // 叶子节点
+    class LeafNode : public Node {
+    public:
+        std::vector<V> values;
+        std::shared_ptr<LeafNode> next;  // 指向下一个叶子节点（用于范围查询）
+        LeafNode* prev;                  // 前一个叶子，不持有；删除合并时 O(1) 摘链
+        
+        LeafNode(int deg) : Node(true, deg), next(nullptr), prev(nullptr) {}
+        
+        bool is_full() const override {
+            return Node::keys.size() >= Node::max_keys();
+        }
+        
+        bool is_underflow() const override {
+            return Node::keys.size() < Node::min_keys();
+        }
+        
+        bool can_borrow() const override {
+            return Node::keys.size() > Node::min_keys();
+        }
+        
+        // 在叶子节点中插入键值对
+        void insert_key(const K& key, const V& value) override {
+            auto it = std::lower_bound(Node::keys.begin(), Node::keys.end(), key);
+            int idx = it - Node::keys.begin();
+            
+            // 键已存在，更新值
+            if (it != Node::keys.end() && *it == key) {
+                values[idx] = value;
+                return;
+            }
+            
+            // 插入键和值
+            Node::keys.insert(it, key);
+            values.insert(values.begin() + idx, value);
+        }
+        
+        // 从叶子节点删除键
+        void remove_key(const K& key) override {
+            auto it = std::lower_bound(Node::keys.begin(), Node::keys.end(), key);
+            if (it != Node::keys.end() && *it == key) {
+                int idx = it - Node::keys.begin();
+                Node::keys.erase(it);
+                values.erase(values.begin() + idx);
+            }
+        }
+        
+        bool contains(const K& key) const override {
+            return std::binary_search(Node::keys.begin(), Node::keys.end(), key);
+        }
+        
+        V* find(const K& key) override {
+            auto it = std::lower_bound(Node::keys.begin(), Node::keys.end(), key);
+            if (it != Node::keys.end() && *it == key) {
+                int idx = it - Node::keys.begin();
+                return &values[idx];
+            }
+            return nullptr;
+        }
+        
+        std::vector<V> range_query(const K& start, const K& end) const override {
+            std::vector<V> result;
+            auto leaf = this;
+            
+            while (leaf) {
+                for (size_t i = 0; i < leaf->keys.size(); i++) {
+                    if (leaf->keys[i] >= start && leaf->keys[i] <= end) {
+                        result.push_back(leaf->values[i]);
+                    } else if (leaf->keys[i] > end) {
+                        return result;  // 超过范围，提前返回
+                    }
+                }
+                leaf = leaf->next.get();
+            }
+            
+            return result;
+        }
+        
+        void print() const override {
+            std::cout << "[Leaf: ";
+            for (size_t i = 0; i < Node::keys.size(); i++) {
+                std::cout << Node::keys[i];
+                if (i < Node::keys.size() - 1) std::cout << ",";
+            }
+            std::cout << "]";
+        }
+        
+        // 分裂叶子节点
+        std::shared_ptr<LeafNode> split() {
+            auto new_leaf = std::make_shared<LeafNode>(Node::degree_ref);
+            
+            // 移动一半的键值对到新节点
+            int mid = Node::keys.size() / 2;
+            new_leaf->keys.assign(Node::keys.begin() + mid, Node::keys.end());
+            new_leaf->values.assign(values.begin() + mid, values.end());
+            
+            // 调整原节点
+            Node::keys.resize(mid);
+            values.resize(mid);
+            
+            // 更新链表指针
+            new_leaf->next = next;
+            new_leaf->prev = this;
+            if (next) next->prev = new_leaf.get();
+            next = new_leaf;
+            
+            return new_leaf;
+        }
+    };
+    
+    std::shared_ptr<Node> root;
+    std::shared_ptr<LeafNode> first_leaf;  // 指向第一个叶子节点
+    
+    // 插入辅助函数
+    void insert_nonfull(std::shared_ptr<Node> node, const K& key, const V& value) {
+        if (node->is_leaf) {
+            auto leaf = std::dynamic_pointer_cast<LeafNode>(node);
+            leaf->insert_key(key, value);
+        } else {
+            auto internal = std::dynamic_pointer_cast<InternalNode>(node);
+            size_t idx = internal->find_child_index(key);
+            
+            // 如果子节点已满，先分裂
+            if (internal->children[idx]->is_full()) {
+                if (internal->children[idx]->is_leaf) {
+                    auto leaf = std::dynamic_pointer_cast<LeafNode>(internal->children[idx]);
+                    auto new_leaf = leaf->split();
+                    K promote_key = new_leaf->keys[0];
+                    
+                    // 将提升的键和新的子节点插入到当前内部节点
+                    internal->insert_child(idx, promote_key, new_leaf);
+                } else {
+                    auto child_internal = std::dynamic_pointer_cast<InternalNode>(internal->children[idx]);
+                    K promote_key; // 中间键
+                    auto new_internal = child_internal->split(promote_key);
+                    
+                    // 将提升的键和新的子节点插入到当前内部节点
+                    internal->insert_child(idx, promote_key, new_internal);
+                }
+                
+                // 重新确定插入位置
+                if (!(key < internal->keys[idx])) {
+                    idx++;
+                }
+            }
+            
+            insert_nonfull(internal->children[idx], key, value);
+        }
+    }
+    
+    // 把叶子从叶子链表中摘掉
+    void unlink_leaf(const std::shared_ptr<LeafNode>& leaf) {
+        if (leaf->prev) {
+            leaf->prev->next = leaf->next;
+        } else {
+            first_leaf = leaf->next;
+        }
+        if (leaf->next) {
+            leaf->next->prev = leaf->prev;
+        }
+        leaf->next = nullptr;
+        leaf->prev = nullptr;
+    }
+    
+    // children[idx] 少于 degree-1 个键：兄弟有富余时借一个，否则和一个兄弟合并
+    void rebalance(InternalNode* parent, size_t idx) {
+        auto child = parent->children[idx];
+        Node* left = idx > 0 ? parent->children[idx - 1].get() : nullptr;
+        Node* right = idx + 1 < parent->children.size() ? parent->children[idx + 1].get() : nullptr;
+        
+        if (left && left->can_borrow()) {
+            borrow_from_left(parent, idx);
+        } else if (right && right->can_borrow()) {
+            borrow_from_right(parent, idx);
+        } else if (left) {
+            merge_children(parent, idx - 1);
+        } else if (right) {
+            merge_children(parent, idx);
+        }
+    }
+    
+    // 左兄弟的最后一个键移到 children[idx] 的开头，分隔键跟着改
+    void borrow_from_left(InternalNode* parent, size_t idx) {
+        Node* node = parent->children[idx].get();
+        Node* left = parent->children[idx - 1].get();
+        
+        if (node->is_leaf) {
+            auto leaf = static_cast<LeafNode*>(node);
+            auto sib = static_cast<LeafNode*>(left);
+            leaf->keys.insert(leaf->keys.begin(), std::move(sib->keys.back()));
+            leaf->values.insert(leaf->values.begin(), std::move(sib->values.back()));
+            sib->keys.pop_back();
+            sib->values.pop_back();
+            parent->keys[idx - 1] = leaf->keys.front();
+        } else {
+            auto internal = static_cast<InternalNode*>(node);
+            auto sib = static_cast<InternalNode*>(left);
+            internal->keys.insert(internal->keys.begin(), std::move(parent->keys[idx - 1]));
+            internal->children.insert(internal->children.begin(), std::move(sib->children.back()));
+            parent->keys[idx - 1] = std::move(sib->keys.back());
+            sib->keys.pop_back();
+            sib->children.pop_back();
+        }
+    }
+    
+    // 右兄弟的第一个键移到 children[idx] 的末尾，分隔键跟着改
+    void borrow_from_right(InternalNode* parent, size_t idx) {
+        Node* node = parent->children[idx].get();
+        Node* right = parent->children[idx + 1].get();
+        
+        if (node->is_leaf) {
+            auto leaf = static_cast<LeafNode*>(node);
+            auto sib = static_cast<LeafNode*>(right);
+            leaf->keys.push_back(std::move(sib->keys.front()));
+            leaf->values.push_back(std::move(sib->values.front()));
+            sib->keys.erase(sib->keys.begin());
+            sib->values.erase(sib->values.begin());
+            parent->keys[idx] = sib->keys.front();
+        } else {
+            auto internal = static_cast<InternalNode*>(node);
+            auto sib = static_cast<InternalNode*>(right);
+            internal->keys.push_back(std::move(parent->keys[idx]));
+            internal->children.push_back(std::move(sib->children.front()));
+            parent->keys[idx] = std::move(sib->keys.front());
+            sib->keys.erase(sib->keys.begin());
+            sib->children.erase(sib->children.begin());
+        }
+    }
+    
+    // children[idx + 1] 并进 children[idx]，去掉两者之间的分隔键。
+    // 两边都不能借时加起来最多 2*degree-3 个键（内部节点加上分隔键 2*degree-2 个），放得下
+    void merge_children(InternalNode* parent, size_t idx) {
+        Node* node = parent->children[idx].get();
+        auto right = parent->children[idx + 1];
+        
+        if (node->is_leaf) {
+            auto leaf = static_cast<LeafNode*>(node);
+            auto sib = std::static_pointer_cast<LeafNode>(right);
+            std::move(sib->keys.begin(), sib->keys.end(), std::back_inserter(leaf->keys));
+            std::move(sib->values.begin(), sib->values.end(), std::back_inserter(leaf->values));
+            unlink_leaf(sib);
+        } else {
+            auto internal = static_cast<InternalNode*>(node);
+            auto sib = std::static_pointer_cast<InternalNode>(right);
+            internal->keys.push_back(std::move(parent->keys[idx]));
+            std::move(sib->keys.begin(), sib->keys.end(), std::back_inserter(internal->keys));
+            std::move(sib->children.begin(), sib->children.end(), std::back_inserter(internal->children));
+        }
+        parent->keys.erase(parent->keys.begin() + idx);
+        parent->children.erase(parent->children.begin() + idx + 1);
+    }
+    
+    // 删除辅助函数，removed 返回key是否存在；返回 node 删完之后是否少于 degree-1 个键，由父节点调整
+    template<typename Q>
+    bool remove_recursive(std::shared_ptr<Node> node, const Q& key, bool& removed) {
+        if (node->is_leaf) {
+            auto leaf = std::static_pointer_cast<LeafNode>(node);
+            auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
+            if (it != leaf->keys.end() && !(key < *it)) {
+                size_t idx = it - leaf->keys.begin();
+                leaf->keys.erase(it);
+                leaf->values.erase(leaf->values.begin() + idx);
+                removed = true;
+            }
+            return removed && leaf->is_underflow();
+        } else {
+            auto internal = std::static_pointer_cast<InternalNode>(node);
+            size_t idx = internal->find_child_index(key);
+            if (idx >= internal->children.size()) {
+                return false;
+            }
+            
+            if (remove_recursive(internal->children[idx], key, removed)) {
+                rebalance(internal.get(), idx);
+            }
+            return internal->is_underflow();
+        }
+    }
+    
+    // 查找叶子节点
+    template<typename Q>
+    std::shared_ptr<LeafNode> find_leaf(const Q& key) const {
+        if (!root) return nullptr;
+        
+        auto node = root;
+        while (!node->is_leaf) {
+            auto internal = std::dynamic_pointer_cast<InternalNode>(node);
+            size_t idx = internal->find_child_index(key);
+            if (idx >= internal->children.size()) {
+                return nullptr;  // 不应该发生
+            }
+            node = internal->children[idx];
+        }
+        return std::dynamic_pointer_cast<LeafNode>(node);
+    }
+    
+    // 验证树结构
+    bool validate_node(std::shared_ptr<Node> node, int level, K& min_key, K& max_key, bool& first) const {
+        if (!node) return true;
+        
+        // 检查节点大小
+        if (node != root) {
+            if (node->is_underflow()) {
+                std::cout << "Error: Node underflow at level " << level << std::endl;
+                return false;
+            }
+            if (node->is_full()) {
+                std::cout << "Warning: Node full at level " << level << std::endl;
+            }
+        }
+        
+        if (node->is_leaf) {
+            auto leaf = std::dynamic_pointer_cast<LeafNode>(node);
+            if (leaf->keys.empty()) {
+                std::cout << "Error: Empty leaf node at level " << level << std::endl;
+                return false;
+            }
+            
+            // 检查键的顺序
+            for (size_t i = 1; i < leaf->keys.size(); i++) {
+                if (leaf->keys[i] <= leaf->keys[i-1]) {
+                    std::cout << "Error: Leaf keys not sorted at level " << level << std::endl;
+                    return false;
+                }
+            }
+            
+            // 更新最小值和最大值
+            if (first) {
+                min_key = leaf->keys.front();
+                max_key = leaf->keys.back();
+                first = false;
+            } else {
+                if (leaf->keys.front() <= max_key) {
+                    std::cout << "Error: Leaf key range overlap at level " << level << std::endl;
+                    return false;
+                }
+                max_key = leaf->keys.back();
+            }
+            
+            return true;
+        } else {
+            auto internal = std::dynamic_pointer_cast<InternalNode>(node);
+            if (internal->children.empty()) {
+                std::cout << "Error: Internal node has no children at level " << level << std::endl;
+                return false;
+            }
+            
+            if (internal->keys.size() != internal->children.size() - 1) {
+                std::cout << "Error: Key count mismatch at internal node level " << level << std::endl;
+                return false;
+            }
+            
+            // 递归验证每个子树：左子树的键 < 分隔键 <= 右子树的键
+            for (size_t i = 0; i < internal->children.size(); i++) {
+                K child_min, child_max;
+                bool child_first = true;
+                
+                if (!validate_node(internal->children[i], level + 1, child_min, child_max, child_first)) {
+                    return false;
+                }
+                
+                if (i < internal->keys.size()) {
+                    if (!(child_max < internal->keys[i])) {
+                        std::cout << "Error: Child max key >= split key at level " << level << std::endl;
+                        return false;
+                    }
+                }
+                if (i > 0) {
+                    if (child_min < internal->keys[i-1]) {
+                        std::cout << "Error: Child min key < previous split key at level " << level << std::endl;
+                        return false;
+                    }
+                }
+                
+                if (first) {
+                    min_key = child_min;
+                    first = false;
+                } else if (!(max_key < child_min)) {
+                    std::cout << "Error: Subtree key range overlap at level " << level << std::endl;
+                    return false;
+                }
+                max_key = child_max;
+            }
+            
+            return true;
+        }
+    }
+    
+public:
+    BPlusTree(int deg = DEFAULT_DEGREE) : degree(std::max(2, deg)), root(nullptr), first_leaf(nullptr) {}
+    
+    // 插入键值对
+    void insert(const K& key, const V& value) {
+        if (!root) {
+            auto leaf = std::make_shared<LeafNode>(degree);
+            leaf->insert_key(key, value);
+            root = leaf;
+            first_leaf = leaf;
+            return;
+        }
+        
+        // 如果根节点已满，需要分裂根节点
+        if (root->is_full()) {
+            auto new_root = std::make_shared<InternalNode>(degree);
+            
+            if (root->is_leaf) {
+                auto old_leaf = std::dynamic_pointer_cast<LeafNode>(root);
+                auto new_leaf = old_leaf->split();
+                K promote_key = new_leaf->keys[0];
+                
+                new_root->keys.push_back(promote_key);
+                new_root->children.push_back(old_leaf);
+                new_root->children.push_back(new_leaf);
+            } else {
+                auto old_internal = std::dynamic_pointer_cast<InternalNode>(root);
+                K promote_key;
+                auto new_internal = old_internal->split(promote_key);
+                
+                new_root->keys.push_back(promote_key);
+                new_root->children.push_back(old_internal);
+                new_root->children.push_back(new_internal);
+            }
+            
+            root = new_root;
+        }
+        
+        insert_nonfull(root, key, value);
+    }
+    
+    // 删除键，返回key是否存在
+    template<typename Q>
+    bool remove(const Q& key) {
+        if (!root) return false;
+        
+        bool removed = false;
+        remove_recursive(root, key, removed);
+        
+        // 如果根节点变成叶子节点且为空，则清空树
+        if (root->is_leaf) {
+            auto leaf = std::dynamic_pointer_cast<LeafNode>(root);
+            if (leaf->keys.empty()) {
+                root = nullptr;
+                first_leaf = nullptr;
+            }
+        }
+        // 根的最后两个孩子合并之后根只剩一个孩子，树降低一层
+        else if (root->keys.empty()) {
+            root = std::static_pointer_cast<InternalNode>(root)->children[0];
+        }
+        return removed;
+    }
+    
+    // 查找键，Q 可以是能与 K 比较的视图类型，查找时不需要构造 K
+    template<typename Q>
+    V* find(const Q& key) {
+        auto leaf = find_leaf(key);
+        if (leaf) {
+            auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
+            if (it != leaf->keys.end() && !(key < *it)) {
+                return &leaf->values[it - leaf->keys.begin()];
+            }
+        }
+        return nullptr;
+    }
+    
+    // 批量查找，key_at(i) 按 i 升序给出 n 个 key（可以重复）。
+    // 下一个 key 还在当前子树的上界之内时不从根重新查找，只从第一个越界的那一层往下走，
+    // 同一个叶子里接着上一次的位置往后找。往下走时预取右边的兄弟和下一个叶子，后面的 key 大多落在那里。
+    // 每个 key 调用一次 fn(i, V*)，找不到时 V* 为 nullptr
+    template<typename G, typename F>
+    void find_sorted(size_t n, G&& key_at, F&& fn) {
+        if (!root) {
+            for (size_t i = 0; i < n; i++) fn(i, nullptr);
+            return;
+        }
+
+        std::vector<std::pair<InternalNode*, size_t>> path;  // 每一层的节点和走过的子节点下标
+        LeafNode* leaf = nullptr;
+        size_t pos = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            const auto& key = key_at(i);
+
+            size_t level = 0;
+            while (level < path.size()) {
+                InternalNode* node = path[level].first;
+                size_t c = path[level].second;
+                if (c < node->keys.size() && !(key < node->keys[c])) break;
+                level++;
+            }
+
+            if (!leaf || level < path.size()) {
+                Node* node = level < path.size() ? path[level].first : root.get();
+                path.resize(level);
+                while (!node->is_leaf) {
+                    auto internal = static_cast<InternalNode*>(node);
+                    size_t c = internal->find_child_index(key);
+                    path.emplace_back(internal, c);
+                    if (c + 1 < internal->children.size()) {
+                        __builtin_prefetch(internal->children[c + 1].get());
+                    }
+                    node = internal->children[c].get();
+                }
+                leaf = static_cast<LeafNode*>(node);
+                pos = 0;
+                if (leaf->next) {
+                    __builtin_prefetch(leaf->next.get());
+                }
+            }
+
+            auto it = std::lower_bound(leaf->keys.begin() + pos, leaf->keys.end(), key);
+            pos = it - leaf->keys.begin();
+            if (it != leaf->keys.end() && !(key < *it)) {
+                fn(i, &leaf->values[pos]);
+            } else {
+                fn(i, nullptr);
+            }
+        }
+    }
+
+    // 用按 key 严格升序的 n 个键值对自底向上重建整棵树，next(K&, V&) 依次给出每一对。
+    // 叶子和内部节点都填到 2*degree-2 个键，留一个空位，之后的插入不会马上分裂；
+    // 每层最后一个节点不够 degree-1 个键时和前一个节点均分
+    template<typename G>
+    void bulk_load(size_t n, G&& next) {
+        root = nullptr;
+        first_leaf = nullptr;
+        if (n == 0) return;
+        
+        const size_t max_keys = 2 * degree - 2;
+        const size_t min_keys = degree - 1;
+        
+        // 每个节点和它子树里的最小键
+        std::vector<std::pair<std::shared_ptr<Node>, K>> level;
+        std::shared_ptr<LeafNode> leaf;
+        for (size_t i = 0; i < n; i++) {
+            if (!leaf || leaf->keys.size() == max_keys) {
+                auto prev = leaf;
+                leaf = std::make_shared<LeafNode>(degree);
+                leaf->keys.reserve(max_keys + 1);
+                leaf->values.reserve(max_keys + 1);
+                if (prev) prev->next = leaf;
+                else first_leaf = leaf;
+                leaf->prev = prev.get();
+            }
+            K key;
+            V value;
+            next(key, value);
+            leaf->keys.push_back(std::move(key));
+            leaf->values.push_back(std::move(value));
+            if (leaf->keys.size() == 1) {
+                level.emplace_back(leaf, leaf->keys[0]);
+            }
+        }
+        if (level.size() > 1 && leaf->keys.size() < min_keys) {
+            auto prev = std::static_pointer_cast<LeafNode>(level[level.size() - 2].first);
+            size_t move = (prev->keys.size() + leaf->keys.size()) / 2 - leaf->keys.size();
+            leaf->keys.insert(leaf->keys.begin(), std::make_move_iterator(prev->keys.end() - move),
+                              std::make_move_iterator(prev->keys.end()));
+            leaf->values.insert(leaf->values.begin(), std::make_move_iterator(prev->values.end() - move),
+                                std::make_move_iterator(prev->values.end()));
+            prev->keys.resize(prev->keys.size() - move);
+            prev->values.resize(prev->values.size() - move);
+            level.back().second = leaf->keys[0];
+        }
+        
+        // 每个内部节点最多 max_keys + 1 个孩子，分隔键是右边孩子子树的最小键
+        while (level.size() > 1) {
+            std::vector<std::pair<std::shared_ptr<Node>, K>> parents;
+            size_t groups = (level.size() + max_keys) / (max_keys + 1);
+            std::vector<size_t> sizes(groups, max_keys + 1);
+            sizes.back() = level.size() - (groups - 1) * (max_keys + 1);
+            if (groups > 1 && sizes.back() < min_keys + 1) {
+                size_t total = sizes[groups - 2] + sizes.back();
+                sizes[groups - 2] = total - total / 2;
+                sizes.back() = total / 2;
+            }
+            
+            size_t pos = 0;
+            for (size_t g = 0; g < groups; g++) {
+                auto internal = std::make_shared<InternalNode>(degree);
+                internal->children.reserve(sizes[g] + 1);
+                internal->keys.reserve(sizes[g]);
+                for (size_t c = 0; c < sizes[g]; c++, pos++) {
+                    if (c > 0) internal->keys.push_back(level[pos].second);
+                    internal->children.push_back(std::move(level[pos].first));
+                }
+                parents.emplace_back(internal, std::move(level[pos - sizes[g]].second));
+            }
+            level = std::move(parents);
+        }
+        root = level[0].first;
+    }
+    
+    // 范围查询
+    std::vector<V> range_query(const K& start, const K& end) {
+        if (!root) return {};
+        
+        auto leaf = find_leaf(start);
+        if (leaf) {
+            return leaf->range_query(start, end);
+        }
+        return {};
+    }
+    
+    // 从第一个 >= start 的键开始沿叶子链表顺序遍历，fn(key, value) 返回 false 时停止
+    template<typename Q, typename F>
+    void scan(const Q& start, F&& fn) const {
+        auto found = find_leaf(start);
+        const LeafNode* leaf = found.get();
+        if (!leaf) return;
+        
+        size_t i = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), start) - leaf->keys.begin();
+        while (leaf) {
+            for (; i < leaf->keys.size(); i++) {
+                if (!fn(leaf->keys[i], leaf->values[i])) {
+                    return;
+                }
+            }
+            leaf = leaf->next.get();
+            i = 0;
+        }
+    }
+    
+    // 从第一个键开始顺序遍历
+    template<typename F>
+    void scan(F&& fn) const {
+        for (const LeafNode* leaf = first_leaf.get(); leaf; leaf = leaf->next.get()) {
+            for (size_t i = 0; i < leaf->keys.size(); i++) {
+                if (!fn(leaf->keys[i], leaf->values[i])) {
+                    return;
+                }
+            }
+        }
+    }
+    
+    // 检查键是否存在
+    template<typename Q>
+    bool contains(const Q& key) {
+        return find(key) != nullptr;
+    }
+    
+    // 验证树结构
+    bool validate() const {
+        if (!root) return true;
+        
+        K min_key, max_key;
+        bool first = true;
+        return validate_node(root, 0, min_key, max_key, first);
+    }
+    
+    // 打印B+树（层次遍历）
+    void print() const {
+        if (!root) {
+            std::cout << "Empty tree" << std::endl;
+            return;
+        }
+        
+        std::queue<std::pair<std::shared_ptr<Node>, int>> q;
+        q.push({root, 0});
+        
+        int current_level = -1;
+        while (!q.empty()) {
+            auto [node, level] = q.front();
+            q.pop();
+            
+            if (level != current_level) {
+                if (current_level != -1) std::cout << std::endl;
+                std::cout << "Level " << level << ": ";
+                current_level = level;
+            }
+            
+            node->print();
+            std::cout << " ";
+            
+            if (!node->is_leaf) {
+                auto internal = std::dynamic_pointer_cast<InternalNode>(node);
+                for (auto& child : internal->children) {
+                    q.push({child, level + 1});
+                }
+            }
+        }
+        std::cout << std::endl;
+    }
+    
+    // 打印所有叶子节点（按顺序）
+    void print_leaves() const {
+        std::cout << "Leaf nodes (in order):" << std::endl;
+        auto leaf = first_leaf;
+        int leaf_count = 0;
+        
+        while (leaf) {
+            std::cout << "Leaf " << leaf_count++ << ": ";
+            leaf->print();
+            std::cout << std::endl;
+            leaf = leaf->next;
+        }
+    }
+    
+    // 获取树的高度
+    int height() const {
+        int h = 0;
+        auto node = root;
+        while (node && !node->is_leaf) {
+            auto internal = std::dynamic_pointer_cast<InternalNode>(node);
+            if (!internal->children.empty()) {
+                node = internal->children[0];
+                h++;
+            } else {
+                break;
+            }
+        }
+        return h + 1;  // +1 for leaf level
+    }
+    
+    // 获取树的大小（键的数量）
+    size_t size() const {
+        size_t count = 0;
+        auto leaf = first_leaf;
+        while (leaf) {
+            count += leaf->keys.size();
+            leaf = leaf->next;
+        }
+        return count;
+    }
+};
+
+#endif
@@ -1,570 +1,4 @@
-#include <iostream>
-#include <memory>
-#include <queue>
-#include <vector>
-#include <algorithm>
-#include <cassert>
-#include <string>
-#include <cmath>
-
-enum class Color { RED, BLACK };
-
-template<typename K, typename V>
-class RedBlackTree {
-private:
-    // 红黑树节点结构
-    struct Node {
-        K key;
-        V value;
-        Color color;
-        std::shared_ptr<Node> left;
-        std::shared_ptr<Node> right;
-        std::weak_ptr<Node> parent;
-        
-        Node(const K& k, const V& v, Color c = Color::RED)
-            : key(k), value(v), color(c), left(nullptr), right(nullptr) {}
-        
-        // 判断是否是左子节点
-        bool is_left_child() const {
-            auto p = parent.lock();
-            return p && p->left.get() == this;
-        }
-        
-        // 获取兄弟节点
-        std::shared_ptr<Node> sibling() const {
-            auto p = parent.lock();
-            if (!p) return nullptr;
-            return is_left_child() ? p->right : p->left;
-        }
-        
-        // 获取叔叔节点
-        std::shared_ptr<Node> uncle() const {
-            auto p = parent.lock();
-            if (!p) return nullptr;
-            auto gp = p->parent.lock();
-            if (!gp) return nullptr;
-            return p->is_left_child() ? gp->right : gp->left;
-        }
-        
-        // 获取祖父节点
-        std::shared_ptr<Node> grandparent() const {
-            auto p = parent.lock();
-            if (!p) return nullptr;
-            return p->parent.lock();
-        }
-    };
-    
-    std::shared_ptr<Node> root;
-    size_t count;
-    
-    // 左旋
-    void left_rotate(std::shared_ptr<Node> x) {
-        auto y = x->right;
-        if (!y) return;  // 安全检查
-        
-        x->right = y->left;
-        
-        if (y->left) {
-            y->left->parent = x;
-        }
-        
-        y->parent = x->parent;
-        
-        if (!x->parent.lock()) {
-            root = y;
-        } else if (x->is_left_child()) {
-            x->parent.lock()->left = y;
-        } else {
-            x->parent.lock()->right = y;
-        }
-        
-        y->left = x;
-        x->parent = y;
-    }
-    
-    // 右旋
-    void right_rotate(std::shared_ptr<Node> y) {
-        auto x = y->left;
-        if (!x) return;  // 安全检查
-        
-        y->left = x->right;
-        
-        if (x->right) {
-            x->right->parent = y;
-        }
-        
-        x->parent = y->parent;
-        
-        if (!y->parent.lock()) {
-            root = x;
-        } else if (y->is_left_child()) {
-            y->parent.lock()->left = x;
-        } else {
-            y->parent.lock()->right = x;
-        }
-        
-        x->right = y;
-        y->parent = x;
-    }
-    
-    // 插入修复
-    void fix_insert(std::shared_ptr<Node> node) {
-        while (node != root && node->parent.lock()->color == Color::RED) {
-            auto parent = node->parent.lock();
-            auto grandparent = parent->parent.lock();
-            if (!grandparent) break;
-            
-            if (parent->is_left_child()) {  // 父节点是左子节点
-                auto uncle = parent->sibling();
-                
-                if (uncle && uncle->color == Color::RED) {
-                    // 情况1：叔叔节点是红色
-                    parent->color = Color::BLACK;
-                    uncle->color = Color::BLACK;
-                    grandparent->color = Color::RED;
-                    node = grandparent;
-                } else {
-                    if (!node->is_left_child()) {
-                        // 情况2：节点是右子节点
-                        node = parent;
-                        left_rotate(node);
-                        parent = node->parent.lock();
-                        grandparent = parent ? parent->parent.lock() : nullptr;
-                        if (!grandparent) break;
-                    }
-                    
-                    // 情况3：节点是左子节点
-                    parent->color = Color::BLACK;
-                    grandparent->color = Color::RED;
-                    right_rotate(grandparent);
-                }
-            } else {  // 父节点是右子节点
-                auto uncle = parent->sibling();
-                
-                if (uncle && uncle->color == Color::RED) {
-                    // 情况1：叔叔节点是红色
-                    parent->color = Color::BLACK;
-                    uncle->color = Color::BLACK;
-                    grandparent->color = Color::RED;
-                    node = grandparent;
-                } else {
-                    if (node->is_left_child()) {
-                        // 情况2：节点是左子节点
-                        node = parent;
-                        right_rotate(node);
-                        parent = node->parent.lock();
-                        grandparent = parent ? parent->parent.lock() : nullptr;
-                        if (!grandparent) break;
-                    }
-                    
-                    // 情况3：节点是右子节点
-                    parent->color = Color::BLACK;
-                    grandparent->color = Color::RED;
-                    left_rotate(grandparent);
-                }
-            }
-        }
-        
-        if (root) {
-            root->color = Color::BLACK;
-        }
-    }
-    
-    // 查找最小节点
-    std::shared_ptr<Node> minimum(std::shared_ptr<Node> node) const {
-        if (!node) return nullptr;
-        while (node->left) {
-            node = node->left;
-        }
-        return node;
-    }
-    
-    // 查找节点
-    std::shared_ptr<Node> find_node(const K& key) const {
-        auto current = root;
-        while (current) {
-            if (key < current->key) {
-                current = current->left;
-            } else if (key > current->key) {
-                current = current->right;
-            } else {
-                return current;
-            }
-        }
-        return nullptr;
-    }
-    
-    // 移植节点（用v替换u）
-    void transplant(std::shared_ptr<Node> u, std::shared_ptr<Node> v) {
-        auto parent = u->parent.lock();
-        if (!parent) {
-            root = v;
-        } else if (u->is_left_child()) {
-            parent->left = v;
-        } else {
-            parent->right = v;
-        }
-        
-        if (v) {
-            v->parent = u->parent;
-        }
-    }
-    
-    // 删除修复
-    void fix_delete(std::shared_ptr<Node> node, std::shared_ptr<Node> parent) {
-        // 如果树为空，直接返回
-        if (!root) return;
-        
-        std::shared_ptr<Node> sibling;
-        
-        while (node != root && (!node || node->color == Color::BLACK)) {
-            if (!parent) break; // 父节点为空，退出循环
-            
-            if (node == parent->left) {
-                sibling = parent->right;
-                if (!sibling) break; // 兄弟节点为空，退出循环
-                
-                if (sibling->color == Color::RED) {
-                    // 情况1：兄弟节点是红色
-                    sibling->color = Color::BLACK;
-                    parent->color = Color::RED;
-                    left_rotate(parent);
-                    sibling = parent->right;
-                    if (!sibling) break;
-                }
-                
-                if ((!sibling->left || sibling->left->color == Color::BLACK) &&
-                    (!sibling->right || sibling->right->color == Color::BLACK)) {
-                    // 情况2：兄弟节点的两个子节点都是黑色
-                    sibling->color = Color::RED;
-                    node = parent;
-                    parent = node->parent.lock();
-                } else {
-                    if (!sibling->right || sibling->right->color == Color::BLACK) {
-                        // 情况3：兄弟节点的右子节点是黑色，左子节点是红色
-                        if (sibling->left) sibling->left->color = Color::BLACK;
-                        sibling->color = Color::RED;
-                        right_rotate(sibling);
-                        sibling = parent->right;
-                        if (!sibling) break;
-                    }
-                    
-                    // 情况4：兄弟节点的右子节点是红色
-                    sibling->color = parent->color;
-                    parent->color = Color::BLACK;
-                    if (sibling->right) sibling->right->color = Color::BLACK;
-                    left_rotate(parent);
-                    node = root;
-                    break;
-                }
-            } else {
-                sibling = parent->left;
-                if (!sibling) break; // 兄弟节点为空，退出循环
-                
-                if (sibling->color == Color::RED) {
-                    // 情况1：兄弟节点是红色（镜像）
-                    sibling->color = Color::BLACK;
-                    parent->color = Color::RED;
-                    right_rotate(parent);
-                    sibling = parent->left;
-                    if (!sibling) break;
-                }
-                
-                if ((!sibling->left || sibling->left->color == Color::BLACK) &&
-                    (!sibling->right || sibling->right->color == Color::BLACK)) {
-                    // 情况2：兄弟节点的两个子节点都是黑色（镜像）
-                    sibling->color = Color::RED;
-                    node = parent;
-                    parent = node->parent.lock();
-                } else {
-                    if (!sibling->left || sibling->left->color == Color::BLACK) {
-                        // 情况3：兄弟节点的左子节点是黑色，右子节点是红色（镜像）
-                        if (sibling->right) sibling->right->color = Color::BLACK;
-                        sibling->color = Color::RED;
-                        left_rotate(sibling);
-                        sibling = parent->left;
-                        if (!sibling) break;
-                    }
-                    
-                    // 情况4：兄弟节点的左子节点是红色（镜像）
-                    sibling->color = parent->color;
-                    parent->color = Color::BLACK;
-                    if (sibling->left) sibling->left->color = Color::BLACK;
-                    right_rotate(parent);
-                    node = root;
-                    break;
-                }
-            }
-        }
-        
-        if (node) {
-            node->color = Color::BLACK;
-        }
-    }
-    
-    // 中序遍历辅助函数
-    void inorder_traversal(std::shared_ptr<Node> node, 
-                          std::vector<std::pair<K, V>>& result) const {
-        if (!node) return;
-        inorder_traversal(node->left, result);
-        result.emplace_back(node->key, node->value);
-        inorder_traversal(node->right, result);
-    }
-    
-    // 验证红黑树属性
-    bool validate_rb(std::shared_ptr<Node> node, int black_count, int& path_black_count) const {
-        if (!node) {
-            if (path_black_count == -1) {
-                path_black_count = black_count;
-            }
-            return black_count == path_black_count;
-        }
-        
-        // 检查红色节点的子节点不能是红色
-        if (node->color == Color::RED) {
-            if ((node->left && node->left->color == Color::RED) ||
-                (node->right && node->right->color == Color::RED)) {
-                return false;
-            }
-        }
-        
-        int new_black_count = black_count + (node->color == Color::BLACK ? 1 : 0);
-        
-        return validate_rb(node->left, new_black_count, path_black_count) &&
-               validate_rb(node->right, new_black_count, path_black_count);
-    }
-    
-    // 计算树的高度
-    int height(std::shared_ptr<Node> node) const {
-        if (!node) return 0;
-        return 1 + std::max(height(node->left), height(node->right));
-    }
-    
-public:
-    RedBlackTree() : root(nullptr), count(0) {}
-    
-    ~RedBlackTree() = default;
-    
-    // 插入键值对
-    bool insert(const K& key, const V& value) {
-        // 如果树为空，直接创建根节点
-        if (!root) {
-            root = std::make_shared<Node>(key, value, Color::BLACK);
-            count = 1;
-            return true;
-        }
-        
-        // 查找插入位置
-        auto current = root;
-        std::shared_ptr<Node> parent = nullptr;
-        
-        while (current) {
-            if (key < current->key) {
-                parent = current;
-                current = current->left;
-            } else if (key > current->key) {
-                parent = current;
-                current = current->right;
-            } else {
-                // 键已存在，更新值
-                current->value = value;
-                return false;
-            }
-        }
-        
-        // 创建新节点
-        auto new_node = std::make_shared<Node>(key, value, Color::RED);
-        new_node->parent = parent;
-        
-        // 插入到正确位置
-        if (key < parent->key) {
-            parent->left = new_node;
-        } else {
-            parent->right = new_node;
-        }
-        
-        // 修复红黑树属性
-        fix_insert(new_node);
-        count++;
-        return true;
-    }
-    
-    // 删除键
-    bool remove(const K& key) {
-        auto node = find_node(key);
-        if (!node) return false;
-        
-        auto original_color = node->color;
-        std::shared_ptr<Node> x = nullptr;
-        std::shared_ptr<Node> parent = nullptr;
-        
-        if (!node->left) {
-            // 只有右子节点或没有子节点
-            x = node->right;
-            parent = node->parent.lock();
-            transplant(node, node->right);
-        } else if (!node->right) {
-            // 只有左子节点
-            x = node->left;
-            parent = node->parent.lock();
-            transplant(node, node->left);
-        } else {
-            // 有两个子节点，找到后继节点
-            auto successor = minimum(node->right);
-            original_color = successor->color;
-            x = successor->right;
-            parent = successor->parent.lock();
-            
-            if (successor->parent.lock() != node) {
-                transplant(successor, successor->right);
-                successor->right = node->right;
-                if (successor->right) {
-                    successor->right->parent = successor;
-                }
-            } else {
-                // 如果后继节点是node的直接右子节点
-                parent = successor;
-            }
-            
-            transplant(node, successor);
-            successor->left = node->left;
-            if (successor->left) {
-                successor->left->parent = successor;
-            }
-            successor->color = node->color;
-        }
-        
-        // 如果删除的是黑色节点，需要修复
-        if (original_color == Color::BLACK) {
-            if (x == root) {
-                // 如果x是根节点，只需将其染黑
-                if (x) x->color = Color::BLACK;
-            } else if (parent) {
-                // 只有当我们有有效的父节点时才修复
-                fix_delete(x, parent);
-            }
-            // 否则，树已经为空或不需要修复
-        }
-        
-        count--;
-        return true;
-    }
-    
-    // 查找键
-    V* find(const K& key) const {
-        auto node = find_node(key);
-        if (node) {
-            return &node->value;
-        }
-        return nullptr;
-    }
-    
-    // 检查键是否存在
-    bool contains(const K& key) const {
-        return find_node(key) != nullptr;
-    }
-    
-    // 获取元素个数
-    size_t size() const {
-        return count;
-    }
-    
-    // 判断树是否为空
-    bool empty() const {
-        return count == 0;
-    }
-    
-    // 清空树
-    void clear() {
-        root.reset();
-        count = 0;
-    }
-    
-    // 中序遍历（返回排序后的键值对）
-    std::vector<std::pair<K, V>> inorder() const {
-        std::vector<std::pair<K, V>> result;
-        inorder_traversal(root, result);
-        return result;
-    }
-    
-    // 层序遍历（用于打印树结构）
-    std::vector<std::vector<std::pair<K, Color>>> level_order() const {
-        std::vector<std::vector<std::pair<K, Color>>> result;
-        if (!root) return result;
-        
-        std::queue<std::shared_ptr<Node>> q;
-        q.push(root);
-        
-        while (!q.empty()) {
-            int level_size = q.size();
-            std::vector<std::pair<K, Color>> level;
-            
-            for (int i = 0; i < level_size; i++) {
-                auto node = q.front();
-                q.pop();
-                
-                level.emplace_back(node->key, node->color);
-                
-                if (node->left) q.push(node->left);
-                if (node->right) q.push(node->right);
-            }
-            
-            result.push_back(level);
-        }
-        
-        return result;
-    }
-    
-    // 验证红黑树的所有属性
-    bool validate() const {
-        if (!root) return true;
-        
-        // 性质2：根节点必须是黑色
-        if (root->color != Color::BLACK) {
-            std::cout << "Violation: Root is not black" << std::endl;
-            return false;
-        }
-        
-        // 性质4和5：检查所有路径的黑色节点数量相同
-        int path_black_count = -1;
-        if (!validate_rb(root, 0, path_black_count)) {
-            std::cout << "Violation: Different number of black nodes in paths" << std::endl;
-            return false;
-        }
-        
-        return true;
-    }
-    
-    // 打印树结构（ASCII图形）
-    void print_tree() const {
-        if (!root) {
-            std::cout << "Empty tree" << std::endl;
-            return;
-        }
-        
-        auto levels = level_order();
-        int total_levels = levels.size();
-        
-        for (int i = 0; i < total_levels; i++) {
-            std::cout << "Level " << i << ": ";
-            for (const auto& node : levels[i]) {
-                std::cout << node.first;
-                if (node.second == Color::RED) {
-                    std::cout << "(R)";
-                } else {
-                    std::cout << "(B)";
-                }
-                std::cout << " ";
-            }
-            std::cout << std::endl;
-        }
-    }
-    
-    // 获取树的高度
-    int get_height() const {
-        return height(root);
-    }
-};
+#include "RBTree.hpp"
 
 // 测试函数
 void test_redblack_tree() {
@@ -0,0 +1,213 @@
+#include "SkipList.hpp"
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 测试用的 value，统计还活着的个数，检查换掉和删掉的 value 都释放了、没有重复释放
+struct TestValue {
+    static std::atomic<long> live;
+    long n;
+    explicit TestValue(long v) : n(v) { live++; }
+    ~TestValue() { n = -1; live--; }
+};
+std::atomic<long> TestValue::live{0};
+
+struct TestDrop {
+    void operator()(TestValue *v) const { delete v; }
+};
+
+using TestList = SkipList<std::string, TestValue, TestDrop>;
+
+static std::string key_of(int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "key%08d", i);
+    return buf;
+}
+
+// 检查是否升序，返回 key 的个数
+static size_t check_order(const TestList& list) {
+    std::string prev;
+    size_t n = 0;
+    bool ok = true;
+    list.scan([&](const std::string& k, TestValue *v) {
+        if ((n > 0 && !(prev < k)) || v->n < 0) {
+            ok = false;
+            return false;
+        }
+        prev = k;
+        n++;
+        return true;
+    });
+    return ok ? n : size_t(-1);
+}
+
+void test_skiplist() {
+    std::cout << "=== Lock-free Skip List Test ===\n" << std::endl;
+
+    // 测试1：基本插入、查找、覆盖和删除
+    std::cout << "Test 1: Basic Operations" << std::endl;
+    {
+        TestList list;
+        for (int i = 0; i < 1000; i += 2) {
+            list.insert(key_of(i), new TestValue(i));
+        }
+        bool ok = list.size() == 500;
+        for (int i = 0; i < 1000; i++) {
+            Epoch::Guard guard;
+            TestValue *v = list.find(key_of(i));
+            ok = ok && (i % 2 == 0 ? v && v->n == i : v == nullptr);
+        }
+        ok = ok && !list.insert(key_of(10), new TestValue(-10 + 1000)) && list.find(key_of(10))->n == 990;
+
+        TestValue *v = new TestValue(7);
+        ok = ok && !list.add(key_of(12), v);
+        delete v;
+        v = new TestValue(13);
+        ok = ok && !list.replace(key_of(13), v);
+        delete v;
+        ok = ok && list.replace(key_of(14), new TestValue(114)) && list.find(key_of(14))->n == 114;
+
+        for (int i = 0; i < 1000; i += 4) {
+            ok = ok && list.remove(key_of(i)) && !list.remove(key_of(i));
+        }
+        ok = ok && list.size() == 250 && check_order(list) == 250;
+        std::cout << (ok ? "✓" : "✗") << " insert/add/replace/remove, " << list.size() << " keys left" << std::endl;
+    }
+
+    // 测试2：从中间开始的有序遍历
+    std::cout << "\nTest 2: Ordered Scan" << std::endl;
+    {
+        TestList list;
+        std::mt19937 rng(1);
+        std::map<std::string, long> ref;
+        for (int i = 0; i < 5000; i++) {
+            int k = rng() % 10000;
+            list.insert(key_of(k), new TestValue(k));
+            ref[key_of(k)] = k;
+        }
+        auto it = ref.lower_bound(key_of(5000));
+        bool ok = true;
+        int n = 0;
+        list.scan(key_of(5000), [&](const std::string& k, TestValue *v) {
+            ok = ok && it != ref.end() && it->first == k && it->second == v->n;
+            ++it;
+            return ++n < 100;
+        });
+        std::cout << (ok && n == 100 ? "✓" : "✗") << " scan from key" << 5000 << " matches std::map" << std::endl;
+    }
+
+    // 测试3：多个线程各写自己的 key，同时有线程在遍历
+    std::cout << "\nTest 3: Concurrent Writers and Scanners" << std::endl;
+    {
+        const int WRITERS = 4, KEYS = 20000, OPS = 200000;
+        TestList list;
+        std::vector<std::map<int, long>> refs(WRITERS);
+        std::atomic<bool> stop{false};
+        std::atomic<bool> bad{false};
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < WRITERS; t++) {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t + 1);
+                auto& ref = refs[t];
+                for (int i = 0; i < OPS; i++) {
+                    int k = (rng() % KEYS) * WRITERS + t;
+                    switch (rng() % 3) {
+                    case 0:
+                        list.insert(key_of(k), new TestValue(i));
+                        ref[k] = i;
+                        break;
+                    case 1:
+                        if (list.remove(key_of(k)) != (ref.erase(k) == 1)) bad = true;
+                        break;
+                    default: {
+                        Epoch::Guard guard;
+                        TestValue *v = list.find(key_of(k));
+                        auto it = ref.find(k);
+                        if ((v != nullptr) != (it != ref.end()) || (v && v->n != it->second)) bad = true;
+                    }
+                    }
+                }
+            });
+        }
+        for (int t = 0; t < 2; t++) {
+            threads.emplace_back([&]() {
+                while (!stop) {
+                    if (check_order(list) == size_t(-1)) bad = true;
+                }
+            });
+        }
+        for (int t = 0; t < WRITERS; t++) {
+            threads[t].join();
+        }
+        stop = true;
+        for (size_t t = WRITERS; t < threads.size(); t++) {
+            threads[t].join();
+        }
+
+        size_t total = 0;
+        for (auto& ref : refs) {
+            total += ref.size();
+            for (auto& [k, n] : ref) {
+                Epoch::Guard guard;
+                TestValue *v = list.find(key_of(k));
+                if (!v || v->n != n) bad = true;
+            }
+        }
+        bool ok = !bad && list.size() == total && check_order(list) == total;
+        std::cout << (ok ? "✓" : "✗") << " " << WRITERS << " writers, 2 scanners, "
+                  << total << " keys left" << std::endl;
+    }
+
+    // 测试4：所有线程抢同一小批 key
+    std::cout << "\nTest 4: Contended Keys" << std::endl;
+    {
+        const int THREADS = 8, KEYS = 64, OPS = 100000;
+        TestList list;
+        std::atomic<long> net{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t + 100);
+                for (int i = 0; i < OPS; i++) {
+                    std::string k = key_of(rng() % KEYS);
+                    if (rng() % 2) {
+                        TestValue *v = new TestValue(i);
+                        if (list.add(k, v)) {
+                            net++;
+                        } else {
+                            delete v;
+                        }
+                    } else if (list.remove(k)) {
+                        net--;
+                    }
+                }
+            });
+        }
+        for (auto& th : threads) {
+            th.join();
+        }
+        bool ok = (long)list.size() == net && (long)check_order(list) == net;
+        std::cout << (ok ? "✓" : "✗") << " " << THREADS << " threads on " << KEYS
+                  << " keys, " << net << " left" << std::endl;
+    }
+
+    Epoch::drain();
+    std::cout << "\nLeaked values: " << TestValue::live << std::endl;
+    std::cout << "\n=== All Tests Completed ===" << std::endl;
+}
+
+int main() {
+    try {
+        test_skiplist();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,482 @@
+#ifndef SKIPLIST_HPP
+#define SKIPLIST_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+// 基于 epoch 的延迟释放，所有线程、所有跳表共用一个全局 epoch。
+// 线程访问共享结构之前进入临界区，记下当时的全局 epoch；摘下来的节点挂在本线程的 limbo 表上，
+// 记下摘下时的全局 epoch e。全局 epoch 只有在临界区内的线程都已经看到当前值时才能加一，
+// 所以等它到了 e + 2，摘下之前进来的线程都已经离开，节点可以释放
+class Epoch {
+public:
+    static const int MAX_THREADS = 256;
+
+    // 临界区，可以嵌套
+    struct Guard {
+        Guard() { enter(); }
+        ~Guard() { exit(); }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    static void enter() {
+        Slot *s = self();
+        if (s->depth++ > 0) {
+            return;
+        }
+        s->epoch.store(global().load(std::memory_order_relaxed) << 1 | 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    static void exit() {
+        Slot *s = self();
+        if (--s->depth > 0) {
+            return;
+        }
+        s->epoch.store(0, std::memory_order_release);
+        if (!s->limbo.empty() && ++s->ticks % COLLECT_EVERY == 0) {
+            collect(s);
+        }
+    }
+
+    // p 已经从结构里摘下来，没有新的线程能拿到它；宽限期过后调用 fn(p)
+    static void retire(void *p, void (*fn)(void *)) {
+        Slot *s = self();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        s->limbo.push_back({ p, fn, global().load(std::memory_order_relaxed) });
+        if (s->limbo.size() % COLLECT_EVERY == 0) {
+            collect(s);
+        }
+    }
+
+    // 释放所有线程的 limbo 表，调用时不能再有线程访问任何跳表
+    static void drain() {
+        for (int i = 0; i < MAX_THREADS; i++) {
+            Slot& s = slots()[i];
+            for (Retired& r : s.limbo) {
+                r.fn(r.p);
+            }
+            s.limbo.clear();
+        }
+    }
+
+private:
+    static const unsigned COLLECT_EVERY = 64;
+
+    struct Retired {
+        void *p;
+        void (*fn)(void *);
+        uint64_t epoch;
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{0};     // 临界区内是 (进入时的全局 epoch << 1) | 1，否则是 0
+        std::atomic<bool> used{false};
+        // 下面的只有占用这个槽的线程访问
+        int depth = 0;
+        unsigned ticks = 0;
+        std::vector<Retired> limbo;         // 按摘下的先后排列，epoch 不减
+    };
+
+    // 线程退出时让出槽，limbo 表留给下一个占用它的线程接着释放
+    struct Owner {
+        Slot *slot = nullptr;
+        ~Owner() {
+            if (slot) {
+                slot->used.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    static std::atomic<uint64_t>& global() {
+        static std::atomic<uint64_t> epoch{1};
+        return epoch;
+    }
+
+    static Slot *slots() {
+        static Slot all[MAX_THREADS];
+        return all;
+    }
+
+    static Slot *self() {
+        thread_local Owner owner;
+        if (owner.slot) {
+            return owner.slot;
+        }
+        for (int i = 0; i < MAX_THREADS; i++) {
+            Slot& s = slots()[i];
+            bool expected = false;
+            if (!s.used.load(std::memory_order_relaxed) &&
+                s.used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                owner.slot = &s;
+                return &s;
+            }
+        }
+        abort();    // 线程数超过 MAX_THREADS
+    }
+
+    // 临界区内的线程都看到了当前的全局 epoch 时推进一步
+    static uint64_t try_advance() {
+        uint64_t g = global().load(std::memory_order_seq_cst);
+        for (int i = 0; i < MAX_THREADS; i++) {
+            Slot& s = slots()[i];
+            uint64_t e = s.epoch.load(std::memory_order_seq_cst);
+            if ((e & 1) && (e >> 1) != g) {
+                return g;
+            }
+        }
+        if (global().compare_exchange_strong(g, g + 1, std::memory_order_seq_cst)) {
+            return g + 1;
+        }
+        return g;
+    }
+
+    static void collect(Slot *s) {
+        uint64_t g = try_advance();
+        size_t n = 0;
+        while (n < s->limbo.size() && s->limbo[n].epoch + 2 <= g) {
+            n++;
+        }
+        for (size_t i = 0; i < n; i++) {
+            s->limbo[i].fn(s->limbo[i].p);
+        }
+        s->limbo.erase(s->limbo.begin(), s->limbo.begin() + n);
+    }
+};
+
+// 无锁跳表，多个线程可以同时读写，读和遍历不写共享内存。
+// 每层是一条按 key 升序的单链表，next 指针的最低位是删除标记：先从高到低标记各层，
+// 第 0 层标记成功就算删除了，之后由查找顺路把它从各层摘下来。
+// value 存 T *，换掉和删掉的 value 过了 Epoch 的宽限期才交给 Drop 释放，
+// 所以在 Epoch::Guard 内通过 find 和 scan 拿到的指针一直有效
+template<typename K, typename T, typename Drop>
+class SkipList {
+public:
+    static const int MAX_LEVEL = 16;    // 每层 1/4 的节点往上长，够用到 4^16 个 key
+
+private:
+    static const uint32_t INSERTING = 1;    // 上面几层还没有挂好
+    static const uint32_t DELETED = 2;
+
+    struct Node {
+        K key;
+        std::atomic<T *> value;
+        std::atomic<uint32_t> state;
+        int height;
+
+        Node(const K& k, T *v, int h) : key(k), value(v), state(INSERTING), height(h) {}
+        // 各层的 next 紧跟在节点后面
+        std::atomic<uintptr_t> *next() {
+            return reinterpret_cast<std::atomic<uintptr_t> *>(this + 1);
+        }
+    };
+
+    Node *head_;
+    std::atomic<size_t> count_;
+
+    static Node *ptr(uintptr_t v) { return reinterpret_cast<Node *>(v & ~uintptr_t(1)); }
+    static bool marked(uintptr_t v) { return v & 1; }
+
+    static Node *new_node(const K& key, T *value, int height) {
+        void *mem = malloc(sizeof(Node) + height * sizeof(std::atomic<uintptr_t>));
+        if (!mem) {
+            throw std::bad_alloc();
+        }
+        Node *n;
+        try {
+            n = new (mem) Node(key, value, height);
+        } catch (...) {
+            free(mem);
+            throw;
+        }
+        for (int i = 0; i < height; i++) {
+            new (&n->next()[i]) std::atomic<uintptr_t>(0);
+        }
+        return n;
+    }
+
+    static void free_node(void *p) {
+        Node *n = static_cast<Node *>(p);
+        T *v = n->value.load(std::memory_order_relaxed);
+        if (v) {
+            Drop()(v);
+        }
+        n->~Node();
+        free(n);
+    }
+
+    static void free_value(void *p) {
+        Drop()(static_cast<T *>(p));
+    }
+
+    static int random_height() {
+        thread_local uint64_t seed = reinterpret_cast<uintptr_t>(&seed) | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        int h = 1;
+        for (uint64_t r = seed; h < MAX_LEVEL && (r & 3) == 0; r >>= 2) {
+            h++;
+        }
+        return h;
+    }
+
+    // 每层找到 key 的前驱和第一个 >= key 的节点，路过带删除标记的节点就摘掉，摘不动从头再来。
+    // 返回第 0 层是否正好是 key
+    template<typename Q>
+    bool locate(const Q& key, Node **preds, Node **succs) {
+    retry:
+        Node *pred = head_;
+        for (int i = MAX_LEVEL - 1; i >= 0; i--) {
+            Node *curr = ptr(pred->next()[i].load(std::memory_order_acquire));
+            while (curr) {
+                uintptr_t succ = curr->next()[i].load(std::memory_order_acquire);
+                if (marked(succ)) {
+                    uintptr_t expected = reinterpret_cast<uintptr_t>(curr);
+                    if (!pred->next()[i].compare_exchange_strong(expected, succ & ~uintptr_t(1),
+                                                                std::memory_order_acq_rel)) {
+                        goto retry;
+                    }
+                    curr = ptr(succ);
+                    continue;
+                }
+                if (!(curr->key < key)) {
+                    break;
+                }
+                pred = curr;
+                curr = ptr(succ);
+            }
+            preds[i] = pred;
+            succs[i] = curr;
+        }
+        return succs[0] && !(key < succs[0]->key);
+    }
+
+    // 只读的查找，跳过带删除标记的节点，返回第一个 >= key 的节点
+    template<typename Q>
+    Node *lower_bound(const Q& key) const {
+        Node *pred = head_;
+        Node *curr = nullptr;
+        for (int i = MAX_LEVEL - 1; i >= 0; i--) {
+            curr = ptr(pred->next()[i].load(std::memory_order_acquire));
+            while (curr) {
+                uintptr_t succ = curr->next()[i].load(std::memory_order_acquire);
+                if (!marked(succ)) {
+                    if (!(curr->key < key)) {
+                        break;
+                    }
+                    pred = curr;
+                }
+                curr = ptr(succ);
+            }
+        }
+        return curr;
+    }
+
+    template<typename Q>
+    Node *find_node(const Q& key) const {
+        Node *n = lower_bound(key);
+        return n && !(key < n->key) ? n : nullptr;
+    }
+
+    // 第 0 层已经挂上，再从下往上挂其余各层；中途被删了就不再挂
+    void link_upper(Node *node, Node **preds, Node **succs) {
+        for (int i = 1; i < node->height; i++) {
+            while (true) {
+                uintptr_t next = node->next()[i].load(std::memory_order_acquire);
+                if (marked(next)) {
+                    return;
+                }
+                uintptr_t succ = reinterpret_cast<uintptr_t>(succs[i]);
+                if (next != succ && !node->next()[i].compare_exchange_strong(next, succ,
+                                                                             std::memory_order_acq_rel)) {
+                    continue;
+                }
+                uintptr_t expected = succ;
+                if (preds[i]->next()[i].compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(node),
+                                                                std::memory_order_acq_rel)) {
+                    break;
+                }
+                locate(node->key, preds, succs);
+                if (succs[0] != node) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // 插入方挂完各层、删除方标记完，两边各自在 state 上留一位：后到的一方负责把节点从各层摘下并回收，
+    // 这样不会有节点在回收之后又被挂回某一层
+    void unlink(Node *node) {
+        Node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        locate(node->key, preds, succs);
+        Epoch::retire(node, free_node);
+    }
+
+    template<typename Q>
+    bool insert_impl(const Q& key, T *value, bool overwrite) {
+        Epoch::Guard guard;
+        Node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        Node *node = nullptr;
+
+        while (true) {
+            if (locate(key, preds, succs)) {
+                if (node) {
+                    node->value.store(nullptr, std::memory_order_relaxed);
+                    free_node(node);
+                }
+                if (!overwrite) {
+                    return false;
+                }
+                T *old = succs[0]->value.exchange(value, std::memory_order_acq_rel);
+                Epoch::retire(old, free_value);
+                return false;
+            }
+            if (!node) {
+                node = new_node(K(key), value, random_height());
+            }
+            for (int i = 0; i < node->height; i++) {
+                node->next()[i].store(reinterpret_cast<uintptr_t>(succs[i]), std::memory_order_relaxed);
+            }
+            uintptr_t expected = reinterpret_cast<uintptr_t>(succs[0]);
+            if (preds[0]->next()[0].compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(node),
+                                                            std::memory_order_acq_rel)) {
+                break;
+            }
+        }
+
+        count_.fetch_add(1, std::memory_order_relaxed);
+        link_upper(node, preds, succs);
+        if (node->state.fetch_and(~INSERTING, std::memory_order_acq_rel) & DELETED) {
+            unlink(node);
+        }
+        return true;
+    }
+
+public:
+    SkipList() : head_(new_node(K(), nullptr, MAX_LEVEL)), count_(0) {
+        head_->state.store(0, std::memory_order_relaxed);
+    }
+
+    // 调用时不能再有线程在访问；已经摘下的节点还在 Epoch 里，由它释放
+    ~SkipList() {
+        Node *n = head_;
+        while (n) {
+            Node *next = ptr(n->next()[0].load(std::memory_order_relaxed));
+            free_node(n);
+            n = next;
+        }
+    }
+
+    SkipList(const SkipList&) = delete;
+    SkipList& operator=(const SkipList&) = delete;
+
+    // 插入或覆盖，插入了新 key 返回 true。value 交给跳表
+    template<typename Q>
+    bool insert(const Q& key, T *value) {
+        return insert_impl(key, value, true);
+    }
+
+    // 不存在才插入；已经存在时返回 false，value 还归调用方
+    template<typename Q>
+    bool add(const Q& key, T *value) {
+        return insert_impl(key, value, false);
+    }
+
+    // 存在才换 value；不存在时返回 false，value 还归调用方
+    template<typename Q>
+    bool replace(const Q& key, T *value) {
+        Epoch::Guard guard;
+        Node *n = find_node(key);
+        if (!n) {
+            return false;
+        }
+        Epoch::retire(n->value.exchange(value, std::memory_order_acq_rel), free_value);
+        return true;
+    }
+
+    template<typename Q>
+    bool remove(const Q& key) {
+        Epoch::Guard guard;
+        Node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+        if (!locate(key, preds, succs)) {
+            return false;
+        }
+        Node *node = succs[0];
+        for (int i = node->height - 1; i >= 1; i--) {
+            uintptr_t next = node->next()[i].load(std::memory_order_acquire);
+            while (!marked(next) &&
+                   !node->next()[i].compare_exchange_weak(next, next | 1, std::memory_order_acq_rel)) {
+            }
+        }
+        uintptr_t next = node->next()[0].load(std::memory_order_acquire);
+        do {
+            if (marked(next)) {
+                return false;   // 别的线程先删了
+            }
+        } while (!node->next()[0].compare_exchange_weak(next, next | 1, std::memory_order_acq_rel));
+
+        count_.fetch_sub(1, std::memory_order_relaxed);
+        if (!(node->state.fetch_or(DELETED, std::memory_order_acq_rel) & INSERTING)) {
+            unlink(node);
+        }
+        return true;
+    }
+
+    // 返回的指针在调用方的 Epoch::Guard 内有效
+    template<typename Q>
+    T *find(const Q& key) const {
+        Epoch::Guard guard;
+        Node *n = find_node(key);
+        return n ? n->value.load(std::memory_order_acquire) : nullptr;
+    }
+
+    template<typename Q>
+    bool contains(const Q& key) const {
+        Epoch::Guard guard;
+        return find_node(key) != nullptr;
+    }
+
+    // 并发修改时只是近似值
+    size_t size() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // 从第一个 >= start 的键开始顺序遍历，fn(key, value) 返回 false 时停止。
+    // 不加锁：遍历期间插入的 key 可能看到也可能看不到，删掉的 key 不会再看到
+    template<typename Q, typename F>
+    void scan(const Q& start, F&& fn) const {
+        Epoch::Guard guard;
+        scan_from(lower_bound(start), fn);
+    }
+
+    // 从第一个键开始顺序遍历
+    template<typename F>
+    void scan(F&& fn) const {
+        Epoch::Guard guard;
+        scan_from(ptr(head_->next()[0].load(std::memory_order_acquire)), fn);
+    }
+
+private:
+    template<typename F>
+    static void scan_from(Node *n, F& fn) {
+        while (n) {
+            uintptr_t next = n->next()[0].load(std::memory_order_acquire);
+            if (!marked(next) && !fn(static_cast<const K&>(n->key), n->value.load(std::memory_order_acquire))) {
+                return;
+            }
+            n = ptr(next);
+        }
+    }
+};
+
+#endif
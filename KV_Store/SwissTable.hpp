@@ -0,0 +1,309 @@
+#ifndef SWISSTABLE_HPP
+#define SWISSTABLE_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 开放寻址的哈希表（SwissTable 的做法），key 是字节串。
+// 每个槽一个控制字节：空、已删除，或者 hash 的低 7 位。16 个控制字节一组，
+// 一次 SSE2 比较找出组里低 7 位对得上的槽，只有这些槽才去比 key；组里有空槽就说明 key 不在表里。
+// key 放在槽里，不超过 INLINE_KEY 字节时不另外分配内存。容量是 2 的幂，满槽加删除槽到 7/8 时重排
+template<typename V>
+class SwissTable {
+public:
+    static const size_t GROUP = 16;
+    static const size_t INLINE_KEY = 28;    // 槽 40 字节，YCSB 的 23 字节 key 放得下
+
+private:
+    static const int8_t EMPTY = -128;       // 0x80
+    static const int8_t DELETED = -2;       // 0xfe，满槽是 0..127，最高位为 1 的都能插
+
+    struct Slot {
+        V value;
+        uint32_t len;
+        char key[INLINE_KEY];               // 长 key 在这里放指针
+    };
+
+    // 一组控制字节里满足条件的槽，第 i 位对应组里第 i 个槽
+    struct Group {
+#ifdef __SSE2__
+        __m128i ctrl;
+        explicit Group(const int8_t *p) : ctrl(_mm_loadu_si128((const __m128i *)p)) {}
+        uint32_t match(int8_t h) const {
+            return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl));
+        }
+        uint32_t match_free() const {
+            return (uint32_t)_mm_movemask_epi8(ctrl);
+        }
+#else
+        const int8_t *ctrl;
+        explicit Group(const int8_t *p) : ctrl(p) {}
+        uint32_t match(int8_t h) const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < GROUP; i++) m |= (uint32_t)(ctrl[i] == h) << i;
+            return m;
+        }
+        uint32_t match_free() const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < GROUP; i++) m |= (uint32_t)(ctrl[i] < 0) << i;
+            return m;
+        }
+#endif
+        uint32_t match_empty() const { return match(EMPTY); }
+    };
+
+    int8_t *ctrl_;          // capacity_ + GROUP 个，最后 GROUP 个是开头的拷贝，从任何位置都能读一整组
+    Slot *slots_;
+    size_t capacity_;       // 0 表示还没分配
+    size_t size_;
+    size_t growth_left_;    // 还能占用多少个空槽
+    uint64_t gen_;          // 每次重排加一，槽的位置都变了
+
+    static size_t hash_of(std::string_view key) {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    static std::string_view key_of(const Slot *s) {
+        if (s->len <= INLINE_KEY) {
+            return std::string_view(s->key, s->len);
+        }
+        const char *p;
+        memcpy(&p, s->key, sizeof(p));
+        return std::string_view(p, s->len);
+    }
+
+    void set_ctrl(size_t i, int8_t h) {
+        ctrl_[i] = h;
+        if (i < GROUP) {
+            ctrl_[capacity_ + i] = h;
+        }
+    }
+
+    // 按组做三角探测：容量是 2 的幂，每一组都会被走到
+    size_t find_index(std::string_view key, size_t hash) const {
+        size_t mask = capacity_ - 1;
+        size_t pos = (hash >> 7) & mask;
+        int8_t h2 = (int8_t)(hash & 0x7f);
+
+        for (size_t step = GROUP; ; step += GROUP) {
+            Group g(ctrl_ + pos);
+            for (uint32_t m = g.match(h2); m != 0; m &= m - 1) {
+                size_t i = (pos + __builtin_ctz(m)) & mask;
+                const Slot *s = &slots_[i];
+                if (s->len == key.size() && key_of(s) == key) {
+                    return i;
+                }
+            }
+            if (g.match_empty() != 0) {
+                return capacity_;
+            }
+            pos = (pos + step) & mask;
+        }
+    }
+
+    // 第一个空槽或者删除槽，表里一定有空槽
+    size_t find_free(size_t hash) const {
+        size_t mask = capacity_ - 1;
+        size_t pos = (hash >> 7) & mask;
+
+        for (size_t step = GROUP; ; step += GROUP) {
+            uint32_t m = Group(ctrl_ + pos).match_free();
+            if (m != 0) {
+                return (pos + __builtin_ctz(m)) & mask;
+            }
+            pos = (pos + step) & mask;
+        }
+    }
+
+    static size_t max_load(size_t capacity) {
+        return capacity - capacity / 8;
+    }
+
+    // 换到 capacity 个槽的新数组上，顺带清掉删除槽；分配失败时表不变
+    void resize(size_t capacity) {
+        int8_t *ctrl = (int8_t *)malloc(capacity + GROUP);
+        Slot *slots = (Slot *)malloc(capacity * sizeof(Slot));
+        if (!ctrl || !slots) {
+            free(ctrl);
+            free(slots);
+            throw std::bad_alloc();
+        }
+        memset(ctrl, EMPTY, capacity + GROUP);
+
+        int8_t *old_ctrl = ctrl_;
+        Slot *old_slots = slots_;
+        size_t old_capacity = capacity_;
+
+        ctrl_ = ctrl;
+        slots_ = slots;
+        capacity_ = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_ctrl[i] < 0) {
+                continue;
+            }
+            Slot *from = &old_slots[i];
+            size_t hash = hash_of(key_of(from));
+            size_t j = find_free(hash);
+            Slot *to = &slots_[j];
+            set_ctrl(j, (int8_t)(hash & 0x7f));
+            new (&to->value) V(std::move(from->value));
+            from->value.~V();
+            to->len = from->len;
+            memcpy(to->key, from->key, INLINE_KEY);
+        }
+        free(old_ctrl);
+        free(old_slots);
+        growth_left_ = max_load(capacity_) - size_;
+        gen_++;
+    }
+
+    // 删除槽多的时候原样大小重排，否则翻倍
+    void grow() {
+        if (capacity_ == 0) {
+            resize(GROUP);
+        } else if (size_ <= max_load(capacity_) / 2) {
+            resize(capacity_);
+        } else {
+            resize(capacity_ * 2);
+        }
+    }
+
+    void destroy_slots() {
+        for (size_t i = 0; i < capacity_; i++) {
+            if (ctrl_[i] >= 0) {
+                Slot *s = &slots_[i];
+                if (s->len > INLINE_KEY) {
+                    free((void *)key_of(s).data());
+                }
+                s->value.~V();
+            }
+        }
+    }
+
+public:
+    SwissTable() : ctrl_(nullptr), slots_(nullptr), capacity_(0), size_(0), growth_left_(0), gen_(0) {}
+    ~SwissTable() {
+        destroy_slots();
+        free(ctrl_);
+        free(slots_);
+    }
+    SwissTable(const SwissTable&) = delete;
+    SwissTable& operator=(const SwissTable&) = delete;
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    uint64_t generation() const { return gen_; }
+
+    V *find(std::string_view key) {
+        if (size_ == 0) {
+            return nullptr;
+        }
+        size_t i = find_index(key, hash_of(key));
+        return i < capacity_ ? &slots_[i].value : nullptr;
+    }
+
+    // 调用方保证 key 不在表里；返回的指针在下一次插入之前有效
+    V *insert(std::string_view key, V value) {
+        if (growth_left_ == 0) {
+            grow();
+        }
+        char *heap = nullptr;
+        if (key.size() > INLINE_KEY) {
+            heap = (char *)malloc(key.size());
+            if (!heap) {
+                throw std::bad_alloc();
+            }
+            memcpy(heap, key.data(), key.size());
+        }
+
+        size_t hash = hash_of(key);
+        size_t i = find_free(hash);
+        if (ctrl_[i] == EMPTY) {
+            growth_left_--;
+        }
+        set_ctrl(i, (int8_t)(hash & 0x7f));
+
+        Slot *s = &slots_[i];
+        new (&s->value) V(std::move(value));
+        s->len = (uint32_t)key.size();
+        if (heap) {
+            memcpy(s->key, &heap, sizeof(heap));
+        } else {
+            memcpy(s->key, key.data(), key.size());
+        }
+        size_++;
+        return &s->value;
+    }
+
+    // 前后连着的满槽凑不满一组时，没有哪次探测越过过这个槽，可以直接标成空槽
+    bool remove(std::string_view key) {
+        if (size_ == 0) {
+            return false;
+        }
+        size_t i = find_index(key, hash_of(key));
+        if (i == capacity_) {
+            return false;
+        }
+        Slot *s = &slots_[i];
+        if (s->len > INLINE_KEY) {
+            free((void *)key_of(s).data());
+        }
+        s->value.~V();
+
+        size_t before = (i - GROUP) & (capacity_ - 1);
+        uint32_t empty_before = Group(ctrl_ + before).match_empty();
+        uint32_t empty_after = Group(ctrl_ + i).match_empty();
+        bool never_full = empty_before && empty_after &&
+            (size_t)(__builtin_ctz(empty_after) + __builtin_clz(empty_before) - 16) < GROUP;
+        set_ctrl(i, never_full ? EMPTY : DELETED);
+        if (never_full) {
+            growth_left_++;
+        }
+        size_--;
+        return true;
+    }
+
+    // 放得下 n 个 key 之前不再重排
+    void reserve(size_t n) {
+        size_t capacity = capacity_ ? capacity_ : GROUP;
+        while (max_load(capacity) < n) {
+            capacity *= 2;
+        }
+        if (capacity != capacity_) {
+            resize(capacity);
+        }
+    }
+
+    void clear() {
+        destroy_slots();
+        if (capacity_) {
+            memset(ctrl_, EMPTY, capacity_ + GROUP);
+        }
+        size_ = 0;
+        growth_left_ = max_load(capacity_);
+        gen_++;
+    }
+
+    // 从第 pos 个槽开始按槽的顺序遍历，visit(key, value) 返回 false 时停下，返回停在哪个槽，
+    // 遍历完返回 capacity()。遍历期间不能插入和删除
+    template<typename F>
+    size_t scan(size_t pos, F&& visit) {
+        for (; pos < capacity_; pos++) {
+            if (ctrl_[pos] >= 0 && !visit(key_of(&slots_[pos]), slots_[pos].value)) {
+                return pos;
+            }
+        }
+        return capacity_;
+    }
+};
+
+#endif
@@ -0,0 +1,998 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "BplusTree.hpp"
+#include "RBTree.hpp"
+#include "SkipList.hpp"
+#include "SwissTable.hpp"
+#include "kv_engine.h"
+#include "kvs_stats.h"
+#include "kvs_ttl.h"
+#include "simple_slab.h"
+
+#define KVS_BPTREE_DEGREE 32     // 每个节点 31 到 63 个键，默认的 3 只有 2 到 5 个，树太高
+
+kvs_value_t *kvs_value_create(const char *data, size_t len) {
+    if (len > UINT32_MAX) {
+        return nullptr;
+    }
+    kvs_value_t *v = (kvs_value_t *)kv_slab_alloc(sizeof(kvs_value_t) + len);
+    if (!v) {
+        return nullptr;
+    }
+    v->refcnt = 1;
+    v->len = (uint32_t)len;
+    v->expire = 0;
+    v->loc = 0;
+    v->home = nullptr;
+    v->flags = 0;
+    memcpy(v->data, data, len);
+    return v;
+}
+
+void kvs_value_put(kvs_value_t *v) {
+    if (__atomic_sub_fetch(&v->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        kv_slab_free(v);
+    }
+}
+
+// home 的高 16 位记着是哪个进程设的：热重启时两个进程共用 value，索引各在各的地址空间里，
+// 只认自己设的 home，另一个进程留下的既不改也不顺着它搬
+#define KVS_HOME_TAG_SHIFT 48
+#define KVS_HOME_TAG_MASK (0xffffULL << KVS_HOME_TAG_SHIFT)
+
+static uint64_t g_home_tag;
+
+void kvs_value_set_owner(uint16_t tag) {
+    g_home_tag = (uint64_t)tag << KVS_HOME_TAG_SHIFT;
+}
+
+static inline kvs_value_t **kvs_home(kvs_value_t *const *ref) {
+    return (kvs_value_t **)((uintptr_t)ref | g_home_tag);
+}
+
+// 本进程设的 home 去掉标记，没有或者是别的进程设的返回 nullptr
+static inline kvs_value_t **kvs_home_mine(const kvs_value_t *v) {
+    uintptr_t h = (uintptr_t)v->home;
+    if (!h || (h & KVS_HOME_TAG_MASK) != g_home_tag) {
+        return nullptr;
+    }
+    return (kvs_value_t **)(h & ~KVS_HOME_TAG_MASK);
+}
+
+// 树里存的是 value 的引用，树内部拷贝、移动节点只改引用计数，不拷贝数据。
+// value 的 home 跟着引用走：树插入、分裂时先拷贝再析构原来的，拷贝接过 home；
+// 持有 home 的引用析构时清掉，value 就不会被搬
+class kvs_value_ref {
+public:
+    kvs_value_ref() : v_(nullptr) {}
+    explicit kvs_value_ref(kvs_value_t *v) : v_(v) {
+        if (v_) v_->home = kvs_home(&v_);
+    }
+    kvs_value_ref(const kvs_value_ref& o) : v_(o.v_) {
+        if (v_) {
+            kvs_value_get(v_);
+            rehome(o);
+        }
+    }
+    kvs_value_ref(kvs_value_ref&& o) noexcept : v_(o.v_) {
+        o.v_ = nullptr;
+        if (v_) rehome(o);
+    }
+    kvs_value_ref& operator=(kvs_value_ref o) noexcept {
+        std::swap(v_, o.v_);
+        if (v_) rehome(o);
+        if (o.v_ && o.v_ != v_) o.rehome(*this);
+        return *this;
+    }
+    ~kvs_value_ref() {
+        if (v_) {
+            if (v_->home == kvs_home(&v_)) v_->home = nullptr;
+            kvs_value_put(v_);
+        }
+    }
+
+    kvs_value_t *get() const { return v_; }
+
+private:
+    void rehome(const kvs_value_ref& from) {
+        if (v_->home == kvs_home(&from.v_)) v_->home = kvs_home(&v_);
+    }
+
+    kvs_value_t *v_;
+};
+
+struct kvs_engine_s {
+    BPlusTree<std::string, kvs_value_ref> bptree{KVS_BPTREE_DEGREE};
+    RedBlackTree<std::string, kvs_value_ref> rbtree;
+    SwissTable<kvs_value_ref> htable;
+    kvs_ttl_t *ttl;     // 时间轮里的 tag 是 0 (B+ 树)、1 (红黑树) 或 2 (哈希表)
+    uint64_t now;       // 最近一次 tick 的时间
+
+    uint64_t mem;       // 树里在内存中的 value 字节数
+    uint64_t cold;      // 树里冷 value 的个数
+    int evict_tree;     // 换出扫到了哪棵树的哪个 key，哈希表记的是槽的位置
+    bool evict_has;
+    std::string evict_key;
+    size_t evict_pos;
+
+    kvs_engine_s() : ttl(nullptr), now(0),
+                     mem(0), cold(0), evict_tree(0), evict_has(false), evict_pos(0) {}
+    ~kvs_engine_s() { kvs_ttl_destroy(ttl); }
+};
+
+static inline std::string_view kvs_view(kvs_slice_t s) {
+    return std::string_view(s.data, s.len);
+}
+
+static inline kvs_value_ref kvs_value_make(kvs_slice_t s) {
+    kvs_value_t *v = kvs_value_create(s.data, s.len);
+    if (!v) {
+        throw std::bad_alloc();
+    }
+    return kvs_value_ref(v);
+}
+
+static inline bool kvs_expired(const kvs_engine_t *e, const kvs_value_ref& v) {
+    uint64_t expire = v.get()->expire;
+    return expire != 0 && expire <= e->now;
+}
+
+// 过期的当作不存在
+static inline kvs_value_ref *kvs_live(const kvs_engine_t *e, kvs_value_ref *v) {
+    return v && !kvs_expired(e, *v) ? v : nullptr;
+}
+
+// 树里换 value 时记账，old/v 为 nullptr 表示删除/插入
+static inline void kvs_account(kvs_engine_t *e, const kvs_value_t *old, const kvs_value_t *v) {
+    uint64_t mem = e->mem, cold = e->cold;
+    if (old) {
+        if (old->flags & KVS_VALUE_COLD) cold--; else mem -= old->len;
+    }
+    if (v) {
+        if (v->flags & KVS_VALUE_COLD) cold++; else mem += v->len;
+    }
+    __atomic_store_n(&e->mem, mem, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->cold, cold, __ATOMIC_RELAXED);
+}
+
+// 读到的 value 打上访问位，换出时放过一轮
+static inline int kvs_value_lookup(kvs_value_ref *ref, kvs_value_t **value) {
+    if (!ref) {
+        return KVS_NOT_FOUND;
+    }
+    *value = ref->get();
+    (*value)->flags |= KVS_VALUE_HOT;
+    kvs_value_get(*value);
+    return KVS_OK;
+}
+
+kvs_engine_t *kvs_engine_create(void) {
+    kvs_engine_t *e = new (std::nothrow) kvs_engine_s();
+    if (!e) {
+        return nullptr;
+    }
+    e->ttl = kvs_ttl_create();
+    if (!e->ttl) {
+        delete e;
+        return nullptr;
+    }
+    return e;
+}
+
+void kvs_engine_destroy(kvs_engine_t *e) {
+    delete e;
+}
+
+// 按 tag 找到对应的树交给 f，f 对三种树的返回类型要一样
+template<typename F>
+static auto kvs_engine_on(kvs_engine_t *e, uint8_t tag, F&& f) {
+    switch (tag) {
+        case 0: return f(e->bptree);
+        case 1: return f(e->rbtree);
+        default: return f(e->htable);
+    }
+}
+
+// 树的 key 是 std::string，哈希表直接从 key 的字节拷进槽里
+template<typename T>
+static void kvs_tree_insert(T& tree, kvs_slice_t key, kvs_value_ref&& v) {
+    tree.insert(std::string(key.data, key.len), std::move(v));
+}
+
+static void kvs_tree_insert(SwissTable<kvs_value_ref>& table, kvs_slice_t key, kvs_value_ref&& v) {
+    table.insert(kvs_view(key), std::move(v));
+}
+
+// 单 key 操作三种树共用，tag 是时间轮里区分它们用的
+
+template<typename T>
+static int kvs_tree_set(kvs_engine_t *e, T& tree, kvs_slice_t key, kvs_slice_t value) {
+    try {
+        kvs_value_ref *v = tree.find(kvs_view(key));
+        if (v && !kvs_expired(e, *v)) {
+            return KVS_EXIST;
+        }
+        kvs_value_ref nv = kvs_value_make(value);
+        kvs_value_t *p = nv.get();
+        if (v) {
+            kvs_account(e, v->get(), p);
+            *v = std::move(nv);
+        } else {
+            kvs_tree_insert(tree, key, std::move(nv));
+            kvs_account(e, nullptr, p);
+        }
+    } catch (const std::bad_alloc&) {
+        return KVS_ERROR;
+    }
+    return KVS_OK;
+}
+
+// 过期的 key 也删掉，但返回不存在
+template<typename T>
+static int kvs_tree_del(kvs_engine_t *e, T& tree, kvs_slice_t key) {
+    kvs_value_ref *v = tree.find(kvs_view(key));
+    if (!v) {
+        return KVS_NOT_FOUND;
+    }
+    bool live = !kvs_expired(e, *v);
+    kvs_account(e, v->get(), nullptr);
+    tree.remove(kvs_view(key));
+    return live ? KVS_OK : KVS_NOT_FOUND;
+}
+
+template<typename T>
+static int kvs_tree_mod(kvs_engine_t *e, T& tree, kvs_slice_t key, kvs_slice_t value) {
+    kvs_value_ref *v = kvs_live(e, tree.find(kvs_view(key)));
+    if (!v) {
+        return KVS_NOT_FOUND;
+    }
+    // 还在发送中的旧 value 由引用计数保活，新 value 不带过期时间
+    try {
+        kvs_value_ref nv = kvs_value_make(value);
+        kvs_account(e, v->get(), nv.get());
+        *v = std::move(nv);
+    } catch (const std::bad_alloc&) {
+        return KVS_ERROR;
+    }
+    return KVS_OK;
+}
+
+template<typename T>
+static int kvs_tree_expire(kvs_engine_t *e, T& tree, uint8_t tag, kvs_slice_t key, uint64_t expire) {
+    kvs_value_ref *v = kvs_live(e, tree.find(kvs_view(key)));
+    if (!v) {
+        return KVS_NOT_FOUND;
+    }
+    kvs_value_t *value = v->get();
+    if (expire == 0) {
+        if (value->expire == 0) {
+            return KVS_NOT_FOUND;
+        }
+        value->expire = 0;
+        return KVS_OK;
+    }
+    // 旧的项留在轮子里，到期时和 value 上的时间对不上，不会误删
+    if (kvs_ttl_add(e->ttl, tag, key, expire) != 0) {
+        return KVS_ERROR;
+    }
+    value->expire = expire;
+    return KVS_OK;
+}
+
+// 时间轮到期的回调：value 上的过期时间还是这一项的才删
+template<typename T>
+static int kvs_tree_reap(kvs_engine_t *e, T& tree, kvs_slice_t key, uint64_t expire) {
+    kvs_value_ref *v = tree.find(kvs_view(key));
+    if (!v || v->get()->expire != expire) {
+        return 0;
+    }
+    kvs_account(e, v->get(), nullptr);
+    tree.remove(kvs_view(key));
+    return 1;
+}
+
+static int kvs_engine_reap(void *arg, uint8_t tag, kvs_slice_t key, uint64_t expire) {
+    kvs_engine_t *e = (kvs_engine_t *)arg;
+    return kvs_engine_on(e, tag, [&](auto& tree) { return kvs_tree_reap(e, tree, key, expire); });
+}
+
+size_t kvs_engine_expire_tick(kvs_engine_t *e, uint64_t now, size_t budget) {
+    e->now = now;
+    return kvs_ttl_advance(e->ttl, now, budget, kvs_engine_reap, e);
+}
+
+void kvs_engine_ttl_stats(kvs_engine_t *e, uint64_t *entries, uint64_t *expired) {
+    const kvs_ttl_stats_t *st = kvs_ttl_get_stats(e->ttl);
+    *entries = kvs_stat_read(&st->entries);
+    *expired = kvs_stat_read(&st->expired);
+}
+
+/*
+#############
+tiering
+#############
+*/
+
+// 只带位置的冷 value，和原来的 value 一样长，没有 data
+static kvs_value_t *kvs_value_stub(const kvs_value_t *value, uint64_t loc) {
+    kvs_value_t *v = (kvs_value_t *)kv_slab_alloc(sizeof(kvs_value_t));
+    if (!v) {
+        return nullptr;
+    }
+    v->refcnt = 1;
+    v->len = value->len;
+    v->expire = value->expire;
+    v->loc = loc;
+    v->home = nullptr;
+    v->flags = KVS_VALUE_COLD;
+    return v;
+}
+
+// 换出的 value 在树里被覆盖或删掉了就什么都不做；value 由调用方持有引用，地址不会被复用
+template<typename T>
+static uint64_t kvs_tree_evict(kvs_engine_t *e, T& tree, kvs_slice_t key, kvs_value_t *value, uint64_t loc) {
+    kvs_value_ref *v = tree.find(kvs_view(key));
+    if (!v || v->get() != value) {
+        return 0;
+    }
+    kvs_value_t *stub = kvs_value_stub(value, loc);
+    if (!stub) {
+        return 0;
+    }
+    uint64_t len = value->len;
+    kvs_account(e, value, stub);
+    *v = kvs_value_ref(stub);
+    return len;
+}
+
+template<typename T>
+static kvs_value_ref *kvs_tree_at(kvs_engine_t *e, T& tree, kvs_slice_t key, uint64_t loc) {
+    kvs_value_ref *v = kvs_live(e, tree.find(kvs_view(key)));
+    return v && v->get()->loc == loc ? v : nullptr;
+}
+
+// 三种树轮流扫，一次扫描中途停下时记住最后看过的 key（哈希表记槽的位置），下次从它后面接着来
+size_t kvs_engine_evict_scan(kvs_engine_t *e, uint64_t want, size_t limit, kvs_evict_fn fn, void *arg) {
+    static thread_local std::vector<std::pair<std::string, kvs_value_t *>> clean[3];
+    uint64_t bytes = 0;
+    size_t scanned = 0;
+    int idle = 0;
+    bool stop = false;
+
+    try {
+        while (!stop && bytes < want && scanned < limit && idle < 3) {
+            int t = e->evict_tree;
+            size_t before = scanned;
+            bool paused = false;
+            auto visit = [&](const auto& k, const kvs_value_ref& ref) {
+                if (e->evict_has && k == e->evict_key) {
+                    return true;
+                }
+                if (bytes >= want || scanned >= limit) {
+                    paused = true;
+                    return false;
+                }
+                kvs_value_t *v = ref.get();
+                if (!(v->flags & (KVS_VALUE_COLD | KVS_VALUE_EVICTING)) && !kvs_expired(e, ref)) {
+                    if (v->flags & KVS_VALUE_HOT) {
+                        v->flags &= ~KVS_VALUE_HOT;
+                    } else if (v->loc != 0) {
+                        clean[t].emplace_back(k, v);
+                        bytes += v->len;
+                    } else {
+                        kvs_slice_t key = { k.data(), k.size() };
+                        int rc = fn(arg, (uint8_t)t, key, v);
+                        if (rc < 0) {
+                            paused = stop = true;
+                            return false;
+                        }
+                        if (rc > 0) {
+                            bytes += v->len;
+                        }
+                    }
+                }
+                scanned++;
+                if (t != 2) {
+                    e->evict_key.assign(k);
+                    e->evict_has = true;
+                }
+                return true;
+            };
+            // 遍历中途会改 evict_key，起点先拷一份
+            std::string start = e->evict_key;
+            bool has = e->evict_has;
+            if (t == 0) {
+                has ? e->bptree.scan(std::string_view(start), visit) : e->bptree.scan(visit);
+            } else if (t == 1) {
+                has ? e->rbtree.scan(std::string_view(start), visit) : e->rbtree.scan(visit);
+            } else {
+                e->evict_pos = e->htable.scan(e->evict_pos, visit);
+            }
+            // 一棵树扫到底了换下一棵，三棵连着都没东西可看就停
+            if (!paused) {
+                e->evict_tree = (t + 1) % 3;
+                e->evict_has = false;
+                e->evict_pos = 0;
+                idle = scanned == before ? idle + 1 : 0;
+            }
+        }
+    } catch (const std::bad_alloc&) {
+        e->evict_has = false;
+    }
+
+    // 盘上已经有的不用再写，扫完再换，不在遍历中途改树
+    for (int t = 0; t < 3; t++) {
+        for (auto& c : clean[t]) {
+            kvs_slice_t key = { c.first.data(), c.first.size() };
+            kvs_engine_evict(e, (uint8_t)t, key, c.second, c.second->loc);
+        }
+        clean[t].clear();
+    }
+    return scanned;
+}
+
+uint64_t kvs_engine_evict(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, kvs_value_t *value, uint64_t loc) {
+    return kvs_engine_on(e, tag, [&](auto& tree) { return kvs_tree_evict(e, tree, key, value, loc); });
+}
+
+void kvs_engine_fill(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, kvs_value_t *stub, kvs_value_t *value) {
+    kvs_value_ref *v = kvs_engine_on(e, tag, [&](auto& tree) { return tree.find(kvs_view(key)); });
+    if (!v || v->get() != stub) {
+        return;
+    }
+    value->loc = stub->loc;
+    value->expire = stub->expire;
+    value->flags = KVS_VALUE_HOT;
+    kvs_value_get(value);
+    kvs_account(e, stub, value);
+    *v = kvs_value_ref(value);
+}
+
+int kvs_engine_located(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, uint64_t loc) {
+    return kvs_engine_on(e, tag, [&](auto& tree) { return kvs_tree_at(e, tree, key, loc); }) != nullptr;
+}
+
+void kvs_engine_relocate(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, uint64_t old_loc, uint64_t new_loc) {
+    kvs_value_ref *v = kvs_engine_on(e, tag, [&](auto& tree) { return kvs_tree_at(e, tree, key, old_loc); });
+    if (v) {
+        v->get()->loc = new_loc;
+    }
+}
+
+void kvs_engine_tier_stats(kvs_engine_t *e, uint64_t *mem, uint64_t *cold) {
+    *mem = __atomic_load_n(&e->mem, __ATOMIC_RELAXED);
+    *cold = __atomic_load_n(&e->cold, __ATOMIC_RELAXED);
+}
+
+/*
+#############
+compaction
+#############
+*/
+
+// 同样大小的一份拷贝，从当前线程的 slab 里分配；冷 value 没有 data
+static kvs_value_t *kvs_value_clone(const kvs_value_t *value) {
+    size_t len = value->flags & KVS_VALUE_COLD ? 0 : value->len;
+    kvs_value_t *v = (kvs_value_t *)kv_slab_alloc(sizeof(kvs_value_t) + len);
+    if (!v) {
+        return nullptr;
+    }
+    memcpy(v, value, sizeof(kvs_value_t) + len);
+    v->refcnt = 1;
+    v->home = nullptr;
+    return v;
+}
+
+// 别处还拿着引用的搬了也省不下内存。先看 home：不在索引里的可能正被别的线程释放
+static bool kvs_value_movable(void *arg, void *obj) {
+    kvs_value_t *v = (kvs_value_t *)obj;
+    return kvs_home_mine(v) && __atomic_load_n(&v->refcnt, __ATOMIC_ACQUIRE) == 1;
+}
+
+// 索引里的引用换成拷贝，大小、过期时间、位置都不变，不用记账
+static int kvs_value_move(void *arg, void *obj) {
+    kvs_value_t *v = (kvs_value_t *)obj;
+    kvs_value_t *copy = kvs_value_clone(v);
+    if (!copy) {
+        return -1;
+    }
+    kvs_value_t **home = kvs_home_mine(v);
+    copy->home = v->home;
+    *home = copy;
+    v->home = nullptr;
+    kvs_value_put(v);
+    return 0;
+}
+
+int kvs_value_compact(int budget) {
+    static const kv_slab_mover_t mover = { kvs_value_movable, kvs_value_move };
+    return kv_slab_compact(&mover, nullptr, budget);
+}
+
+/*
+#############
+handoff
+#############
+*/
+
+// 自己拿一个引用，home 换成本进程索引里的；原来有 value 时换掉
+template<typename T>
+static int kvs_tree_adopt(kvs_engine_t *e, T& tree, uint8_t tag, kvs_slice_t key, kvs_value_t *value) {
+    kvs_value_get(value);
+    try {
+        kvs_value_ref nv(value);
+        kvs_value_ref *v = tree.find(kvs_view(key));
+        if (v) {
+            kvs_account(e, v->get(), value);
+            *v = std::move(nv);
+        } else {
+            kvs_tree_insert(tree, key, std::move(nv));
+            kvs_account(e, nullptr, value);
+        }
+    } catch (const std::bad_alloc&) {
+        return KVS_ERROR;
+    }
+    // 挂不上时 key 照样按过期处理，只是不会被主动删掉
+    if (value->expire != 0) {
+        kvs_ttl_add(e->ttl, tag, key, value->expire);
+    }
+    return KVS_OK;
+}
+
+int kvs_engine_adopt(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, kvs_value_t *value) {
+    return kvs_engine_on(e, tag, [&](auto& tree) { return kvs_tree_adopt(e, tree, tag, key, value); });
+}
+
+/*
+#############
+B+ tree
+#############
+*/
+
+int kvs_bptree_set(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_tree_set(e, e->bptree, key, value);
+}
+
+int kvs_bptree_get(kvs_engine_t *e, kvs_slice_t key, kvs_value_t **value) {
+    return kvs_value_lookup(kvs_live(e, e->bptree.find(kvs_view(key))), value);
+}
+
+int kvs_bptree_del(kvs_engine_t *e, kvs_slice_t key) {
+    return kvs_tree_del(e, e->bptree, key);
+}
+
+int kvs_bptree_mod(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_tree_mod(e, e->bptree, key, value);
+}
+
+int kvs_bptree_expire(kvs_engine_t *e, kvs_slice_t key, uint64_t expire) {
+    return kvs_tree_expire(e, e->bptree, 0, key, expire);
+}
+
+void kvs_bptree_scan(kvs_engine_t *e, const kvs_slice_t *start, kvs_scan_fn fn, void *arg) {
+    auto visit = [e, fn, arg](const std::string& k, const kvs_value_ref& v) {
+        if (kvs_expired(e, v)) {
+            return true;
+        }
+        kvs_slice_t key = { k.data(), k.size() };
+        kvs_slice_t value = {};
+        if (!(v.get()->flags & KVS_VALUE_COLD)) {
+            value = { v.get()->data, v.get()->len };
+        }
+        return fn(arg, key, value) == 0;
+    };
+    if (start) {
+        e->bptree.scan(kvs_view(*start), visit);
+    } else {
+        e->bptree.scan(visit);
+    }
+}
+
+// B+ 树和红黑树的 range 共用
+template<typename T>
+static void kvs_tree_range(const kvs_engine_t *e, const T& tree, const kvs_slice_t *start, const kvs_slice_t *end,
+                           kvs_range_fn fn, void *arg) {
+    auto visit = [e, end, fn, arg](const std::string& k, const kvs_value_ref& v) {
+        if (end && kvs_view(*end) < k) {
+            return false;
+        }
+        if (kvs_expired(e, v)) {
+            return true;
+        }
+        kvs_slice_t key = { k.data(), k.size() };
+        return fn(arg, key, v.get()) == 0;
+    };
+    if (start) {
+        tree.scan(kvs_view(*start), visit);
+    } else {
+        tree.scan(visit);
+    }
+}
+
+void kvs_bptree_range(kvs_engine_t *e, const kvs_slice_t *start, const kvs_slice_t *end,
+                      kvs_range_fn fn, void *arg) {
+    kvs_tree_range(e, e->bptree, start, end, fn, arg);
+}
+
+// 按 key 排序后的下标，临时数组每个线程复用
+static std::vector<uint32_t>& kvs_batch_order(const kvs_batch_item_t *items, size_t n) {
+    static thread_local std::vector<uint32_t> order;
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = (uint32_t)i;
+    }
+    std::stable_sort(order.begin(), order.end(), [items](uint32_t a, uint32_t b) {
+        return kvs_view(items[a].key) < kvs_view(items[b].key);
+    });
+    return order;
+}
+
+void kvs_bptree_mget(kvs_engine_t *e, kvs_batch_item_t *items, size_t n) {
+    auto& order = kvs_batch_order(items, n);
+    e->bptree.find_sorted(n,
+        [&](size_t i) { return kvs_view(items[order[i]].key); },
+        [&](size_t i, kvs_value_ref *v) {
+            kvs_batch_item_t *item = &items[order[i]];
+            item->ref = nullptr;
+            item->rc = kvs_value_lookup(kvs_live(e, v), &item->ref);
+        });
+}
+
+void kvs_bptree_mput(kvs_engine_t *e, kvs_batch_item_t *items, size_t n) {
+    auto& order = kvs_batch_order(items, n);
+
+    // 已有的 key（包括过期的）原地换 value，树的结构不变，可以批量查找
+    e->bptree.find_sorted(n,
+        [&](size_t i) { return kvs_view(items[order[i]].key); },
+        [&](size_t i, kvs_value_ref *v) {
+            kvs_batch_item_t *item = &items[order[i]];
+            item->rc = KVS_NOT_FOUND;
+            if (!v) {
+                return;
+            }
+            try {
+                kvs_value_ref nv = kvs_value_make(item->value);
+                kvs_account(e, v->get(), nv.get());
+                *v = std::move(nv);
+                item->rc = KVS_OK;
+            } catch (const std::bad_alloc&) {
+                item->rc = KVS_ERROR;
+            }
+        });
+
+    // 新 key 按顺序插入，相邻的插入落在同一个叶子上
+    for (size_t i = 0; i < n; i++) {
+        kvs_batch_item_t *item = &items[order[i]];
+        if (item->rc != KVS_NOT_FOUND) {
+            continue;
+        }
+        try {
+            kvs_value_ref nv = kvs_value_make(item->value);
+            kvs_value_t *p = nv.get();
+            e->bptree.insert(std::string(item->key.data, item->key.len), std::move(nv));
+            kvs_account(e, nullptr, p);
+            item->rc = KVS_OK;
+        } catch (const std::bad_alloc&) {
+            item->rc = KVS_ERROR;
+        }
+    }
+}
+
+// 删除会改变树的结构，路径不能复用，只按 key 的顺序删
+void kvs_bptree_mdel(kvs_engine_t *e, kvs_batch_item_t *items, size_t n) {
+    auto& order = kvs_batch_order(items, n);
+    for (size_t i = 0; i < n; i++) {
+        kvs_batch_item_t *item = &items[order[i]];
+        item->rc = kvs_tree_del(e, e->bptree, item->key);
+    }
+}
+
+/*
+#############
+red-black tree
+#############
+*/
+
+int kvs_rbtree_set(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_tree_set(e, e->rbtree, key, value);
+}
+
+int kvs_rbtree_get(kvs_engine_t *e, kvs_slice_t key, kvs_value_t **value) {
+    return kvs_value_lookup(kvs_live(e, e->rbtree.find(kvs_view(key))), value);
+}
+
+int kvs_rbtree_del(kvs_engine_t *e, kvs_slice_t key) {
+    return kvs_tree_del(e, e->rbtree, key);
+}
+
+int kvs_rbtree_mod(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_tree_mod(e, e->rbtree, key, value);
+}
+
+int kvs_rbtree_expire(kvs_engine_t *e, kvs_slice_t key, uint64_t expire) {
+    return kvs_tree_expire(e, e->rbtree, 1, key, expire);
+}
+
+void kvs_rbtree_range(kvs_engine_t *e, const kvs_slice_t *start, const kvs_slice_t *end,
+                      kvs_range_fn fn, void *arg) {
+    kvs_tree_range(e, e->rbtree, start, end, fn, arg);
+}
+
+/*
+#############
+hash table
+#############
+*/
+
+int kvs_htable_set(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_tree_set(e, e->htable, key, value);
+}
+
+int kvs_htable_get(kvs_engine_t *e, kvs_slice_t key, kvs_value_t **value) {
+    return kvs_value_lookup(kvs_live(e, e->htable.find(kvs_view(key))), value);
+}
+
+int kvs_htable_del(kvs_engine_t *e, kvs_slice_t key) {
+    return kvs_tree_del(e, e->htable, key);
+}
+
+int kvs_htable_mod(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_tree_mod(e, e->htable, key, value);
+}
+
+int kvs_htable_expire(kvs_engine_t *e, kvs_slice_t key, uint64_t expire) {
+    return kvs_tree_expire(e, e->htable, 2, key, expire);
+}
+
+int kvs_htable_walk(kvs_engine_t *e, kvs_htable_cursor_t *cursor, kvs_range_fn fn, void *arg) {
+    uint64_t gen = e->htable.generation();
+    if (cursor->gen != gen) {
+        bool moved = cursor->pos != 0;
+        cursor->gen = gen;
+        cursor->pos = 0;
+        if (moved) {
+            return -1;
+        }
+    }
+
+    size_t pos = e->htable.scan(cursor->pos, [e, fn, arg](std::string_view k, kvs_value_ref& v) {
+        if (kvs_expired(e, v)) {
+            return true;
+        }
+        kvs_slice_t key = { k.data(), k.size() };
+        return fn(arg, key, v.get()) == 0;
+    });
+    if (pos >= e->htable.capacity()) {
+        cursor->pos = pos;
+        return 1;
+    }
+    cursor->pos = pos + 1;
+    return 0;
+}
+
+/*
+#############
+skip list
+#############
+*/
+
+// 跳表直接存 kvs_value_t *，持有一个引用；换下来的 value 过了宽限期才放掉，
+// 所以 Epoch::Guard 内读到的 value 加引用之前不会被释放
+struct kvs_value_drop {
+    void operator()(kvs_value_t *v) const { kvs_value_put(v); }
+};
+
+struct kvs_slist_s {
+    SkipList<std::string, kvs_value_t, kvs_value_drop> list;
+};
+
+kvs_slist_t *kvs_slist_create(void) {
+    try {
+        return new kvs_slist_s();
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void kvs_slist_destroy(kvs_slist_t *s) {
+    delete s;
+    Epoch::drain();
+}
+
+// 写 value 的三个操作共用：op 返回 false 时 value 还归这里
+template<typename F>
+static int kvs_slist_write(kvs_slice_t value, int fail, F&& op) {
+    kvs_value_t *v = kvs_value_create(value.data, value.len);
+    if (!v) {
+        return KVS_ERROR;
+    }
+    try {
+        if (op(v)) {
+            return KVS_OK;
+        }
+    } catch (const std::bad_alloc&) {
+        fail = KVS_ERROR;
+    }
+    kvs_value_put(v);
+    return fail;
+}
+
+int kvs_slist_set(kvs_slist_t *s, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_slist_write(value, KVS_EXIST, [&](kvs_value_t *v) {
+        return s->list.add(kvs_view(key), v);
+    });
+}
+
+int kvs_slist_get(kvs_slist_t *s, kvs_slice_t key, kvs_value_t **value) {
+    Epoch::Guard guard;
+    kvs_value_t *v = s->list.find(kvs_view(key));
+    if (!v) {
+        return KVS_NOT_FOUND;
+    }
+    kvs_value_get(v);
+    *value = v;
+    return KVS_OK;
+}
+
+int kvs_slist_del(kvs_slist_t *s, kvs_slice_t key) {
+    return s->list.remove(kvs_view(key)) ? KVS_OK : KVS_NOT_FOUND;
+}
+
+int kvs_slist_mod(kvs_slist_t *s, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_slist_write(value, KVS_NOT_FOUND, [&](kvs_value_t *v) {
+        return s->list.replace(kvs_view(key), v);
+    });
+}
+
+int kvs_slist_put(kvs_slist_t *s, kvs_slice_t key, kvs_slice_t value) {
+    return kvs_slist_write(value, KVS_ERROR, [&](kvs_value_t *v) {
+        s->list.insert(kvs_view(key), v);
+        return true;
+    });
+}
+
+int kvs_slist_adopt(kvs_slist_t *s, kvs_slice_t key, kvs_value_t *value) {
+    kvs_value_get(value);
+    try {
+        s->list.insert(kvs_view(key), value);
+    } catch (const std::bad_alloc&) {
+        kvs_value_put(value);
+        return KVS_ERROR;
+    }
+    return KVS_OK;
+}
+
+void kvs_slist_range(kvs_slist_t *s, const kvs_slice_t *start, const kvs_slice_t *end,
+                     kvs_range_fn fn, void *arg) {
+    auto visit = [end, fn, arg](const std::string& k, kvs_value_t *v) {
+        if (end && kvs_view(*end) < k) {
+            return false;
+        }
+        kvs_slice_t key = { k.data(), k.size() };
+        return fn(arg, key, v) == 0;
+    };
+    if (start) {
+        s->list.scan(kvs_view(*start), visit);
+    } else {
+        s->list.scan(visit);
+    }
+}
+
+size_t kvs_slist_count(kvs_slist_t *s) {
+    return s->list.size();
+}
+
+/*
+#############
+bulk load
+#############
+*/
+
+struct kvs_bulk_s {
+    std::vector<std::string> keys[3];
+    std::vector<kvs_value_ref> values[3];
+};
+
+kvs_bulk_t *kvs_bulk_create(void) {
+    return new (std::nothrow) kvs_bulk_s();
+}
+
+int kvs_bulk_add(kvs_bulk_t *b, int tag, kvs_slice_t key, kvs_slice_t value, uint64_t expire) {
+    if (tag < 0 || tag > 2) {
+        return KVS_ERROR;
+    }
+    auto& keys = b->keys[tag];
+    auto& values = b->values[tag];
+    if (tag != 2 && !keys.empty() && !(keys.back() < kvs_view(key))) {
+        return KVS_ERROR;
+    }
+    try {
+        keys.emplace_back(key.data, key.len);
+        values.push_back(kvs_value_make(value));
+        values.back().get()->expire = expire;
+    } catch (const std::bad_alloc&) {
+        if (keys.size() > values.size()) {
+            keys.pop_back();
+        }
+        return KVS_ERROR;
+    }
+    return KVS_OK;
+}
+
+// 哈希表不用排序，预留好容量逐个插入；同一个 key 出现多次时后面的生效
+static void kvs_bulk_load_htable(kvs_bulk_t *b, kvs_engine_t *e) {
+    auto& keys = b->keys[2];
+    auto& values = b->values[2];
+
+    e->htable.clear();
+    try {
+        e->htable.reserve(keys.size());
+    } catch (const std::bad_alloc&) {
+        // 预留不了就边插边扩
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        kvs_slice_t key = { keys[i].data(), keys[i].size() };
+        uint64_t expire = values[i].get()->expire;
+        kvs_value_ref *v = e->htable.find(keys[i]);
+        kvs_value_t *p = values[i].get();
+        try {
+            if (v) {
+                kvs_account(e, v->get(), p);
+                *v = std::move(values[i]);
+            } else {
+                e->htable.insert(keys[i], std::move(values[i]));
+                kvs_account(e, nullptr, p);
+            }
+        } catch (const std::bad_alloc&) {
+            continue;
+        }
+        if (expire != 0) {
+            kvs_ttl_add(e->ttl, 2, key, expire);
+        }
+    }
+    std::vector<std::string>().swap(keys);
+    std::vector<kvs_value_ref>().swap(values);
+}
+
+// key 和 value 都是移动进树里的，不再拷贝；带过期时间的 key 挂到时间轮上，
+// 轮子里原来的项都成了过时的，到期时自然丢掉
+void kvs_bulk_load(kvs_bulk_t *b, kvs_engine_t *e) {
+    __atomic_store_n(&e->mem, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->cold, 0, __ATOMIC_RELAXED);
+    e->evict_has = false;
+    e->evict_pos = 0;
+    for (int t = 0; t < 2; t++) {
+        size_t i = 0;
+        auto next = [b, e, t, &i](std::string& k, kvs_value_ref& v) {
+            uint64_t expire = b->values[t][i].get()->expire;
+            if (expire != 0) {
+                // 内存不够挂不上时 key 照样按过期处理，只是不会被主动删掉
+                kvs_slice_t key = { b->keys[t][i].data(), b->keys[t][i].size() };
+                kvs_ttl_add(e->ttl, (uint8_t)t, key, expire);
+            }
+            kvs_account(e, nullptr, b->values[t][i].get());
+            k = std::move(b->keys[t][i]);
+            v = std::move(b->values[t][i]);
+            i++;
+        };
+        if (t == 0) {
+            e->bptree.bulk_load(b->keys[t].size(), next);
+        } else {
+            e->rbtree.bulk_load(b->keys[t].size(), next);
+        }
+        std::vector<std::string>().swap(b->keys[t]);
+        std::vector<kvs_value_ref>().swap(b->values[t]);
+    }
+    kvs_bulk_load_htable(b, e);
+}
+
+void kvs_bulk_free(kvs_bulk_t *b) {
+    delete b;
+}
@@ -0,0 +1,186 @@
+#ifndef KV_ENGINE_H
+#define KV_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// engine 返回值
+#define KVS_OK          0
+#define KVS_EXIST       1
+#define KVS_NOT_FOUND   2
+#define KVS_ERROR      -1
+
+// 指向接收缓冲区的 (pointer, length) 视图，不以'\0'结尾
+typedef struct kvs_slice_s {
+    const char *data;
+    size_t len;
+} kvs_slice_t;
+
+// engine 里的 value 不可变，带引用计数：修改是换上一个新的 value，
+// get 拿到的引用在 kvs_value_put 之前一直有效，回复时可以直接交给 socket 发送。
+// expire、loc、home 和 flags 例外：原地修改，只在所属 shard 上读写，发送时不碰它们
+typedef struct kvs_value_s {
+    uint32_t refcnt;
+    uint32_t len;
+    uint64_t expire;    // 毫秒级的绝对时间，0 表示不过期
+    uint64_t loc;       // 分层模式下在 value log 里的位置，0 表示盘上没有
+    struct kvs_value_s **home;  // 索引里持有它的那个引用，碎片整理从这里换成拷贝；不在索引里时为 NULL。
+                                // 高 16 位是设它的进程的标记，见 kvs_value_set_owner
+    uint32_t flags;     // KVS_VALUE_*
+    char data[];
+} kvs_value_t;
+
+#define KVS_VALUE_COLD      0x1     // data 不在内存里，只有 len/expire/loc
+#define KVS_VALUE_HOT       0x2     // 最近读过，换出时放过一轮
+#define KVS_VALUE_EVICTING  0x4     // 正在写到 value log
+
+kvs_value_t *kvs_value_create(const char *data, size_t len);
+void kvs_value_put(kvs_value_t *v);
+
+// 引用会在 shard 线程之间传递，计数用原子操作
+static inline void kvs_value_get(kvs_value_t *v) {
+    __atomic_fetch_add(&v->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+// 一个 engine 实例持有一棵 B+ 树、一棵红黑树和一个哈希表，三者的 key 互不相干
+typedef struct kvs_engine_s kvs_engine_t;
+
+kvs_engine_t *kvs_engine_create(void);
+void kvs_engine_destroy(kvs_engine_t *e);
+
+// 过期的 key 对所有接口都当作不存在（覆盖写除外，直接换掉），之后由时间轮删掉。
+// engine 的时钟只由 kvs_engine_expire_tick 推进，第一次调用之前什么都不过期
+size_t kvs_engine_expire_tick(kvs_engine_t *e, uint64_t now, size_t budget);
+// 可以在别的线程上读
+void kvs_engine_ttl_stats(kvs_engine_t *e, uint64_t *entries, uint64_t *expired);
+
+// 分层模式：树里只有一部分 value 在内存里，其余的换成只带位置的冷 value (KVS_VALUE_COLD)。
+// get/mget/range 可能拿到冷 value，由调用方从 value log 读回来；scan 只要 key，冷 value 的 value 为空。
+// tag 和时间轮里的一样，0 是 B+ 树，1 是红黑树，2 是哈希表
+
+// 换出的候选交给 fn：返回 1 表示要写到盘上，0 表示跳过，-1 表示放不下了，下次从这个 key 接着来
+typedef int (*kvs_evict_fn)(void *arg, uint8_t tag, kvs_slice_t key, kvs_value_t *value);
+// 从上次停下的地方接着扫两棵树和哈希表（CLOCK）：最近读过的清掉访问位放过一轮，盘上已经有的直接换成冷 value，
+// 其余的交给 fn。凑够 want 字节或者看了 limit 个 key 就停，返回看了多少个 key
+size_t kvs_engine_evict_scan(kvs_engine_t *e, uint64_t want, size_t limit, kvs_evict_fn fn, void *arg);
+// value 已经写到 loc：树里还是这个 value 时换成冷 value，返回省下的字节数
+uint64_t kvs_engine_evict(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, kvs_value_t *value, uint64_t loc);
+// 从盘上读回来的 value 换回树里，树里还是 stub 这个冷 value 时才换，位置和过期时间照搬
+void kvs_engine_fill(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, kvs_value_t *stub, kvs_value_t *value);
+// GC 用：key 现在的 value 是不是在 loc
+int kvs_engine_located(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, uint64_t loc);
+// GC 把 value 搬到 new_loc，key 的 value 还在 old_loc 时改过去
+void kvs_engine_relocate(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, uint64_t old_loc, uint64_t new_loc);
+// 树里在内存中的 value 字节数和冷 value 的个数，可以在别的线程上读
+void kvs_engine_tier_stats(kvs_engine_t *e, uint64_t *mem, uint64_t *cold);
+
+// 碎片整理：当前线程的 slab 缓存里稀疏的页 (kv_slab_compact) 上的 value 拷到别的页，
+// 顺着 home 把索引里的引用换成拷贝，旧的随之释放，不用查 key。只搬只有索引引用着的 value，
+// 冷 value 也搬，跳表里的没有 home 不搬。value 要在它所在的索引的 shard 上创建。
+// 最多看 budget 个 value，返回腾空了多少页，0 表示现在没什么可做
+int kvs_value_compact(int budget);
+
+// 热重启时新老进程共用 value（slab 的页在两边映射在同一地址的共享内存里）。
+// 本进程写进 home 的标记，和另一个进程不一样；在往索引里放任何 value 之前设，默认 0
+void kvs_value_set_owner(uint16_t tag);
+// 另一个进程的 value 原样装进索引，自己拿一个引用；key 原来有 value 时换掉，换的还是同一个 value 也行。
+// value 带过期时间时挂到时间轮上，tag 是 kvs_engine_type_t
+int kvs_engine_adopt(kvs_engine_t *e, uint8_t tag, kvs_slice_t key, kvs_value_t *value);
+
+// key/value 只在真正插入时才拷贝进 engine
+// get 返回 value 的一个引用，用完调用 kvs_value_put
+int kvs_bptree_set(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value);
+int kvs_bptree_get(kvs_engine_t *e, kvs_slice_t key, kvs_value_t **value);
+int kvs_bptree_del(kvs_engine_t *e, kvs_slice_t key);
+int kvs_bptree_mod(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value);
+// 给已有的 key 设置过期时间，expire 为 0 时去掉；key 不存在，或者去掉时本来就没有过期时间，返回 KVS_NOT_FOUND
+int kvs_bptree_expire(kvs_engine_t *e, kvs_slice_t key, uint64_t expire);
+
+// 顺序遍历 B+ 树，start 为 NULL 时从第一个键开始；fn 返回非 0 时停止。冷 value 的 value 为空
+typedef int (*kvs_scan_fn)(void *arg, kvs_slice_t key, kvs_slice_t value);
+void kvs_bptree_scan(kvs_engine_t *e, const kvs_slice_t *start, kvs_scan_fn fn, void *arg);
+
+// 沿叶子链表遍历 [start, end]，start/end 为 NULL 时不限；fn 返回非 0 时停止。
+// value 的引用只在回调期间有效，要留下来自己 kvs_value_get
+typedef int (*kvs_range_fn)(void *arg, kvs_slice_t key, kvs_value_t *value);
+void kvs_bptree_range(kvs_engine_t *e, const kvs_slice_t *start, const kvs_slice_t *end,
+                      kvs_range_fn fn, void *arg);
+
+// 批量接口的一项：key/value 是输入，rc 和 GET 的 ref 是输出
+typedef struct kvs_batch_item_s {
+    kvs_slice_t key;
+    kvs_slice_t value;
+    kvs_value_t *ref;
+    int rc;
+} kvs_batch_item_t;
+
+// 一次调用处理 n 个 key。先按 key 排序，相邻的 key 共用从根往下的路径
+void kvs_bptree_mget(kvs_engine_t *e, kvs_batch_item_t *items, size_t n);
+// 插入或覆盖，同一个 key 出现多次时后面的生效
+void kvs_bptree_mput(kvs_engine_t *e, kvs_batch_item_t *items, size_t n);
+void kvs_bptree_mdel(kvs_engine_t *e, kvs_batch_item_t *items, size_t n);
+
+int kvs_rbtree_set(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value);
+int kvs_rbtree_get(kvs_engine_t *e, kvs_slice_t key, kvs_value_t **value);
+int kvs_rbtree_del(kvs_engine_t *e, kvs_slice_t key);
+int kvs_rbtree_mod(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value);
+int kvs_rbtree_expire(kvs_engine_t *e, kvs_slice_t key, uint64_t expire);
+// 中序遍历 [start, end]，用法和 kvs_bptree_range 一样
+void kvs_rbtree_range(kvs_engine_t *e, const kvs_slice_t *start, const kvs_slice_t *end,
+                      kvs_range_fn fn, void *arg);
+
+// 只做点查询的哈希表（SwissTable），没有顺序，用法和两棵树一样
+int kvs_htable_set(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value);
+int kvs_htable_get(kvs_engine_t *e, kvs_slice_t key, kvs_value_t **value);
+int kvs_htable_del(kvs_engine_t *e, kvs_slice_t key);
+int kvs_htable_mod(kvs_engine_t *e, kvs_slice_t key, kvs_slice_t value);
+int kvs_htable_expire(kvs_engine_t *e, kvs_slice_t key, uint64_t expire);
+
+// 哈希表的遍历位置，开始时清零。表扩容或者重排之后 gen 对不上，位置作废
+typedef struct kvs_htable_cursor_s {
+    uint64_t gen;
+    uint64_t pos;
+} kvs_htable_cursor_t;
+// 从 cursor 接着无序遍历，fn 返回非 0 时在这一项之后停下。遍历完返回 1，停下返回 0；
+// 上次停下之后表重排过返回 -1，cursor 回到开头，之前遍历过的 key 之后可能再遇到一次
+int kvs_htable_walk(kvs_engine_t *e, kvs_htable_cursor_t *cursor, kvs_range_fn fn, void *arg);
+
+// 所有线程共用的一个有序 keyspace（无锁跳表），不属于哪个 engine，任何线程都可以直接并发读写和遍历。
+// 只在内存里：不记 WAL，不进 checkpoint，没有过期时间，也不换出到盘上
+typedef struct kvs_slist_s kvs_slist_t;
+
+kvs_slist_t *kvs_slist_create(void);
+// 调用时不能再有线程访问它
+void kvs_slist_destroy(kvs_slist_t *s);
+int kvs_slist_set(kvs_slist_t *s, kvs_slice_t key, kvs_slice_t value);
+int kvs_slist_get(kvs_slist_t *s, kvs_slice_t key, kvs_value_t **value);
+int kvs_slist_del(kvs_slist_t *s, kvs_slice_t key);
+int kvs_slist_mod(kvs_slist_t *s, kvs_slice_t key, kvs_slice_t value);
+// 插入或覆盖
+int kvs_slist_put(kvs_slist_t *s, kvs_slice_t key, kvs_slice_t value);
+// 插入或覆盖成另一个进程的 value，自己拿一个引用，不拷贝
+int kvs_slist_adopt(kvs_slist_t *s, kvs_slice_t key, kvs_value_t *value);
+// 用法和 kvs_bptree_range 一样。不加锁，遍历期间别的线程的修改可能看到也可能看不到
+void kvs_slist_range(kvs_slist_t *s, const kvs_slice_t *start, const kvs_slice_t *end,
+                     kvs_range_fn fn, void *arg);
+size_t kvs_slist_count(kvs_slist_t *s);
+
+// 从 checkpoint 重建 engine：tag 同上，两棵树按 key 严格升序 add，load 时都自底向上一次建好，
+// 哈希表的 key 不要求顺序，同一个 key 出现多次时后面的生效。替换 engine 原有的内容。
+// 树的 key 不是升序时 add 返回 KVS_ERROR
+typedef struct kvs_bulk_s kvs_bulk_t;
+
+kvs_bulk_t *kvs_bulk_create(void);
+int kvs_bulk_add(kvs_bulk_t *b, int tag, kvs_slice_t key, kvs_slice_t value, uint64_t expire);
+void kvs_bulk_load(kvs_bulk_t *b, kvs_engine_t *e);
+void kvs_bulk_free(kvs_bulk_t *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
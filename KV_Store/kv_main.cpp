@@ -2,13 +2,14 @@
 #include <spdk/nvme.h>
 #include <spdk/queue.h>
 
+#include "spdk_server.h"
+
 #define ALIGN_4k 0x1000
 #define NVME_CONTROLLER_NAME_LENGTH 5112
 
 struct spdk_nvme_transport_id gtrid;
 struct spdk_nvme_ctrlr *gctrlr = NULL;
 struct spdk_nvme_ns* gns = NULL;
-struct spdk_nvme_qpair* gqpair = NULL;
 
 struct ctrlr_entry {
     struct spdk_nvme_ctrlr *ctrlr;
@@ -36,27 +37,22 @@ static bool nvme_probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *tri
 }
 
 static void nvme_attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid, struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts) {
-    // printf("nvme_attach_cb: %s\n", trid->traddr);
-    // gctrlr = ctrlr;
-    
-    // gns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
+    printf("nvme_attach_cb: %s\n", trid->traddr);
 
-    int nsid = spdk_nvme_ctrlr_get_first_active_ns(ctrlr);
-    gns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
-    gctrlr = ctrlr;
     struct ctrlr_entry *entry = (struct ctrlr_entry*)malloc(sizeof(struct ctrlr_entry));
-    struct spdk_nvme_qpair *qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, NULL, 0);
     if (!entry) {
         exit(1);
     }
 
+    // qpair 由使用者在自己的线程上分配，这里只记录 controller 和 namespace
     entry->ctrlr = ctrlr;
-    entry->qpair = qpair;
+    entry->qpair = NULL;
     
     snprintf(entry->name, sizeof(entry->name), "%s", trid->traddr);
     TAILQ_INSERT_TAIL(&g_ctrlr, entry, link);
 
-    while (nsid != 0) {
+    uint32_t nsid = spdk_nvme_ctrlr_get_first_active_ns(ctrlr);
+    for (; nsid != 0; nsid = spdk_nvme_ctrlr_get_next_active_ns(ctrlr, nsid)) {
         struct spdk_nvme_ns* ns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
         if (ns == NULL) {
             continue;
@@ -72,7 +68,10 @@ static void nvme_attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *tr
 
         TAILQ_INSERT_TAIL(&g_ns, ns_entry, link);
 
-        nsid = spdk_nvme_ctrlr_get_next_active_ns(ctrlr, nsid);
+        if (gns == NULL) {
+            gctrlr = ctrlr;
+            gns = ns;
+        }
     }
 }
 
@@ -80,97 +79,43 @@ static void nvme_remove_cb(void* cb_ctx, struct spdk_nvme_ctrlr* ctrlr) {
     printf("nvme_remove_cb\n");
 }
 
+// 在 spdk app 线程上调用，取第一个 controller 的第一个 namespace
+extern "C" int kvs_nvme_probe(struct spdk_nvme_ctrlr **ctrlr, struct spdk_nvme_ns **ns) {
+    memset(&gtrid, 0, sizeof(gtrid));
+    spdk_nvme_trid_populate_transport(&gtrid, SPDK_NVME_TRANSPORT_PCIE);
+    snprintf(gtrid.subnqn, sizeof(gtrid.subnqn), "%s", SPDK_NVMF_DISCOVERY_NQN);
 
+    if (spdk_nvme_probe(&gtrid, NULL, nvme_probe_cb, nvme_attach_cb, nvme_remove_cb) != 0) {
+        return -1;
+    }
+    if (gns == NULL) {
+        return -ENODEV;
+    }
 
-static void nvme_opera_write_cb(void* ctx, const struct spdk_nvme_cpl* cpl) {
-    int *finished = (int*)ctx;
-    *finished = 1;
-    printf("nvme_opera_write cb finished\n");
-}
-
-static void nvme_opera_read_cb(void* ctx, const struct spdk_nvme_cpl* cpl) {
-    int *finished = (int*)ctx;
-    *finished = 1;
-    printf("nvme_opera_read cb finished\n");
+    *ctrlr = gctrlr;
+    *ns = gns;
+    return 0;
 }
 
-static int nvme_opera_read(struct spdk_nvme_ctrlr* ctrlr, struct spdk_nvme_ns* ns) {
-    //spdk采用异步读写 分配一个队列组 包含提交队列 和 回收队列
-    struct spdk_nvme_qpair *qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, NULL, 0);
-    if (qpair == NULL) return -1;
-
-    size_t sz;
-    // rmem 是 写空间 叫 read buf 更好
-    char* rmem = (char*)spdk_nvme_ctrlr_map_cmb(ctrlr, &sz); // 先尝试分配4k内存页 使用mmap的方式来映射
-    if (rmem == NULL) {
-        // mmap 映射失败 可以自主分配空间 使用spdk内置的malloc函数
-        rmem = (char*)spdk_zmalloc(0x1000, 0x1000, NULL, SPDK_ENV_LCORE_ID_ANY, SPDK_MALLOC_DMA);
-    }
+extern "C" void kvs_nvme_detach(void) {
+    struct namespace_entry *ns_entry, *ns_tmp;
+    struct ctrlr_entry *entry, *tmp;
 
-    int finished = 0;
-    int rc = spdk_nvme_ns_cmd_read(ns, qpair, rmem, 0, 1, nvme_opera_read_cb, &finished, 0);
-    if (rc != 0) {
-        printf("starting read I/O failed\n");
-        exit(1);
+    TAILQ_FOREACH_SAFE(ns_entry, &g_ns, link, ns_tmp) {
+        TAILQ_REMOVE(&g_ns, ns_entry, link);
+        free(ns_entry);
     }
-
-    while (!finished) {
-        spdk_nvme_qpair_process_completions(qpair, 0);
+    TAILQ_FOREACH_SAFE(entry, &g_ctrlr, link, tmp) {
+        TAILQ_REMOVE(&g_ctrlr, entry, link);
+        spdk_nvme_detach(entry->ctrlr);
+        free(entry);
     }
-
-    spdk_nvme_ctrlr_free_io_qpair(qpair);
-    printf("nvme_opera_read successful: %s\n", rmem);
-    return 0;
+    gctrlr = NULL;
+    gns = NULL;
 }
 
 
 int main(int argc, char* argv[]) {
-    struct spdk_env_opts opts = {0};
-    memset(&opts, 0, sizeof(opts));
-
-    opts.name = "kvstore";
-    opts.core_mask = "0x1";
-    opts.opts_size = sizeof(struct spdk_env_opts);
-    //opts.no_huge = true;
-    spdk_env_opts_init(&opts);
-
-
-    spdk_env_init(&opts);
-
-    memset(&gtrid, 0, sizeof(gtrid));
-    spdk_nvme_trid_populate_transport(&gtrid, SPDK_NVME_TRANSPORT_PCIE);
-    snprintf(gtrid.subnqn, sizeof(gtrid.subnqn), "%s", SPDK_NVMF_DISCOVERY_NQN);
-
-    spdk_nvme_probe(&gtrid, NULL, nvme_probe_cb, nvme_attach_cb, nvme_remove_cb);
-
-    struct spdk_nvme_qpair* qpair = spdk_nvme_ctrlr_alloc_io_qpair(gctrlr, NULL, 0);
-    gqpair = qpair;
-    if (qpair == NULL) return -1;
-
-    size_t sz = 0;
-    int mmap_io =  1;
-    void* buf = spdk_nvme_ctrlr_map_cmb(gctrlr, &sz); // 先尝试分配4k内存页 使用mmap的方式来映射
-    if (buf == NULL || sz == 0) {
-        printf("switch spdk_zmalloc\n");
-        // mmap 映射失败 可以自主分配空间 使用spdk内置的malloc函数
-        buf = spdk_zmalloc(ALIGN_4k, ALIGN_4k, NULL, SPDK_ENV_LCORE_ID_ANY, SPDK_MALLOC_DMA);
-        sz = ALIGN_4k;
-        mmap_io = 0;
-    }
-    if (buf == NULL) return -1;
-    memset(buf, 0, sz);
-    snprintf((char*)buf, ALIGN_4k, "The test for spdk, 555, 1025, KKK");
-    int finished = 0;
-    int rc = spdk_nvme_ns_cmd_write(gns, qpair, buf, 0, 1, nvme_opera_write_cb, &finished, 0);
-    if (rc != 0) {
-        printf("starting write I/O failed\n");
-        exit(1);
-    }
-    while (!finished) {
-        spdk_nvme_qpair_process_completions(qpair, 0);
-    }
-    spdk_nvme_ctrlr_free_io_qpair(qpair);
-    nvme_opera_read(gctrlr, gns);
-    printf("main mmap_io %d\n", mmap_io);
+    start_server(argc, argv);
     return 0;
-}
\ No newline at end of file
+}
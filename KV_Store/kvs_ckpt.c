@@ -0,0 +1,605 @@
+#include "spdk/stdinc.h"
+#include "spdk/env.h"
+#include "spdk/thread.h"
+#include "spdk/crc32.h"
+#include "spdk/endian.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+#include "kvs_ckpt.h"
+#include "kvs_shard.h"
+
+#define KVS_CKPT_ROUNDUP(x)		(((x) + KVS_WAL_BLOCK - 1) & ~(uint64_t)(KVS_WAL_BLOCK - 1))
+#define KVS_CKPT_ROUNDDOWN(x)	((x) & ~(uint64_t)(KVS_WAL_BLOCK - 1))
+
+typedef enum {
+	KVS_CKPT_IDLE = 0,
+	KVS_CKPT_SAVE,			// 写数据
+	KVS_CKPT_SAVE_HDR,		// 数据都写完了，写头部
+	KVS_CKPT_LOAD_HDR,		// 读两个槽的头部
+	KVS_CKPT_LOAD,			// 读数据
+} kvs_ckpt_state_t;
+
+struct kvs_ckpt_s {
+	struct spdk_nvme_ns *ns;
+	struct spdk_nvme_qpair *qpair;
+	struct spdk_poller *poller;
+
+	uint32_t sector_size;
+	uint32_t max_xfer;
+	uint64_t start_lba;
+	uint64_t slot_size;		// 一个槽的字节数
+
+	uint64_t seq;			// 最新的有效 checkpoint
+	int slot;				// 它在哪个槽，-1 表示还没有
+
+	kvs_ckpt_state_t state;
+	int pending;
+	int status;
+	kvs_ckpt_done_fn done;
+	void *done_arg;
+	kvs_engine_t *engine;
+	kvs_ckpt_hdr_t hdr;
+	uint64_t start_tsc;
+
+	// DMA 缓冲区，[pos, len) 是还没写下去或者还没解析的数据，buf[0] 在数据区里的偏移是 base
+	char *buf;
+	size_t size;
+	size_t pos;
+	size_t len;
+	uint64_t base;
+	uint32_t crc;
+
+	// save：下一个要写的是第 tree 棵树里 cursor 之后的 key，哈希表用 hcursor
+	int tree;
+	char *cursor;
+	size_t cursor_len;
+	size_t cursor_size;
+	bool has_cursor;
+	kvs_htable_cursor_t hcursor;
+	bool paused;
+	int target;				// 这次写哪个槽
+
+	// load
+	kvs_bulk_t *bulk;
+	char *hdr_buf;
+	uint64_t loaded[KVS_CKPT_TREES];
+};
+
+static int kvs_ckpt_poll(void *arg) {
+	kvs_ckpt_t *c = arg;
+	int n = spdk_nvme_qpair_process_completions(c->qpair, 0);
+
+	return n > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// 读写都按 max_xfer 切开，每提交一条 pending 加一
+static int kvs_ckpt_io(kvs_ckpt_t *c, bool write, char *buf, uint64_t off, size_t len, spdk_nvme_cmd_cb cb) {
+	while (len > 0) {
+		size_t n = spdk_min(len, (size_t)c->max_xfer);
+		uint64_t lba = c->start_lba + off / c->sector_size;
+		int rc = write ?
+			spdk_nvme_ns_cmd_write(c->ns, c->qpair, buf, lba, n / c->sector_size, cb, c,
+				SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) :
+			spdk_nvme_ns_cmd_read(c->ns, c->qpair, buf, lba, n / c->sector_size, cb, c, 0);
+		if (rc != 0) {
+			return rc;
+		}
+		c->pending++;
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// 缓冲区里至少还能放 need 字节，不够时换一块大的
+static int kvs_ckpt_reserve(kvs_ckpt_t *c, size_t need) {
+	size_t size = c->size;
+
+	while (c->len + need > size) {
+		size *= 2;
+	}
+	if (size == c->size) {
+		return 0;
+	}
+
+	char *buf = spdk_zmalloc(size, KVS_WAL_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(buf, c->buf, c->len);
+	spdk_free(c->buf);
+	c->buf = buf;
+	c->size = size;
+	return 0;
+}
+
+static void kvs_ckpt_finish(kvs_ckpt_t *c, int rc) {
+	kvs_wal_pos_t pos = { c->hdr.wal_lsn, c->hdr.wal_off, c->hdr.wal_crc };
+	bool found = c->state == KVS_CKPT_SAVE_HDR || c->state == KVS_CKPT_LOAD;
+
+	c->state = KVS_CKPT_IDLE;
+	if (c->bulk) {
+		kvs_bulk_free(c->bulk);
+		c->bulk = NULL;
+	}
+	spdk_poller_unregister(&c->poller);
+	c->done(c->done_arg, rc, rc == 0 && found ? &pos : NULL);
+}
+
+/*
+#############
+save
+#############
+*/
+
+static void kvs_ckpt_save_next(kvs_ckpt_t *c);
+static void kvs_ckpt_save_hdr(kvs_ckpt_t *c);
+
+static void kvs_ckpt_save_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_ckpt_t *c = arg;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		c->status = -EIO;
+	}
+	if (--c->pending > 0) {
+		return;
+	}
+	if (c->status != 0) {
+		SPDK_ERRLOG("Checkpoint write failed: %d\n", c->status);
+		kvs_ckpt_finish(c, c->status);
+		return;
+	}
+
+	if (c->state == KVS_CKPT_SAVE) {
+		if (c->tree < KVS_CKPT_TREES) {
+			kvs_ckpt_save_next(c);
+		} else {
+			kvs_ckpt_save_hdr(c);
+		}
+		return;
+	}
+
+	c->seq = c->hdr.seq;
+	c->slot = c->target;
+	SPDK_NOTICELOG("Checkpoint %" PRIu64 ": %" PRIu64 " + %" PRIu64 " + %" PRIu64 " keys, %" PRIu64 " bytes in %" PRIu64 " ms\n",
+		c->seq, c->hdr.count[0], c->hdr.count[1], c->hdr.count[2], c->hdr.data_len,
+		(spdk_get_ticks() - c->start_tsc) * 1000 / spdk_get_ticks_hz());
+	kvs_ckpt_finish(c, 0);
+}
+
+static void kvs_ckpt_set_cursor(kvs_ckpt_t *c, kvs_slice_t key) {
+	if (key.len > c->cursor_size) {
+		size_t size = spdk_max(key.len, (size_t)64);
+		char *cursor = realloc(c->cursor, size);
+		if (cursor == NULL) {
+			// 游标存不下就没法接着遍历，这次 checkpoint 作废
+			c->status = -ENOMEM;
+			return;
+		}
+		c->cursor = cursor;
+		c->cursor_size = size;
+	}
+	memcpy(c->cursor, key.data, key.len);
+	c->cursor_len = key.len;
+	c->has_cursor = true;
+}
+
+static int kvs_ckpt_save_cb(void *arg, kvs_slice_t key, kvs_value_t *value) {
+	kvs_ckpt_t *c = arg;
+	kvs_ckpt_ent_t ent = {};
+
+	// 从游标处开始的遍历会先碰到游标本身
+	if (c->has_cursor && key.len == c->cursor_len && memcmp(key.data, c->cursor, key.len) == 0) {
+		return 0;
+	}
+
+	size_t need = sizeof(ent) + key.len + value->len + (value->expire ? sizeof(uint64_t) : 0);
+	if (kvs_ckpt_reserve(c, need) != 0) {
+		c->status = -ENOMEM;
+		return 1;
+	}
+
+	ent.engine = c->tree;
+	ent.flags = value->expire ? KVS_CKPT_ENT_EXPIRE : 0;
+	ent.key_len = key.len;
+	ent.value_len = value->len;
+	char *p = c->buf + c->len;
+	memcpy(p, &ent, sizeof(ent));
+	memcpy(p + sizeof(ent), key.data, key.len);
+	memcpy(p + sizeof(ent) + key.len, value->data, value->len);
+	if (value->expire) {
+		to_le64(p + sizeof(ent) + key.len + value->len, value->expire);
+	}
+	c->len += need;
+	c->hdr.count[c->tree]++;
+
+	if (c->tree != KVS_ENGINE_HTABLE) {
+		kvs_ckpt_set_cursor(c, key);
+	}
+	if (c->status != 0 || c->len >= KVS_CKPT_BUF_SIZE) {
+		c->paused = true;
+		return 1;
+	}
+	return 0;
+}
+
+// 接着上次的位置攒满一个缓冲区，写下整 4K 的部分，剩下的留到下一次；都遍历完了再写头部
+static void kvs_ckpt_save_next(kvs_ckpt_t *c) {
+	// 上一次写下去的部分不会再改，剩下的挪到前面
+	memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+	c->len -= c->pos;
+	c->pos = 0;
+
+	while (c->tree < KVS_CKPT_TREES && c->len < KVS_CKPT_BUF_SIZE && c->status == 0) {
+		kvs_slice_t cursor = { c->cursor, c->cursor_len };
+		const kvs_slice_t *start = c->has_cursor ? &cursor : NULL;
+		bool done;
+
+		c->paused = false;
+		if (c->tree == KVS_ENGINE_BPTREE) {
+			kvs_bptree_range(c->engine, start, NULL, kvs_ckpt_save_cb, c);
+			done = !c->paused;
+		} else if (c->tree == KVS_ENGINE_RBTREE) {
+			kvs_rbtree_range(c->engine, start, NULL, kvs_ckpt_save_cb, c);
+			done = !c->paused;
+		} else {
+			// 返回 -1 时表重排过，下一轮从头再来
+			done = kvs_htable_walk(c->engine, &c->hcursor, kvs_ckpt_save_cb, c) == 1;
+		}
+		if (done) {
+			c->tree++;
+			c->has_cursor = false;
+		}
+	}
+	if (c->status != 0) {
+		kvs_ckpt_finish(c, c->status);
+		return;
+	}
+
+	bool last = c->tree == KVS_CKPT_TREES;
+	size_t len = last ? c->len : KVS_CKPT_ROUNDDOWN(c->len);
+	size_t write_len = KVS_CKPT_ROUNDUP(len);
+
+	if (KVS_WAL_BLOCK + c->base + write_len > c->slot_size) {
+		SPDK_ERRLOG("Checkpoint does not fit in %" PRIu64 " bytes\n", c->slot_size);
+		kvs_ckpt_finish(c, -ENOSPC);
+		return;
+	}
+
+	// 尾部补零到 4K
+	if (kvs_ckpt_reserve(c, write_len - len) != 0) {
+		kvs_ckpt_finish(c, -ENOMEM);
+		return;
+	}
+	c->crc = spdk_crc32c_update(c->buf, len, c->crc);
+	memset(c->buf + c->len, 0, write_len - len);
+
+	uint64_t off = c->target * c->slot_size + KVS_WAL_BLOCK + c->base;
+	c->pending = 1;
+	int rc = kvs_ckpt_io(c, true, c->buf, off, write_len, kvs_ckpt_save_done);
+	if (rc != 0) {
+		c->status = rc;
+	}
+
+	// 命令执行时缓冲区不能动，剩下的部分等写完再挪
+	c->pos = len;
+	c->base += len;
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_ckpt_save_done(c, &cpl);
+}
+
+// 数据都落盘之后才写头部，头部写完这个槽才生效
+static void kvs_ckpt_save_hdr(kvs_ckpt_t *c) {
+	c->hdr.magic = KVS_CKPT_MAGIC;
+	c->hdr.seq = c->seq + 1;
+	c->hdr.data_len = c->base;
+	c->hdr.data_crc = c->crc;
+	c->hdr.crc = 0;
+	c->hdr.crc = spdk_crc32c_update(&c->hdr, sizeof(c->hdr), 0);
+	c->state = KVS_CKPT_SAVE_HDR;
+
+	memset(c->buf, 0, KVS_WAL_BLOCK);
+	memcpy(c->buf, &c->hdr, sizeof(c->hdr));
+	c->pos = c->len = 0;
+
+	c->pending = 1;
+	int rc = kvs_ckpt_io(c, true, c->buf, c->target * c->slot_size, KVS_WAL_BLOCK, kvs_ckpt_save_done);
+	if (rc != 0) {
+		c->status = rc;
+	}
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_ckpt_save_done(c, &cpl);
+}
+
+int kvs_ckpt_save(kvs_ckpt_t *c, kvs_engine_t *e, const kvs_wal_pos_t *pos, kvs_ckpt_done_fn done, void *arg) {
+	if (c->state != KVS_CKPT_IDLE) {
+		return -EBUSY;
+	}
+
+	memset(&c->hdr, 0, sizeof(c->hdr));
+	c->hdr.wal_lsn = pos->lsn;
+	c->hdr.wal_off = pos->off;
+	c->hdr.wal_crc = pos->crc;
+
+	c->state = KVS_CKPT_SAVE;
+	c->status = 0;
+	c->done = done;
+	c->done_arg = arg;
+	c->engine = e;
+	c->start_tsc = spdk_get_ticks();
+	c->target = c->slot == 0 ? 1 : 0;
+	c->tree = 0;
+	c->has_cursor = false;
+	memset(&c->hcursor, 0, sizeof(c->hcursor));
+	c->pos = c->len = 0;
+	c->base = 0;
+	c->crc = 0;
+	c->poller = SPDK_POLLER_REGISTER(kvs_ckpt_poll, c, 0);
+
+	kvs_ckpt_save_next(c);
+	return 0;
+}
+
+/*
+#############
+load
+#############
+*/
+
+static void kvs_ckpt_load_read(kvs_ckpt_t *c);
+
+// 头部的 magic 和 crc 都对才算有效
+static bool kvs_ckpt_hdr_valid(const char *block, kvs_ckpt_hdr_t *hdr) {
+	memcpy(hdr, block, sizeof(*hdr));
+
+	uint32_t crc = hdr->crc;
+	hdr->crc = 0;
+	bool valid = hdr->magic == KVS_CKPT_MAGIC && spdk_crc32c_update(hdr, sizeof(*hdr), 0) == crc;
+	hdr->crc = crc;
+	return valid;
+}
+
+// 解析 [pos, len) 里完整的项；返回还差的字节数，0 表示数据都解析完了，负数是数据有错
+static ssize_t kvs_ckpt_load_parse(kvs_ckpt_t *c) {
+	kvs_ckpt_ent_t ent;
+
+	while (c->base + c->pos < c->hdr.data_len) {
+		size_t avail = c->len - c->pos;
+		if (c->base + c->pos + sizeof(ent) > c->hdr.data_len) {
+			return -EILSEQ;
+		}
+		if (avail < sizeof(ent)) {
+			return sizeof(ent);
+		}
+		memcpy(&ent, c->buf + c->pos, sizeof(ent));
+
+		size_t need = sizeof(ent) + (size_t)ent.key_len + ent.value_len +
+			(ent.flags & KVS_CKPT_ENT_EXPIRE ? sizeof(uint64_t) : 0);
+		if (ent.engine >= KVS_CKPT_TREES || c->base + c->pos + need > c->hdr.data_len) {
+			return -EILSEQ;
+		}
+		if (avail < need) {
+			return need;
+		}
+
+		char *p = c->buf + c->pos;
+		kvs_slice_t key = { p + sizeof(ent), ent.key_len };
+		kvs_slice_t value = { key.data + key.len, ent.value_len };
+		uint64_t expire = ent.flags & KVS_CKPT_ENT_EXPIRE ? from_le64(value.data + value.len) : 0;
+		if (kvs_bulk_add(c->bulk, ent.engine, key, value, expire) != KVS_OK) {
+			return -EILSEQ;
+		}
+		c->loaded[ent.engine]++;
+		c->crc = spdk_crc32c_update(p, need, c->crc);
+		c->pos += need;
+	}
+	return 0;
+}
+
+static void kvs_ckpt_load_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_ckpt_t *c = arg;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		c->status = -EIO;
+	}
+	if (--c->pending > 0) {
+		return;
+	}
+	if (c->status != 0) {
+		SPDK_ERRLOG("Checkpoint read failed: %d\n", c->status);
+		kvs_ckpt_finish(c, c->status);
+		return;
+	}
+
+	if (c->state == KVS_CKPT_LOAD_HDR) {
+		kvs_ckpt_hdr_t hdr[2];
+		bool valid[2];
+		for (int i = 0; i < 2; i++) {
+			valid[i] = kvs_ckpt_hdr_valid(c->hdr_buf + i * KVS_WAL_BLOCK, &hdr[i]);
+		}
+		spdk_free(c->hdr_buf);
+		c->hdr_buf = NULL;
+
+		c->slot = valid[0] && (!valid[1] || hdr[0].seq > hdr[1].seq) ? 0 : valid[1] ? 1 : -1;
+		if (c->slot < 0) {
+			SPDK_NOTICELOG("No checkpoint found\n");
+			kvs_ckpt_finish(c, 0);
+			return;
+		}
+		c->hdr = hdr[c->slot];
+		c->seq = c->hdr.seq;
+		c->state = KVS_CKPT_LOAD;
+		kvs_ckpt_load_read(c);
+		return;
+	}
+
+	ssize_t need = kvs_ckpt_load_parse(c);
+	if (need < 0) {
+		SPDK_ERRLOG("Checkpoint %" PRIu64 " is corrupted at offset %" PRIu64 "\n", c->seq, c->base + c->pos);
+		kvs_ckpt_finish(c, (int)need);
+		return;
+	}
+	if (need > 0) {
+		// 没解析完的尾巴挪到前面，让接下来读的位置 4K 对齐，放不下时扩容
+		size_t rem = c->len - c->pos;
+		size_t shift = KVS_CKPT_ROUNDUP(rem) - rem;
+
+		memmove(c->buf + shift, c->buf + c->pos, rem);
+		c->base += c->pos;
+		c->base -= shift;
+		c->pos = shift;
+		c->len = shift + rem;
+		if (kvs_ckpt_reserve(c, need + KVS_CKPT_BUF_SIZE) != 0) {
+			kvs_ckpt_finish(c, -ENOMEM);
+			return;
+		}
+		kvs_ckpt_load_read(c);
+		return;
+	}
+
+	if (c->crc != c->hdr.data_crc || memcmp(c->loaded, c->hdr.count, sizeof(c->loaded)) != 0) {
+		SPDK_ERRLOG("Checkpoint %" PRIu64 " failed verification\n", c->seq);
+		kvs_ckpt_finish(c, -EILSEQ);
+		return;
+	}
+
+	kvs_bulk_load(c->bulk, c->engine);
+	SPDK_NOTICELOG("Loaded checkpoint %" PRIu64 ": %" PRIu64 " + %" PRIu64 " + %" PRIu64 " keys, %" PRIu64 " bytes in %" PRIu64 " ms\n",
+		c->seq, c->hdr.count[0], c->hdr.count[1], c->hdr.count[2], c->hdr.data_len,
+		(spdk_get_ticks() - c->start_tsc) * 1000 / spdk_get_ticks_hz());
+	kvs_ckpt_finish(c, 0);
+}
+
+// 从 base + len 开始把缓冲区读满
+static void kvs_ckpt_load_read(kvs_ckpt_t *c) {
+	uint64_t from = c->base + c->len;
+	size_t len = spdk_min(c->size - c->len, KVS_CKPT_ROUNDUP(c->hdr.data_len) - from);
+	uint64_t off = c->slot * c->slot_size + KVS_WAL_BLOCK + from;
+
+	c->pending = 1;
+	int rc = kvs_ckpt_io(c, false, c->buf + c->len, off, len, kvs_ckpt_load_done);
+	if (rc != 0) {
+		c->status = rc;
+	}
+	c->len += len;
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_ckpt_load_done(c, &cpl);
+}
+
+int kvs_ckpt_load(kvs_ckpt_t *c, kvs_engine_t *e, kvs_ckpt_done_fn done, void *arg) {
+	if (c->state != KVS_CKPT_IDLE) {
+		return -EBUSY;
+	}
+
+	c->hdr_buf = spdk_zmalloc(2 * KVS_WAL_BLOCK, KVS_WAL_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+	c->bulk = kvs_bulk_create();
+	if (c->hdr_buf == NULL || c->bulk == NULL) {
+		spdk_free(c->hdr_buf);
+		c->hdr_buf = NULL;
+		kvs_bulk_free(c->bulk);
+		c->bulk = NULL;
+		return -ENOMEM;
+	}
+
+	c->state = KVS_CKPT_LOAD_HDR;
+	c->status = 0;
+	c->done = done;
+	c->done_arg = arg;
+	c->engine = e;
+	c->start_tsc = spdk_get_ticks();
+	c->pos = c->len = 0;
+	c->base = 0;
+	c->crc = 0;
+	memset(c->loaded, 0, sizeof(c->loaded));
+	c->poller = SPDK_POLLER_REGISTER(kvs_ckpt_poll, c, 0);
+
+	c->pending = 1;
+	for (int i = 0; i < 2 && c->status == 0; i++) {
+		int rc = kvs_ckpt_io(c, false, c->hdr_buf + i * KVS_WAL_BLOCK, i * c->slot_size,
+			KVS_WAL_BLOCK, kvs_ckpt_load_done);
+		if (rc != 0) {
+			c->status = rc;
+		}
+	}
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_ckpt_load_done(c, &cpl);
+	return 0;
+}
+
+/*
+#############
+lifecycle
+#############
+*/
+
+bool kvs_ckpt_busy(const kvs_ckpt_t *c) {
+	return c->state != KVS_CKPT_IDLE;
+}
+
+kvs_ckpt_t *kvs_ckpt_create(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns,
+		uint64_t start_lba, uint64_t num_lba) {
+	uint32_t sector_size = spdk_nvme_ns_get_sector_size(ns);
+
+	if (sector_size == 0 || KVS_WAL_BLOCK % sector_size != 0) {
+		SPDK_ERRLOG("Unsupported sector size %u for checkpoint\n", sector_size);
+		return NULL;
+	}
+
+	kvs_ckpt_t *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return NULL;
+	}
+
+	c->ns = ns;
+	c->sector_size = sector_size;
+	c->max_xfer = spdk_nvme_ns_get_max_io_xfer_size(ns) & ~(KVS_WAL_BLOCK - 1);
+	if (c->max_xfer == 0 || c->max_xfer > KVS_CKPT_BUF_SIZE) {
+		c->max_xfer = KVS_CKPT_BUF_SIZE;
+	}
+	c->start_lba = start_lba;
+	c->slot_size = KVS_CKPT_ROUNDDOWN(num_lba * sector_size / 2);
+	c->slot = -1;
+
+	c->size = 2 * KVS_CKPT_BUF_SIZE;
+	c->buf = spdk_zmalloc(c->size, KVS_WAL_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+	c->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, NULL, 0);
+	if (c->buf == NULL || c->qpair == NULL) {
+		SPDK_ERRLOG("Cannot allocate checkpoint buffer or qpair\n");
+		spdk_free(c->buf);
+		if (c->qpair) {
+			spdk_nvme_ctrlr_free_io_qpair(c->qpair);
+		}
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void kvs_ckpt_destroy(kvs_ckpt_t *c) {
+	if (c == NULL) {
+		return;
+	}
+
+	// 只在退出时走到这里，没写头部的 checkpoint 不会生效
+	while (c->pending > 0) {
+		if (spdk_nvme_qpair_process_completions(c->qpair, 0) < 0) {
+			break;
+		}
+	}
+
+	spdk_poller_unregister(&c->poller);
+	if (c->bulk) {
+		kvs_bulk_free(c->bulk);
+	}
+	spdk_free(c->hdr_buf);
+	spdk_free(c->buf);
+	free(c->cursor);
+	spdk_nvme_ctrlr_free_io_qpair(c->qpair);
+	free(c);
+}
@@ -0,0 +1,78 @@
+#ifndef KVS_CKPT_H
+#define KVS_CKPT_H
+
+#include "spdk/stdinc.h"
+#include "spdk/nvme.h"
+
+#include "kv_engine.h"
+#include "kvs_wal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+checkpoint
+#############
+
+每个 shard 在 namespace 上有两个 checkpoint 槽，轮流写，头部最后写，写完头部才算生效，
+写到一半挂掉时另一个槽还是完整的。一个槽是 4K 的头部加上连续的数据：
+先是 B+ 树的全部键值对，再是红黑树的，各自按 key 升序，启动时可以直接自底向上建树；最后是哈希表的，没有顺序。
+
+写 checkpoint 时不停写：从上一个 key 之后接着遍历，每次攒满一个缓冲区写一次，
+中间的修改可能有一部分被带进来。WAL 里只记 PUT/DEL/EXPIRE 这样的最终结果，重放是幂等的，
+从 checkpoint 开始时的位置重放一遍，结果和没有 checkpoint 时一样。
+哈希表按槽的位置接着遍历，两次之间表重排过就从头再来一遍，同一个 key 可能写进去两次，加载时后面的生效
+*/
+
+#define KVS_CKPT_MAGIC			0x504b434bu		// "KCKP"
+#define KVS_CKPT_BUF_SIZE		(1024 * 1024)	// 攒够这么多写一次
+#define KVS_CKPT_TREES			3				// B+ 树、红黑树、哈希表，顺序和 kvs_engine_type_t 一样
+
+typedef struct kvs_ckpt_hdr_s {
+	uint32_t magic;
+	uint32_t crc;			// 整个头部的 crc32c，计算时这个字段为 0
+	uint64_t seq;			// 每次加一，两个槽里大的是最新的
+	uint64_t wal_lsn;		// checkpoint 开始时 WAL 的位置，重放从这里开始
+	uint64_t wal_off;
+	uint32_t wal_crc;
+	uint32_t reserved;
+	uint64_t count[KVS_CKPT_TREES];	// 各自写了多少项，哈希表的可能有重复
+	uint64_t data_len;
+	uint32_t data_crc;
+	uint32_t reserved2;
+} __attribute__((packed)) kvs_ckpt_hdr_t;
+
+#define KVS_CKPT_ENT_EXPIRE		0x1		// value 后面跟着 le64 的过期时间
+
+typedef struct kvs_ckpt_ent_s {
+	uint8_t engine;			// kvs_engine_type_t
+	uint8_t flags;
+	uint8_t reserved[2];
+	uint32_t key_len;
+	uint32_t value_len;
+} __attribute__((packed)) kvs_ckpt_ent_t;
+
+typedef struct kvs_ckpt_s kvs_ckpt_t;
+
+// load 完成时 pos 是 WAL 重放的起点，没有 checkpoint 时为 NULL；save 完成时是这次 checkpoint 开始时的位置
+typedef void (*kvs_ckpt_done_fn)(void *arg, int rc, const kvs_wal_pos_t *pos);
+
+// 在 shard 线程上调用，两个槽占 [start_lba, start_lba + num_lba)
+kvs_ckpt_t *kvs_ckpt_create(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns,
+	uint64_t start_lba, uint64_t num_lba);
+// 等在读写的命令完成后释放，没写完的 checkpoint 丢弃
+void kvs_ckpt_destroy(kvs_ckpt_t *c);
+
+// 读最新的 checkpoint，替换 engine 的内容
+int kvs_ckpt_load(kvs_ckpt_t *c, kvs_engine_t *e, kvs_ckpt_done_fn done, void *arg);
+// 把 engine 写到另一个槽，pos 是 kvs_wal_mark 拿到的位置
+int kvs_ckpt_save(kvs_ckpt_t *c, kvs_engine_t *e, const kvs_wal_pos_t *pos, kvs_ckpt_done_fn done, void *arg);
+bool kvs_ckpt_busy(const kvs_ckpt_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "kvs_frame.h"
+
+/*
+#############
+simd scan
+#############
+*/
+
+const char *kvs_scan_byte(const char *p, const char *end, char c) {
+#if defined(__AVX2__)
+    const __m256i needle32 = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i needle16 = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    // 不足一个向量的尾部
+    while (p < end && *p != c) {
+        p++;
+    }
+    return p;
+}
+
+/*
+#############
+recv buffer
+#############
+*/
+
+int kvs_rbuf_init(kvs_rbuf_t *b, size_t size) {
+    if (!b) return -1;
+
+    b->data = (char *)malloc(size);
+    if (!b->data) return -1;
+    b->size = size;
+    b->head = b->tail = b->scan = 0;
+    return 0;
+}
+
+void kvs_rbuf_free(kvs_rbuf_t *b) {
+    if (!b) return;
+    free(b->data);
+    b->data = NULL;
+    b->size = b->head = b->tail = b->scan = 0;
+}
+
+char *kvs_rbuf_reserve(kvs_rbuf_t *b, size_t *avail) {
+    if (b->size - b->tail < KVS_RBUF_MIN_READ) {
+        size_t pending = b->tail - b->head;
+
+        // 先把未解析的尾巴挪到开头
+        if (b->head > 0) {
+            memmove(b->data, b->data + b->head, pending);
+            b->scan -= b->head;
+            b->head = 0;
+            b->tail = pending;
+        }
+
+        // 一条命令比整个缓冲区还大，扩容
+        if (b->size - b->tail < KVS_RBUF_MIN_READ) {
+            size_t size = b->size * 2;
+            if (size > KVS_RBUF_MAX_SIZE) {
+                return NULL;
+            }
+            char *data = (char *)realloc(b->data, size);
+            if (!data) {
+                return NULL;
+            }
+            b->data = data;
+            b->size = size;
+        }
+    }
+
+    *avail = b->size - b->tail;
+    return b->data + b->tail;
+}
+
+void kvs_rbuf_commit(kvs_rbuf_t *b, size_t n) {
+    b->tail += n;
+}
+
+void kvs_rbuf_consume(kvs_rbuf_t *b, size_t n) {
+    b->head += n;
+    if (b->scan < b->head) {
+        b->scan = b->head;
+    }
+    if (b->head == b->tail) {
+        b->head = b->tail = b->scan = 0;
+    }
+}
+
+const char *kvs_rbuf_peek(const kvs_rbuf_t *b, size_t *len) {
+    *len = b->tail - b->head;
+    return *len > 0 ? b->data + b->head : NULL;
+}
+
+int kvs_rbuf_next_line(kvs_rbuf_t *b, const char **line, size_t *len) {
+    const char *start = b->data + b->head;
+    const char *end = b->data + b->tail;
+    const char *eol = kvs_scan_byte(b->data + b->scan, end, '\n');
+
+    if (eol == end) {
+        // 不完整，下次从这里继续扫
+        b->scan = b->tail;
+        return 0;
+    }
+
+    size_t n = eol - start;
+    *line = start;
+    *len = (n > 0 && start[n - 1] == '\r') ? n - 1 : n;
+
+    kvs_rbuf_consume(b, n + 1);
+    return 1;
+}
+
+/*
+#############
+send buffer
+#############
+*/
+
+int kvs_wbuf_init(kvs_wbuf_t *b, size_t size) {
+    if (!b) return -1;
+
+    memset(b, 0, sizeof(*b));
+    b->data = (char *)malloc(size);
+    if (!b->data) return -1;
+    b->size = size;
+    return 0;
+}
+
+void kvs_wbuf_free(kvs_wbuf_t *b) {
+    if (!b) return;
+    kvs_wbuf_reset(b);
+    free(b->data);
+    free(b->segs);
+    memset(b, 0, sizeof(*b));
+}
+
+void kvs_wbuf_reset(kvs_wbuf_t *b) {
+    for (int i = 0; i < b->nsegs; i++) {
+        kvs_value_put(b->segs[i].ref);
+    }
+    b->nsegs = 0;
+    b->len = 0;
+    b->bytes = 0;
+}
+
+int kvs_wbuf_append(kvs_wbuf_t *b, const void *data, size_t len) {
+    if (b->size - b->len < len) {
+        size_t size = b->size;
+        while (size - b->len < len) {
+            size *= 2;
+        }
+        char *p = (char *)realloc(b->data, size);
+        if (!p) return -1;
+        b->data = p;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->bytes += len;
+    return 0;
+}
+
+int kvs_wbuf_append_ref(kvs_wbuf_t *b, kvs_value_t *v) {
+    if (v->len == 0) {
+        return 0;
+    }
+    if (b->nsegs == b->segs_size) {
+        int size = b->segs_size ? b->segs_size * 2 : 16;
+        kvs_wseg_t *segs = (kvs_wseg_t *)realloc(b->segs, size * sizeof(*segs));
+        if (!segs) return -1;
+        b->segs = segs;
+        b->segs_size = size;
+    }
+
+    kvs_value_get(v);
+    b->segs[b->nsegs].off = b->len;
+    b->segs[b->nsegs].ref = v;
+    b->nsegs++;
+    b->bytes += v->len;
+    return 0;
+}
+
+int kvs_wbuf_to_iov(const kvs_wbuf_t *b, struct iovec *iov) {
+    size_t off = 0;
+    int n = 0;
+
+    for (int i = 0; i < b->nsegs; i++) {
+        const kvs_wseg_t *seg = &b->segs[i];
+        if (seg->off > off) {
+            iov[n].iov_base = b->data + off;
+            iov[n].iov_len = seg->off - off;
+            n++;
+            off = seg->off;
+        }
+        iov[n].iov_base = seg->ref->data;
+        iov[n].iov_len = seg->ref->len;
+        n++;
+    }
+    if (b->len > off) {
+        iov[n].iov_base = b->data + off;
+        iov[n].iov_len = b->len - off;
+        n++;
+    }
+    return n;
+}
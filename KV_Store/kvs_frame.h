@@ -0,0 +1,88 @@
+#ifndef KVS_FRAME_H
+#define KVS_FRAME_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "kv_engine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KVS_RBUF_INIT_SIZE      0x1000
+#define KVS_RBUF_MIN_READ       0x400
+#define KVS_RBUF_MAX_SIZE       (64 << 20)  // 单条命令最大 64MB
+
+#define KVS_WBUF_INIT_SIZE      0x1000
+
+// 每个连接一个接收缓冲区
+// [head, tail) 是收到但还没解析的数据，命令跨越多次 recv 时留在这里等下一次
+// 空间不够时先把未解析部分挪到开头，还不够再成倍扩容，保证一条命令在内存里是连续的
+typedef struct kvs_rbuf_s {
+    char *data;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t scan;    // [head, scan) 已经扫描过，没有换行符
+} kvs_rbuf_t;
+
+// value 的引用插在 data[off] 之前
+typedef struct kvs_wseg_s {
+    size_t off;
+    kvs_value_t *ref;
+} kvs_wseg_t;
+
+// 每次 poll 产生的所有回复先攒在这里，最后一次性写出
+// 协议头、短回复拷贝进 data，GET 的 value 只记引用，发送时和 data 交错成 iovec
+typedef struct kvs_wbuf_s {
+    char *data;
+    size_t size;
+    size_t len;
+
+    kvs_wseg_t *segs;
+    int nsegs;
+    int segs_size;
+    size_t bytes;   // data 加上所有 value 的总长度
+} kvs_wbuf_t;
+
+int kvs_rbuf_init(kvs_rbuf_t *b, size_t size);
+void kvs_rbuf_free(kvs_rbuf_t *b);
+// 返回可写位置，avail 至少为 KVS_RBUF_MIN_READ；超过 KVS_RBUF_MAX_SIZE 返回 NULL
+char *kvs_rbuf_reserve(kvs_rbuf_t *b, size_t *avail);
+void kvs_rbuf_commit(kvs_rbuf_t *b, size_t n);
+void kvs_rbuf_consume(kvs_rbuf_t *b, size_t n);
+// 返回未解析数据的起始位置，没有数据返回 NULL
+const char *kvs_rbuf_peek(const kvs_rbuf_t *b, size_t *len);
+// 取出下一条以 '\n' 结尾的完整命令（不含 "\r\n"），返回 1；数据不完整返回 0
+int kvs_rbuf_next_line(kvs_rbuf_t *b, const char **line, size_t *len);
+
+int kvs_wbuf_init(kvs_wbuf_t *b, size_t size);
+void kvs_wbuf_free(kvs_wbuf_t *b);
+int kvs_wbuf_append(kvs_wbuf_t *b, const void *data, size_t len);
+// 追加 value 的引用，不拷贝；wbuf 持有自己的一个引用，reset 时释放
+int kvs_wbuf_append_ref(kvs_wbuf_t *b, kvs_value_t *v);
+// 释放 value 引用并清空，保留已分配的内存
+void kvs_wbuf_reset(kvs_wbuf_t *b);
+
+static inline bool kvs_wbuf_empty(const kvs_wbuf_t *b) {
+    return b->bytes == 0;
+}
+
+// 生成 iovec 需要的最大个数
+static inline int kvs_wbuf_iovcnt(const kvs_wbuf_t *b) {
+    return 2 * b->nsegs + 1;
+}
+
+// 按顺序填充 iovec，返回实际个数
+int kvs_wbuf_to_iov(const kvs_wbuf_t *b, struct iovec *iov);
+
+// 在 [p, end) 中查找字节 c，使用 AVX2/SSE2 一次比较 32/16 字节，找不到返回 end
+const char *kvs_scan_byte(const char *p, const char *end, char c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,692 @@
+// accept4
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "spdk/stdinc.h"
+#include "spdk/log.h"
+#include "spdk/string.h"
+
+#include <poll.h>
+#include <sys/un.h>
+
+#include "kvs_handoff.h"
+#include "kvs_region.h"
+
+#define KVS_JOURNAL_MAGIC		0x4e524a4bu			// "KJRN"
+#define KVS_JOURNAL_CHUNK		KV_PAGE_SIZE		// 日志每次至少加这么多
+#define KVS_JOURNAL_REC_SIZE(klen)	((sizeof(kvs_journal_rec_t) + (klen) + 7) & ~(size_t)7)
+
+/*
+#############
+socket
+#############
+*/
+
+static int kvs_handoff_addr(struct sockaddr_un *addr, const char *path) {
+	size_t len = strlen(path);
+
+	if (len >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len);
+	return 0;
+}
+
+void kvs_handoff_set_timeout(int fd, int sec) {
+	struct timeval tv = { .tv_sec = sec };
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int kvs_handoff_listen(const char *path) {
+	struct sockaddr_un addr;
+
+	if (kvs_handoff_addr(&addr, path) < 0) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int kvs_handoff_accept(int lfd) {
+	int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd >= 0) {
+		kvs_handoff_set_timeout(fd, KVS_HANDOFF_TIMEOUT_S);
+	}
+	return fd;
+}
+
+int kvs_handoff_connect(const char *path) {
+	struct sockaddr_un addr;
+
+	if (kvs_handoff_addr(&addr, path) < 0) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	kvs_handoff_set_timeout(fd, KVS_HANDOFF_TIMEOUT_S);
+	return fd;
+}
+
+// 写完 iov 里的所有数据，会修改 iov；control 里的 fd 跟着第一次 sendmsg 走
+static int kvs_handoff_writev(int fd, struct iovec *iov, int iovcnt, void *control, size_t controllen) {
+	while (iovcnt > 0) {
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt,
+			.msg_control = control, .msg_controllen = controllen };
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		control = NULL;
+		controllen = 0;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int kvs_handoff_read(int fd, void *buf, size_t len) {
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) {
+				errno = ECONNRESET;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int kvs_handoff_send(int fd, kvs_handoff_type_t type, uint64_t arg, uint64_t arg2,
+	const void *data, uint32_t len, const int *fds, int nfds) {
+	kvs_handoff_msg_t m = { .magic = KVS_HANDOFF_MAGIC, .version = KVS_HANDOFF_VERSION, .type = type,
+		.arg = arg, .arg2 = arg2, .len = len };
+	struct iovec iov[2] = {
+		{ .iov_base = &m, .iov_len = sizeof(m) },
+		{ .iov_base = (void *)data, .iov_len = len },
+	};
+	char cbuf[CMSG_SPACE(sizeof(int) * KVS_HANDOFF_MAX_FDS)] = {0};
+	size_t controllen = 0;
+
+	assert(nfds <= KVS_HANDOFF_MAX_FDS);
+	if (nfds > 0) {
+		struct msghdr msg = { .msg_control = cbuf, .msg_controllen = CMSG_SPACE(sizeof(int) * nfds) };
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+		controllen = msg.msg_controllen;
+	}
+	return kvs_handoff_writev(fd, iov, len > 0 ? 2 : 1, nfds > 0 ? cbuf : NULL, controllen);
+}
+
+int kvs_handoff_recv(int fd, int type, kvs_handoff_msg_t *out, void **data, int *fds, int *nfds) {
+	kvs_handoff_msg_t m;
+	struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+	char cbuf[CMSG_SPACE(sizeof(int) * KVS_HANDOFF_MAX_FDS)];
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+
+	ssize_t n;
+	do {
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+
+	// 带过来的 fd 先收下，消息不对时也要关掉
+	int got = 0;
+	int tmp[KVS_HANDOFF_MAX_FDS];
+	struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(tmp, CMSG_DATA(cmsg), sizeof(int) * got);
+	}
+
+	void *buf = NULL;
+	bool ok = n == sizeof(m) && m.magic == KVS_HANDOFF_MAGIC && m.version == KVS_HANDOFF_VERSION &&
+		(type == 0 || m.type == type || m.type == KVS_HANDOFF_REJECT) && !(msg.msg_flags & MSG_CTRUNC) &&
+		(fds != NULL || got == 0) && m.len <= KVS_HANDOFF_MAX_LEN && (data != NULL || m.len == 0);
+	if (ok && m.len > 0) {
+		buf = malloc(m.len);
+		if (buf == NULL || kvs_handoff_read(fd, buf, m.len) < 0) {
+			int err = buf ? errno : ENOMEM;
+			free(buf);
+			for (int i = 0; i < got; i++) {
+				close(tmp[i]);
+			}
+			errno = err;
+			return -1;
+		}
+	}
+	if (!ok || m.type == KVS_HANDOFF_REJECT) {
+		for (int i = 0; i < got; i++) {
+			close(tmp[i]);
+		}
+		free(buf);
+		if (ok) {
+			errno = m.arg ? (int)m.arg : EPROTO;
+		} else if (n >= 0) {
+			errno = n == 0 ? ECONNRESET : EPROTO;
+		}
+		return -1;
+	}
+
+	if (out) {
+		*out = m;
+	}
+	if (data) {
+		*data = buf;
+	}
+	if (fds) {
+		memcpy(fds, tmp, sizeof(int) * got);
+		*nfds = got;
+	}
+	return 0;
+}
+
+bool kvs_handoff_readable(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+int kvs_handoff_wait_close(int fd) {
+	char buf[256];
+
+	shutdown(fd, SHUT_WR);
+	kvs_handoff_set_timeout(fd, KVS_HANDOFF_TIMEOUT_S);
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n == 0 || (n < 0 && errno == ECONNRESET)) {
+			return 0;
+		}
+		if (n < 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+/*
+#############
+layout
+#############
+*/
+
+uint64_t kvs_handoff_layout(void) {
+	kv_slab_class_stats_t st[KV_SLAB_MAX_CLASSES];
+	uint64_t v[32 + KV_SLAB_MAX_CLASSES];
+	int n = 0;
+
+	v[n++] = KVS_HANDOFF_VERSION;
+	v[n++] = KVS_REGION_VERSION;
+	v[n++] = KVS_REGION_BASE;
+	v[n++] = KVS_REGION_RESERVE;
+	v[n++] = KV_PAGE_SIZE;
+	v[n++] = sizeof(slab_page_t);
+	v[n++] = offsetof(slab_page_t, slab);
+	v[n++] = offsetof(slab_page_t, free_list);
+	v[n++] = offsetof(slab_page_t, unused);
+	v[n++] = offsetof(slab_page_t, used);
+	v[n++] = offsetof(slab_page_t, total);
+	v[n++] = offsetof(slab_page_t, size);
+	v[n++] = offsetof(slab_page_t, block_size);
+	v[n++] = offsetof(slab_page_t, owner);
+	v[n++] = sizeof(kvs_value_t);
+	v[n++] = offsetof(kvs_value_t, refcnt);
+	v[n++] = offsetof(kvs_value_t, len);
+	v[n++] = offsetof(kvs_value_t, expire);
+	v[n++] = offsetof(kvs_value_t, home);
+	v[n++] = offsetof(kvs_value_t, flags);
+	v[n++] = offsetof(kvs_value_t, data);
+	v[n++] = sizeof(kvs_journal_rec_t);
+	v[n++] = sizeof(kvs_journal_chunk_t);
+	v[n++] = sizeof(kvs_journal_dir_t);
+
+	int nclasses = kv_slab_get_stats(st, KV_SLAB_MAX_CLASSES);
+	for (int i = 0; i < nclasses; i++) {
+		v[n++] = st[i].size;
+	}
+	return kvs_hash(v, n * sizeof(v[0]));
+}
+
+/*
+#############
+journal
+#############
+*/
+
+struct kvs_journal_s {
+	kvs_journal_dir_t *dir;
+	kvs_shard_t *shard;
+	kvs_journal_chunk_t *tail;
+	int status;
+
+	// 遍历到哪了：phase 是正在遍历的 kvs_engine_type_t，有序的索引从 resume 之后接着，哈希表从 cursor 接着
+	int phase;
+	bool synced;
+	bool resumed;
+	char *resume;
+	size_t resume_len;
+	size_t resume_size;
+	kvs_htable_cursor_t cursor;
+	int budget;			// 这一轮还能记多少个 key
+};
+
+static kvs_journal_chunk_t *kvs_journal_chunk_new(size_t need) {
+	// 别的记录都给 END 留出位置，END 不会因为分配不到而写不进去
+	size_t size = sizeof(kvs_journal_chunk_t) + need + sizeof(kvs_journal_rec_t);
+	if (size < KVS_JOURNAL_CHUNK) {
+		size = KVS_JOURNAL_CHUNK;
+	}
+	size = (size + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE * KV_PAGE_SIZE;
+
+	kvs_journal_chunk_t *c = kvs_region_alloc(size, KVS_REGION_RAW);
+	if (c == NULL) {
+		return NULL;
+	}
+	c->next = NULL;
+	c->len = 0;
+	c->size = size - sizeof(*c);
+	c->consumed = 0;
+	return c;
+}
+
+// 放掉一块里 PUT 持有的引用，块还给共享内存
+static void kvs_journal_chunk_free(kvs_journal_chunk_t *c) {
+	for (uint64_t pos = 0; pos < c->len; ) {
+		kvs_journal_rec_t *rec = (kvs_journal_rec_t *)(c->data + pos);
+		if (rec->type == KVS_JOURNAL_PUT) {
+			kvs_value_put(rec->value);
+		}
+		pos += KVS_JOURNAL_REC_SIZE(rec->key_len);
+	}
+	kvs_region_free(c);
+}
+
+kvs_journal_dir_t *kvs_journal_dir_create(int nshards) {
+	kvs_journal_dir_t *dir = kvs_region_alloc(sizeof(*dir), KVS_REGION_RAW);
+
+	if (dir == NULL) {
+		return NULL;
+	}
+	memset(dir, 0, sizeof(*dir));
+	dir->magic = KVS_JOURNAL_MAGIC;
+	dir->nshards = nshards;
+	return dir;
+}
+
+kvs_journal_t *kvs_journal_open(kvs_journal_dir_t *dir, kvs_shard_t *shard) {
+	kvs_journal_t *j = calloc(1, sizeof(*j));
+
+	if (j == NULL) {
+		return NULL;
+	}
+	j->tail = kvs_journal_chunk_new(0);
+	if (j->tail == NULL) {
+		free(j);
+		return NULL;
+	}
+	j->dir = dir;
+	j->shard = shard;
+	j->phase = KVS_ENGINE_BPTREE;
+	__atomic_store_n(&dir->head[shard->index], j->tail, __ATOMIC_RELEASE);
+	return j;
+}
+
+static int kvs_journal_append(kvs_journal_t *j, uint8_t engine, uint8_t type, kvs_slice_t key, kvs_value_t *value) {
+	size_t need = KVS_JOURNAL_REC_SIZE(key.len);
+	kvs_journal_chunk_t *c = j->tail;
+	size_t room = type == KVS_JOURNAL_END ? need : need + sizeof(kvs_journal_rec_t);
+
+	if (c->len + room > c->size) {
+		kvs_journal_chunk_t *n = kvs_journal_chunk_new(need);
+		if (n == NULL) {
+			return -ENOMEM;
+		}
+		// 写了 next 之后这一块不再动，读的一方读完它就可以走
+		__atomic_store_n(&c->next, n, __ATOMIC_RELEASE);
+		j->tail = c = n;
+	}
+
+	kvs_journal_rec_t *rec = (kvs_journal_rec_t *)(c->data + c->len);
+	rec->engine = engine;
+	rec->type = type;
+	rec->reserved = 0;
+	rec->key_len = key.len;
+	rec->value = value;
+	if (key.len) {
+		memcpy(rec + 1, key.data, key.len);
+	}
+	__atomic_store_n(&c->len, c->len + need, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// value 的引用交给日志，记不下时放掉
+static void kvs_journal_record(kvs_journal_t *j, uint8_t engine, uint8_t type, kvs_slice_t key, kvs_value_t *value) {
+	int rc = j->status;
+
+	// 共享内存外面的 value 新进程看不到
+	if (rc == 0 && value && !kvs_region_contains(value)) {
+		rc = -EFAULT;
+	}
+	if (rc == 0) {
+		rc = kvs_journal_append(j, engine, type, key, value);
+	}
+	if (rc != 0) {
+		if (j->status == 0) {
+			SPDK_ERRLOG("Cannot journal shard %d for hot restart: %s\n", j->shard->index, spdk_strerror(-rc));
+		}
+		j->status = rc;
+		if (value) {
+			kvs_value_put(value);
+		}
+	}
+}
+
+// 写完之后 key 是什么样就记什么样，不管这个写成没成
+static void kvs_journal_key(kvs_journal_t *j, kvs_op_t *op) {
+	kvs_engine_t *e = j->shard->engine;
+	kvs_value_t *value = NULL;
+	int rc = KVS_ERROR;
+
+	switch (op->engine) {
+		case KVS_ENGINE_BPTREE: rc = kvs_bptree_get(e, op->key, &value); break;
+		case KVS_ENGINE_RBTREE: rc = kvs_rbtree_get(e, op->key, &value); break;
+		case KVS_ENGINE_HTABLE: rc = kvs_htable_get(e, op->key, &value); break;
+		case KVS_ENGINE_SKIPLIST: rc = kvs_slist_get(g_slist, op->key, &value); break;
+	}
+	if (rc == KVS_OK) {
+		kvs_journal_record(j, op->engine, KVS_JOURNAL_PUT, op->key, value);
+	} else {
+		kvs_journal_record(j, op->engine, KVS_JOURNAL_DEL, op->key, NULL);
+	}
+}
+
+void kvs_journal_op(kvs_journal_t *j, kvs_op_t *op) {
+	if (op->type == KVS_OP_BATCH) {
+		for (uint32_t i = 0; i < op->count; i++) {
+			if (kvs_op_is_write(op->batch[i])) {
+				kvs_journal_key(j, op->batch[i]);
+			}
+		}
+	} else if (kvs_op_is_write(op)) {
+		kvs_journal_key(j, op);
+	}
+}
+
+// 老进程还是 owner：新进程读完的块马上还回去，日志只占还没读的那一段
+static void kvs_journal_reclaim(kvs_journal_t *j) {
+	kvs_journal_chunk_t **head = &j->dir->head[j->shard->index];
+	kvs_journal_chunk_t *c;
+
+	while ((c = *head) != NULL && c != j->tail && __atomic_load_n(&c->consumed, __ATOMIC_ACQUIRE)) {
+		*head = c->next;
+		kvs_journal_chunk_free(c);
+	}
+}
+
+static int kvs_journal_snap_cb(void *arg, kvs_slice_t key, kvs_value_t *value) {
+	kvs_journal_t *j = arg;
+
+	if (j->resumed && key.len == j->resume_len && memcmp(key.data, j->resume, key.len) == 0) {
+		return 0;
+	}
+	kvs_value_get(value);
+	kvs_journal_record(j, (uint8_t)j->phase, KVS_JOURNAL_PUT, key, value);
+	if (j->status != 0) {
+		return 1;
+	}
+	if (--j->budget > 0) {
+		return 0;
+	}
+	// 哈希表的位置记在 cursor 里
+	if (j->phase == KVS_ENGINE_HTABLE) {
+		return 1;
+	}
+
+	// 有序的索引下次从这个 key 接着，它自己跳过
+	if (key.len > j->resume_size) {
+		char *buf = realloc(j->resume, key.len);
+		if (buf == NULL) {
+			j->status = -ENOMEM;
+			return 1;
+		}
+		j->resume = buf;
+		j->resume_size = key.len;
+	}
+	memcpy(j->resume, key.data, key.len);
+	j->resume_len = key.len;
+	j->resumed = true;
+	return 1;
+}
+
+int kvs_journal_snapshot(kvs_journal_t *j, int budget, bool slist) {
+	kvs_engine_t *e = j->shard->engine;
+
+	kvs_journal_reclaim(j);
+	if (j->status != 0 || j->synced) {
+		return j->status != 0 ? j->status : 1;
+	}
+
+	j->budget = budget;
+	while (j->budget > 0 && j->phase <= KVS_ENGINE_SKIPLIST && j->status == 0) {
+		kvs_slice_t resume = { j->resume, j->resume_len };
+		const kvs_slice_t *start = j->resumed ? &resume : NULL;
+		bool done = false;
+
+		switch (j->phase) {
+			case KVS_ENGINE_BPTREE:
+				kvs_bptree_range(e, start, NULL, kvs_journal_snap_cb, j);
+				break;
+			case KVS_ENGINE_RBTREE:
+				kvs_rbtree_range(e, start, NULL, kvs_journal_snap_cb, j);
+				break;
+			case KVS_ENGINE_HTABLE:
+				// 表重排过从头再来，记重了的 key 装两遍，结果一样
+				done = kvs_htable_walk(e, &j->cursor, kvs_journal_snap_cb, j) == 1;
+				break;
+			case KVS_ENGINE_SKIPLIST:
+				if (slist) {
+					kvs_slist_range(g_slist, start, NULL, kvs_journal_snap_cb, j);
+				}
+				break;
+		}
+		// 有序的遍历没用完额度就是走到头了
+		if (j->phase != KVS_ENGINE_HTABLE) {
+			done = j->budget > 0;
+		}
+		if (done) {
+			j->phase++;
+			j->resumed = false;
+		}
+	}
+
+	if (j->status == 0 && j->phase > KVS_ENGINE_SKIPLIST) {
+		kvs_slice_t none = { NULL, 0 };
+		kvs_journal_record(j, 0, KVS_JOURNAL_SYNCED, none, NULL);
+		j->synced = j->status == 0;
+	}
+	if (j->status != 0) {
+		return j->status;
+	}
+	return j->synced ? 1 : 0;
+}
+
+int kvs_journal_end(kvs_journal_t *j) {
+	kvs_slice_t none = { NULL, 0 };
+
+	// 每一块都给 END 留了位置
+	if (kvs_journal_append(j, 0, KVS_JOURNAL_END, none, NULL) != 0 && j->status == 0) {
+		j->status = -ENOMEM;
+	}
+	return j->status;
+}
+
+void kvs_journal_close(kvs_journal_t *j) {
+	if (j == NULL) {
+		return;
+	}
+	free(j->resume);
+	free(j);
+}
+
+void kvs_journal_dir_free(kvs_journal_dir_t *dir) {
+	if (dir == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < dir->nshards && i < KVS_MAX_SHARDS; i++) {
+		kvs_journal_chunk_t *c = dir->head[i];
+		while (c) {
+			kvs_journal_chunk_t *next = c->next;
+			kvs_journal_chunk_free(c);
+			c = next;
+		}
+	}
+	kvs_region_free(dir);
+}
+
+/*
+#############
+replay
+#############
+*/
+
+struct kvs_replay_s {
+	kvs_shard_t *shard;
+	kvs_journal_chunk_t *chunk;
+	uint64_t pos;
+	int state;			// 读到的最后一个 SYNCED 或 END
+};
+
+kvs_replay_t *kvs_replay_open(kvs_journal_dir_t *dir, kvs_shard_t *shard) {
+	if (!kvs_region_contains(dir) || dir->magic != KVS_JOURNAL_MAGIC || dir->nshards != (uint32_t)g_nshards) {
+		return NULL;
+	}
+	kvs_journal_chunk_t *head = __atomic_load_n(&dir->head[shard->index], __ATOMIC_ACQUIRE);
+	if (!kvs_region_contains(head)) {
+		return NULL;
+	}
+
+	kvs_replay_t *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->shard = shard;
+	r->chunk = head;
+	return r;
+}
+
+static int kvs_replay_apply(kvs_replay_t *r, const kvs_journal_rec_t *rec) {
+	kvs_slice_t key = { (const char *)(rec + 1), rec->key_len };
+	int rc = KVS_OK;
+
+	switch (rec->type) {
+		case KVS_JOURNAL_PUT:
+			if (rec->engine > KVS_ENGINE_SKIPLIST || !kvs_region_contains(rec->value)) {
+				return -EPROTO;
+			}
+			if (rec->engine == KVS_ENGINE_SKIPLIST) {
+				rc = kvs_slist_adopt(g_slist, key, rec->value);
+			} else {
+				rc = kvs_engine_adopt(r->shard->engine, rec->engine, key, rec->value);
+			}
+			return rc == KVS_OK ? 0 : -ENOMEM;
+		case KVS_JOURNAL_DEL: {
+			if (rec->engine > KVS_ENGINE_SKIPLIST) {
+				return -EPROTO;
+			}
+			kvs_op_t op = { .engine = rec->engine, .type = KVS_OP_DEL, .key = key };
+			kvs_op_execute(r->shard->engine, &op);
+			return 0;
+		}
+		case KVS_JOURNAL_SYNCED:
+		case KVS_JOURNAL_END:
+			r->state = rec->type;
+			return 0;
+	}
+	return -EPROTO;
+}
+
+int kvs_replay_poll(kvs_replay_t *r, int budget) {
+	while (r->state != KVS_JOURNAL_END && budget > 0) {
+		kvs_journal_chunk_t *c = r->chunk;
+		uint64_t len = __atomic_load_n(&c->len, __ATOMIC_ACQUIRE);
+
+		if (r->pos >= len) {
+			kvs_journal_chunk_t *next = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE);
+			if (next == NULL) {
+				break;
+			}
+			// 设 next 之前写的记录这时一定看得到
+			if (r->pos < __atomic_load_n(&c->len, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			if (!kvs_region_contains(next)) {
+				return -EPROTO;
+			}
+			__atomic_store_n(&c->consumed, 1, __ATOMIC_RELEASE);
+			r->chunk = next;
+			r->pos = 0;
+			continue;
+		}
+
+		const kvs_journal_rec_t *rec = (const kvs_journal_rec_t *)(c->data + r->pos);
+		if (len - r->pos < sizeof(*rec) || rec->key_len > len - r->pos - sizeof(*rec)) {
+			return -EPROTO;
+		}
+		int rc = kvs_replay_apply(r, rec);
+		if (rc < 0) {
+			return rc;
+		}
+		r->pos += KVS_JOURNAL_REC_SIZE(rec->key_len);
+		budget--;
+	}
+	return r->state;
+}
+
+void kvs_replay_close(kvs_replay_t *r) {
+	free(r);
+}
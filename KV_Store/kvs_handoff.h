@@ -0,0 +1,167 @@
+#ifndef KVS_HANDOFF_H
+#define KVS_HANDOFF_H
+
+#include "spdk/stdinc.h"
+
+#include "kv_engine.h"
+#include "kvs_shard.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+hot restart
+#############
+
+新进程接替老进程，不重新从空的开始。两个进程用 -O 指定同一个 Unix socket：
+新进程先去连它，连不上说明没有老进程，照常启动，自己在上面监听，等下一个进程来接替。
+
+value 和 slab 的页放在两个进程映射在同一地址的共享内存里（见 kvs_region.h），一个字节都不拷贝；
+索引是各自地址空间里的 C++ 容器，映射不过去，新进程照着共享内存里的日志自己建一份，只带 key 和 value 的指针：
+
+1. 新进程发 HELLO，带上自己的 shard 数和内存布局的签名；和老进程的不一样时老进程回 REJECT
+2. 老进程给每个 shard 开一份日志，之后这个 shard 上的每个写都把 key 现在的 value（或者已经删掉）记进去；
+   shard 线程每次 poll 再遍历一小段索引，已有的 key 也记一遍，遍历完记 SYNCED。这期间请求照常服务。
+   回 READY，用 SCM_RIGHTS 交过去共享内存和两个 Unix socket，都是自己开的 fd
+3. 新进程映射共享内存，每个 shard 线程上跟着日志往自己的索引里装，所有 shard 都过了 SYNCED 回 CAUGHT_UP
+4. 老进程把已经排队的 TCP 连接 accept 完，关掉 TCP 监听，停止共享内存连接的 accept，回 UNLISTENED
+5. 新进程用 spdk_sock_listen 在同一个端口上监听，先不 accept，新的连接排在内核的队列里
+6. 老进程不再解析新的请求，已经收到的执行完，日志记 END，slab 的页 disown，交出共享内存，回 SEALED。
+   只有这一步不服务，长短和数据量无关
+7. 新进程装到 END，抢到共享内存，接手 slab 的页，回 ACK，开始 accept
+8. 老进程等连接上的回复发完，空闲了就关掉，最多等 KVS_HANDOFF_LINGER_S，然后退出。
+   没解析的请求没有执行过，客户端看到连接断了重连到新进程上再发
+
+连接不在两个进程之间传，一直由 accept 它的进程的 spdk_sock 服务，TCP 监听只在 4 和 5 之间没有人拿着。
+老进程在 SEALED 之前出错时丢掉日志，关掉过监听的话等新进程退出后重新监听，接着服务；
+SEALED 之后等不到 ACK 时和新进程抢共享内存，抢到了照样接着服务，没抢到说明新进程已经接手，照常排空退出
+*/
+
+#define KVS_HANDOFF_MAGIC		0x4f48564bu		// "KVHO"
+#define KVS_HANDOFF_VERSION		2
+#define KVS_HANDOFF_MAX_FDS		3
+#define KVS_HANDOFF_TIMEOUT_S	30				// 每次收发最多等多久
+#define KVS_HANDOFF_LINGER_S	10				// 收到 ACK 之后连接最多等多久，再不空闲就关掉
+#define KVS_HANDOFF_MAX_LEN		(128 << 20)		// 一条消息后面最多带多少数据
+
+typedef enum {
+	KVS_HANDOFF_HELLO = 1,	// 新 -> 老，arg 是 shard 数，arg2 是 kvs_handoff_layout
+	KVS_HANDOFF_REJECT,		// 老 -> 新，arg 是 errno
+	KVS_HANDOFF_READY,		// 老 -> 新，带着 fd（kvs_handoff_fd_t 的顺序），arg 是日志目录的地址，arg2 是新进程的标记
+	KVS_HANDOFF_ACK,		// 新 -> 老，已经接手
+	KVS_HANDOFF_CAUGHT_UP,	// 新 -> 老，所有 shard 都过了 SYNCED
+	KVS_HANDOFF_SEALED,		// 老 -> 新，日志写完了，共享内存已经交出
+	KVS_HANDOFF_UNLISTENED,	// 老 -> 新，TCP 监听已经关掉，新进程可以在这个端口上监听了
+} kvs_handoff_type_t;
+
+typedef enum {
+	KVS_HANDOFF_FD_REGION = 0,
+	KVS_HANDOFF_FD_HANDOFF,		// 等下一个进程的 Unix socket
+	KVS_HANDOFF_FD_SHM,			// 共享内存握手的 Unix socket，没开 -U 时没有
+} kvs_handoff_fd_t;
+
+typedef struct kvs_handoff_msg_s {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	uint64_t arg;
+	uint64_t arg2;
+	uint32_t len;			// 后面跟着的数据的字节数
+	uint32_t reserved;
+} __attribute__((packed)) kvs_handoff_msg_t;
+
+// 非阻塞地监听 path，上面留下的旧 socket 文件先删掉
+int kvs_handoff_listen(const char *path);
+// 没有连接时返回 -1，errno 为 EAGAIN；返回的 fd 是阻塞的，收发超时 KVS_HANDOFF_TIMEOUT_S
+int kvs_handoff_accept(int lfd);
+// 连不上时返回 -1：errno 为 ENOENT 或 ECONNREFUSED 说明没有老进程在监听
+int kvs_handoff_connect(const char *path);
+// 改收发的超时，0 表示一直等
+void kvs_handoff_set_timeout(int fd, int sec);
+
+// data 是消息后面带的 len 字节，可以为 NULL
+int kvs_handoff_send(int fd, kvs_handoff_type_t type, uint64_t arg, uint64_t arg2,
+	const void *data, uint32_t len, const int *fds, int nfds);
+// 收一条 type 类型的消息，type 为 0 时什么类型都收；收到 REJECT 时返回 -1，errno 为对方给的值。
+// 带着数据时 *data 是 malloc 出来的，由调用者释放；data 为 NULL 时不收带数据的消息。fds 可以为 NULL
+int kvs_handoff_recv(int fd, int type, kvs_handoff_msg_t *m, void **data, int *fds, int *nfds);
+// 不阻塞地看一眼：对方关了或者发来了消息返回 true
+bool kvs_handoff_readable(int fd);
+// 关掉自己这一端的写，等对方关闭，最多等 KVS_HANDOFF_TIMEOUT_S；对方关了返回 0
+int kvs_handoff_wait_close(int fd);
+
+// 两个进程能不能共用 value 和 slab 的页：共享内存的地址、页和 value 的布局、slab 的 class 都一样才行
+uint64_t kvs_handoff_layout(void);
+
+/*
+交接日志：每个 shard 一串 chunk，都在共享内存里。老进程在 shard 线程上写，新进程在同号的 shard 线程上读，
+一个写一个读，不加锁：写的一方先写记录再 release 写 len，一块写满了才设 next，之后不再碰这一块。
+读完的块由读的一方标记 consumed，老进程回收
+*/
+
+typedef enum {
+	KVS_JOURNAL_PUT = 1,	// key 现在是 value，日志持有 value 的一个引用
+	KVS_JOURNAL_DEL,		// key 不在了
+	KVS_JOURNAL_SYNCED,		// 遍历完了，之前的记录合起来就是 shard 的全部内容
+	KVS_JOURNAL_END,		// 老进程不会再写
+} kvs_journal_type_t;
+
+// 一条记录，后面跟着 key，整条按 8 字节对齐
+typedef struct kvs_journal_rec_s {
+	uint8_t engine;			// kvs_engine_type_t
+	uint8_t type;			// kvs_journal_type_t
+	uint16_t reserved;
+	uint32_t key_len;
+	kvs_value_t *value;		// PUT
+} kvs_journal_rec_t;
+
+typedef struct kvs_journal_chunk_s {
+	struct kvs_journal_chunk_s *next;
+	uint64_t len;			// data 里写了多少字节
+	uint64_t size;
+	uint32_t consumed;
+	uint32_t reserved;
+	char data[];
+} kvs_journal_chunk_t;
+
+// 共享内存里的一页，READY 把它的地址交给新进程
+typedef struct kvs_journal_dir_s {
+	uint32_t magic;
+	uint32_t nshards;
+	kvs_journal_chunk_t *head[KVS_MAX_SHARDS];	// 还没回收的第一块
+} kvs_journal_dir_t;
+
+// 老进程这一侧，在共享内存的 owner 上调用
+typedef struct kvs_journal_s kvs_journal_t;
+
+kvs_journal_dir_t *kvs_journal_dir_create(int nshards);
+// 在 shard 线程上调用；之后把返回值挂到 shard->journal 上，kvs_op_track 就会记下每个写
+kvs_journal_t *kvs_journal_open(kvs_journal_dir_t *dir, kvs_shard_t *shard);
+// kvs_op_track 调用：op 是刚在 shard 上执行完的，写过的 key 记下现在的 value
+void kvs_journal_op(kvs_journal_t *j, kvs_op_t *op);
+// 接着遍历最多 budget 个 key（slist 为 true 时最后还有跳表），顺带回收读完的块。
+// 遍历完（SYNCED 已经写进去）返回 1，还没完返回 0，出过错返回负的 errno
+int kvs_journal_snapshot(kvs_journal_t *j, int budget, bool slist);
+// 写 END，返回之前有没有出过错，出过错时新进程装的不全
+int kvs_journal_end(kvs_journal_t *j);
+// 只释放本进程这边的状态，日志留在共享内存里
+void kvs_journal_close(kvs_journal_t *j);
+// owner 上调用，这时已经没有人读写：放掉所有记录里的引用，日志和目录还给共享内存
+void kvs_journal_dir_free(kvs_journal_dir_t *dir);
+
+// 新进程这一侧
+typedef struct kvs_replay_s kvs_replay_t;
+
+// dir 是 READY 带过来的地址，不对时返回 NULL
+kvs_replay_t *kvs_replay_open(kvs_journal_dir_t *dir, kvs_shard_t *shard);
+// 在 shard 线程上装最多 budget 条记录。返回读到了哪一步（0、KVS_JOURNAL_SYNCED 或 KVS_JOURNAL_END），出错返回负的 errno
+int kvs_replay_poll(kvs_replay_t *r, int budget);
+void kvs_replay_close(kvs_replay_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
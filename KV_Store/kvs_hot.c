@@ -0,0 +1,350 @@
+#include "spdk/stdinc.h"
+
+#include "kvs_hot.h"
+#include "kvs_stats.h"
+
+#define KVS_HOT_DEPTH			4
+#define KVS_HOT_WIDTH_BITS		12
+#define KVS_HOT_WIDTH			(1 << KVS_HOT_WIDTH_BITS)
+#define KVS_HOT_REPLICA_BITS	10
+
+typedef struct kvs_hot_replica_s {
+	uint64_t hash;
+	kvs_value_t *value;		// 持有一个引用，NULL 表示空槽
+	uint64_t expire;		// value 本身的 expire 只有所属 shard 能读，复制时拷一份
+	uint32_t hits;			// 还没报给所属 shard 的命中次数
+	uint8_t engine;
+	uint8_t len;
+	char key[KVS_HOT_KEY_MAX];
+} kvs_hot_replica_t;
+
+struct kvs_hot_s {
+	uint32_t threshold;
+	kvs_hot_fn fn;
+	void *arg;
+
+	uint32_t window;		// 上次减半之后记了多少次读
+	uint32_t seq;			// 改堆之前和之后各加一，奇数表示正在改，给 kvs_hot_snapshot 用
+	int ntop;
+	kvs_hot_entry_t top[KVS_HOT_TOPK];	// 按 count 的最小堆
+
+	kvs_hot_stats_t stats;
+	kvs_hot_replica_t replicas[KVS_HOT_REPLICAS];
+	uint32_t sketch[KVS_HOT_DEPTH][KVS_HOT_WIDTH];
+};
+
+// 每行一个奇数乘子，取乘积的高位做下标；key 所属的 shard 由 hash 的高位决定，同一个 shard 上的 hash 高位很接近，要重新打散
+static const uint64_t kvs_hot_seeds[KVS_HOT_DEPTH] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+};
+
+kvs_hot_t *kvs_hot_create(uint32_t threshold, kvs_hot_fn fn, void *arg) {
+	kvs_hot_t *h = calloc(1, sizeof(*h));
+
+	if (h == NULL) {
+		return NULL;
+	}
+	h->threshold = threshold;
+	h->fn = fn;
+	h->arg = arg;
+	return h;
+}
+
+void kvs_hot_destroy(kvs_hot_t *h) {
+	if (h == NULL) {
+		return;
+	}
+	for (int i = 0; i < KVS_HOT_REPLICAS; i++) {
+		if (h->replicas[i].value) {
+			kvs_value_put(h->replicas[i].value);
+		}
+	}
+	free(h);
+}
+
+/*
+#############
+count-min sketch
+#############
+*/
+
+// 加 n 次，返回新的估计值：各行里最小的计数加 n，比它小的计数都抬到这个值，大的不动
+static uint32_t kvs_hot_sketch_add(kvs_hot_t *h, uint64_t hash, uint32_t n) {
+	uint32_t *c[KVS_HOT_DEPTH];
+	uint32_t min = UINT32_MAX;
+
+	for (int i = 0; i < KVS_HOT_DEPTH; i++) {
+		c[i] = &h->sketch[i][(hash * kvs_hot_seeds[i]) >> (64 - KVS_HOT_WIDTH_BITS)];
+		if (*c[i] < min) {
+			min = *c[i];
+		}
+	}
+
+	uint32_t est = min > UINT32_MAX - n ? UINT32_MAX : min + n;
+	for (int i = 0; i < KVS_HOT_DEPTH; i++) {
+		if (*c[i] < est) {
+			*c[i] = est;
+		}
+	}
+	return est;
+}
+
+/*
+#############
+top-k
+#############
+*/
+
+static void kvs_hot_begin(kvs_hot_t *h) {
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void kvs_hot_end(kvs_hot_t *h) {
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void kvs_hot_swap(kvs_hot_t *h, int a, int b) {
+	kvs_hot_entry_t t = h->top[a];
+	h->top[a] = h->top[b];
+	h->top[b] = t;
+}
+
+static int kvs_hot_sift_up(kvs_hot_t *h, int i) {
+	while (i > 0 && h->top[i].count < h->top[(i - 1) / 2].count) {
+		kvs_hot_swap(h, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	return i;
+}
+
+static int kvs_hot_sift_down(kvs_hot_t *h, int i) {
+	for (;;) {
+		int min = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < h->ntop && h->top[l].count < h->top[min].count) min = l;
+		if (r < h->ntop && h->top[r].count < h->top[min].count) min = r;
+		if (min == i) {
+			return i;
+		}
+		kvs_hot_swap(h, i, min);
+		i = min;
+	}
+}
+
+// key 为 NULL 时只比 hash
+static int kvs_hot_find(const kvs_hot_t *h, uint64_t hash, const kvs_slice_t *key) {
+	for (int i = 0; i < h->ntop; i++) {
+		const kvs_hot_entry_t *e = &h->top[i];
+		if (e->hash == hash && (key == NULL || (e->len == key->len && memcmp(e->key, key->data, key->len) == 0))) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void kvs_hot_drop(kvs_hot_t *h, kvs_hot_entry_t *e) {
+	if (e->replicated) {
+		e->replicated = false;
+		h->fn(h->arg, e, NULL);
+		kvs_stat_add(&h->stats.invalidated, 1);
+	}
+}
+
+// 所有计数减半：堆里的顺序不变，复制过但已经冷下来的作废
+static void kvs_hot_decay(kvs_hot_t *h) {
+	for (int i = 0; i < KVS_HOT_DEPTH; i++) {
+		for (int j = 0; j < KVS_HOT_WIDTH; j++) {
+			h->sketch[i][j] >>= 1;
+		}
+	}
+
+	kvs_hot_begin(h);
+	for (int i = 0; i < h->ntop; i++) {
+		kvs_hot_entry_t *e = &h->top[i];
+		e->count >>= 1;
+		if (e->count < h->threshold / 2) {
+			kvs_hot_drop(h, e);
+		}
+	}
+	kvs_hot_end(h);
+	h->window = 0;
+}
+
+static void kvs_hot_tick(kvs_hot_t *h, uint32_t n) {
+	h->window += n;
+	if (h->window >= KVS_HOT_WINDOW) {
+		kvs_hot_decay(h);
+	}
+}
+
+void kvs_hot_read(kvs_hot_t *h, uint8_t engine, kvs_slice_t key, uint64_t hash, kvs_value_t *value, uint32_t n) {
+	if (key.len > KVS_HOT_KEY_MAX) {
+		return;
+	}
+
+	uint32_t est = kvs_hot_sketch_add(h, hash, n);
+
+	// 堆满了而且比堆顶还小，一定不在堆里
+	if (h->ntop == KVS_HOT_TOPK && est < h->top[0].count) {
+		kvs_hot_tick(h, n);
+		return;
+	}
+
+	kvs_hot_begin(h);
+	int i = kvs_hot_find(h, hash, &key);
+	if (i >= 0) {
+		h->top[i].count = est;
+		h->top[i].reads += n;
+		i = kvs_hot_sift_down(h, i);
+	} else {
+		if (h->ntop < KVS_HOT_TOPK) {
+			i = h->ntop++;
+		} else {
+			kvs_hot_drop(h, &h->top[0]);
+			i = 0;
+		}
+		kvs_hot_entry_t *e = &h->top[i];
+		e->hash = hash;
+		e->count = est;
+		e->reads = n;
+		e->replicated = false;
+		e->engine = engine;
+		e->len = (uint8_t)key.len;
+		memcpy(e->key, key.data, key.len);
+		i = i == 0 ? kvs_hot_sift_down(h, 0) : kvs_hot_sift_up(h, i);
+	}
+
+	kvs_hot_entry_t *e = &h->top[i];
+	if (value && !e->replicated && e->count >= h->threshold && e->reads >= KVS_HOT_REARM &&
+			h->fn(h->arg, e, value)) {
+		e->replicated = true;
+		kvs_stat_add(&h->stats.replicated, 1);
+	}
+	kvs_hot_end(h);
+
+	kvs_hot_tick(h, n);
+}
+
+void kvs_hot_report(kvs_hot_t *h, uint64_t hash, uint32_t n) {
+	uint32_t est = kvs_hot_sketch_add(h, hash, n);
+	int i = kvs_hot_find(h, hash, NULL);
+
+	if (i >= 0) {
+		kvs_hot_begin(h);
+		h->top[i].count = est;
+		h->top[i].reads += n;
+		kvs_hot_sift_down(h, i);
+		kvs_hot_end(h);
+	}
+	kvs_hot_tick(h, n);
+}
+
+void kvs_hot_write(kvs_hot_t *h, uint64_t hash) {
+	int i = kvs_hot_find(h, hash, NULL);
+
+	if (i >= 0) {
+		kvs_hot_begin(h);
+		h->top[i].reads = 0;
+		kvs_hot_drop(h, &h->top[i]);
+		kvs_hot_end(h);
+	}
+}
+
+int kvs_hot_snapshot(const kvs_hot_t *h, kvs_hot_entry_t *out, int max) {
+	uint32_t seq;
+	int n;
+
+	do {
+		while ((seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE)) & 1) {
+		}
+		n = __atomic_load_n(&h->ntop, __ATOMIC_RELAXED);
+		n = n < max ? n : max;
+		memcpy(out, h->top, n * sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq);
+
+	// 堆里只是部分有序，拷出来再排
+	for (int i = 1; i < n; i++) {
+		kvs_hot_entry_t e = out[i];
+		int j = i;
+		for (; j > 0 && out[j - 1].count < e.count; j--) {
+			out[j] = out[j - 1];
+		}
+		out[j] = e;
+	}
+	return n;
+}
+
+const kvs_hot_stats_t *kvs_hot_get_stats(const kvs_hot_t *h) {
+	return &h->stats;
+}
+
+/*
+#############
+replica
+#############
+*/
+
+static kvs_hot_replica_t *kvs_hot_slot(kvs_hot_t *h, uint64_t hash) {
+	return &h->replicas[(hash * kvs_hot_seeds[0]) >> (64 - KVS_HOT_REPLICA_BITS)];
+}
+
+static void kvs_hot_replica_clear(kvs_hot_replica_t *r) {
+	kvs_value_put(r->value);
+	r->value = NULL;
+}
+
+void kvs_hot_replica_set(kvs_hot_t *h, uint8_t engine, kvs_slice_t key, uint64_t hash,
+		kvs_value_t *value, uint64_t expire) {
+	kvs_hot_replica_t *r = kvs_hot_slot(h, hash);
+
+	if (r->value) {
+		kvs_hot_replica_clear(r);
+	}
+	r->hash = hash;
+	r->value = value;
+	r->expire = expire;
+	r->hits = 0;
+	r->engine = engine;
+	r->len = (uint8_t)key.len;
+	memcpy(r->key, key.data, key.len);
+}
+
+void kvs_hot_replica_drop(kvs_hot_t *h, uint64_t hash) {
+	kvs_hot_replica_t *r = kvs_hot_slot(h, hash);
+
+	if (r->value && r->hash == hash) {
+		kvs_hot_replica_clear(r);
+	}
+}
+
+void kvs_hot_replica_drop_all(kvs_hot_t *h) {
+	for (int i = 0; i < KVS_HOT_REPLICAS; i++) {
+		if (h->replicas[i].value) {
+			kvs_hot_replica_clear(&h->replicas[i]);
+		}
+	}
+}
+
+bool kvs_hot_replica_get(kvs_hot_t *h, uint8_t engine, kvs_slice_t key, uint64_t hash, uint64_t now,
+		kvs_value_t **value, bool *report) {
+	kvs_hot_replica_t *r = kvs_hot_slot(h, hash);
+
+	if (r->value == NULL || r->hash != hash || r->engine != engine ||
+			r->len != key.len || memcmp(r->key, key.data, key.len) != 0) {
+		return false;
+	}
+	if (r->expire != 0 && r->expire <= now) {
+		kvs_hot_replica_clear(r);
+		return false;
+	}
+
+	kvs_value_get(r->value);
+	*value = r->value;
+	*report = ++r->hits == KVS_HOT_REPORT;
+	if (*report) {
+		r->hits = 0;
+	}
+	kvs_stat_add(&h->stats.replica_hits, 1);
+	return true;
+}
@@ -0,0 +1,92 @@
+#ifndef KVS_HOT_H
+#define KVS_HOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kv_engine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+hot keys
+#############
+
+每个 shard 一份，只在 shard 线程上访问（kvs_hot_snapshot 和统计除外）。
+
+所属 shard 这一侧：count-min sketch 估计每个 key 被读的次数，4 行计数器，只加最小的那几个（conservative update），
+每读 KVS_HOT_WINDOW 次所有计数减半，估计的是最近一段时间的热度。估计次数最高的 KVS_HOT_TOPK 个 key
+放在一个按次数排的最小堆里，堆顶是门槛：新 key 的估计次数超过堆顶才能挤进来。
+堆里的 key 次数到了阈值，就把 value 复制到其他 shard 上；写、挤出堆、冷下来时作废。
+
+其他 shard 这一侧：直接映射的副本缓存，每个槽一个 key，新的直接覆盖旧的。
+
+key 超过 KVS_HOT_KEY_MAX 字节的不统计
+*/
+
+#define KVS_HOT_KEY_MAX			48
+#define KVS_HOT_TOPK			16
+#define KVS_HOT_WINDOW			65536
+#define KVS_HOT_THRESHOLD		1024	// 默认阈值，大约是这个 shard 上 1% 以上的读
+#define KVS_HOT_REARM			256		// 上次写之后至少读过这么多次才（重新）复制，写得频繁的 key 不复制
+#define KVS_HOT_REPLICAS		1024	// 副本缓存的槽数，2 的幂
+#define KVS_HOT_REPORT			256		// 副本每命中这么多次告诉所属 shard 一次，它那边的热度才不会掉下来
+
+typedef struct kvs_hot_s kvs_hot_t;
+
+typedef struct kvs_hot_entry_s {
+	uint64_t hash;			// key 和 engine 一起的 hash，由调用方算
+	uint32_t count;			// 估计的读次数
+	uint32_t reads;			// 上次写之后的读次数
+	bool replicated;
+	uint8_t engine;
+	uint8_t len;
+	char key[KVS_HOT_KEY_MAX];
+} kvs_hot_entry_t;
+
+typedef struct kvs_hot_stats_s {
+	uint64_t replicated;	// 复制出去的 key 次数
+	uint64_t invalidated;	// 作废的 key 次数
+	uint64_t replica_hits;	// 用本 shard 上的副本回复的读
+} kvs_hot_stats_t;
+
+// 要复制 (value 非 NULL) 或者作废 (value 为 NULL) 堆里的一个 key 时调用。
+// 复制时返回 false 表示没复制出去，下次读到时再试
+typedef bool (*kvs_hot_fn)(void *arg, const kvs_hot_entry_t *e, kvs_value_t *value);
+
+kvs_hot_t *kvs_hot_create(uint32_t threshold, kvs_hot_fn fn, void *arg);
+// 放掉副本缓存里的引用，不调用 fn
+void kvs_hot_destroy(kvs_hot_t *h);
+
+// 所属 shard 上读到了 key，value 是读到的结果；n 次读只是统计，value 为 NULL 时不会复制
+void kvs_hot_read(kvs_hot_t *h, uint8_t engine, kvs_slice_t key, uint64_t hash, kvs_value_t *value, uint32_t n);
+// 别的 shard 用副本回复了 n 次读，只知道 hash：key 不在堆里时只加到 sketch 上
+void kvs_hot_report(kvs_hot_t *h, uint64_t hash, uint32_t n);
+// 所属 shard 上写了 key：复制过的作废，重新计算上次写之后的读次数
+void kvs_hot_write(kvs_hot_t *h, uint64_t hash);
+
+// 放进副本缓存，value 的引用交给缓存，expire 是复制时的过期时间；占了同一个槽的旧副本直接丢掉
+void kvs_hot_replica_set(kvs_hot_t *h, uint8_t engine, kvs_slice_t key, uint64_t hash,
+	kvs_value_t *value, uint64_t expire);
+// hash 对得上的副本丢掉，没有就什么都不做
+void kvs_hot_replica_drop(kvs_hot_t *h, uint64_t hash);
+// 副本缓存整个清空，不管是哪个 shard 的：单个作废送不出去时的退路
+void kvs_hot_replica_drop_all(kvs_hot_t *h);
+// 从副本缓存里读：命中时 *value 是一个新的引用，返回 true；过期的副本当作没有，顺便丢掉。
+// 每命中 KVS_HOT_REPORT 次 *report 为 true，由调用方告诉所属 shard
+bool kvs_hot_replica_get(kvs_hot_t *h, uint8_t engine, kvs_slice_t key, uint64_t hash, uint64_t now,
+	kvs_value_t **value, bool *report);
+
+// 可以在别的线程上调用：拷出堆里最多 max 个 key，按次数从高到低，返回个数
+int kvs_hot_snapshot(const kvs_hot_t *h, kvs_hot_entry_t *out, int max);
+const kvs_hot_stats_t *kvs_hot_get_stats(const kvs_hot_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef KVS_PROTO_H
+#define KVS_PROTO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 命令编号同时也是二进制协议的 opcode，新命令只能追加在 KVS_CMD_COUNT 前面
+typedef enum {
+	KVS_CMD_START = 0,
+	KVS_CMD_BSET = KVS_CMD_START,
+	KVS_CMD_BGET,
+	KVS_CMD_BDEL,
+	KVS_CMD_BMOD,
+	KVS_CMD_RSET,
+	KVS_CMD_RGET,
+	KVS_CMD_RDEL,
+	KVS_CMD_RMOD,
+	KVS_CMD_STATS,		// 没有 key，回复统计信息文本
+	KVS_CMD_MGET,		// 多 key 命令，都落在 B+ 树上
+	KVS_CMD_MSET,		// 插入或覆盖
+	KVS_CMD_MDEL,
+	KVS_CMD_BSCAN,		// 有序范围扫描，带游标分批返回
+	KVS_CMD_SETEX,		// 插入或覆盖，同时设置过期秒数，以下都落在 B+ 树上
+	KVS_CMD_EXPIRE,		// 给已有的 key 设置过期秒数
+	KVS_CMD_TTL,		// 查询剩余的过期时间
+	KVS_CMD_PERSIST,	// 去掉过期时间
+	KVS_CMD_HSET,		// 以下落在哈希表上，只有单 key 的点操作
+	KVS_CMD_HGET,
+	KVS_CMD_HDEL,
+	KVS_CMD_HMOD,
+	KVS_CMD_SSET,		// 以下落在所有 shard 共用的跳表上，不转发，只在内存里
+	KVS_CMD_SGET,
+	KVS_CMD_SDEL,
+	KVS_CMD_SMOD,
+	KVS_CMD_SSCAN,		// 和 BSCAN 一样的参数和回复
+	KVS_CMD_COUNT
+} kvs_cmd_t;
+
+/*
+#############
+binary protocol
+#############
+
+连接上收到的第一个字节是 KVS_BIN_MAGIC_REQ 时，该连接使用二进制协议，否则使用文本协议。
+每个请求/回复都是一个固定长度的头部，后面紧跟 key 和 value 的原始字节，整数均为小端序。
+
+  request:  kvs_bin_hdr_t | key[key_len] | value[value_len]
+  response: kvs_bin_hdr_t | value[value_len]      (key_len 为 0)
+
+opaque 原样带回，客户端可以用它匹配乱序到达的回复。
+
+MGET/MSET/MDEL 的 key 区是若干个 (le32 len | bytes)，MSET 的 value 区按同样的格式和 key 一一对应。
+MGET/MDEL 按 key 的顺序每个 key 回复一帧，opaque 都相同；MSET 只回复一帧，有一个 key 失败就是 ERROR。
+
+BSCAN 的 key 是起点，value 是终点（都包含在内，空表示不限），reserved 是这一批最多取多少个。
+回复的第一帧 key 是游标，reserved 是后面跟着的帧数；之后每个结果一帧：hdr | key | value。
+游标不为空时把它当作起点再发一次 BSCAN 继续。
+
+SETEX/EXPIRE 的过期秒数放在 reserved 里。TTL 回复的 value 是 le64 的剩余毫秒数，key 没有过期时间时 value 为空；
+PERSIST 在 key 不存在或者本来就没有过期时间时回复 NOT_FOUND。
+*/
+
+#define KVS_BIN_MAGIC_REQ	0x80
+#define KVS_BIN_MAGIC_RES	0x81
+
+typedef enum {
+	KVS_BIN_STATUS_OK = 0,
+	KVS_BIN_STATUS_EXIST,
+	KVS_BIN_STATUS_NOT_FOUND,
+	KVS_BIN_STATUS_ERROR,
+} kvs_bin_status_t;
+
+typedef struct kvs_bin_hdr_s {
+	uint8_t magic;
+	uint8_t opcode;			// kvs_cmd_t
+	uint16_t status;		// kvs_bin_status_t，请求中为 0
+	uint32_t key_len;
+	uint32_t value_len;
+	uint32_t reserved;
+	uint64_t opaque;		// 请求 id
+} __attribute__((packed)) kvs_bin_hdr_t;
+
+#ifdef __cplusplus
+static_assert(sizeof(kvs_bin_hdr_t) == 24, "kvs_bin_hdr_t must be 24 bytes");
+#else
+_Static_assert(sizeof(kvs_bin_hdr_t) == 24, "kvs_bin_hdr_t must be 24 bytes");
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,291 @@
+// memfd_create、fallocate
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kvs_region.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE		0x100000
+#endif
+
+// 第一页的布局，两个进程共用
+typedef struct kvs_region_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t base;
+	uint64_t size;			// 文件现在的长度，只有 owner 改
+	uint64_t top;			// 用过的页号的上界，后面的页都是空的
+	uint32_t owner;			// 0 表示已经交出去，否则是 owner 标记加一
+	uint32_t reserved;
+	void *garbage;			// 不是 owner 时释放的对象，无锁栈，链接放在对象的前 8 个字节
+	uint8_t map[KVS_REGION_PAGES];	// kvs_region_kind_t
+} kvs_region_hdr_t;
+
+_Static_assert(sizeof(kvs_region_hdr_t) <= KV_PAGE_SIZE, "region header must fit in one page");
+
+static kvs_region_hdr_t *g_hdr;
+static int g_fd = -1;
+static bool g_owned;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;	// 本进程里分配、释放页的线程之间
+static uint64_t g_hint = 1;		// 这之前没有空页
+
+static int kvs_region_map(int fd) {
+	void *p = mmap((void *)KVS_REGION_BASE, KVS_REGION_RESERVE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_NORESERVE | MAP_FIXED_NOREPLACE, fd, 0);
+
+	if (p == MAP_FAILED) {
+		return -errno;
+	}
+	// 老内核不认 MAP_FIXED_NOREPLACE，当成提示给了别的地址
+	if (p != (void *)KVS_REGION_BASE) {
+		munmap(p, KVS_REGION_RESERVE);
+		return -EEXIST;
+	}
+	g_hdr = p;
+	g_fd = fd;
+	return 0;
+}
+
+int kvs_region_create(uint16_t owner) {
+	int fd = memfd_create("kvs_region", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (ftruncate(fd, KVS_REGION_GROW) < 0) {
+		int rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	int rc = kvs_region_map(fd);
+	if (rc < 0) {
+		close(fd);
+		return rc;
+	}
+	// ftruncate 出来的内存全是 0，页表一开始都是 KVS_REGION_FREE
+	g_hdr->magic = KVS_REGION_MAGIC;
+	g_hdr->version = KVS_REGION_VERSION;
+	g_hdr->base = KVS_REGION_BASE;
+	g_hdr->size = KVS_REGION_GROW;
+	g_hdr->top = 1;
+	g_hdr->map[0] = KVS_REGION_RAW;
+	g_hdr->owner = (uint32_t)owner + 1;
+	g_owned = true;
+	return 0;
+}
+
+int kvs_region_attach(int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		return -errno;
+	}
+	if ((uint64_t)st.st_size < KV_PAGE_SIZE) {
+		return -EPROTO;
+	}
+
+	int rc = kvs_region_map(fd);
+	if (rc < 0) {
+		return rc;
+	}
+	if (g_hdr->magic != KVS_REGION_MAGIC || g_hdr->version != KVS_REGION_VERSION ||
+		g_hdr->base != KVS_REGION_BASE) {
+		munmap(g_hdr, KVS_REGION_RESERVE);
+		g_hdr = NULL;
+		g_fd = -1;
+		return -EPROTO;
+	}
+	return 0;
+}
+
+bool kvs_region_active(void) {
+	return g_hdr != NULL;
+}
+
+int kvs_region_fd(void) {
+	return g_fd;
+}
+
+bool kvs_region_contains(const void *ptr) {
+	return g_hdr != NULL && (uintptr_t)ptr - KVS_REGION_BASE < KVS_REGION_RESERVE;
+}
+
+void kvs_region_release(void) {
+	pthread_mutex_lock(&g_lock);
+	g_owned = false;
+	__atomic_store_n(&g_hdr->owner, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&g_lock);
+}
+
+bool kvs_region_acquire(uint16_t owner) {
+	uint32_t expected = 0;
+
+	if (!__atomic_compare_exchange_n(&g_hdr->owner, &expected, (uint32_t)owner + 1, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	pthread_mutex_lock(&g_lock);
+	g_owned = true;
+	g_hint = 1;
+	pthread_mutex_unlock(&g_lock);
+	return true;
+}
+
+bool kvs_region_owned(void) {
+	return g_hdr != NULL && __atomic_load_n(&g_owned, __ATOMIC_ACQUIRE);
+}
+
+void *kvs_region_alloc(size_t size, kvs_region_kind_t kind) {
+	uint64_t n = (size + KV_PAGE_SIZE - 1) / KV_PAGE_SIZE;
+	void *ptr = NULL;
+
+	if (g_hdr == NULL || n == 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&g_lock);
+	if (!g_owned) {
+		goto out;
+	}
+
+	// 从第一个空页往后找连续 n 个空页
+	uint64_t first = 0, start = 0, run = 0;
+	for (uint64_t i = g_hint; i < KVS_REGION_PAGES; i++) {
+		if (g_hdr->map[i] != KVS_REGION_FREE) {
+			run = 0;
+			continue;
+		}
+		if (first == 0) {
+			first = i;
+		}
+		if (++run == n) {
+			start = i + 1 - n;
+			break;
+		}
+	}
+	if (start == 0) {
+		goto out;
+	}
+
+	uint64_t end = (start + n) * KV_PAGE_SIZE;
+	if (end > g_hdr->size) {
+		uint64_t grow = g_hdr->size + KVS_REGION_GROW;
+		if (grow < end) {
+			grow = end;
+		}
+		if (grow > KVS_REGION_RESERVE) {
+			grow = KVS_REGION_RESERVE;
+		}
+		if (ftruncate(g_fd, grow) < 0) {
+			goto out;
+		}
+		g_hdr->size = grow;
+	}
+
+	g_hdr->map[start] = kind;
+	memset(&g_hdr->map[start + 1], KVS_REGION_CONT, n - 1);
+	if (start + n > g_hdr->top) {
+		g_hdr->top = start + n;
+	}
+	g_hint = first == start ? start + n : first;
+	ptr = (char *)KVS_REGION_BASE + start * KV_PAGE_SIZE;
+
+out:
+	pthread_mutex_unlock(&g_lock);
+	return ptr;
+}
+
+void kvs_region_free(void *ptr) {
+	if (!kvs_region_contains(ptr)) {
+		return;
+	}
+	uint64_t start = ((uintptr_t)ptr - KVS_REGION_BASE) / KV_PAGE_SIZE;
+
+	pthread_mutex_lock(&g_lock);
+	// 不是 owner 时页头归别人管，只能泄漏；slab 那边不是 owner 时不会走到这里
+	if (!g_owned || start == 0 || g_hdr->map[start] == KVS_REGION_FREE ||
+		g_hdr->map[start] == KVS_REGION_CONT) {
+		pthread_mutex_unlock(&g_lock);
+		return;
+	}
+
+	uint64_t n = 1;
+	while (start + n < g_hdr->top && g_hdr->map[start + n] == KVS_REGION_CONT) {
+		n++;
+	}
+	memset(&g_hdr->map[start], KVS_REGION_FREE, n);
+	if (start < g_hint) {
+		g_hint = start;
+	}
+	// 内存还给系统，文件长度不变，下次用到时是全 0 的新页
+	fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		start * KV_PAGE_SIZE, n * KV_PAGE_SIZE);
+	pthread_mutex_unlock(&g_lock);
+}
+
+void kvs_region_walk(kvs_region_kind_t kind, void (*fn)(void *arg, void *ptr), void *arg) {
+	if (g_hdr == NULL) {
+		return;
+	}
+	uint64_t top = __atomic_load_n(&g_hdr->top, __ATOMIC_ACQUIRE);
+
+	for (uint64_t i = 1; i < top; i++) {
+		if (g_hdr->map[i] == kind) {
+			fn(arg, (char *)KVS_REGION_BASE + i * KV_PAGE_SIZE);
+		}
+	}
+}
+
+/*
+#############
+slab backend
+#############
+*/
+
+// 不是 owner 时返回 NULL，slab 退回 posix_memalign，这样的页不会交给下一个进程
+static void *kvs_region_page_alloc(size_t size, size_t align) {
+	(void)align;
+	return kvs_region_alloc(size, KVS_REGION_SLAB);
+}
+
+const kv_slab_backend_t kvs_region_backend = {
+	.alloc = kvs_region_page_alloc,
+	.free = kvs_region_free,
+};
+
+bool kvs_region_defer(void *ptr) {
+	if (!kvs_region_contains(ptr)) {
+		return false;
+	}
+
+	void *head = __atomic_load_n(&g_hdr->garbage, __ATOMIC_RELAXED);
+	do {
+		*(void **)ptr = head;
+	} while (!__atomic_compare_exchange_n(&g_hdr->garbage, &head, ptr, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return true;
+}
+
+size_t kvs_region_reclaim(void) {
+	size_t n = 0;
+
+	if (!kvs_region_owned()) {
+		return 0;
+	}
+	void *p = __atomic_exchange_n(&g_hdr->garbage, NULL, __ATOMIC_ACQUIRE);
+	while (p) {
+		void *next = *(void **)p;
+		kv_slab_free(p);
+		p = next;
+		n++;
+	}
+	return n;
+}
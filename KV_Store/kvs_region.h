@@ -0,0 +1,75 @@
+#ifndef KVS_REGION_H
+#define KVS_REGION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "simple_slab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+shared region
+#############
+
+热重启时两个进程共用的一块内存：一个 memfd，两个进程都映射在同一个固定地址 KVS_REGION_BASE 上，
+里面的指针（value、slab 的页头、交接日志）在两边直接能用。-O 打开时 slab 的页都从这里分配，
+新进程接手时接过这些页，value 一个字节都不拷贝。
+
+按 KV_PAGE_SIZE 分页，第一页是头，页表里每页一个字节，记着这一页空着、是 slab 的页、别的用途，还是前一页的延续。
+同一时间只有一个进程是 owner，只有它分配、释放页，改 slab 的页头；交接时老进程 release，新进程 acquire，
+两个都是对头里同一个字的原子操作，谁抢到算谁的。不是 owner 的进程释放的 slab 对象压进头里的 garbage 栈，
+owner 成批收回来。文件按需 ftruncate 变长，释放的页打洞还给系统
+*/
+
+#define KVS_REGION_MAGIC		0x4e47524bu			// "KRGN"
+#define KVS_REGION_VERSION		1
+#define KVS_REGION_BASE			0x600000000000ULL	// 两个进程都映射在这里
+#define KVS_REGION_RESERVE		(256ULL << 30)		// 只占地址空间，用多少才占多少内存
+#define KVS_REGION_GROW			(64ULL << 20)		// 文件每次至少长这么多
+#define KVS_REGION_PAGES		(KVS_REGION_RESERVE / KV_PAGE_SIZE)
+
+typedef enum {
+	KVS_REGION_FREE = 0,
+	KVS_REGION_CONT,		// 多页的一块里第一页之后的页
+	KVS_REGION_SLAB,		// slab 的页或者单独分配的大对象，页头是 slab_page_t
+	KVS_REGION_RAW,			// 别的用途，比如交接日志
+} kvs_region_kind_t;
+
+// 建一块新的，自己是 owner；owner 是进程的标记，交接时新进程用老进程的加一。成功返回 0，失败返回 -errno
+int kvs_region_create(uint16_t owner);
+// 映射老进程交过来的 fd，还不是 owner
+int kvs_region_attach(int fd);
+bool kvs_region_active(void);
+int kvs_region_fd(void);
+bool kvs_region_contains(const void *ptr);
+
+// 交出去：之后不能再分配、释放页，之前对页头的修改对抢到的进程都可见
+void kvs_region_release(void);
+// 对方 release 之后还没有被别人抢走才成功
+bool kvs_region_acquire(uint16_t owner);
+bool kvs_region_owned(void);
+
+// owner 分配 size 字节，取整到页，KV_PAGE_SIZE 对齐；不是 owner 或者满了返回 NULL。任意线程上调用
+void *kvs_region_alloc(size_t size, kvs_region_kind_t kind);
+void kvs_region_free(void *ptr);
+// 把 kind 类型的每一块的起始地址交给 fn
+void kvs_region_walk(kvs_region_kind_t kind, void (*fn)(void *arg, void *ptr), void *arg);
+
+// slab 的 backend：页从 region 分配
+extern const kv_slab_backend_t kvs_region_backend;
+
+// 交给 kv_slab_defer_free：region 里的对象压进 garbage 栈，返回 true；别的返回 false，照常释放
+bool kvs_region_defer(void *ptr);
+// owner 上调用：释放 garbage 栈里的所有对象，返回个数
+size_t kvs_region_reclaim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
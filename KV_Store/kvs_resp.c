@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "kvs_resp.h"
+
+void kvs_resp_parser_reset(kvs_resp_parser_t *p) {
+    p->nargs = -1;
+    p->argc = 0;
+    p->pos = 0;
+}
+
+// 解析 "<prefix><int>\r\n"，返回这一行之后的偏移；不完整返回 0，格式错误返回 -1
+static ssize_t kvs_resp_parse_len(const char *buf, size_t len, size_t pos, char prefix, int64_t *value) {
+    const char *end = buf + len;
+    const char *eol = kvs_scan_byte(buf + pos, end, '\n');
+    if (eol == end) {
+        return 0;
+    }
+
+    const char *p = buf + pos;
+    if (*p++ != prefix || eol - p < 2 || eol[-1] != '\r') {
+        return -1;
+    }
+
+    bool neg = false;
+    int64_t v = 0;
+    if (*p == '-') {
+        neg = true;
+        p++;
+    }
+    if (p == eol - 1) {
+        return -1;
+    }
+    for (; p < eol - 1; p++) {
+        if (*p < '0' || *p > '9' || v > (INT64_MAX - 9) / 10) {
+            return -1;
+        }
+        v = v * 10 + (*p - '0');
+    }
+
+    *value = neg ? -v : v;
+    return eol + 1 - buf;
+}
+
+ssize_t kvs_resp_parse(kvs_resp_parser_t *p, const char *buf, size_t len) {
+    int64_t v;
+    ssize_t next;
+
+    if (p->nargs < 0) {
+        next = kvs_resp_parse_len(buf, len, 0, '*', &v);
+        if (next <= 0) {
+            return next;
+        }
+        if (v <= 0 || v > KVS_RESP_MAX_ARGS) {
+            return -1;
+        }
+        p->nargs = v;
+        p->pos = next;
+    }
+
+    // 每次从上一个完整参数之后继续
+    while (p->argc < p->nargs) {
+        next = kvs_resp_parse_len(buf, len, p->pos, '$', &v);
+        if (next <= 0) {
+            return next;
+        }
+        if (v < 0 || v > KVS_RESP_MAX_BULK) {
+            return -1;
+        }
+        if ((size_t)next + v + 2 > len) {
+            return 0;
+        }
+        if (buf[next + v] != '\r' || buf[next + v + 1] != '\n') {
+            return -1;
+        }
+
+        p->argv[p->argc].off = next;
+        p->argv[p->argc].len = v;
+        p->argc++;
+        p->pos = next + v + 2;
+    }
+
+    return p->pos;
+}
+
+bool kvs_resp_match(const char *pat, size_t plen, const char *str, size_t slen) {
+    size_t p = 0, s = 0;
+    size_t star = (size_t)-1, mark = 0;
+
+    while (s < slen) {
+        if (p < plen && pat[p] == '*') {
+            star = p++;
+            mark = s;
+        } else if (p + 1 < plen && pat[p] == '\\') {
+            // 转义字符按字面匹配
+            if (pat[p + 1] == str[s]) {
+                p += 2;
+                s++;
+                continue;
+            }
+            if (star == (size_t)-1) {
+                return false;
+            }
+            p = star + 1;
+            s = ++mark;
+        } else if (p < plen && (pat[p] == '?' || pat[p] == str[s])) {
+            p++;
+            s++;
+        } else {
+            if (star == (size_t)-1) {
+                return false;
+            }
+            // 回退到上一个 *，让它多吞一个字符
+            p = star + 1;
+            s = ++mark;
+        }
+    }
+    while (p < plen && pat[p] == '*') {
+        p++;
+    }
+    return p == plen;
+}
+
+/*
+#############
+serialize
+#############
+*/
+
+// 整数转字符串，返回长度；buf 至少 21 字节
+static int kvs_resp_itoa(char *buf, int64_t v) {
+    char tmp[20];
+    int n = 0, len = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (v < 0) {
+        buf[len++] = '-';
+    }
+    while (n) {
+        buf[len++] = tmp[--n];
+    }
+    return len;
+}
+
+static int kvs_resp_prefixed(kvs_wbuf_t *out, char prefix, int64_t v) {
+    char buf[24];
+    int len = 0;
+
+    buf[len++] = prefix;
+    len += kvs_resp_itoa(buf + len, v);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return kvs_wbuf_append(out, buf, len);
+}
+
+int kvs_resp_simple(kvs_wbuf_t *out, const char *s) {
+    if (kvs_wbuf_append(out, "+", 1) < 0 || kvs_wbuf_append(out, s, strlen(s)) < 0) {
+        return -1;
+    }
+    return kvs_wbuf_append(out, "\r\n", 2);
+}
+
+int kvs_resp_error(kvs_wbuf_t *out, const char *msg) {
+    if (kvs_wbuf_append(out, "-ERR ", 5) < 0 || kvs_wbuf_append(out, msg, strlen(msg)) < 0) {
+        return -1;
+    }
+    return kvs_wbuf_append(out, "\r\n", 2);
+}
+
+int kvs_resp_integer(kvs_wbuf_t *out, int64_t v) {
+    return kvs_resp_prefixed(out, ':', v);
+}
+
+int kvs_resp_bulk(kvs_wbuf_t *out, const char *data, size_t len) {
+    if (kvs_resp_prefixed(out, '$', len) < 0 || kvs_wbuf_append(out, data, len) < 0) {
+        return -1;
+    }
+    return kvs_wbuf_append(out, "\r\n", 2);
+}
+
+int kvs_resp_bulk_ref(kvs_wbuf_t *out, kvs_value_t *v) {
+    if (kvs_resp_prefixed(out, '$', v->len) < 0 || kvs_wbuf_append_ref(out, v) < 0) {
+        return -1;
+    }
+    return kvs_wbuf_append(out, "\r\n", 2);
+}
+
+int kvs_resp_nil(kvs_wbuf_t *out) {
+    return kvs_wbuf_append(out, "$-1\r\n", 5);
+}
+
+int kvs_resp_array(kvs_wbuf_t *out, size_t n) {
+    return kvs_resp_prefixed(out, '*', n);
+}
@@ -0,0 +1,52 @@
+#ifndef KVS_RESP_H
+#define KVS_RESP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "kvs_frame.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KVS_RESP_MAX_ARGS       512
+#define KVS_RESP_MAX_BULK       (KVS_RBUF_MAX_SIZE - 64)
+
+// RESP2 增量解析器，状态保存在连接里，不分配内存
+// 参数以相对命令起始位置的偏移记录，接收缓冲区搬移/扩容后依然有效
+typedef struct kvs_resp_arg_s {
+    uint32_t off;
+    uint32_t len;
+} kvs_resp_arg_t;
+
+typedef struct kvs_resp_parser_s {
+    int nargs;      // -1 表示还没解析到 "*<n>\r\n"
+    int argc;       // 已经完整收到的参数个数
+    size_t pos;     // 下一个参数的起始偏移
+    kvs_resp_arg_t argv[KVS_RESP_MAX_ARGS];
+} kvs_resp_parser_t;
+
+void kvs_resp_parser_reset(kvs_resp_parser_t *p);
+// 返回完整命令的字节数；数据不完整返回 0，协议错误返回 -1
+ssize_t kvs_resp_parse(kvs_resp_parser_t *p, const char *buf, size_t len);
+
+// glob 匹配（支持 * ? 和 \ 转义），用于 SCAN MATCH
+bool kvs_resp_match(const char *pat, size_t plen, const char *str, size_t slen);
+
+// 序列化
+int kvs_resp_simple(kvs_wbuf_t *out, const char *s);       // +OK
+int kvs_resp_error(kvs_wbuf_t *out, const char *msg);      // -ERR msg
+int kvs_resp_integer(kvs_wbuf_t *out, int64_t v);          // :1
+int kvs_resp_bulk(kvs_wbuf_t *out, const char *data, size_t len);
+int kvs_resp_bulk_ref(kvs_wbuf_t *out, kvs_value_t *v);    // value 不拷贝
+int kvs_resp_nil(kvs_wbuf_t *out);                         // $-1
+int kvs_resp_array(kvs_wbuf_t *out, size_t n);             // *n
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
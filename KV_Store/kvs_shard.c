@@ -0,0 +1,1209 @@
+#include "spdk/stdinc.h"
+#include "spdk/thread.h"
+#include "spdk/env.h"
+#include "spdk/cpuset.h"
+#include "spdk/log.h"
+#include "spdk/endian.h"
+
+#include "kvs_shard.h"
+#include "kvs_handoff.h"
+#include "simple_slab.h"
+
+kvs_shard_t g_shards[KVS_MAX_SHARDS];
+int g_nshards;
+kvs_slist_t *g_slist;
+
+// 当前线程上的 shard，收到只带 hash 的消息时用
+static __thread kvs_shard_t *g_local_shard;
+
+// MurmurHash64A
+uint64_t kvs_hash(const void *key, size_t len) {
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	const uint8_t *data = key;
+	const uint8_t *end = data + (len & ~(size_t)7);
+	uint64_t h = 0x9747b28cULL ^ (len * m);
+
+	while (data != end) {
+		uint64_t k;
+		memcpy(&k, data, sizeof(k));
+		data += sizeof(k);
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7) {
+		case 7: h ^= (uint64_t)data[6] << 48; /* fallthrough */
+		case 6: h ^= (uint64_t)data[5] << 40; /* fallthrough */
+		case 5: h ^= (uint64_t)data[4] << 32; /* fallthrough */
+		case 4: h ^= (uint64_t)data[3] << 24; /* fallthrough */
+		case 3: h ^= (uint64_t)data[2] << 16; /* fallthrough */
+		case 2: h ^= (uint64_t)data[1] << 8; /* fallthrough */
+		case 1: h ^= (uint64_t)data[0];
+			h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
+/*
+#############
+message
+#############
+*/
+
+#define KVS_MSG_RETRY_US	100
+
+// 当前线程上还没送出去的消息，按发送的顺序
+static __thread kvs_msg_t *t_msg_head;
+static __thread kvs_msg_t *t_msg_tail;
+static __thread struct spdk_poller *t_msg_poller;
+
+// 消息池满了返回 -ENOMEM，留着重发；目标线程已经退出时等它回复的连接也已经关了，丢掉
+static int kvs_msg_deliver(struct spdk_thread *thread, spdk_msg_fn fn, void *arg) {
+	int rc = spdk_thread_send_msg(thread, fn, arg);
+
+	if (rc != 0 && rc != -ENOMEM) {
+		SPDK_ERRLOG("Dropping message to an exited thread: %d\n", rc);
+		rc = 0;
+	}
+	return rc;
+}
+
+// 送出去之前先摘下来：对方收到后可能马上拿同一个节点再发
+static int kvs_msg_poll(void *arg) {
+	kvs_msg_t *m;
+	int count = 0;
+
+	while ((m = t_msg_head) != NULL) {
+		struct spdk_thread *thread = m->thread;
+		spdk_msg_fn fn = m->fn;
+		void *msg_arg = m->arg;
+
+		t_msg_head = m->next;
+		if (t_msg_head == NULL) {
+			t_msg_tail = NULL;
+		}
+		m->queued = false;
+		if (kvs_msg_deliver(thread, fn, msg_arg) != 0) {
+			m->queued = true;
+			m->next = t_msg_head;
+			t_msg_head = m;
+			if (t_msg_tail == NULL) {
+				t_msg_tail = m;
+			}
+			return count > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+		}
+		count++;
+	}
+
+	spdk_poller_unregister(&t_msg_poller);
+	return count > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+bool kvs_msg_pending(void) {
+	return t_msg_head != NULL;
+}
+
+void kvs_msg_send(kvs_msg_t *m, struct spdk_thread *thread, spdk_msg_fn fn, void *arg) {
+	if (m->queued) {
+		return;
+	}
+	if (t_msg_head == NULL && kvs_msg_deliver(thread, fn, arg) == 0) {
+		return;
+	}
+
+	m->thread = thread;
+	m->fn = fn;
+	m->arg = arg;
+	m->next = NULL;
+	m->queued = true;
+	if (t_msg_tail) {
+		t_msg_tail->next = m;
+	} else {
+		t_msg_head = m;
+	}
+	t_msg_tail = m;
+
+	// 注册不了就等下一次发送再注册，消息一直留在队列里
+	if (t_msg_poller == NULL) {
+		t_msg_poller = SPDK_POLLER_REGISTER(kvs_msg_poll, NULL, KVS_MSG_RETRY_US);
+	}
+}
+
+/*
+#############
+op
+#############
+*/
+
+struct kvs_scan_pack {
+	kvs_op_t *op;
+	uint32_t limit;
+	size_t len;
+	size_t size;
+};
+
+// 结果缓冲区里留出 need 字节，返回写入位置
+static char *kvs_scan_reserve(struct kvs_scan_pack *pack, size_t need) {
+	kvs_op_t *op = pack->op;
+
+	if (pack->len + need > pack->size) {
+		size_t size = pack->size ? pack->size * 2 : 0x1000;
+		while (pack->len + need > size) {
+			size *= 2;
+		}
+		char *buf = realloc(op->result_buf, size);
+		if (buf == NULL) {
+			op->rc = KVS_ERROR;
+			return NULL;
+		}
+		op->result_buf = buf;
+		pack->size = size;
+	}
+
+	char *p = op->result_buf + pack->len;
+	pack->len += need;
+	return p;
+}
+
+// SCAN 的结果打包成 (uint32_t len + bytes) 序列
+static int kvs_op_scan_cb(void *arg, kvs_slice_t key, kvs_slice_t value) {
+	struct kvs_scan_pack *pack = arg;
+	uint32_t len = key.len;
+	char *p = kvs_scan_reserve(pack, sizeof(len) + key.len);
+
+	if (p == NULL) {
+		return 1;
+	}
+	memcpy(p, &len, sizeof(len));
+	memcpy(p + sizeof(len), key.data, key.len);
+
+	return ++pack->op->count == pack->limit;
+}
+
+// RANGE 的结果打包成 (kvs_value_t * + uint32_t len + bytes) 序列，value 不拷贝，只加引用
+static int kvs_op_range_cb(void *arg, kvs_slice_t key, kvs_value_t *value) {
+	struct kvs_scan_pack *pack = arg;
+	uint32_t len = key.len;
+	char *p = kvs_scan_reserve(pack, sizeof(value) + sizeof(len) + key.len);
+
+	if (p == NULL) {
+		return 1;
+	}
+	kvs_value_get(value);
+	memcpy(p, &value, sizeof(value));
+	memcpy(p + sizeof(value), &len, sizeof(len));
+	memcpy(p + sizeof(value) + sizeof(len), key.data, key.len);
+
+	return ++pack->op->count == pack->limit;
+}
+
+// key.data 为 NULL 时从头开始
+static void kvs_op_scan(kvs_engine_t *e, kvs_op_t *op) {
+	struct kvs_scan_pack pack = { op, op->count, 0, 0 };
+
+	op->count = 0;
+	op->rc = KVS_OK;
+	if (pack.limit > 0) {
+		kvs_bptree_scan(e, op->key.data ? &op->key : NULL, kvs_op_scan_cb, &pack);
+	}
+	op->result.data = op->result_buf;
+	op->result.len = pack.len;
+}
+
+// [key, value] 范围，key/value 的 data 为 NULL 时不限；最多取 count 个，结果大小和 count 成正比
+static void kvs_op_range(kvs_engine_t *e, kvs_op_t *op) {
+	struct kvs_scan_pack pack = { op, op->count, 0, 0 };
+	const kvs_slice_t *start = op->key.data ? &op->key : NULL;
+	const kvs_slice_t *end = op->value.data ? &op->value : NULL;
+
+	op->count = 0;
+	op->rc = KVS_OK;
+	if (pack.limit > 0 && op->engine == KVS_ENGINE_SKIPLIST) {
+		kvs_slist_range(g_slist, start, end, kvs_op_range_cb, &pack);
+	} else if (pack.limit > 0) {
+		kvs_bptree_range(e, start, end, kvs_op_range_cb, &pack);
+	}
+	op->result.data = op->result_buf;
+	op->result.len = pack.len;
+}
+
+static int kvs_op_get(kvs_engine_t *e, kvs_op_t *op, kvs_value_t **value) {
+	switch (op->engine) {
+		case KVS_ENGINE_BPTREE: return kvs_bptree_get(e, op->key, value);
+		case KVS_ENGINE_RBTREE: return kvs_rbtree_get(e, op->key, value);
+		case KVS_ENGINE_HTABLE: return kvs_htable_get(e, op->key, value);
+	}
+	return KVS_ERROR;
+}
+
+static int kvs_op_expire(kvs_engine_t *e, kvs_op_t *op) {
+	switch (op->engine) {
+		case KVS_ENGINE_BPTREE: return kvs_bptree_expire(e, op->key, op->expire);
+		case KVS_ENGINE_RBTREE: return kvs_rbtree_expire(e, op->key, op->expire);
+		case KVS_ENGINE_HTABLE: return kvs_htable_expire(e, op->key, op->expire);
+	}
+	return KVS_ERROR;
+}
+
+// TTL 不拿引用，只带回过期时间
+static int kvs_op_ttl(kvs_engine_t *e, kvs_op_t *op) {
+	kvs_value_t *value;
+	int rc = kvs_op_get(e, op, &value);
+
+	if (rc == KVS_OK) {
+		op->expire = value->expire;
+		kvs_value_put(value);
+	}
+	return rc;
+}
+
+// SET/MOD/PUT 写成功之后再设过期时间，新写的 value 本来不带过期时间
+static int kvs_op_set_expire(kvs_engine_t *e, kvs_op_t *op, int rc) {
+	if (rc != KVS_OK || op->expire == 0 ||
+		(op->type != KVS_OP_SET && op->type != KVS_OP_MOD && op->type != KVS_OP_PUT)) {
+		return rc;
+	}
+	return kvs_op_expire(e, op);
+}
+
+void kvs_op_execute(kvs_engine_t *e, kvs_op_t *op) {
+	int rc = KVS_ERROR;
+
+	if (op->type == KVS_OP_BATCH) {
+		kvs_op_execute_batch(e, op->batch, op->count);
+		op->rc = KVS_OK;
+		return;
+	}
+
+	if (op->engine == KVS_ENGINE_BPTREE) {
+		switch (op->type) {
+			case KVS_OP_SET: rc = kvs_bptree_set(e, op->key, op->value); break;
+			case KVS_OP_GET: rc = kvs_bptree_get(e, op->key, &op->ref); break;
+			case KVS_OP_DEL: rc = kvs_bptree_del(e, op->key); break;
+			case KVS_OP_MOD: rc = kvs_bptree_mod(e, op->key, op->value); break;
+			case KVS_OP_PUT:
+				rc = kvs_bptree_set(e, op->key, op->value);
+				if (rc == KVS_EXIST) {
+					rc = kvs_bptree_mod(e, op->key, op->value);
+				}
+				break;
+			case KVS_OP_SCAN:
+				kvs_op_scan(e, op);
+				return;
+			case KVS_OP_RANGE:
+				kvs_op_range(e, op);
+				return;
+			case KVS_OP_EXPIRE: rc = kvs_bptree_expire(e, op->key, op->expire); break;
+			case KVS_OP_TTL: rc = kvs_op_ttl(e, op); break;
+		}
+	} else if (op->engine == KVS_ENGINE_RBTREE) {
+		switch (op->type) {
+			case KVS_OP_SET: rc = kvs_rbtree_set(e, op->key, op->value); break;
+			case KVS_OP_GET: rc = kvs_rbtree_get(e, op->key, &op->ref); break;
+			case KVS_OP_DEL: rc = kvs_rbtree_del(e, op->key); break;
+			case KVS_OP_MOD: rc = kvs_rbtree_mod(e, op->key, op->value); break;
+			case KVS_OP_PUT:
+				rc = kvs_rbtree_set(e, op->key, op->value);
+				if (rc == KVS_EXIST) {
+					rc = kvs_rbtree_mod(e, op->key, op->value);
+				}
+				break;
+			case KVS_OP_EXPIRE: rc = kvs_rbtree_expire(e, op->key, op->expire); break;
+			case KVS_OP_TTL: rc = kvs_op_ttl(e, op); break;
+		}
+	} else if (op->engine == KVS_ENGINE_HTABLE) {
+		switch (op->type) {
+			case KVS_OP_SET: rc = kvs_htable_set(e, op->key, op->value); break;
+			case KVS_OP_GET: rc = kvs_htable_get(e, op->key, &op->ref); break;
+			case KVS_OP_DEL: rc = kvs_htable_del(e, op->key); break;
+			case KVS_OP_MOD: rc = kvs_htable_mod(e, op->key, op->value); break;
+			case KVS_OP_PUT:
+				rc = kvs_htable_set(e, op->key, op->value);
+				if (rc == KVS_EXIST) {
+					rc = kvs_htable_mod(e, op->key, op->value);
+				}
+				break;
+			case KVS_OP_EXPIRE: rc = kvs_htable_expire(e, op->key, op->expire); break;
+			case KVS_OP_TTL: rc = kvs_op_ttl(e, op); break;
+		}
+	} else if (op->engine == KVS_ENGINE_SKIPLIST) {
+		switch (op->type) {
+			case KVS_OP_SET: rc = kvs_slist_set(g_slist, op->key, op->value); break;
+			case KVS_OP_GET: rc = kvs_slist_get(g_slist, op->key, &op->ref); break;
+			case KVS_OP_DEL: rc = kvs_slist_del(g_slist, op->key); break;
+			case KVS_OP_MOD: rc = kvs_slist_mod(g_slist, op->key, op->value); break;
+			case KVS_OP_PUT: rc = kvs_slist_put(g_slist, op->key, op->value); break;
+			case KVS_OP_RANGE:
+				kvs_op_range(e, op);
+				return;
+		}
+	}
+
+	op->rc = kvs_op_set_expire(e, op, rc);
+}
+
+// 批量接口的参数，shard 线程上同一时间只有一个批在执行
+static __thread kvs_batch_item_t g_batch_items[KVS_BATCH_MAX];
+
+// 带过期时间的 PUT 逐个执行，批量接口里同一个 key 的多次写只有最后一次生效，过期时间对不上
+static bool kvs_op_batchable(const kvs_op_t *op) {
+	return op->engine == KVS_ENGINE_BPTREE && op->expire == 0 &&
+		(op->type == KVS_OP_GET || op->type == KVS_OP_PUT || op->type == KVS_OP_DEL);
+}
+
+void kvs_op_execute_batch(kvs_engine_t *e, kvs_op_t **ops, int n) {
+	kvs_batch_item_t *items = g_batch_items;
+	int i = 0;
+
+	while (i < n) {
+		kvs_op_t *op = ops[i];
+		int j = i + 1;
+
+		while (j < n && j - i < KVS_BATCH_MAX &&
+			ops[j]->engine == op->engine && ops[j]->type == op->type &&
+			ops[j]->expire == op->expire) {
+			j++;
+		}
+		if (j - i == 1 || !kvs_op_batchable(op)) {
+			for (; i < j; i++) {
+				kvs_op_execute(e, ops[i]);
+			}
+			continue;
+		}
+
+		for (int k = i; k < j; k++) {
+			items[k - i].key = ops[k]->key;
+			items[k - i].value = ops[k]->value;
+			items[k - i].ref = NULL;
+		}
+		switch (op->type) {
+			case KVS_OP_GET: kvs_bptree_mget(e, items, j - i); break;
+			case KVS_OP_PUT: kvs_bptree_mput(e, items, j - i); break;
+			case KVS_OP_DEL: kvs_bptree_mdel(e, items, j - i); break;
+		}
+		for (int k = i; k < j; k++) {
+			ops[k]->rc = items[k - i].rc;
+			ops[k]->ref = items[k - i].ref;
+		}
+		i = j;
+	}
+}
+
+void kvs_op_free_result(kvs_op_t *op) {
+	if (op->ref) {
+		kvs_value_put(op->ref);
+		op->ref = NULL;
+	}
+	if (op->type == KVS_OP_RANGE) {
+		kvs_slice_t key;
+		kvs_value_t *value;
+		size_t off = 0, n;
+		while ((n = kvs_op_range_peek(op, off, &key, &value)) > 0) {
+			kvs_value_put(value);
+			off += n;
+		}
+		op->result.len = 0;
+	}
+	free(op->result_buf);
+	op->result_buf = NULL;
+}
+
+/*
+#############
+hot key
+#############
+*/
+
+static uint64_t kvs_hot_key_hash(uint8_t engine, kvs_slice_t key) {
+	return kvs_hash(key.data, key.len) ^ ((uint64_t)(engine + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+// 复制给一个 shard 的热 key，带着 value 的一个引用
+struct kvs_hot_msg {
+	kvs_value_t *value;
+	uint64_t hash;
+	uint64_t expire;
+	uint8_t engine;
+	uint8_t len;
+	char key[KVS_HOT_KEY_MAX];
+};
+
+static void kvs_hot_install_msg(void *arg) {
+	struct kvs_hot_msg *m = arg;
+	kvs_shard_t *shard = g_local_shard;
+
+	if (shard && shard->hot) {
+		kvs_slice_t key = { m->key, m->len };
+		kvs_hot_replica_set(shard->hot, m->engine, key, m->hash, m->value, m->expire);
+	} else {
+		kvs_value_put(m->value);
+	}
+	free(m);
+}
+
+// 作废和命中报告只带 hash，不用分配内存
+static void kvs_hot_drop_msg(void *arg) {
+	kvs_shard_t *shard = g_local_shard;
+
+	if (shard && shard->hot) {
+		kvs_hot_replica_drop(shard->hot, (uint64_t)(uintptr_t)arg);
+	}
+}
+
+static void kvs_hot_drop_all_msg(void *arg) {
+	kvs_shard_t *shard = g_local_shard;
+
+	if (shard && shard->hot) {
+		kvs_hot_replica_drop_all(shard->hot);
+	}
+}
+
+static void kvs_hot_report_msg(void *arg) {
+	kvs_shard_t *shard = g_local_shard;
+
+	if (shard && shard->hot) {
+		kvs_hot_report(shard->hot, (uint64_t)(uintptr_t)arg, KVS_HOT_REPORT);
+	}
+}
+
+// 复制发给其他每个 shard，发出去一个就算复制了；作废一定要送到，否则别的 shard 会一直读到旧的 value。
+// 消息池满了，或者前面还有排队重发的消息（直接发会插到它们前面）时，改成排队让那个 shard 清空副本：
+// 节点是预先分配的，一定送得到，也排在这个写的回复前面；已经在排的就不用再排
+static bool kvs_shard_hot_cb(void *arg, const kvs_hot_entry_t *e, kvs_value_t *value) {
+	kvs_shard_t *shard = arg;
+	bool sent = false;
+
+	if (value && (value->flags & KVS_VALUE_COLD)) {
+		return false;
+	}
+
+	for (int i = 0; i < g_nshards; i++) {
+		if (i == shard->index) {
+			continue;
+		}
+		if (value == NULL) {
+			if (kvs_msg_pending() ||
+				spdk_thread_send_msg(g_shards[i].thread, kvs_hot_drop_msg, (void *)(uintptr_t)e->hash) != 0) {
+				kvs_msg_send(&shard->hot_drop[i], g_shards[i].thread, kvs_hot_drop_all_msg, NULL);
+			}
+			continue;
+		}
+
+		struct kvs_hot_msg *m = malloc(sizeof(*m));
+		if (m == NULL) {
+			continue;
+		}
+		kvs_value_get(value);
+		m->value = value;
+		m->hash = e->hash;
+		m->expire = value->expire;
+		m->engine = e->engine;
+		m->len = e->len;
+		memcpy(m->key, e->key, e->len);
+		if (spdk_thread_send_msg(g_shards[i].thread, kvs_hot_install_msg, m) != 0) {
+			kvs_value_put(value);
+			free(m);
+			continue;
+		}
+		sent = true;
+	}
+	return sent;
+}
+
+// 跳表不属于哪个 shard，不用复制
+static void kvs_op_track_one(kvs_shard_t *shard, kvs_op_t *op) {
+	if (op->rc != KVS_OK || op->engine == KVS_ENGINE_SKIPLIST || op->key.len > KVS_HOT_KEY_MAX) {
+		return;
+	}
+	if (op->type == KVS_OP_GET) {
+		kvs_hot_read(shard->hot, op->engine, op->key, kvs_hot_key_hash(op->engine, op->key), op->ref, 1);
+	} else if (kvs_op_is_write(op)) {
+		kvs_hot_write(shard->hot, kvs_hot_key_hash(op->engine, op->key));
+	}
+}
+
+void kvs_op_track(kvs_shard_t *shard, kvs_op_t *op) {
+	if (shard->journal) {
+		kvs_journal_op(shard->journal, op);
+	}
+	if (shard->hot == NULL) {
+		return;
+	}
+	if (op->type == KVS_OP_BATCH) {
+		for (uint32_t i = 0; i < op->count; i++) {
+			kvs_op_track_one(shard, op->batch[i]);
+		}
+	} else {
+		kvs_op_track_one(shard, op);
+	}
+}
+
+// 命中够 KVS_HOT_REPORT 次时告诉所属 shard，消息池满了就算了
+bool kvs_op_replica_get(kvs_shard_t *shard, kvs_op_t *op) {
+	bool report;
+
+	if (shard->hot == NULL || op->type != KVS_OP_GET || op->engine == KVS_ENGINE_SKIPLIST ||
+			op->key.len > KVS_HOT_KEY_MAX) {
+		return false;
+	}
+
+	uint64_t hash = kvs_hot_key_hash(op->engine, op->key);
+	if (!kvs_hot_replica_get(shard->hot, op->engine, op->key, hash, kvs_now_ms(), &op->ref, &report)) {
+		return false;
+	}
+	op->rc = KVS_OK;
+	if (report) {
+		spdk_thread_send_msg(g_shards[op->shard].thread, kvs_hot_report_msg, (void *)(uintptr_t)hash);
+	}
+	return true;
+}
+
+/*
+#############
+cold value
+#############
+*/
+
+// 一个冷 value 的读：GET 的结果换掉 sub->ref，RANGE 的换掉结果里 off 处的那一项
+struct kvs_op_fetch {
+	kvs_op_t *op;			// 全部读完才完成
+	kvs_op_t *sub;
+	size_t off;
+	kvs_value_t *stub;
+};
+
+static void kvs_op_finish(kvs_op_t *op);
+
+// RANGE 读失败时 stub 留在结果里，由 kvs_op_free_result 释放，op 按失败回复
+static void kvs_op_fetched(void *arg, kvs_value_t *value) {
+	struct kvs_op_fetch *f = arg;
+	kvs_op_t *op = f->op;
+
+	if (f->sub) {
+		// 读回来的放回树里，下次不用再读；在这之间 key 被改过就算了
+		if (value) {
+			kvs_engine_fill(g_shards[op->shard].engine, f->sub->engine, f->sub->key, f->stub, value);
+		}
+		f->sub->ref = value;
+		f->sub->rc = value ? KVS_OK : KVS_ERROR;
+		kvs_value_put(f->stub);
+	} else if (value) {
+		memcpy(op->result_buf + f->off, &value, sizeof(value));
+		kvs_value_put(f->stub);
+	} else {
+		op->rc = KVS_ERROR;
+	}
+	free(f);
+
+	if (--op->pending == 0) {
+		kvs_op_finish(op);
+	}
+}
+
+static void kvs_op_fetch(kvs_shard_t *shard, kvs_op_t *op, kvs_op_t *sub, size_t off,
+		kvs_slice_t key, kvs_value_t *stub) {
+	struct kvs_op_fetch *f = malloc(sizeof(*f));
+
+	if (f != NULL) {
+		f->op = op;
+		f->sub = sub;
+		f->off = off;
+		f->stub = stub;
+		op->pending++;
+		if (kvs_vlog_read(shard->vlog, key, stub, kvs_op_fetched, f) == 0) {
+			return;
+		}
+		op->pending--;
+		free(f);
+	}
+
+	if (sub) {
+		sub->ref = NULL;
+		sub->rc = KVS_ERROR;
+		kvs_value_put(stub);
+	} else {
+		op->rc = KVS_ERROR;
+	}
+}
+
+static bool kvs_value_is_cold(const kvs_value_t *v) {
+	return v != NULL && (v->flags & KVS_VALUE_COLD);
+}
+
+static void kvs_op_fetch_get(kvs_shard_t *shard, kvs_op_t *op, kvs_op_t *sub) {
+	if (sub->type == KVS_OP_GET && sub->rc == KVS_OK && kvs_value_is_cold(sub->ref)) {
+		kvs_op_fetch(shard, op, sub, 0, sub->key, sub->ref);
+	}
+}
+
+// 执行完之后把结果里的冷 value 都读回来再完成，读是并行发出去的
+static void kvs_op_load(kvs_shard_t *shard, kvs_op_t *op) {
+	op->pending = 1;	// 发读的过程中先多持有一次
+
+	if (shard->vlog && op->type == KVS_OP_GET) {
+		kvs_op_fetch_get(shard, op, op);
+	} else if (shard->vlog && op->type == KVS_OP_BATCH) {
+		for (uint32_t i = 0; i < op->count; i++) {
+			kvs_op_fetch_get(shard, op, op->batch[i]);
+		}
+	} else if (shard->vlog && op->type == KVS_OP_RANGE) {
+		kvs_slice_t key;
+		kvs_value_t *value;
+		size_t off = 0, n;
+		while ((n = kvs_op_range_peek(op, off, &key, &value)) > 0) {
+			if (kvs_value_is_cold(value)) {
+				kvs_op_fetch(shard, op, NULL, off, key, value);
+			}
+			off += n;
+		}
+	}
+
+	if (--op->pending == 0) {
+		kvs_op_finish(op);
+	}
+}
+
+static void kvs_op_done_msg(void *arg) {
+	kvs_op_t *op = arg;
+	op->cb(op);
+}
+
+// 在目标 shard 上执行完，回到 origin
+static void kvs_op_finish(kvs_op_t *op) {
+	if (op->origin == &g_shards[op->shard]) {
+		op->cb(op);
+		return;
+	}
+
+	// origin 一直在等这个回复，消息池耗尽时排队重发
+	kvs_msg_send(&op->msg, op->origin->thread, kvs_op_done_msg, op);
+}
+
+// 日志写失败时内存里已经改了，但没有落盘，按失败回复
+static void kvs_op_durable(void *arg, int status) {
+	kvs_op_t *op = arg;
+
+	if (status != 0) {
+		if (op->type != KVS_OP_BATCH) {
+			op->rc = KVS_ERROR;
+		}
+		for (uint32_t i = 0; op->type == KVS_OP_BATCH && i < op->count; i++) {
+			if (kvs_op_is_write(op->batch[i])) {
+				op->batch[i]->rc = KVS_ERROR;
+			}
+		}
+	}
+	kvs_op_finish(op);
+}
+
+// 日志里记的是执行的结果：成功的 SET/MOD/PUT 记成 PUT，成功的 DEL 记成 DEL，没改 engine 的不记。
+// 设了过期时间的再跟一条 EXPIRE，value 是 le64 的过期时间
+static size_t kvs_op_log_size(const kvs_op_t *op) {
+	size_t size = 0;
+
+	if (!kvs_op_is_logged(op)) {
+		return 0;
+	}
+	if (op->type != KVS_OP_EXPIRE) {
+		size += sizeof(kvs_wal_rec_t) + op->key.len + (op->type == KVS_OP_DEL ? 0 : op->value.len);
+	}
+	if (op->type == KVS_OP_EXPIRE || (op->type != KVS_OP_DEL && op->expire != 0)) {
+		size += sizeof(kvs_wal_rec_t) + op->key.len + sizeof(uint64_t);
+	}
+	return size;
+}
+
+static void kvs_op_log(kvs_wal_t *wal, kvs_op_t *op) {
+	kvs_slice_t none = {};
+	uint64_t expire;
+	int rc = 0;
+
+	if (!kvs_op_is_logged(op) || op->rc != KVS_OK) {
+		return;
+	}
+	if (op->type == KVS_OP_DEL) {
+		rc = kvs_wal_append(wal, op->engine, KVS_OP_DEL, op->key, none);
+	} else if (op->type != KVS_OP_EXPIRE) {
+		rc = kvs_wal_append(wal, op->engine, KVS_OP_PUT, op->key, op->value);
+	}
+	if (rc == 0 && (op->type == KVS_OP_EXPIRE || (op->type != KVS_OP_DEL && op->expire != 0))) {
+		kvs_slice_t value = { (const char *)&expire, sizeof(expire) };
+		to_le64(&expire, op->expire);
+		rc = kvs_wal_append(wal, op->engine, KVS_OP_EXPIRE, op->key, value);
+	}
+	if (rc != 0) {
+		op->rc = KVS_ERROR;
+	}
+}
+
+// 先确认日志放得下，再执行，最后把结果追加进日志；日志放不下的写不执行。
+// 有写的 op 都等日志落盘再完成，失败的写读到的也是已经落盘的状态
+static void kvs_op_run(kvs_shard_t *shard, kvs_op_t *op) {
+	kvs_wal_t *wal = shard->wal;
+	size_t need = 0;
+
+	if (wal == NULL) {
+		kvs_op_execute(shard->engine, op);
+		kvs_op_track(shard, op);
+		kvs_op_load(shard, op);
+		return;
+	}
+
+	if (op->type == KVS_OP_BATCH) {
+		for (uint32_t i = 0; i < op->count; i++) {
+			need += kvs_op_log_size(op->batch[i]);
+		}
+	} else {
+		need = kvs_op_log_size(op);
+	}
+	if (need == 0) {
+		kvs_op_execute(shard->engine, op);
+		kvs_op_track(shard, op);
+		kvs_op_finish(op);
+		return;
+	}
+
+	if (kvs_wal_reserve(wal, need) != 0) {
+		if (op->type != KVS_OP_BATCH) {
+			op->rc = KVS_ERROR;
+			kvs_op_finish(op);
+			return;
+		}
+		// 批里的读照常执行
+		int n = 0;
+		for (uint32_t i = 0; i < op->count; i++) {
+			if (kvs_op_is_write(op->batch[i])) {
+				op->batch[i]->rc = KVS_ERROR;
+			} else {
+				op->batch[n++] = op->batch[i];
+			}
+		}
+		kvs_op_execute_batch(shard->engine, op->batch, n);
+		for (int i = 0; shard->hot && i < n; i++) {
+			kvs_op_track_one(shard, op->batch[i]);
+		}
+		op->rc = KVS_OK;
+		kvs_op_finish(op);
+		return;
+	}
+
+	kvs_op_execute(shard->engine, op);
+	kvs_op_track(shard, op);
+	if (op->type == KVS_OP_BATCH) {
+		for (uint32_t i = 0; i < op->count; i++) {
+			kvs_op_log(wal, op->batch[i]);
+		}
+	} else {
+		kvs_op_log(wal, op);
+	}
+	kvs_wal_wait(wal, &op->wal_wait, kvs_op_durable, op);
+}
+
+static void kvs_op_execute_msg(void *arg) {
+	kvs_op_t *op = arg;
+
+	kvs_op_run(&g_shards[op->shard], op);
+}
+
+void kvs_op_submit(kvs_shard_t *origin, kvs_op_t *op) {
+	kvs_shard_t *target = &g_shards[op->shard];
+
+	op->origin = origin;
+	if (target == origin) {
+		kvs_op_run(target, op);
+		return;
+	}
+
+	kvs_msg_send(&op->msg, target->thread, kvs_op_execute_msg, op);
+}
+
+/*
+#############
+shard
+#############
+*/
+
+struct kvs_shard_iter {
+	kvs_shard_fn fn;
+	void *arg;
+	spdk_msg_fn done;
+	struct spdk_thread *caller;
+	int index;
+	kvs_msg_t msg;
+};
+
+static void kvs_shard_iter_next(void *arg);
+
+static void kvs_shard_iter_run(void *arg) {
+	struct kvs_shard_iter *it = arg;
+
+	it->fn(&g_shards[it->index], it->arg);
+	it->index++;
+
+	kvs_msg_send(&it->msg, it->caller, kvs_shard_iter_next, it);
+}
+
+static void kvs_shard_iter_next(void *arg) {
+	struct kvs_shard_iter *it = arg;
+
+	if (it->index == g_nshards) {
+		it->done(it->arg);
+		free(it);
+		return;
+	}
+
+	kvs_msg_send(&it->msg, g_shards[it->index].thread, kvs_shard_iter_run, it);
+}
+
+int kvs_shard_for_each(kvs_shard_fn fn, void *arg, spdk_msg_fn done) {
+	struct kvs_shard_iter *it = calloc(1, sizeof(*it));
+	if (it == NULL) {
+		return -ENOMEM;
+	}
+
+	it->fn = fn;
+	it->arg = arg;
+	it->done = done;
+	it->caller = spdk_get_thread();
+	kvs_shard_iter_next(it);
+	return 0;
+}
+
+struct kvs_shard_start_ctx {
+	kvs_shard_start_fn done;
+	void *arg;
+	int rc;
+	int pending;
+	struct spdk_thread *caller;
+};
+
+#define KVS_CKPT_POLL_US	(100 * 1000)
+#define KVS_TTL_POLL_US		1000	// 和时间轮的一格一样长
+#define KVS_TTL_BUDGET		256		// 一次最多处理的到期项，剩下的留给下一次
+#define KVS_SLAB_POLL_US	(10 * 1000)
+#define KVS_SLAB_BUDGET		4096	// 碎片整理一次最多看的 value
+#define KVS_SLAB_REST		100		// 腾不出页时歇这么多次再看
+
+static struct spdk_nvme_ctrlr *g_nvme_ctrlr;
+static struct spdk_nvme_ns *g_nvme_ns;
+static uint64_t g_tier_budget;		// 所有 shard 的内存预算，0 表示 ns 用来做 WAL
+static uint32_t g_hot_threshold;	// 0 表示不复制热 key
+
+void kvs_shards_use_nvme(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns) {
+	g_nvme_ctrlr = ctrlr;
+	g_nvme_ns = ns;
+}
+
+void kvs_shards_use_tiering(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns, uint64_t budget) {
+	g_nvme_ctrlr = ctrlr;
+	g_nvme_ns = ns;
+	g_tier_budget = budget;
+}
+
+void kvs_shards_use_hot(uint32_t threshold) {
+	g_hot_threshold = threshold;
+}
+
+// namespace 按 shard 数等分，每段 4K 对齐，前 1/4 做 WAL，剩下的给两个 checkpoint 槽；
+// seed 里带上 shard 数，shard 数变了旧日志不会被重放到错误的 shard 上
+static int kvs_shard_nvme_create(kvs_shard_t *shard) {
+	uint32_t sector_size = spdk_nvme_ns_get_sector_size(g_nvme_ns);
+	uint64_t align = sector_size < KVS_WAL_BLOCK ? KVS_WAL_BLOCK / sector_size : 1;
+	uint64_t per = spdk_nvme_ns_get_num_sectors(g_nvme_ns) / g_nshards / align * align;
+	uint64_t wal_lba = per / 4 / align * align;
+	uint64_t start = per * shard->index;
+
+	shard->wal = kvs_wal_create(g_nvme_ctrlr, g_nvme_ns, start, wal_lba,
+		KVS_WAL_MAGIC ^ ((uint32_t)g_nshards << 16 | shard->index));
+	if (shard->wal == NULL) {
+		return -EIO;
+	}
+	shard->ckpt = kvs_ckpt_create(g_nvme_ctrlr, g_nvme_ns, start + wal_lba, per - wal_lba);
+	if (shard->ckpt == NULL) {
+		return -EIO;
+	}
+	return 0;
+}
+
+// namespace 按 shard 数等分，整段做 value log，内存预算也按 shard 数等分
+static int kvs_shard_vlog_create(kvs_shard_t *shard) {
+	uint32_t sector_size = spdk_nvme_ns_get_sector_size(g_nvme_ns);
+	uint64_t align = sector_size < KVS_VLOG_BLOCK ? KVS_VLOG_BLOCK / sector_size : 1;
+	uint64_t per = spdk_nvme_ns_get_num_sectors(g_nvme_ns) / g_nshards / align * align;
+
+	shard->vlog = kvs_vlog_create(g_nvme_ctrlr, g_nvme_ns, per * shard->index, per,
+		shard->engine, g_tier_budget / g_nshards);
+	return shard->vlog ? 0 : -EIO;
+}
+
+// 同一时刻到期的 key 再多，一次也只删 KVS_TTL_BUDGET 个，不会卡住这个 shard 上的请求
+static int kvs_shard_ttl_poll(void *arg) {
+	kvs_shard_t *shard = arg;
+
+	return kvs_engine_expire_tick(shard->engine, kvs_now_ms(), KVS_TTL_BUDGET) > 0 ?
+		SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// slab 有可以腾空的页时把上面的 value 搬走，一次只看 KVS_SLAB_BUDGET 个，不会卡住请求；
+// 腾不出页就歇 KVS_SLAB_REST 次轮询，搬不动的页过一阵再看
+static int kvs_shard_slab_poll(void *arg) {
+	kvs_shard_t *shard = arg;
+
+	if (shard->slab_rest > 0) {
+		shard->slab_rest--;
+		return SPDK_POLLER_IDLE;
+	}
+	if (kvs_value_compact(KVS_SLAB_BUDGET) > 0) {
+		return SPDK_POLLER_BUSY;
+	}
+	shard->slab_rest = KVS_SLAB_REST;
+	return SPDK_POLLER_IDLE;
+}
+
+static void kvs_shard_init(kvs_shard_t *shard, void *arg) {
+	struct kvs_shard_start_ctx *ctx = arg;
+
+	// 这个 reactor 上创建的 value 从它自己的 slab 缓存里分配
+	if (kv_slab_cache_init() != 0) {
+		SPDK_ERRLOG("Cannot create slab cache for shard %d\n", shard->index);
+		ctx->rc = -ENOMEM;
+		return;
+	}
+	shard->engine = kvs_engine_create();
+	if (shard->engine == NULL) {
+		SPDK_ERRLOG("Cannot create engine for shard %d\n", shard->index);
+		ctx->rc = -ENOMEM;
+		return;
+	}
+	shard->ttl_poller = SPDK_POLLER_REGISTER(kvs_shard_ttl_poll, shard, KVS_TTL_POLL_US);
+	shard->slab_poller = SPDK_POLLER_REGISTER(kvs_shard_slab_poll, shard, KVS_SLAB_POLL_US);
+	g_local_shard = shard;
+
+	// 只有一个 shard 时没有地方复制
+	if (g_hot_threshold && g_nshards > 1) {
+		shard->hot = kvs_hot_create(g_hot_threshold, kvs_shard_hot_cb, shard);
+		if (shard->hot == NULL) {
+			SPDK_ERRLOG("Cannot create hot key tracker for shard %d\n", shard->index);
+			ctx->rc = -ENOMEM;
+			return;
+		}
+	}
+
+	if (g_nvme_ns && g_tier_budget && kvs_shard_vlog_create(shard) != 0) {
+		SPDK_ERRLOG("Cannot create value log for shard %d\n", shard->index);
+		ctx->rc = -EIO;
+	} else if (g_nvme_ns && !g_tier_budget && kvs_shard_nvme_create(shard) != 0) {
+		SPDK_ERRLOG("Cannot create WAL or checkpoint for shard %d\n", shard->index);
+		ctx->rc = -EIO;
+	}
+}
+
+static void kvs_shard_start_done(void *arg) {
+	struct kvs_shard_start_ctx *ctx = arg;
+
+	ctx->done(ctx->arg, ctx->rc);
+	free(ctx);
+}
+
+// 重放不走 WAL，直接改 engine
+static void kvs_shard_replay_rec(void *arg, uint8_t engine, uint8_t type, kvs_slice_t key, kvs_slice_t value) {
+	kvs_shard_t *shard = arg;
+	kvs_op_t op = {};
+
+	op.engine = engine;
+	op.type = type;
+	op.key = key;
+	op.value = value;
+	if (type == KVS_OP_EXPIRE) {
+		if (value.len != sizeof(uint64_t)) {
+			return;
+		}
+		op.expire = from_le64(value.data);
+	}
+	kvs_op_execute(shard->engine, &op);
+}
+
+// 启动只有一次，重放期间各 shard 完成后都回到这里
+static struct kvs_shard_start_ctx *g_start_ctx;
+
+static void kvs_shard_recovered_msg(void *arg) {
+	struct kvs_shard_start_ctx *ctx = g_start_ctx;
+	int rc = (int)(intptr_t)arg;
+
+	if (rc != 0) {
+		ctx->rc = rc;
+	}
+	if (--ctx->pending == 0) {
+		g_start_ctx = NULL;
+		kvs_shard_start_done(ctx);
+	}
+}
+
+static int kvs_shard_ckpt_poll(void *arg);
+
+// 恢复完才开始检查要不要写 checkpoint
+static void kvs_shard_replay_done(void *arg, int rc) {
+	kvs_shard_t *shard = arg;
+
+	if (rc != 0) {
+		SPDK_ERRLOG("Recovery failed on shard %d: %d\n", shard->index, rc);
+	} else {
+		shard->ckpt_poller = SPDK_POLLER_REGISTER(kvs_shard_ckpt_poll, shard, KVS_CKPT_POLL_US);
+	}
+	kvs_msg_send(&shard->start_msg, g_start_ctx->caller, kvs_shard_recovered_msg, (void *)(intptr_t)rc);
+}
+
+// checkpoint 加载完，从它开始时的位置接着重放日志
+static void kvs_shard_ckpt_loaded(void *arg, int rc, const kvs_wal_pos_t *pos) {
+	kvs_shard_t *shard = arg;
+
+	if (rc != 0) {
+		kvs_shard_replay_done(shard, rc);
+		return;
+	}
+	if (kvs_wal_replay(shard->wal, pos, kvs_shard_replay_rec, shard, kvs_shard_replay_done, shard) != 0) {
+		kvs_shard_replay_done(shard, -ENOMEM);
+	}
+}
+
+static void kvs_shard_replay_msg(void *arg) {
+	kvs_shard_t *shard = arg;
+
+	if (kvs_ckpt_load(shard->ckpt, shard->engine, kvs_shard_ckpt_loaded, shard) != 0) {
+		kvs_shard_replay_done(shard, -ENOMEM);
+	}
+}
+
+static void kvs_shard_ckpt_done(void *arg, int rc, const kvs_wal_pos_t *pos) {
+	kvs_shard_t *shard = arg;
+
+	if (rc != 0) {
+		SPDK_ERRLOG("Checkpoint failed on shard %d: %d\n", shard->index, rc);
+		return;
+	}
+	kvs_wal_truncate(shard->wal, pos->off);
+}
+
+int kvs_shard_checkpoint(kvs_shard_t *shard) {
+	kvs_wal_pos_t pos;
+
+	if (shard->ckpt == NULL) {
+		return -ENODEV;
+	}
+	if (kvs_ckpt_busy(shard->ckpt)) {
+		return -EBUSY;
+	}
+	kvs_wal_mark(shard->wal, &pos);
+	return kvs_ckpt_save(shard->ckpt, shard->engine, &pos, kvs_shard_ckpt_done, shard);
+}
+
+// 日志用掉一半就写一次 checkpoint，写完之后前面的日志空间可以复用
+static int kvs_shard_ckpt_poll(void *arg) {
+	kvs_shard_t *shard = arg;
+
+	if (kvs_ckpt_busy(shard->ckpt) || kvs_wal_used(shard->wal) < kvs_wal_size(shard->wal) / 2) {
+		return SPDK_POLLER_IDLE;
+	}
+	return kvs_shard_checkpoint(shard) == 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// 所有 shard 并行重放各自的日志，全部完成后才算启动完成
+static void kvs_shard_init_done(void *arg) {
+	struct kvs_shard_start_ctx *ctx = arg;
+
+	// value log 不需要恢复，重启后从空的开始
+	if (ctx->rc != 0 || g_nvme_ns == NULL || g_tier_budget) {
+		kvs_shard_start_done(ctx);
+		return;
+	}
+
+	ctx->caller = spdk_get_thread();
+	ctx->pending = g_nshards;
+	g_start_ctx = ctx;
+	for (int i = 0; i < g_nshards; i++) {
+		kvs_msg_send(&g_shards[i].start_msg, g_shards[i].thread, kvs_shard_replay_msg, &g_shards[i]);
+	}
+}
+
+int kvs_shards_start(kvs_shard_start_fn done, void *arg) {
+	struct spdk_cpuset cpumask;
+	char name[32];
+	uint32_t core;
+
+	g_nshards = 0;
+	SPDK_ENV_FOREACH_CORE(core) {
+		if (g_nshards == KVS_MAX_SHARDS) {
+			break;
+		}
+
+		kvs_shard_t *shard = &g_shards[g_nshards];
+
+		spdk_cpuset_zero(&cpumask);
+		spdk_cpuset_set_cpu(&cpumask, core, true);
+		snprintf(name, sizeof(name), "kvs_shard_%u", core);
+
+		shard->index = g_nshards;
+		shard->core = core;
+		shard->thread = spdk_thread_create(name, &cpumask);
+		if (shard->thread == NULL) {
+			SPDK_ERRLOG("Cannot create thread on core %u\n", core);
+			return -1;
+		}
+		g_nshards++;
+	}
+
+	g_slist = kvs_slist_create();
+	if (g_slist == NULL) {
+		return -ENOMEM;
+	}
+
+	struct kvs_shard_start_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		return -ENOMEM;
+	}
+	ctx->done = done;
+	ctx->arg = arg;
+
+	SPDK_NOTICELOG("Starting %d kv shards\n", g_nshards);
+	return kvs_shard_for_each(kvs_shard_init, ctx, kvs_shard_init_done);
+}
+
+static void kvs_shard_fini(kvs_shard_t *shard, void *arg) {
+	spdk_poller_unregister(&shard->ckpt_poller);
+	spdk_poller_unregister(&shard->ttl_poller);
+	spdk_poller_unregister(&shard->slab_poller);
+	kvs_ckpt_destroy(shard->ckpt);
+	shard->ckpt = NULL;
+	kvs_wal_destroy(shard->wal);
+	shard->wal = NULL;
+	kvs_vlog_destroy(shard->vlog);
+	shard->vlog = NULL;
+	kvs_engine_destroy(shard->engine);
+	shard->engine = NULL;
+	kvs_hot_destroy(shard->hot);
+	shard->hot = NULL;
+	// 按顺序销毁，最后一个 shard 停下时已经没有线程访问跳表
+	if (shard->index == g_nshards - 1) {
+		kvs_slist_destroy(g_slist);
+		g_slist = NULL;
+	}
+	// 后面的 shard 还没停，它们的热 key 副本和还没发完的回复可能引用这里分配的 value；
+	// 缓存留到所有 shard 都停下之后由 kvs_shards_stop 的调用方 reap
+	kv_slab_cache_fini();
+	spdk_thread_exit(shard->thread);
+}
+
+void kvs_shards_stop(spdk_msg_fn done, void *arg) {
+	if (kvs_shard_for_each(kvs_shard_fini, arg, done) != 0) {
+		done(arg);
+	}
+}
@@ -0,0 +1,190 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include "spdk/stdinc.h"
+#include "spdk/thread.h"
+
+#include "kv_engine.h"
+#include "kvs_wal.h"
+#include "kvs_ckpt.h"
+#include "kvs_vlog.h"
+#include "kvs_hot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KVS_MAX_SHARDS		64
+
+// 一定要送到的消息。spdk_thread_send_msg 在消息池耗尽时会失败，失败的消息挂在发送线程的队列上，
+// 由这个线程上的 poller 按顺序重发；队列不空时后发的也排在后面，一个线程发出的消息不会乱序。
+// 节点由调用方提供（放在 op 之类的结构里），排队不用分配内存
+typedef struct kvs_msg_s {
+	struct kvs_msg_s *next;
+	struct spdk_thread *thread;
+	spdk_msg_fn fn;
+	void *arg;
+	bool queued;
+} kvs_msg_t;
+
+// 在 spdk 线程上调用。m 送出之前不能再用，已经在队列里时什么都不做；目标线程已经退出时丢掉
+void kvs_msg_send(kvs_msg_t *m, struct spdk_thread *thread, spdk_msg_fn fn, void *arg);
+// 当前线程还有没送出去的消息，这时直接 spdk_thread_send_msg 会插到它们前面
+bool kvs_msg_pending(void);
+
+// 每个 reactor 一个 shard：一个 spdk_thread 加上它独占的 engine，engine 只在这个线程上访问，不加锁
+typedef struct kvs_shard_s {
+	int index;
+	uint32_t core;
+	struct spdk_thread *thread;
+	kvs_engine_t *engine;
+	kvs_wal_t *wal;			// 开了 WAL 时，写先落盘再回复
+	kvs_ckpt_t *ckpt;		// 和 WAL 一起开，日志用掉一半时写一次
+	struct spdk_poller *ckpt_poller;
+	struct spdk_poller *ttl_poller;	// 推进 engine 的时间轮
+	struct spdk_poller *slab_poller;	// 碎片整理：把稀疏的 slab 页上的 value 搬走，页还回页池
+	uint32_t slab_rest;
+	kvs_vlog_t *vlog;		// 分层模式：超出内存预算的 value 换到 NVMe 上，和 WAL 不同时开
+	kvs_hot_t *hot;			// 本 shard 上 key 的热度，和别的 shard 复制过来的热 key；只有一个 shard 时不开
+	struct kvs_journal_s *journal;	// 热重启时写给新进程的日志，见 kvs_handoff.h
+	kvs_msg_t start_msg;	// 启动时重放日志的来回
+	kvs_msg_t hot_drop[KVS_MAX_SHARDS];	// 作废送不出去时让目标 shard 清空副本，每个目标一个，排队时不用分配
+} kvs_shard_t;
+
+extern kvs_shard_t g_shards[KVS_MAX_SHARDS];
+extern int g_nshards;
+// 所有 shard 共用的跳表，在哪个 shard 线程上都直接访问，不转发
+extern kvs_slist_t *g_slist;
+
+typedef enum {
+	KVS_ENGINE_BPTREE = 0,
+	KVS_ENGINE_RBTREE,
+	KVS_ENGINE_HTABLE,		// 只有单 key 操作，没有 SCAN/RANGE 和批量接口
+	KVS_ENGINE_SKIPLIST,	// g_slist，op 在发起的 shard 上执行；只有单 key 操作和 RANGE，没有过期时间
+} kvs_engine_type_t;
+
+typedef enum {
+	KVS_OP_SET = 0,		// 不存在才插入
+	KVS_OP_GET,
+	KVS_OP_DEL,
+	KVS_OP_MOD,			// 存在才修改
+	KVS_OP_PUT,			// 插入或覆盖
+	KVS_OP_SCAN,		// 从 key 开始顺序取最多 count 个 key
+	KVS_OP_BATCH,		// 同一个 shard 上的一组 op，一次交给 engine
+	KVS_OP_RANGE,		// 顺序取 [key, value] 范围内最多 count 个 key 和 value
+	KVS_OP_EXPIRE,		// 给已有的 key 设置过期时间，expire 为 0 时去掉
+	KVS_OP_TTL,			// 取过期时间放在 expire 里
+} kvs_op_type_t;
+
+// 一次交给 engine 的最大 key 数，更多的分几批
+#define KVS_BATCH_MAX		512
+
+typedef struct kvs_op_s kvs_op_t;
+typedef void (*kvs_op_cb)(kvs_op_t *op);
+
+// engine 上的一次单 key 操作，可能在别的 shard 上执行
+struct kvs_op_s {
+	uint8_t engine;			// kvs_engine_type_t
+	uint8_t type;			// kvs_op_type_t
+	int shard;				// 目标 shard
+	int rc;
+
+	kvs_slice_t key;
+	kvs_slice_t value;
+	kvs_value_t *ref;		// GET: value 的引用，不拷贝，跨 shard 也直接带回来
+	uint64_t expire;		// SET/MOD/PUT/EXPIRE: 成功后设置的过期时间，0 表示不设；TTL: 输出
+	kvs_slice_t result;		// SCAN: 打包的 key 列表 (uint32_t len + bytes)...
+							// RANGE: (kvs_value_t * + uint32_t len + bytes)...，每个 value 持有一个引用
+	uint32_t count;			// SCAN: 输入最多取多少个，输出实际取到多少个；BATCH: op 个数
+	char *result_buf;
+	kvs_op_t **batch;		// BATCH: 组里的 op，结果写回各自的 op
+
+	kvs_shard_t *origin;
+	kvs_op_cb cb;
+	void *cb_arg;
+	kvs_wal_waiter_t wal_wait;
+	uint32_t pending;		// 还在读的冷 value 数
+	kvs_msg_t msg;			// 转发到目标 shard 和送回 origin 共用
+};
+
+uint64_t kvs_hash(const void *key, size_t len);
+
+// 取 RANGE 结果里 off 处的一项，off 越界返回 0，否则返回这一项的长度
+static inline size_t kvs_op_range_peek(const kvs_op_t *op, size_t off, kvs_slice_t *key, kvs_value_t **value) {
+	uint32_t len;
+
+	if (off >= op->result.len) {
+		return 0;
+	}
+	memcpy(value, op->result.data + off, sizeof(*value));
+	memcpy(&len, op->result.data + off + sizeof(*value), sizeof(len));
+	key->data = op->result.data + off + sizeof(*value) + sizeof(len);
+	key->len = len;
+	return sizeof(*value) + sizeof(len) + len;
+}
+
+// 会修改 engine 的 op，开了 WAL 时要先记日志
+static inline bool kvs_op_is_write(const kvs_op_t *op) {
+	return op->type == KVS_OP_SET || op->type == KVS_OP_DEL ||
+		op->type == KVS_OP_MOD || op->type == KVS_OP_PUT || op->type == KVS_OP_EXPIRE;
+}
+
+// 要记 WAL 的写，共享的跳表只在内存里，不记
+static inline bool kvs_op_is_logged(const kvs_op_t *op) {
+	return kvs_op_is_write(op) && op->engine != KVS_ENGINE_SKIPLIST;
+}
+
+// 过期时间用墙上时间的毫秒数，重启之后 WAL 和 checkpoint 里的过期时间还有效
+static inline uint64_t kvs_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// key 所属的 shard，用 hash 的高 32 位，低位留给 engine 自己用
+static inline int kvs_shard_index(const kvs_slice_t *key) {
+	uint64_t h = kvs_hash(key->data, key->len) >> 32;
+	return (int)((h * (uint64_t)g_nshards) >> 32);
+}
+
+// 在当前线程上对 engine 同步执行
+void kvs_op_execute(kvs_engine_t *e, kvs_op_t *op);
+// 同步执行一组 op：连续的同类 B+ 树 GET/PUT/DEL 一次交给 engine 的批量接口，其他的逐个执行
+void kvs_op_execute_batch(kvs_engine_t *e, kvs_op_t **ops, int n);
+// 在 op->shard 上执行，完成后回到 origin 线程调用 op->cb；目标就是 origin 时直接执行，
+// 没有写或者没开 WAL 时同步调用 op->cb，否则等日志落盘；读到冷 value 时等它从盘上读回来
+void kvs_op_submit(kvs_shard_t *origin, kvs_op_t *op);
+// 释放 GET 的引用和 SCAN 的结果
+void kvs_op_free_result(kvs_op_t *op);
+// 在所属 shard 上执行完之后调用（kvs_op_submit 自己会调）：读计入热度，热 key 复制到其他 shard，
+// 写了复制过的 key 时让其他 shard 上的副本作废。作废在写完成之前发出，发起写的 shard 先收到作废再收到回复。
+// 热重启期间写还要记进 shard->journal
+void kvs_op_track(kvs_shard_t *shard, kvs_op_t *op);
+// 别的 shard 上的 key 在本 shard 有副本时直接读副本，填好 op->ref 和 op->rc 返回 true
+bool kvs_op_replica_get(kvs_shard_t *shard, kvs_op_t *op);
+
+// 按 reactor_mask 中的每个核创建一个 shard，全部初始化完成后在调用线程上执行 done(arg, rc)
+typedef void (*kvs_shard_start_fn)(void *arg, int rc);
+int kvs_shards_start(kvs_shard_start_fn done, void *arg);
+// 在 kvs_shards_start 之前调用：每个 shard 在 ns 上分一段做 WAL 和 checkpoint，
+// 启动时先加载 checkpoint，再重放它之后的日志
+void kvs_shards_use_nvme(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns);
+// 在 kvs_shards_start 之前调用，和 kvs_shards_use_nvme 二选一：每个 shard 在 ns 上分一段做 value log，
+// 所有 shard 的 value 加起来超过 budget 字节时，超出的部分换到盘上
+void kvs_shards_use_tiering(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns, uint64_t budget);
+// 在 kvs_shards_start 之前调用：估计读次数到了 threshold 的热 key 复制到每个 shard 上，0 表示不复制（默认）
+void kvs_shards_use_hot(uint32_t threshold);
+// 在 shard 线程上调用，马上开始一次 checkpoint；没开 WAL 返回 -ENODEV，正在写时返回 -EBUSY
+int kvs_shard_checkpoint(kvs_shard_t *shard);
+void kvs_shards_stop(spdk_msg_fn done, void *arg);
+
+// 依次在每个 shard 线程上执行 fn(shard, arg)，全部完成后在调用线程上执行 done(arg)
+typedef void (*kvs_shard_fn)(kvs_shard_t *shard, void *arg);
+int kvs_shard_for_each(kvs_shard_fn fn, void *arg, spdk_msg_fn done);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+// accept4、memfd_create
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "kvs_shm.h"
+
+static int kvs_shm_addr(struct sockaddr_un *addr, const char *path) {
+	size_t len = strlen(path);
+
+	if (len >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len);
+	return 0;
+}
+
+// 服务端写回复环、读请求环，客户端反过来
+static void kvs_shm_bind(kvs_shm_t *shm, kvs_shm_hdr_t *hdr, size_t map_len, bool server) {
+	char *req = (char *)(hdr + 1);
+	char *resp = req + hdr->size;
+
+	shm->hdr = hdr;
+	shm->map_len = map_len;
+	shm->mask = hdr->size - 1;
+	shm->tx = server ? &hdr->resp : &hdr->req;
+	shm->rx = server ? &hdr->req : &hdr->resp;
+	shm->tx_data = server ? resp : req;
+	shm->rx_data = server ? req : resp;
+}
+
+int kvs_shm_listen(const char *path) {
+	struct sockaddr_un addr;
+
+	if (kvs_shm_addr(&addr, path) < 0) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int kvs_shm_accept(int lfd, kvs_shm_t *shm, size_t size) {
+	int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	size_t map_len = sizeof(kvs_shm_hdr_t) + 2 * size;
+	kvs_shm_hdr_t *hdr = MAP_FAILED;
+	int mfd = memfd_create("kvs_shm", MFD_CLOEXEC);
+	if (mfd < 0 || ftruncate(mfd, map_len) < 0) {
+		goto fail;
+	}
+	hdr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	if (hdr == MAP_FAILED) {
+		goto fail;
+	}
+	// ftruncate 出来的内存全是 0，head、tail 不用再初始化
+	hdr->magic = KVS_SHM_MAGIC;
+	hdr->version = KVS_SHM_VERSION;
+	hdr->size = size;
+
+	// 正文是 magic，客户端用它确认连的是对的服务
+	uint32_t magic = KVS_SHM_MAGIC;
+	struct iovec iov = { .iov_base = &magic, .iov_len = sizeof(magic) };
+	char cbuf[CMSG_SPACE(sizeof(int))] = {0};
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mfd, sizeof(int));
+
+	// 刚建立的连接发送缓冲区是空的，几个字节不会 EAGAIN
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(magic)) {
+		goto fail;
+	}
+	close(mfd);
+
+	shm->fd = fd;
+	kvs_shm_bind(shm, hdr, map_len, true);
+	return 0;
+
+fail:
+	if (hdr != MAP_FAILED) {
+		munmap(hdr, map_len);
+	}
+	if (mfd >= 0) {
+		close(mfd);
+	}
+	close(fd);
+	// 这个客户端失败了不影响继续 accept 下一个
+	errno = EPROTO;
+	return -1;
+}
+
+int kvs_shm_connect(kvs_shm_t *shm, const char *path) {
+	struct sockaddr_un addr;
+
+	if (kvs_shm_addr(&addr, path) < 0) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		goto fail;
+	}
+
+	uint32_t magic = 0;
+	struct iovec iov = { .iov_base = &magic, .iov_len = sizeof(magic) };
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+	};
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic) || magic != KVS_SHM_MAGIC) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		goto fail;
+	}
+	int mfd;
+	memcpy(&mfd, CMSG_DATA(cmsg), sizeof(int));
+
+	struct stat st;
+	kvs_shm_hdr_t *hdr = MAP_FAILED;
+	if (fstat(mfd, &st) == 0 && (size_t)st.st_size > sizeof(kvs_shm_hdr_t)) {
+		hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+	}
+	close(mfd);
+	if (hdr == MAP_FAILED) {
+		errno = EPROTO;
+		goto fail;
+	}
+	if (hdr->magic != KVS_SHM_MAGIC || hdr->version != KVS_SHM_VERSION ||
+		hdr->size == 0 || (hdr->size & (hdr->size - 1)) != 0 ||
+		sizeof(kvs_shm_hdr_t) + 2 * hdr->size != (size_t)st.st_size) {
+		munmap(hdr, st.st_size);
+		errno = EPROTO;
+		goto fail;
+	}
+
+	shm->fd = fd;
+	kvs_shm_bind(shm, hdr, st.st_size, false);
+	return 0;
+
+fail:;
+	int err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+void kvs_shm_close(kvs_shm_t *shm) {
+	if (shm->hdr) {
+		munmap(shm->hdr, shm->map_len);
+		shm->hdr = NULL;
+	}
+	if (shm->fd >= 0) {
+		close(shm->fd);
+		shm->fd = -1;
+	}
+}
+
+bool kvs_shm_peer_closed(const kvs_shm_t *shm) {
+	char c;
+	ssize_t n = recv(shm->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/*
+#############
+ring
+#############
+*/
+
+// 写到环里 pos 开始的位置，跨过结尾时分两段
+static void kvs_shm_copy_in(kvs_shm_t *shm, uint64_t pos, const char *src, size_t len) {
+	size_t off = pos & shm->mask;
+	size_t first = shm->mask + 1 - off;
+
+	if (first >= len) {
+		memcpy(shm->tx_data + off, src, len);
+	} else {
+		memcpy(shm->tx_data + off, src, first);
+		memcpy(shm->tx_data, src + first, len - first);
+	}
+}
+
+size_t kvs_shm_writev(kvs_shm_t *shm, const struct iovec *iov, int iovcnt, size_t skip) {
+	kvs_shm_ring_t *r = shm->tx;
+	uint64_t tail = r->tail;
+	uint64_t used = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	size_t done = 0;
+
+	// 对方写坏了 head 时当作满的，不能越界
+	size_t room = used > shm->mask ? 0 : shm->mask + 1 - used;
+
+	for (int i = 0; i < iovcnt && done < room; i++) {
+		const char *p = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
+		p += skip;
+		len -= skip;
+		skip = 0;
+		if (len > room - done) {
+			len = room - done;
+		}
+		kvs_shm_copy_in(shm, tail + done, p, len);
+		done += len;
+	}
+
+	if (done > 0) {
+		__atomic_store_n(&r->tail, tail + done, __ATOMIC_RELEASE);
+	}
+	return done;
+}
+
+size_t kvs_shm_write(kvs_shm_t *shm, const void *buf, size_t len) {
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return kvs_shm_writev(shm, &iov, 1, 0);
+}
+
+size_t kvs_shm_read(kvs_shm_t *shm, void *buf, size_t len) {
+	kvs_shm_ring_t *r = shm->rx;
+	uint64_t head = r->head;
+	uint64_t avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+
+	if (avail > shm->mask + 1) {
+		avail = 0;
+	}
+	if (len > avail) {
+		len = avail;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	size_t off = head & shm->mask;
+	size_t first = shm->mask + 1 - off;
+	if (first >= len) {
+		memcpy(buf, shm->rx_data + off, len);
+	} else {
+		memcpy(buf, shm->rx_data + off, first);
+		memcpy((char *)buf + first, shm->rx_data, len - first);
+	}
+
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+	return len;
+}
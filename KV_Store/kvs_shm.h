@@ -0,0 +1,90 @@
+#ifndef KVS_SHM_H
+#define KVS_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+shared memory ring
+#############
+
+和服务端在同一台机器上的客户端不走 TCP：每个客户端一块共享内存，里面两个单生产者单消费者的字节环，
+请求环客户端写服务端读，回复环服务端写客户端读。环里跑的还是文本、二进制或者 RESP 协议的字节流，
+服务端照常按第一个字节识别协议，一条命令可以跨越环的边界，也可以比环还大（分几次写）。
+
+建立连接：客户端连上服务端的 Unix socket，服务端 memfd_create 一块内存、初始化好，用 SCM_RIGHTS 把 fd 发过去，
+两边各自 mmap。之后的每个请求只读写共享内存，没有系统调用；两边都是轮询。
+Unix socket 留着只用来发现对方退出：一端关闭时另一端 recv 到 0。
+
+head、tail 是一直增长的字节数，不回绕，取下标时和 size - 1 相与；size 是 2 的幂。
+生产者先写数据再 release 写 tail，消费者 acquire 读 tail 再读数据，读完 release 写 head
+*/
+
+#define KVS_SHM_MAGIC			0x4b56534d	// "KVSM"
+#define KVS_SHM_VERSION			1
+#define KVS_SHM_RING_SIZE		(1 << 20)	// 每个方向 1MB
+#define KVS_SHM_CACHELINE		64
+
+typedef struct kvs_shm_ring_s {
+	uint64_t tail;			// 只有生产者写
+	char pad0[KVS_SHM_CACHELINE - sizeof(uint64_t)];
+	uint64_t head;			// 只有消费者写
+	char pad1[KVS_SHM_CACHELINE - sizeof(uint64_t)];
+} kvs_shm_ring_t;
+
+// 共享内存开头的布局，后面依次是请求环和回复环的数据，各 size 字节
+typedef struct kvs_shm_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	char pad[KVS_SHM_CACHELINE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+	kvs_shm_ring_t req;
+	kvs_shm_ring_t resp;
+} kvs_shm_hdr_t;
+
+// 一端的视图：tx 是自己写的环，rx 是自己读的环
+typedef struct kvs_shm_s {
+	int fd;					// Unix socket
+	kvs_shm_hdr_t *hdr;
+	size_t map_len;
+	uint64_t mask;
+	kvs_shm_ring_t *tx;
+	kvs_shm_ring_t *rx;
+	char *tx_data;
+	char *rx_data;
+} kvs_shm_t;
+
+// 服务端：在 path 上监听，非阻塞；path 上留下的旧 socket 文件先删掉。返回 fd，失败返回 -1
+int kvs_shm_listen(const char *path);
+// 服务端：accept 一个客户端，建好 size 字节（2 的幂）的环并把 memfd 发过去。
+// 没有客户端时返回 -1，errno 为 EAGAIN
+int kvs_shm_accept(int lfd, kvs_shm_t *shm, size_t size);
+// 客户端：连上服务端，收 memfd 并映射
+int kvs_shm_connect(kvs_shm_t *shm, const char *path);
+// 解除映射，关闭 Unix socket
+void kvs_shm_close(kvs_shm_t *shm);
+// 不阻塞地看一下对方是不是已经关闭了 Unix socket，会有一次系统调用，不要每个请求都调
+bool kvs_shm_peer_closed(const kvs_shm_t *shm);
+
+// 从 iov 组成的字节流的第 skip 个字节开始，写入能放下的部分，返回写了多少字节
+size_t kvs_shm_writev(kvs_shm_t *shm, const struct iovec *iov, int iovcnt, size_t skip);
+size_t kvs_shm_write(kvs_shm_t *shm, const void *buf, size_t len);
+// 读出最多 len 字节，返回读了多少
+size_t kvs_shm_read(kvs_shm_t *shm, void *buf, size_t len);
+
+static inline size_t kvs_shm_readable(const kvs_shm_t *shm) {
+	return __atomic_load_n(&shm->rx->tail, __ATOMIC_ACQUIRE) - shm->rx->head;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
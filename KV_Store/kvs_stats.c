@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "kvs_stats.h"
+
+const char *kvs_stat_names[KVS_STAT_COUNT] = {
+	"get", "set", "del", "mod", "mget", "mset", "scan", "ping", "stats", "ttl", "other",
+};
+
+// 桶覆盖的区间 [lo, lo + width)
+static void kvs_hist_bucket_range(int idx, uint64_t *lo, uint64_t *width) {
+	if (idx < KVS_HIST_SUB_COUNT) {
+		*lo = idx;
+		*width = 1;
+		return;
+	}
+	int shift = idx / KVS_HIST_HALF_COUNT - 1;
+	uint64_t sub = idx - shift * KVS_HIST_HALF_COUNT;
+	*lo = sub << shift;
+	*width = 1ULL << shift;
+}
+
+void kvs_hist_merge(kvs_hist_t *dst, const kvs_hist_t *src) {
+	uint64_t max = kvs_stat_read(&src->max);
+
+	for (int i = 0; i < KVS_HIST_BUCKETS; i++) {
+		uint64_t n = kvs_stat_read(&src->buckets[i]);
+		dst->buckets[i] += n;
+		dst->count += n;
+	}
+	if (max > dst->max) {
+		dst->max = max;
+	}
+}
+
+uint64_t kvs_hist_percentile(const kvs_hist_t *h, double p) {
+	uint64_t total = 0, seen = 0;
+
+	for (int i = 0; i < KVS_HIST_BUCKETS; i++) {
+		total += h->buckets[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)(p * total);
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	for (int i = 0; i < KVS_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank) {
+			uint64_t lo, width;
+			kvs_hist_bucket_range(i, &lo, &width);
+			uint64_t v = lo + width / 2;
+			return v > h->max ? h->max : v;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,100 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 调试用的 trace point，默认编译掉；make KVS_TRACE=1 打开
+#ifdef KVS_TRACE_ENABLE
+#define KVS_TRACE(fmt, ...)		fprintf(stderr, "[kvs] " fmt "\n", ##__VA_ARGS__)
+#else
+#define KVS_TRACE(fmt, ...)		do { } while (0)
+#endif
+
+/*
+HDR 风格的对数-线性直方图，记录 TSC 时钟周期。
+每个 2 的幂区间再分成 16 个桶，相对误差不超过 1/16；小于 32 的值每个值一个桶
+*/
+#define KVS_HIST_SUB_BITS		5
+#define KVS_HIST_SUB_COUNT		(1 << KVS_HIST_SUB_BITS)
+#define KVS_HIST_HALF_COUNT		(KVS_HIST_SUB_COUNT / 2)
+#define KVS_HIST_BUCKETS		((64 - KVS_HIST_SUB_BITS + 2) * KVS_HIST_HALF_COUNT)
+
+typedef struct kvs_hist_s {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[KVS_HIST_BUCKETS];
+} kvs_hist_t;
+
+// 统计按命令语义分类，不区分协议和 engine
+typedef enum {
+	KVS_STAT_GET = 0,
+	KVS_STAT_SET,
+	KVS_STAT_DEL,
+	KVS_STAT_MOD,
+	KVS_STAT_MGET,
+	KVS_STAT_MSET,
+	KVS_STAT_SCAN,
+	KVS_STAT_PING,
+	KVS_STAT_STATS,
+	KVS_STAT_TTL,		// EXPIRE/TTL/PERSIST
+	KVS_STAT_OTHER,
+	KVS_STAT_COUNT,
+} kvs_stat_cmd_t;
+
+extern const char *kvs_stat_names[KVS_STAT_COUNT];
+
+// 每个 shard 一份，只有所属线程写，别的线程用 relaxed load 读，不加锁
+typedef struct kvs_stats_s {
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t conns_opened;
+	uint64_t conns_closed;
+
+	uint64_t ops_per_sec;	// 由每秒一次的 poller 更新
+	uint64_t last_ops;
+
+	kvs_hist_t latency[KVS_STAT_COUNT];
+} kvs_stats_t;
+
+// 单写者计数：普通的读-加-写，但用原子 store 保证读者看不到撕裂的值
+static inline void kvs_stat_add(uint64_t *c, uint64_t v) {
+	__atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t kvs_stat_read(const uint64_t *c) {
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline int kvs_hist_index(uint64_t v) {
+	if (v < KVS_HIST_SUB_COUNT) {
+		return (int)v;
+	}
+	int shift = 63 - __builtin_clzll(v) - (KVS_HIST_SUB_BITS - 1);
+	return shift * KVS_HIST_HALF_COUNT + (int)(v >> shift);
+}
+
+static inline void kvs_hist_record(kvs_hist_t *h, uint64_t v) {
+	kvs_stat_add(&h->buckets[kvs_hist_index(v)], 1);
+	kvs_stat_add(&h->count, 1);
+	if (v > h->max) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+// 把 src 累加到 dst，src 可以正在被别的线程写
+void kvs_hist_merge(kvs_hist_t *dst, const kvs_hist_t *src);
+// p 取 0~1，返回对应的值（桶的中点）
+uint64_t kvs_hist_percentile(const kvs_hist_t *h, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+#include "spdk/stdinc.h"
+#include "spdk/queue.h"
+
+#include "kvs_ttl.h"
+#include "kvs_stats.h"
+
+typedef struct kvs_ttl_ent_s {
+	TAILQ_ENTRY(kvs_ttl_ent_s) link;
+	uint64_t expire;
+	uint8_t tag;
+	uint32_t key_len;
+	char key[];
+} kvs_ttl_ent_t;
+
+TAILQ_HEAD(kvs_ttl_list, kvs_ttl_ent_s);
+
+struct kvs_ttl_s {
+	uint64_t cur;			// 已经走到的时间
+	bool started;
+
+	struct kvs_ttl_list slots[KVS_TTL_LEVELS][KVS_TTL_SLOTS];
+	uint32_t slot_count[KVS_TTL_LEVELS][KVS_TTL_SLOTS];
+	uint64_t level_count[KVS_TTL_LEVELS];	// 低层都空着时直接跳到高层的下一格
+
+	struct kvs_ttl_list due;	// 摘下来还没处理的项
+
+	kvs_ttl_stats_t stats;
+};
+
+#define KVS_TTL_SHIFT(l)		((l) * KVS_TTL_SLOT_BITS)
+#define KVS_TTL_MASK(l)			((1ULL << KVS_TTL_SHIFT(l)) - 1)
+
+kvs_ttl_t *kvs_ttl_create(void) {
+	kvs_ttl_t *t = calloc(1, sizeof(*t));
+
+	if (t == NULL) {
+		return NULL;
+	}
+	for (int l = 0; l < KVS_TTL_LEVELS; l++) {
+		for (int s = 0; s < KVS_TTL_SLOTS; s++) {
+			TAILQ_INIT(&t->slots[l][s]);
+		}
+	}
+	TAILQ_INIT(&t->due);
+	return t;
+}
+
+static void kvs_ttl_list_free(struct kvs_ttl_list *list) {
+	kvs_ttl_ent_t *ent;
+
+	while ((ent = TAILQ_FIRST(list)) != NULL) {
+		TAILQ_REMOVE(list, ent, link);
+		free(ent);
+	}
+}
+
+void kvs_ttl_destroy(kvs_ttl_t *t) {
+	if (t == NULL) {
+		return;
+	}
+	for (int l = 0; l < KVS_TTL_LEVELS; l++) {
+		for (int s = 0; s < KVS_TTL_SLOTS; s++) {
+			kvs_ttl_list_free(&t->slots[l][s]);
+		}
+	}
+	kvs_ttl_list_free(&t->due);
+	free(t);
+}
+
+// 离到期还有多远决定挂在哪一层，格按到期时间在那一层的位来选，转到这一格时一定还没过期。
+// 超出 2^30 ms 的按 2^30 - 1 挂在最高层，转到了再重新挂
+static void kvs_ttl_insert(kvs_ttl_t *t, kvs_ttl_ent_t *ent) {
+	if (!t->started || ent->expire <= t->cur) {
+		TAILQ_INSERT_TAIL(&t->due, ent, link);
+		return;
+	}
+
+	uint64_t delta = ent->expire - t->cur;
+	uint64_t when = ent->expire;
+
+	if (delta > KVS_TTL_MASK(KVS_TTL_LEVELS)) {
+		delta = KVS_TTL_MASK(KVS_TTL_LEVELS);
+		when = t->cur + delta;
+	}
+
+	int level = (63 - __builtin_clzll(delta)) / KVS_TTL_SLOT_BITS;
+	int slot = (when >> KVS_TTL_SHIFT(level)) & (KVS_TTL_SLOTS - 1);
+
+	TAILQ_INSERT_TAIL(&t->slots[level][slot], ent, link);
+	t->slot_count[level][slot]++;
+	t->level_count[level]++;
+}
+
+int kvs_ttl_add(kvs_ttl_t *t, uint8_t tag, kvs_slice_t key, uint64_t expire) {
+	kvs_ttl_ent_t *ent = malloc(sizeof(*ent) + key.len);
+
+	if (ent == NULL) {
+		return -ENOMEM;
+	}
+	ent->expire = expire;
+	ent->tag = tag;
+	ent->key_len = key.len;
+	memcpy(ent->key, key.data, key.len);
+	kvs_ttl_insert(t, ent);
+	kvs_stat_add(&t->stats.entries, 1);
+	return 0;
+}
+
+// 整格接到到期链表上，不逐项处理
+static void kvs_ttl_cascade(kvs_ttl_t *t, int level, int slot) {
+	if (t->slot_count[level][slot] == 0) {
+		return;
+	}
+	TAILQ_CONCAT(&t->due, &t->slots[level][slot], link);
+	t->level_count[level] -= t->slot_count[level][slot];
+	t->slot_count[level][slot] = 0;
+}
+
+// 走到 cur + 1：低位刚好归零的层摘下对应的格，第 0 层每一格都摘
+static void kvs_ttl_tick(kvs_ttl_t *t) {
+	uint64_t now = ++t->cur;
+
+	for (int l = KVS_TTL_LEVELS - 1; l > 0; l--) {
+		if ((now & KVS_TTL_MASK(l)) == 0) {
+			kvs_ttl_cascade(t, l, (now >> KVS_TTL_SHIFT(l)) & (KVS_TTL_SLOTS - 1));
+		}
+	}
+	kvs_ttl_cascade(t, 0, now & (KVS_TTL_SLOTS - 1));
+}
+
+// 一格一格地走，最低的非空层之下没有东西可摘，直接跳到那一层下一格的前面
+static void kvs_ttl_forward(kvs_ttl_t *t, uint64_t now) {
+	while (t->cur < now) {
+		int l = 0;
+
+		while (l < KVS_TTL_LEVELS && t->level_count[l] == 0) {
+			l++;
+		}
+		if (l == KVS_TTL_LEVELS) {
+			t->cur = now;
+			return;
+		}
+		if (l > 0) {
+			uint64_t skip = t->cur | KVS_TTL_MASK(l);
+			if (skip >= now) {
+				t->cur = now;
+				return;
+			}
+			t->cur = skip;
+		}
+		kvs_ttl_tick(t);
+	}
+}
+
+size_t kvs_ttl_advance(kvs_ttl_t *t, uint64_t now, size_t budget, kvs_ttl_fn fn, void *arg) {
+	kvs_ttl_ent_t *ent;
+	size_t n = 0;
+
+	if (!t->started) {
+		t->started = true;
+		t->cur = now;
+	}
+	kvs_ttl_forward(t, now);
+
+	while (n < budget && (ent = TAILQ_FIRST(&t->due)) != NULL) {
+		TAILQ_REMOVE(&t->due, ent, link);
+		n++;
+		if (ent->expire > t->cur) {
+			kvs_ttl_insert(t, ent);
+			continue;
+		}
+
+		kvs_slice_t key = { ent->key, ent->key_len };
+		if (fn(arg, ent->tag, key, ent->expire)) {
+			kvs_stat_add(&t->stats.expired, 1);
+		} else {
+			kvs_stat_add(&t->stats.stale, 1);
+		}
+		kvs_stat_add(&t->stats.entries, -1);
+		free(ent);
+	}
+	return n;
+}
+
+const kvs_ttl_stats_t *kvs_ttl_get_stats(const kvs_ttl_t *t) {
+	return &t->stats;
+}
@@ -0,0 +1,56 @@
+#ifndef KVS_TTL_H
+#define KVS_TTL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kv_engine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+timing wheel
+#############
+
+分层时间轮，一格 1ms，每层 64 格，5 层覆盖 2^30 ms（大约 12 天），更远的先挂在最高层，转到了再重新挂。
+插入是 O(1)；时间前进时整格摘下来接到到期链表上，也是 O(1)，不管格子里有多少项。
+到期链表里的项每次最多处理 budget 个：真的到期的回调 fn，没到期的（从高层降下来的）重新挂到低层，
+一次 poll 的工作量有上限，大量 key 同时到期时分摊到之后的几次 poll 里。
+
+项不支持取消：key 被删除、覆盖或者改了过期时间时旧的项留在轮子里，到期时由 fn 自己判断是不是过时的
+*/
+
+#define KVS_TTL_SLOT_BITS		6
+#define KVS_TTL_SLOTS			(1 << KVS_TTL_SLOT_BITS)
+#define KVS_TTL_LEVELS			5
+
+typedef struct kvs_ttl_s kvs_ttl_t;
+
+// key 的过期时间到了，返回 1 表示确实删掉了 key，返回 0 表示这一项已经过时
+typedef int (*kvs_ttl_fn)(void *arg, uint8_t tag, kvs_slice_t key, uint64_t expire);
+
+typedef struct kvs_ttl_stats_s {
+	uint64_t entries;		// 轮子里的项数，包括过时的
+	uint64_t expired;		// 到期删掉的 key 数
+	uint64_t stale;			// 到期时已经过时的项数
+} kvs_ttl_stats_t;
+
+// 第一次 advance 之前没有时间，加进来的项都先放在到期链表里
+kvs_ttl_t *kvs_ttl_create(void);
+void kvs_ttl_destroy(kvs_ttl_t *t);
+
+// expire 是毫秒级的绝对时间，key 拷贝一份；tag 原样交给 fn。内存不够返回 -ENOMEM
+int kvs_ttl_add(kvs_ttl_t *t, uint8_t tag, kvs_slice_t key, uint64_t expire);
+// 时间走到 now，最多处理 budget 个到期的项，返回处理了多少个
+size_t kvs_ttl_advance(kvs_ttl_t *t, uint64_t now, size_t budget, kvs_ttl_fn fn, void *arg);
+
+const kvs_ttl_stats_t *kvs_ttl_get_stats(const kvs_ttl_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
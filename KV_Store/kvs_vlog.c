@@ -0,0 +1,876 @@
+#include "spdk/stdinc.h"
+#include "spdk/env.h"
+#include "spdk/thread.h"
+#include "spdk/queue.h"
+#include "spdk/crc32.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+#include "kvs_vlog.h"
+#include "kvs_stats.h"
+#include "simple_slab.h"
+
+#define KVS_VLOG_ROUNDUP(x)		(((x) + KVS_VLOG_BLOCK - 1) & ~(uint64_t)(KVS_VLOG_BLOCK - 1))
+#define KVS_VLOG_ALIGN(x)		(((x) + 7) & ~(size_t)7)
+
+#define KVS_VLOG_SCAN_LIMIT		4096	// 一次 poll 最多看多少个 key
+#define KVS_VLOG_RESERVE		(3 * KVS_VLOG_BUF_SIZE)	// 剩下这么多时不再换出，留给 GC 搬活的 value
+#define KVS_VLOG_MIN_SIZE		(16 * KVS_VLOG_BUF_SIZE)
+#define KVS_VLOG_GC_BACKOFF_MS	100
+#define KVS_VLOG_READ_BUCKETS	256		// 在飞的冷读按 key 的哈希分桶
+#define KVS_VLOG_ZCOPY_MIN		2048	// 比这小的 value 拷进批里比多一个 SGL 段划算
+
+// 批里的一条记录写完之后要改树：换出的 value 持有引用，GC 搬的记着原来的位置
+typedef struct kvs_vlog_ent_s {
+	kvs_value_t *value;
+	uint64_t old_loc;
+	uint32_t rec_off;		// 记录在 buf 里的偏移
+	bool zcopy;				// value 没有拷进 buf，buf 里留着它的位置，写的时候直接从 value 写
+} kvs_vlog_ent_t;
+
+// 有 zcopy 的批按段写：buf 里的几段和 value 交替
+typedef struct kvs_vlog_seg_s {
+	char *data;
+	uint32_t off;			// 在批里的偏移
+	uint32_t len;
+} kvs_vlog_seg_t;
+
+struct kvs_vlog_batch_s;
+
+// 每条写命令一个，SGL 回调从这条命令在批里的起点往后给段
+typedef struct kvs_vlog_sgl_s {
+	struct kvs_vlog_batch_s *batch;
+	uint32_t base;
+	uint32_t seg;
+	uint32_t seg_off;
+} kvs_vlog_sgl_t;
+
+typedef struct kvs_vlog_batch_s {
+	kvs_vlog_t *vlog;
+	STAILQ_ENTRY(kvs_vlog_batch_s) link;
+
+	char *buf;				// DMA 内存，KVS_VLOG_BUF_SIZE
+	size_t len;				// 包括批头
+	uint64_t off;			// 在日志里的逻辑偏移，提交时确定
+
+	kvs_vlog_ent_t *ents;
+	size_t nents;
+	size_t ents_size;
+	size_t nzcopy;
+	uint64_t free_to;		// GC 的批：写完之后 tail 可以推到这里
+
+	kvs_vlog_seg_t *segs;
+	size_t nsegs;
+	size_t segs_size;
+	kvs_vlog_sgl_t *sgls;	// 控制器支持 SGL 时才有，KVS_VLOG_BUF_SIZE / max_xfer 个
+
+	int pending;
+	int status;
+} kvs_vlog_batch_t;
+
+// 同一条记录已经在读时，后来的读挂在它上面等结果
+typedef struct kvs_vlog_waiter_s {
+	kvs_vlog_read_cb cb;
+	void *arg;
+	STAILQ_ENTRY(kvs_vlog_waiter_s) link;
+} kvs_vlog_waiter_t;
+
+typedef struct kvs_vlog_read_s {
+	kvs_vlog_t *vlog;
+	kvs_vlog_read_cb cb;
+	void *arg;
+	kvs_slice_t key;
+	uint64_t loc;
+	uint32_t hash;
+	LIST_ENTRY(kvs_vlog_read_s) link;
+	STAILQ_HEAD(, kvs_vlog_waiter_s) waiters;
+	uint32_t value_len;
+	uint32_t skew;			// 记录在 buf 里的偏移
+	size_t len;
+	char *buf;
+	int epoch;
+	int pending;
+	int status;
+} kvs_vlog_read_t;
+
+typedef enum {
+	KVS_VLOG_GC_IDLE = 0,
+	KVS_VLOG_GC_READ,		// 读最旧的一段
+	KVS_VLOG_GC_WRITE,		// 活的 value 在往日志头上写
+	KVS_VLOG_GC_FREE,		// 等之前发出的冷读完成，再释放
+} kvs_vlog_gc_state_t;
+
+struct kvs_vlog_s {
+	struct spdk_nvme_ns *ns;
+	struct spdk_nvme_qpair *qpair;
+	struct spdk_poller *poller;
+
+	uint32_t sector_size;
+	uint32_t max_xfer;
+	bool sgl;				// 控制器支持 SGL，DMA 内存里的 value 可以不拷贝直接写
+	bool sgl_dword;			// SGL 的地址和长度要 4 字节对齐
+	uint64_t start_lba;
+	uint64_t size;			// 日志区的字节数
+
+	kvs_engine_t *engine;
+	uint64_t budget;
+
+	// [tail, head) 里可能还有活的 value
+	uint64_t head;
+	uint64_t tail;
+	uint64_t evicting;		// 在写的批里的 value 字节数，写完之前还占着 engine 的内存
+	bool failed;			// 写失败之后 GC 不知道后面的批在哪，不再换出，已经在盘上的照样能读
+
+	STAILQ_HEAD(, kvs_vlog_batch_s) free;
+	int ninflight;
+	kvs_vlog_batch_t *fill;	// 正在攒的换出批，只在一次 poll 里用
+
+	// 冷读按 epoch 分两组计数：GC 要释放一段空间时 epoch 加一，
+	// 之前发出的读（可能还指着这段空间）都完成后才真正释放
+	uint32_t readers[2];
+	uint32_t epoch;
+
+	// 在飞的冷读，读同一条记录的请求合成一次 I/O
+	LIST_HEAD(, kvs_vlog_read_s) reading[KVS_VLOG_READ_BUCKETS];
+
+	kvs_vlog_gc_state_t gc;
+	char *gc_buf;
+	size_t gc_len;
+	int gc_pending;
+	int gc_status;
+	kvs_vlog_batch_t *gc_batch;
+	uint64_t free_to;
+	uint64_t gc_idle_until;	// tsc，几乎都是活的时候歇一会儿
+
+	kvs_vlog_stats_t stats;
+};
+
+// 按 max_xfer 切成几条命令，每提交一条 *pending 加一；批和记录都不跨过环的末尾
+static int kvs_vlog_io(kvs_vlog_t *vlog, bool write, char *buf, uint64_t off, size_t len,
+		spdk_nvme_cmd_cb cb, void *arg, int *pending) {
+	uint64_t pos = off % vlog->size;
+
+	while (len > 0) {
+		size_t n = spdk_min(len, (size_t)vlog->max_xfer);
+		uint64_t lba = vlog->start_lba + pos / vlog->sector_size;
+		int rc = write ?
+			spdk_nvme_ns_cmd_write(vlog->ns, vlog->qpair, buf, lba, n / vlog->sector_size, cb, arg, 0) :
+			spdk_nvme_ns_cmd_read(vlog->ns, vlog->qpair, buf, lba, n / vlog->sector_size, cb, arg, 0);
+		if (rc != 0) {
+			return rc;
+		}
+		(*pending)++;
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+#############
+write
+#############
+*/
+
+static kvs_vlog_batch_t *kvs_vlog_batch_get(kvs_vlog_t *vlog) {
+	kvs_vlog_batch_t *batch = STAILQ_FIRST(&vlog->free);
+
+	if (batch == NULL) {
+		return NULL;
+	}
+	STAILQ_REMOVE_HEAD(&vlog->free, link);
+	batch->len = sizeof(kvs_vlog_hdr_t);
+	batch->nents = 0;
+	batch->nzcopy = 0;
+	batch->free_to = 0;
+	batch->status = 0;
+	return batch;
+}
+
+static void kvs_vlog_batch_put(kvs_vlog_t *vlog, kvs_vlog_batch_t *batch) {
+	STAILQ_INSERT_HEAD(&vlog->free, batch, link);
+}
+
+// 在批里加一条 len 字节的记录，data 为 NULL 时只留出位置，由调用方填
+static int kvs_vlog_batch_add(kvs_vlog_batch_t *batch, const char *data, size_t len,
+		kvs_value_t *value, uint64_t old_loc) {
+	size_t need = KVS_VLOG_ALIGN(len);
+
+	if (batch->len + need > KVS_VLOG_BUF_SIZE) {
+		return -ENOSPC;
+	}
+	if (batch->nents == batch->ents_size) {
+		size_t size = batch->ents_size ? batch->ents_size * 2 : 256;
+		kvs_vlog_ent_t *ents = realloc(batch->ents, size * sizeof(*ents));
+		if (ents == NULL) {
+			return -ENOMEM;
+		}
+		batch->ents = ents;
+		batch->ents_size = size;
+	}
+
+	kvs_vlog_ent_t *ent = &batch->ents[batch->nents++];
+	ent->value = value;
+	ent->old_loc = old_loc;
+	ent->rec_off = batch->len;
+	ent->zcopy = false;
+	if (data) {
+		memcpy(batch->buf + batch->len, data, len);
+	}
+	memset(batch->buf + batch->len + len, 0, need - len);
+	batch->len += need;
+	return 0;
+}
+
+static void kvs_vlog_release(kvs_vlog_t *vlog, uint64_t to);
+
+// 写完再改树：换出的换成冷 value，GC 搬的改位置；写失败时树不动，value 还在原来的地方
+static void kvs_vlog_write_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_vlog_batch_t *batch = arg;
+	kvs_vlog_t *vlog = batch->vlog;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		batch->status = -EIO;
+	}
+	if (--batch->pending > 0) {
+		return;
+	}
+	vlog->ninflight--;
+
+	if (batch->status != 0 && !vlog->failed) {
+		SPDK_ERRLOG("Value log write at offset %" PRIu64 " failed, no longer evicting\n", batch->off);
+		vlog->failed = true;
+	}
+
+	for (size_t i = 0; i < batch->nents; i++) {
+		kvs_vlog_ent_t *ent = &batch->ents[i];
+		kvs_vlog_rec_t rec;
+		uint64_t loc = batch->off + ent->rec_off;
+
+		memcpy(&rec, batch->buf + ent->rec_off, sizeof(rec));
+		kvs_slice_t key = { batch->buf + ent->rec_off + sizeof(rec), rec.key_len };
+		if (ent->value) {
+			if (batch->status == 0 && kvs_engine_evict(vlog->engine, rec.engine, key, ent->value, loc) > 0) {
+				kvs_stat_add(&vlog->stats.evicted, 1);
+				kvs_stat_add(&vlog->stats.evicted_bytes, rec.value_len);
+				if (ent->zcopy) {
+					kvs_stat_add(&vlog->stats.zcopy, 1);
+				}
+			}
+			ent->value->flags &= ~KVS_VALUE_EVICTING;
+			vlog->evicting -= ent->value->len;
+			kvs_value_put(ent->value);
+		} else if (batch->status == 0) {
+			kvs_engine_relocate(vlog->engine, rec.engine, key, ent->old_loc, loc);
+			kvs_stat_add(&vlog->stats.relocated, 1);
+		}
+	}
+
+	// GC 的批写失败时旧的位置还在用，不能释放
+	if (batch->free_to != 0) {
+		if (batch->status == 0) {
+			kvs_vlog_release(vlog, batch->free_to);
+		} else {
+			vlog->gc = KVS_VLOG_GC_IDLE;
+		}
+	}
+	kvs_vlog_batch_put(vlog, batch);
+}
+
+static void kvs_vlog_sgl_reset(void *arg, uint32_t offset) {
+	kvs_vlog_sgl_t *sgl = arg;
+	kvs_vlog_batch_t *batch = sgl->batch;
+	uint32_t pos = sgl->base + offset;
+	uint32_t i = 0;
+
+	while (i + 1 < batch->nsegs && batch->segs[i + 1].off <= pos) {
+		i++;
+	}
+	sgl->seg = i;
+	sgl->seg_off = pos - batch->segs[i].off;
+}
+
+// 段可以比这条命令剩下的长，SPDK 只取需要的部分
+static int kvs_vlog_sgl_next(void *arg, void **address, uint32_t *length) {
+	kvs_vlog_sgl_t *sgl = arg;
+	kvs_vlog_batch_t *batch = sgl->batch;
+
+	if (sgl->seg >= batch->nsegs) {
+		return -1;
+	}
+	kvs_vlog_seg_t *seg = &batch->segs[sgl->seg++];
+	*address = seg->data + sgl->seg_off;
+	*length = seg->len - sgl->seg_off;
+	sgl->seg_off = 0;
+	return 0;
+}
+
+static void kvs_vlog_sgl_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_vlog_sgl_t *sgl = arg;
+
+	kvs_vlog_write_done(sgl->batch, cpl);
+}
+
+static int kvs_vlog_seg_add(kvs_vlog_batch_t *batch, char *data, uint32_t off, uint32_t len) {
+	if (len == 0) {
+		return 0;
+	}
+	if (batch->nsegs == batch->segs_size) {
+		size_t size = batch->segs_size ? batch->segs_size * 2 : 64;
+		kvs_vlog_seg_t *segs = realloc(batch->segs, size * sizeof(*segs));
+		if (segs == NULL) {
+			return -ENOMEM;
+		}
+		batch->segs = segs;
+		batch->segs_size = size;
+	}
+	batch->segs[batch->nsegs++] = (kvs_vlog_seg_t){ .data = data, .off = off, .len = len };
+	return 0;
+}
+
+// 写 [0, len)：buf 里 zcopy 的 value 留的空位换成 value 本身，分成几条 writev 命令
+static int kvs_vlog_writev(kvs_vlog_t *vlog, kvs_vlog_batch_t *batch, size_t len) {
+	uint32_t cur = 0;
+	int rc = 0;
+
+	batch->nsegs = 0;
+	for (size_t i = 0; i < batch->nents && rc == 0; i++) {
+		kvs_vlog_ent_t *ent = &batch->ents[i];
+		kvs_vlog_rec_t rec;
+
+		if (!ent->zcopy) {
+			continue;
+		}
+		memcpy(&rec, batch->buf + ent->rec_off, sizeof(rec));
+		uint32_t off = ent->rec_off + sizeof(rec) + rec.key_len;
+		rc = kvs_vlog_seg_add(batch, batch->buf + cur, cur, off - cur);
+		if (rc == 0) {
+			rc = kvs_vlog_seg_add(batch, ent->value->data, off, rec.value_len);
+		}
+		cur = off + rec.value_len;
+	}
+	if (rc == 0) {
+		rc = kvs_vlog_seg_add(batch, batch->buf + cur, cur, len - cur);
+	}
+
+	uint64_t pos = batch->off % vlog->size;
+	for (uint32_t done = 0, i = 0; rc == 0 && done < len; i++) {
+		uint32_t n = spdk_min(len - done, (size_t)vlog->max_xfer);
+		kvs_vlog_sgl_t *sgl = &batch->sgls[i];
+
+		sgl->batch = batch;
+		sgl->base = done;
+		rc = spdk_nvme_ns_cmd_writev(vlog->ns, vlog->qpair, vlog->start_lba + pos / vlog->sector_size,
+			n / vlog->sector_size, kvs_vlog_sgl_done, sgl, 0, kvs_vlog_sgl_reset, kvs_vlog_sgl_next);
+		if (rc == 0) {
+			batch->pending++;
+		}
+		done += n;
+		pos += n;
+	}
+	return rc;
+}
+
+// 这一圈剩下的放不下时跳到下一圈的开头
+static void kvs_vlog_submit(kvs_vlog_t *vlog, kvs_vlog_batch_t *batch) {
+	size_t len = KVS_VLOG_ROUNDUP(batch->len);
+	uint64_t left = vlog->size - vlog->head % vlog->size;
+	kvs_vlog_hdr_t hdr = {};
+
+	if (left < len) {
+		vlog->head += left;
+	}
+	batch->off = vlog->head;
+	vlog->head += len;
+
+	hdr.magic = KVS_VLOG_MAGIC;
+	hdr.off = batch->off;
+	hdr.len = batch->len;
+	hdr.crc = spdk_crc32c_update(&hdr, sizeof(hdr), 0);
+	memcpy(batch->buf, &hdr, sizeof(hdr));
+	memset(batch->buf + batch->len, 0, len - batch->len);
+
+	batch->pending = 1;		// 提交过程中先多持有一次
+	int rc = batch->nzcopy > 0 ? kvs_vlog_writev(vlog, batch, len) :
+		kvs_vlog_io(vlog, true, batch->buf, batch->off, len, kvs_vlog_write_done, batch, &batch->pending);
+	if (rc != 0) {
+		batch->status = rc;
+	}
+	vlog->ninflight++;
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_vlog_write_done(batch, &cpl);
+}
+
+// value 在 slab 的 DMA 页里、够大，控制器又支持 SGL 时不拷贝。off 是 value 在批里的偏移
+static bool kvs_vlog_zcopy(const kvs_vlog_t *vlog, size_t off, const kvs_value_t *value) {
+	if (!vlog->sgl || value->len < KVS_VLOG_ZCOPY_MIN || !kv_slab_from_backend(value)) {
+		return false;
+	}
+	// 要求对齐时 value 和它前后 buf 里的两段都要对齐，记录本身是 8 字节对齐的
+	return !vlog->sgl_dword || (((uintptr_t)value->data | off | value->len) & 3) == 0;
+}
+
+static int kvs_vlog_evict_cb(void *arg, uint8_t tag, kvs_slice_t key, kvs_value_t *value) {
+	kvs_vlog_t *vlog = arg;
+	kvs_vlog_batch_t *batch = vlog->fill;
+	kvs_vlog_rec_t rec = {};
+	size_t len = sizeof(rec) + key.len + value->len;
+
+	if (sizeof(kvs_vlog_hdr_t) + KVS_VLOG_ALIGN(len) > KVS_VLOG_BUF_SIZE) {
+		return 0;
+	}
+	if (kvs_vlog_batch_add(batch, NULL, len, value, 0) != 0) {
+		return -1;
+	}
+
+	kvs_vlog_ent_t *ent = &batch->ents[batch->nents - 1];
+	char *p = batch->buf + ent->rec_off;
+	rec.magic = KVS_VLOG_REC_MAGIC;
+	rec.engine = tag;
+	rec.key_len = key.len;
+	rec.value_len = value->len;
+	memcpy(p + sizeof(rec), key.data, key.len);
+	ent->zcopy = kvs_vlog_zcopy(vlog, ent->rec_off + sizeof(rec) + key.len, value);
+	if (ent->zcopy) {
+		batch->nzcopy++;
+	} else {
+		memcpy(p + sizeof(rec) + key.len, value->data, value->len);
+	}
+	rec.crc = spdk_crc32c_update(p + sizeof(rec), key.len, 0);
+	rec.crc = spdk_crc32c_update(value->data, value->len, rec.crc);
+	memcpy(p, &rec, sizeof(rec));
+
+	value->flags |= KVS_VALUE_EVICTING;
+	kvs_value_get(value);
+	vlog->evicting += value->len;
+	return 1;
+}
+
+// 超出预算的部分攒一批写下去，盘上已经有的 value 在扫描时直接换掉
+static size_t kvs_vlog_evict(kvs_vlog_t *vlog) {
+	uint64_t mem, cold;
+
+	kvs_engine_tier_stats(vlog->engine, &mem, &cold);
+	if (vlog->failed || mem <= vlog->budget + vlog->evicting ||
+		vlog->size - (vlog->head - vlog->tail) < KVS_VLOG_RESERVE) {
+		return 0;
+	}
+
+	vlog->fill = kvs_vlog_batch_get(vlog);
+	if (vlog->fill == NULL) {
+		return 0;
+	}
+	size_t n = kvs_engine_evict_scan(vlog->engine, mem - vlog->budget - vlog->evicting,
+		KVS_VLOG_SCAN_LIMIT, kvs_vlog_evict_cb, vlog);
+	if (vlog->fill->nents > 0) {
+		kvs_vlog_submit(vlog, vlog->fill);
+	} else {
+		kvs_vlog_batch_put(vlog, vlog->fill);
+	}
+	vlog->fill = NULL;
+	return n;
+}
+
+/*
+#############
+read
+#############
+*/
+
+static bool kvs_vlog_rec_check(const char *p, size_t avail, kvs_vlog_rec_t *rec) {
+	if (avail < sizeof(*rec)) {
+		return false;
+	}
+	memcpy(rec, p, sizeof(*rec));
+	return rec->magic == KVS_VLOG_REC_MAGIC &&
+		sizeof(*rec) + (uint64_t)rec->key_len + rec->value_len <= avail &&
+		spdk_crc32c_update(p + sizeof(*rec), rec->key_len + rec->value_len, 0) == rec->crc;
+}
+
+static void kvs_vlog_read_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_vlog_read_t *r = arg;
+	kvs_vlog_t *vlog = r->vlog;
+	kvs_value_t *value = NULL;
+	kvs_vlog_rec_t rec;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		r->status = -EIO;
+	}
+	if (--r->pending > 0) {
+		return;
+	}
+	vlog->readers[r->epoch]--;
+
+	if (r->status == 0) {
+		const char *p = r->buf + r->skew;
+		// 位置指错了记录也能发现
+		if (kvs_vlog_rec_check(p, r->len - r->skew, &rec) && rec.key_len == r->key.len &&
+			rec.value_len == r->value_len && memcmp(p + sizeof(rec), r->key.data, r->key.len) == 0) {
+			value = kvs_value_create(p + sizeof(rec) + rec.key_len, rec.value_len);
+		} else {
+			SPDK_ERRLOG("Bad value log record for key of %zu bytes\n", r->key.len);
+		}
+	}
+	kvs_stat_add(&vlog->stats.reads, 1);
+	kvs_stat_add(&vlog->stats.read_bytes, r->len);
+
+	// 先摘下来，回调里再读同一个 key 时发新的读
+	LIST_REMOVE(r, link);
+
+	kvs_vlog_waiter_t *w;
+	while ((w = STAILQ_FIRST(&r->waiters)) != NULL) {
+		STAILQ_REMOVE_HEAD(&r->waiters, link);
+		if (value) {
+			kvs_value_get(value);
+		}
+		w->cb(w->arg, value);
+		free(w);
+	}
+	r->cb(r->arg, value);
+	spdk_free(r->buf);
+	free(r);
+}
+
+static kvs_vlog_read_t *kvs_vlog_read_find(kvs_vlog_t *vlog, uint32_t hash, kvs_slice_t key, uint64_t loc) {
+	kvs_vlog_read_t *r;
+
+	LIST_FOREACH(r, &vlog->reading[hash % KVS_VLOG_READ_BUCKETS], link) {
+		if (r->hash == hash && r->loc == loc && r->key.len == key.len &&
+			memcmp(r->key.data, key.data, key.len) == 0) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+int kvs_vlog_read(kvs_vlog_t *vlog, kvs_slice_t key, const kvs_value_t *stub, kvs_vlog_read_cb cb, void *arg) {
+	uint64_t start = stub->loc & ~(uint64_t)(vlog->sector_size - 1);
+	uint64_t end = stub->loc + sizeof(kvs_vlog_rec_t) + key.len + stub->len;
+	uint32_t hash = spdk_crc32c_update(key.data, key.len, 0);
+	kvs_vlog_read_t *r = kvs_vlog_read_find(vlog, hash, key, stub->loc);
+
+	// 这条记录正在读：它的 epoch 计数还护着这段空间，等它读完一起回调
+	if (r != NULL) {
+		kvs_vlog_waiter_t *w = malloc(sizeof(*w));
+		if (w == NULL) {
+			return -ENOMEM;
+		}
+		w->cb = cb;
+		w->arg = arg;
+		STAILQ_INSERT_TAIL(&r->waiters, w, link);
+		kvs_stat_add(&vlog->stats.coalesced, 1);
+		return 0;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return -ENOMEM;
+	}
+	r->len = (end - start + vlog->sector_size - 1) & ~(uint64_t)(vlog->sector_size - 1);
+	r->buf = spdk_zmalloc(r->len, vlog->sector_size, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+	if (r->buf == NULL) {
+		free(r);
+		return -ENOMEM;
+	}
+	r->vlog = vlog;
+	r->cb = cb;
+	r->arg = arg;
+	r->key = key;
+	r->loc = stub->loc;
+	r->hash = hash;
+	STAILQ_INIT(&r->waiters);
+	LIST_INSERT_HEAD(&vlog->reading[hash % KVS_VLOG_READ_BUCKETS], r, link);
+	r->value_len = stub->len;
+	r->skew = stub->loc - start;
+	r->epoch = vlog->epoch & 1;
+	vlog->readers[r->epoch]++;
+
+	r->pending = 1;
+	int rc = kvs_vlog_io(vlog, false, r->buf, start, r->len, kvs_vlog_read_done, r, &r->pending);
+	if (rc != 0) {
+		r->status = rc;
+	}
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_vlog_read_done(r, &cpl);
+	return 0;
+}
+
+/*
+#############
+GC
+#############
+*/
+
+// 批头对得上才是这一圈在这里写的批
+static bool kvs_vlog_hdr_check(const char *p, uint64_t off, kvs_vlog_hdr_t *hdr) {
+	memcpy(hdr, p, sizeof(*hdr));
+	uint32_t crc = hdr->crc;
+	hdr->crc = 0;
+	return hdr->magic == KVS_VLOG_MAGIC && hdr->off == off &&
+		hdr->len >= sizeof(*hdr) && hdr->len <= KVS_VLOG_BUF_SIZE &&
+		spdk_crc32c_update(hdr, sizeof(*hdr), 0) == crc;
+}
+
+// [tail, to) 不再用了：先换 epoch，之前发出的读都完成后在 poll 里推进 tail
+static void kvs_vlog_release(kvs_vlog_t *vlog, uint64_t to) {
+	vlog->free_to = to;
+	vlog->epoch++;
+	vlog->gc = KVS_VLOG_GC_FREE;
+}
+
+// 读上来的一段里逐批检查，活的记录拷进 GC 的批；只处理完整的批，剩下的下次再读
+static void kvs_vlog_gc_scan(kvs_vlog_t *vlog) {
+	kvs_vlog_batch_t *batch = vlog->gc_batch;
+	uint64_t left = vlog->size - vlog->tail % vlog->size;
+	size_t p = 0;
+	kvs_vlog_hdr_t hdr;
+
+	vlog->gc_batch = NULL;
+	while (p < vlog->gc_len) {
+		if (!kvs_vlog_hdr_check(vlog->gc_buf + p, vlog->tail + p, &hdr)) {
+			// 写的时候跳过了这一圈剩下的部分
+			if (vlog->head - vlog->tail < left) {
+				SPDK_ERRLOG("Bad value log batch at offset %" PRIu64 ", stopping GC\n", vlog->tail + p);
+				vlog->failed = true;
+				vlog->gc = KVS_VLOG_GC_IDLE;
+				kvs_vlog_batch_put(vlog, batch);
+				return;
+			}
+			p = left;
+			break;
+		}
+		if (p + KVS_VLOG_ROUNDUP(hdr.len) > vlog->gc_len || batch->len + hdr.len > KVS_VLOG_BUF_SIZE) {
+			break;
+		}
+
+		kvs_vlog_rec_t rec;
+		size_t r = sizeof(hdr);
+		bool full = false;
+		while (r < hdr.len && kvs_vlog_rec_check(vlog->gc_buf + p + r, hdr.len - r, &rec)) {
+			const char *data = vlog->gc_buf + p + r;
+			size_t len = sizeof(rec) + rec.key_len + rec.value_len;
+			uint64_t loc = vlog->tail + p + r;
+			kvs_slice_t key = { data + sizeof(rec), rec.key_len };
+
+			if (kvs_engine_located(vlog->engine, rec.engine, key, loc) &&
+				kvs_vlog_batch_add(batch, data, len, NULL, loc) != 0) {
+				full = true;
+				break;
+			}
+			r += KVS_VLOG_ALIGN(len);
+		}
+		// 没搬完的批不能释放，下次从它开始
+		if (full) {
+			break;
+		}
+		p += KVS_VLOG_ROUNDUP(hdr.len);
+	}
+
+	// 几乎都是活的，说明日志装不下这么多 value，搬来搬去也腾不出地方
+	if (KVS_VLOG_ROUNDUP(batch->len) * 8 > p * 7) {
+		vlog->gc_idle_until = spdk_get_ticks() + spdk_get_ticks_hz() * KVS_VLOG_GC_BACKOFF_MS / 1000;
+	}
+
+	if (batch->nents == 0) {
+		kvs_vlog_batch_put(vlog, batch);
+		kvs_vlog_release(vlog, vlog->tail + p);
+		return;
+	}
+	batch->free_to = vlog->tail + p;
+	vlog->gc = KVS_VLOG_GC_WRITE;
+	kvs_vlog_submit(vlog, batch);
+}
+
+static void kvs_vlog_gc_read_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_vlog_t *vlog = arg;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		vlog->gc_status = -EIO;
+	}
+	if (--vlog->gc_pending > 0) {
+		return;
+	}
+	if (vlog->gc_status != 0) {
+		SPDK_ERRLOG("Value log GC read at offset %" PRIu64 " failed\n", vlog->tail);
+		kvs_vlog_batch_put(vlog, vlog->gc_batch);
+		vlog->gc_batch = NULL;
+		vlog->gc = KVS_VLOG_GC_IDLE;
+		vlog->gc_idle_until = spdk_get_ticks() + spdk_get_ticks_hz() * KVS_VLOG_GC_BACKOFF_MS / 1000;
+		return;
+	}
+	kvs_vlog_gc_scan(vlog);
+}
+
+// 从 tail 读一段，最多一批的大小，不跨过环的末尾
+static bool kvs_vlog_gc_start(kvs_vlog_t *vlog) {
+	uint64_t used = vlog->head - vlog->tail;
+
+	if (vlog->failed || vlog->gc != KVS_VLOG_GC_IDLE || used <= vlog->size - vlog->size / 4 ||
+		spdk_get_ticks() < vlog->gc_idle_until) {
+		return false;
+	}
+	vlog->gc_batch = kvs_vlog_batch_get(vlog);
+	if (vlog->gc_batch == NULL) {
+		return false;
+	}
+
+	vlog->gc = KVS_VLOG_GC_READ;
+	vlog->gc_len = spdk_min((uint64_t)KVS_VLOG_BUF_SIZE, vlog->size - vlog->tail % vlog->size);
+	vlog->gc_len = spdk_min(vlog->gc_len, used);
+	vlog->gc_status = 0;
+	vlog->gc_pending = 1;
+	int rc = kvs_vlog_io(vlog, false, vlog->gc_buf, vlog->tail, vlog->gc_len,
+		kvs_vlog_gc_read_done, vlog, &vlog->gc_pending);
+	if (rc != 0) {
+		vlog->gc_status = rc;
+	}
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_vlog_gc_read_done(vlog, &cpl);
+	return true;
+}
+
+static int kvs_vlog_poll(void *arg) {
+	kvs_vlog_t *vlog = arg;
+	int n = spdk_nvme_qpair_process_completions(vlog->qpair, 0);
+	bool busy = n > 0;
+
+	if (vlog->gc == KVS_VLOG_GC_FREE && vlog->readers[(vlog->epoch - 1) & 1] == 0) {
+		kvs_stat_add(&vlog->stats.reclaimed, vlog->free_to - vlog->tail);
+		vlog->tail = vlog->free_to;
+		vlog->gc = KVS_VLOG_GC_IDLE;
+		busy = true;
+	}
+	busy |= kvs_vlog_gc_start(vlog);
+	busy |= kvs_vlog_evict(vlog) > 0;
+
+	return busy ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+/*
+#############
+vlog
+#############
+*/
+
+uint64_t kvs_vlog_used(const kvs_vlog_t *vlog) {
+	return vlog->head - vlog->tail;
+}
+
+uint64_t kvs_vlog_size(const kvs_vlog_t *vlog) {
+	return vlog->size;
+}
+
+const kvs_vlog_stats_t *kvs_vlog_get_stats(const kvs_vlog_t *vlog) {
+	return &vlog->stats;
+}
+
+kvs_vlog_t *kvs_vlog_create(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns,
+		uint64_t start_lba, uint64_t num_lba, kvs_engine_t *e, uint64_t budget) {
+	uint32_t sector_size = spdk_nvme_ns_get_sector_size(ns);
+
+	if (sector_size == 0 || KVS_VLOG_BLOCK % sector_size != 0) {
+		SPDK_ERRLOG("Unsupported sector size %u for value log\n", sector_size);
+		return NULL;
+	}
+
+	kvs_vlog_t *vlog = calloc(1, sizeof(*vlog));
+	if (vlog == NULL) {
+		return NULL;
+	}
+
+	vlog->ns = ns;
+	vlog->sector_size = sector_size;
+	vlog->max_xfer = spdk_nvme_ns_get_max_io_xfer_size(ns) & ~(KVS_VLOG_BLOCK - 1);
+	if (vlog->max_xfer == 0 || vlog->max_xfer > KVS_VLOG_BUF_SIZE) {
+		vlog->max_xfer = KVS_VLOG_BUF_SIZE;
+	}
+	// 只用 PRP 的控制器要求中间的段按页对齐，value 做不到，还是拷贝
+	uint64_t flags = spdk_nvme_ctrlr_get_flags(ctrlr);
+	vlog->sgl = (flags & SPDK_NVME_CTRLR_SGL_SUPPORTED) != 0;
+	vlog->sgl_dword = (flags & SPDK_NVME_CTRLR_SGL_REQUIRES_DWORD_ALIGNMENT) != 0;
+	vlog->start_lba = start_lba;
+	vlog->size = num_lba * sector_size & ~(uint64_t)(KVS_VLOG_BLOCK - 1);
+	vlog->engine = e;
+	vlog->budget = budget;
+	STAILQ_INIT(&vlog->free);
+	for (int i = 0; i < KVS_VLOG_READ_BUCKETS; i++) {
+		LIST_INIT(&vlog->reading[i]);
+	}
+
+	if (vlog->size < KVS_VLOG_MIN_SIZE) {
+		SPDK_ERRLOG("Value log needs at least %d bytes per shard\n", KVS_VLOG_MIN_SIZE);
+		free(vlog);
+		return NULL;
+	}
+
+	// 批的 DMA 缓冲区一次分配好，一直复用
+	int nbatches = 0;
+	vlog->gc_buf = spdk_zmalloc(KVS_VLOG_BUF_SIZE, KVS_VLOG_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+	while (vlog->gc_buf && nbatches < KVS_VLOG_MAX_INFLIGHT) {
+		kvs_vlog_batch_t *batch = calloc(1, sizeof(*batch));
+		if (batch == NULL) {
+			break;
+		}
+		batch->vlog = vlog;
+		batch->buf = spdk_zmalloc(KVS_VLOG_BUF_SIZE, KVS_VLOG_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+		if (vlog->sgl) {
+			batch->sgls = calloc(KVS_VLOG_BUF_SIZE / vlog->max_xfer + 1, sizeof(kvs_vlog_sgl_t));
+		}
+		kvs_vlog_batch_put(vlog, batch);
+		if (batch->buf == NULL || (vlog->sgl && batch->sgls == NULL)) {
+			break;
+		}
+		nbatches++;
+	}
+
+	vlog->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, NULL, 0);
+	if (vlog->qpair == NULL || nbatches < KVS_VLOG_MAX_INFLIGHT) {
+		SPDK_ERRLOG("Cannot allocate qpair or buffers for value log\n");
+		kvs_vlog_destroy(vlog);
+		return NULL;
+	}
+	vlog->poller = SPDK_POLLER_REGISTER(kvs_vlog_poll, vlog, 0);
+	return vlog;
+}
+
+void kvs_vlog_destroy(kvs_vlog_t *vlog) {
+	kvs_vlog_batch_t *batch;
+
+	if (vlog == NULL) {
+		return;
+	}
+
+	// 只在退出时走到这里，等在读写的命令完成，qpair 才能释放
+	while (vlog->qpair && (vlog->ninflight > 0 || vlog->gc == KVS_VLOG_GC_READ ||
+		vlog->readers[0] + vlog->readers[1] > 0)) {
+		if (spdk_nvme_qpair_process_completions(vlog->qpair, 0) < 0) {
+			break;
+		}
+	}
+
+	spdk_poller_unregister(&vlog->poller);
+	while ((batch = STAILQ_FIRST(&vlog->free)) != NULL) {
+		STAILQ_REMOVE_HEAD(&vlog->free, link);
+		spdk_free(batch->buf);
+		free(batch->ents);
+		free(batch->segs);
+		free(batch->sgls);
+		free(batch);
+	}
+	if (vlog->gc_batch) {
+		spdk_free(vlog->gc_batch->buf);
+		free(vlog->gc_batch->ents);
+		free(vlog->gc_batch->segs);
+		free(vlog->gc_batch->sgls);
+		free(vlog->gc_batch);
+	}
+	spdk_free(vlog->gc_buf);
+	if (vlog->qpair) {
+		spdk_nvme_ctrlr_free_io_qpair(vlog->qpair);
+	}
+	free(vlog);
+}
@@ -0,0 +1,91 @@
+#ifndef KVS_VLOG_H
+#define KVS_VLOG_H
+
+#include "spdk/stdinc.h"
+#include "spdk/nvme.h"
+
+#include "kv_engine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+value log
+#############
+
+分层模式下每个 shard 一个 value log，在 namespace 上独占一段连续的 LBA，只在 shard 线程上访问，有自己的 qpair。
+索引（两棵树）一直在内存里，engine 里的 value 超出内存预算时，poller 按 CLOCK 挑出最近没读过的 value，
+打包成批顺序写进日志，写完后树里换成只带位置的冷 value；GET 读到冷 value 时异步读回来，读完再回复，不阻塞 reactor。
+读回来的 value 放回树里并且记着盘上的位置，再被换出时不用重写。
+刚换出去的热 key 会被很多连接同时读：同一条记录已经在读时，后来的读挂在那次读上，只发一次 I/O，读完一起回调。
+
+日志区当成环用，偏移都是一直增长的逻辑偏移。每批从 4K 边界开始，批头记着自己的逻辑偏移，一批不跨过环的末尾，
+放不下时跳到下一圈的开头，GC 读到批头对不上的地方就知道后面是跳过的。
+记录里带着 key（WiscKey 的做法）：用掉 3/4 时 GC 从最旧的批读起，树里的 value 还指着这条记录的才是活的，
+活的搬到日志头上，树里的位置跟着改，之后这段空间才能复用。
+换出的 value 不需要持久：日志只是内存的延伸，重启后从头开始，不能和 WAL 一起用
+*/
+
+#define KVS_VLOG_BLOCK			0x1000
+#define KVS_VLOG_BUF_SIZE		(1024 * 1024)	// 一批的大小，放不下一批的 value 一直留在内存里
+#define KVS_VLOG_MAX_INFLIGHT	4				// 同时在写的批数，包括 GC 的
+#define KVS_VLOG_MAGIC			0x4c56564bu		// "KVVL"，批头
+#define KVS_VLOG_REC_MAGIC		0x5256564bu		// "KVVR"，记录
+
+typedef struct kvs_vlog_hdr_s {
+	uint32_t magic;
+	uint32_t crc;			// 整个批头的 crc32c，计算时这个字段为 0
+	uint64_t off;			// 这一批的逻辑偏移
+	uint32_t len;			// 批头加上记录的字节数
+	uint32_t reserved;
+} __attribute__((packed)) kvs_vlog_hdr_t;
+
+// 记录 8 字节对齐，value 的位置就是记录的逻辑偏移
+typedef struct kvs_vlog_rec_s {
+	uint32_t magic;
+	uint32_t crc;			// crc32c(key + value)
+	uint8_t engine;			// 哪棵树，和 engine 的 tag 一样
+	uint8_t reserved[3];
+	uint32_t key_len;
+	uint32_t value_len;
+	uint32_t reserved2;
+} __attribute__((packed)) kvs_vlog_rec_t;
+
+typedef struct kvs_vlog_s kvs_vlog_t;
+
+// 冷 value 读完后调用，value 是一个新的引用，读失败时为 NULL
+typedef void (*kvs_vlog_read_cb)(void *arg, kvs_value_t *value);
+
+typedef struct kvs_vlog_stats_s {
+	uint64_t evicted;		// 写到日志里的 value 数
+	uint64_t evicted_bytes;
+	uint64_t zcopy;			// 换出时没有拷进批里、直接从 value 写下去的个数
+	uint64_t reads;			// 冷读实际发的 I/O 次数
+	uint64_t coalesced;		// 合并到已经在飞的读上的冷读次数
+	uint64_t read_bytes;	// 按扇区对齐之后实际读的字节数
+	uint64_t relocated;		// GC 搬走的活 value 数
+	uint64_t reclaimed;		// GC 回收的字节数
+} kvs_vlog_stats_t;
+
+// 在 shard 线程上调用：分配 qpair 和 poller，日志占 [start_lba, start_lba + num_lba)，
+// engine 里的 value 超过 budget 字节时开始往日志里换
+kvs_vlog_t *kvs_vlog_create(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns,
+	uint64_t start_lba, uint64_t num_lba, kvs_engine_t *e, uint64_t budget);
+// 等在读写的命令完成后释放
+void kvs_vlog_destroy(kvs_vlog_t *vlog);
+
+// 读回冷 value stub，key 在回调之前要一直有效。同一条记录已经在读时不再发 I/O，
+// 读完后每个调用者各拿到一个引用。失败返回 -ENOMEM，不会调用 cb
+int kvs_vlog_read(kvs_vlog_t *vlog, kvs_slice_t key, const kvs_value_t *stub, kvs_vlog_read_cb cb, void *arg);
+
+uint64_t kvs_vlog_used(const kvs_vlog_t *vlog);
+uint64_t kvs_vlog_size(const kvs_vlog_t *vlog);
+const kvs_vlog_stats_t *kvs_vlog_get_stats(const kvs_vlog_t *vlog);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,613 @@
+#include "spdk/stdinc.h"
+#include "spdk/env.h"
+#include "spdk/thread.h"
+#include "spdk/crc32.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+#include "kvs_wal.h"
+#include "kvs_stats.h"
+
+#define KVS_WAL_READ_SIZE		(1024 * 1024)	// 重放时每次顺序读多少
+
+#define KVS_WAL_ROUNDUP(x)		(((x) + KVS_WAL_BLOCK - 1) & ~(uint64_t)(KVS_WAL_BLOCK - 1))
+
+typedef struct kvs_wal_batch_s {
+	kvs_wal_t *wal;
+	STAILQ_ENTRY(kvs_wal_batch_s) link;
+
+	char *buf;				// DMA 内存，4K 对齐
+	size_t size;
+	size_t len;
+	uint64_t off;			// 在日志区里的字节偏移，封口时确定
+
+	int pending;			// 还没完成的 NVMe 命令数
+	int status;
+	bool done;
+	STAILQ_HEAD(, kvs_wal_waiter_s) waiters;
+} kvs_wal_batch_t;
+
+STAILQ_HEAD(kvs_wal_batch_list, kvs_wal_batch_s);
+
+typedef struct kvs_wal_replay_s {
+	kvs_wal_replay_fn fn;
+	void *arg;
+	kvs_wal_done_fn done;
+	void *done_arg;
+
+	char *buf;
+	size_t size;
+	size_t pos;				// buf 里 [pos, len) 是读上来还没解析的数据
+	size_t len;
+	uint64_t base;			// buf[0] 在日志里的逻辑偏移
+	uint64_t start;			// 从这里开始最多读一圈
+	uint64_t lsn;
+	int pending;
+	int status;
+} kvs_wal_replay_t;
+
+struct kvs_wal_s {
+	struct spdk_nvme_ns *ns;
+	struct spdk_nvme_qpair *qpair;
+	struct spdk_poller *poller;
+
+	uint32_t sector_size;
+	uint32_t max_xfer;
+	uint64_t start_lba;
+	uint64_t size;			// 日志区的字节数
+
+	// 日志区当成环用，偏移都是一直增长的逻辑偏移，对 size 取模才是在日志区里的位置。
+	// [head, tail) 是重放还要用的部分，checkpoint 完成后 head 往前推
+	uint64_t lsn;			// 下一条记录的 lsn
+	uint32_t crc;			// 上一条记录的 crc
+	uint64_t head;
+	uint64_t tail;			// 下一批的起始偏移
+	int status;				// 有一批写失败之后，后面的记录在重放时都接不上，整个 WAL 不再可用
+	bool full_logged;
+
+	kvs_wal_batch_t *open;					// 正在攒的批
+	kvs_wal_batch_t *last;					// 最后封口、还没完成的批
+	struct kvs_wal_batch_list ready;		// 已封口，等 inflight 有空位
+	struct kvs_wal_batch_list inflight;		// 按在日志里的顺序
+	int ninflight;
+	struct kvs_wal_batch_list free;			// 标准大小的批复用，不每次都申请 DMA 内存
+
+	kvs_wal_replay_t *replay;
+	kvs_wal_stats_t stats;
+};
+
+/*
+#############
+batch
+#############
+*/
+
+static kvs_wal_batch_t *kvs_wal_batch_get(kvs_wal_t *wal, size_t need) {
+	kvs_wal_batch_t *batch = STAILQ_FIRST(&wal->free);
+	size_t size = need > KVS_WAL_BUF_SIZE ? KVS_WAL_ROUNDUP(need) : KVS_WAL_BUF_SIZE;
+
+	if (batch && size == KVS_WAL_BUF_SIZE) {
+		STAILQ_REMOVE_HEAD(&wal->free, link);
+	} else {
+		batch = calloc(1, sizeof(*batch));
+		if (batch == NULL) {
+			return NULL;
+		}
+		batch->buf = spdk_zmalloc(size, KVS_WAL_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+		if (batch->buf == NULL) {
+			free(batch);
+			return NULL;
+		}
+		batch->size = size;
+		batch->wal = wal;
+	}
+
+	batch->len = 0;
+	batch->pending = 0;
+	batch->status = 0;
+	batch->done = false;
+	STAILQ_INIT(&batch->waiters);
+	return batch;
+}
+
+static void kvs_wal_batch_put(kvs_wal_t *wal, kvs_wal_batch_t *batch) {
+	if (batch->size == KVS_WAL_BUF_SIZE) {
+		STAILQ_INSERT_HEAD(&wal->free, batch, link);
+		return;
+	}
+	spdk_free(batch->buf);
+	free(batch);
+}
+
+// 封口：确定在日志里的位置，尾部补零到 4K
+static void kvs_wal_seal(kvs_wal_t *wal) {
+	kvs_wal_batch_t *batch = wal->open;
+	size_t len = KVS_WAL_ROUNDUP(batch->len);
+
+	memset(batch->buf + batch->len, 0, len - batch->len);
+	batch->off = wal->tail;
+	wal->tail += len;
+	wal->open = NULL;
+	wal->last = batch;
+	STAILQ_INSERT_TAIL(&wal->ready, batch, link);
+}
+
+// 按顺序完成：前面的批还没写完时，后面的批即使写完了也不能回复
+static void kvs_wal_complete(kvs_wal_t *wal) {
+	kvs_wal_batch_t *batch;
+
+	while ((batch = STAILQ_FIRST(&wal->inflight)) != NULL && batch->done) {
+		STAILQ_REMOVE_HEAD(&wal->inflight, link);
+		wal->ninflight--;
+		if (wal->last == batch) {
+			wal->last = NULL;
+		}
+
+		if (batch->status != 0 && wal->status == 0) {
+			SPDK_ERRLOG("WAL write at offset %" PRIu64 " failed, log is no longer usable\n", batch->off);
+			wal->status = batch->status;
+		}
+
+		int status = wal->status;
+		kvs_wal_waiter_t *waiter;
+		while ((waiter = STAILQ_FIRST(&batch->waiters)) != NULL) {
+			STAILQ_REMOVE_HEAD(&batch->waiters, link);
+			waiter->cb(waiter->arg, status);
+		}
+		kvs_wal_batch_put(wal, batch);
+	}
+}
+
+static void kvs_wal_write_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_wal_batch_t *batch = arg;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		batch->status = -EIO;
+	}
+	if (--batch->pending == 0) {
+		batch->done = true;
+		kvs_wal_complete(batch->wal);
+	}
+}
+
+// 按 max_xfer 和环的边界切成几条命令，每提交一条 *pending 加一
+static int kvs_wal_io(kvs_wal_t *wal, bool write, char *buf, uint64_t off, size_t len,
+		spdk_nvme_cmd_cb cb, void *arg, int *pending) {
+	while (len > 0) {
+		uint64_t pos = off % wal->size;
+		size_t n = spdk_min(len, (size_t)wal->max_xfer);
+		n = spdk_min(n, wal->size - pos);
+
+		uint64_t lba = wal->start_lba + pos / wal->sector_size;
+		int rc = write ?
+			spdk_nvme_ns_cmd_write(wal->ns, wal->qpair, buf, lba, n / wal->sector_size, cb, arg,
+				SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) :
+			spdk_nvme_ns_cmd_read(wal->ns, wal->qpair, buf, lba, n / wal->sector_size, cb, arg, 0);
+		if (rc != 0) {
+			return rc;
+		}
+		(*pending)++;
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// 写命令都带 FUA，完成即落盘
+static void kvs_wal_submit(kvs_wal_t *wal, kvs_wal_batch_t *batch) {
+	size_t len = KVS_WAL_ROUNDUP(batch->len);
+
+	batch->pending = 1;		// 提交过程中先多持有一次
+	int rc = kvs_wal_io(wal, true, batch->buf, batch->off, len, kvs_wal_write_done, batch, &batch->pending);
+	if (rc != 0) {
+		batch->status = rc;
+	}
+
+	kvs_stat_add(&wal->stats.batches, 1);
+	kvs_stat_add(&wal->stats.bytes_written, len);
+
+	STAILQ_INSERT_TAIL(&wal->inflight, batch, link);
+	wal->ninflight++;
+	if (--batch->pending == 0) {
+		batch->done = true;
+		kvs_wal_complete(wal);
+	}
+}
+
+/*
+#############
+append
+#############
+*/
+
+int kvs_wal_reserve(kvs_wal_t *wal, size_t need) {
+	if (wal->status != 0) {
+		return wal->status;
+	}
+
+	// 当前批放不下就封口开新批，两种情况都要先确认日志区还有空间
+	bool fits = wal->open && wal->open->len + need <= wal->open->size;
+	uint64_t end = fits ? wal->tail + KVS_WAL_ROUNDUP(wal->open->len + need) :
+		wal->tail + (wal->open ? KVS_WAL_ROUNDUP(wal->open->len) : 0) + KVS_WAL_ROUNDUP(need);
+	if (end - wal->head > wal->size) {
+		if (!wal->full_logged) {
+			SPDK_ERRLOG("WAL is full (%" PRIu64 " bytes), rejecting writes\n", wal->size);
+			wal->full_logged = true;
+		}
+		return -ENOSPC;
+	}
+
+	if (!fits) {
+		kvs_wal_batch_t *batch = kvs_wal_batch_get(wal, need);
+		if (batch == NULL) {
+			return -ENOMEM;
+		}
+		if (wal->open && wal->open->len > 0) {
+			kvs_wal_seal(wal);
+		} else if (wal->open) {
+			kvs_wal_batch_put(wal, wal->open);
+		}
+		wal->open = batch;
+	}
+	return 0;
+}
+
+int kvs_wal_append(kvs_wal_t *wal, uint8_t engine, uint8_t type, kvs_slice_t key, kvs_slice_t value) {
+	kvs_wal_rec_t rec = {};
+	size_t need = sizeof(rec) + key.len + value.len;
+
+	int rc = kvs_wal_reserve(wal, need);
+	if (rc != 0) {
+		return rc;
+	}
+
+	rec.magic = KVS_WAL_MAGIC;
+	rec.lsn = wal->lsn;
+	rec.engine = engine;
+	rec.type = type;
+	rec.key_len = key.len;
+	rec.value_len = value.len;
+
+	char *p = wal->open->buf + wal->open->len;
+	memcpy(p + sizeof(rec), key.data, key.len);
+	memcpy(p + sizeof(rec) + key.len, value.data, value.len);
+
+	size_t skip = offsetof(kvs_wal_rec_t, lsn);
+	uint32_t crc = spdk_crc32c_update((char *)&rec + skip, sizeof(rec) - skip, wal->crc);
+	rec.crc = spdk_crc32c_update(p + sizeof(rec), key.len + value.len, crc);
+	memcpy(p, &rec, sizeof(rec));
+
+	wal->open->len += need;
+	wal->lsn++;
+	wal->crc = rec.crc;
+	kvs_stat_add(&wal->stats.records, 1);
+	kvs_stat_add(&wal->stats.bytes, need);
+	return 0;
+}
+
+void kvs_wal_wait(kvs_wal_t *wal, kvs_wal_waiter_t *waiter, kvs_wal_cb cb, void *arg) {
+	kvs_wal_batch_t *batch = wal->open && wal->open->len > 0 ? wal->open : wal->last;
+
+	// 之前追加的都已经写完了
+	if (batch == NULL) {
+		cb(arg, wal->status);
+		return;
+	}
+	waiter->cb = cb;
+	waiter->arg = arg;
+	STAILQ_INSERT_TAIL(&batch->waiters, waiter, link);
+}
+
+void kvs_wal_mark(kvs_wal_t *wal, kvs_wal_pos_t *pos) {
+	if (wal->open && wal->open->len > 0) {
+		kvs_wal_seal(wal);
+	}
+	pos->lsn = wal->lsn;
+	pos->off = wal->tail;
+	pos->crc = wal->crc;
+}
+
+void kvs_wal_truncate(kvs_wal_t *wal, uint64_t off) {
+	if (off > wal->head) {
+		wal->head = off;
+		wal->full_logged = false;
+	}
+}
+
+uint64_t kvs_wal_used(const kvs_wal_t *wal) {
+	return wal->tail + (wal->open ? KVS_WAL_ROUNDUP(wal->open->len) : 0) - wal->head;
+}
+
+uint64_t kvs_wal_size(const kvs_wal_t *wal) {
+	return wal->size;
+}
+
+const kvs_wal_stats_t *kvs_wal_get_stats(const kvs_wal_t *wal) {
+	return &wal->stats;
+}
+
+/*
+#############
+replay
+#############
+*/
+
+static void kvs_wal_replay_read(kvs_wal_t *wal);
+
+static void kvs_wal_replay_finish(kvs_wal_t *wal, uint64_t end) {
+	kvs_wal_replay_t *r = wal->replay;
+
+	wal->tail = KVS_WAL_ROUNDUP(end);
+	wal->replay = NULL;
+	SPDK_NOTICELOG("WAL replayed %" PRIu64 " records, %" PRIu64 " bytes\n", wal->lsn - r->lsn, end - r->start);
+
+	spdk_free(r->buf);
+	r->done(r->done_arg, r->status);
+	free(r);
+}
+
+// 把没解析完的尾巴挪到缓冲区前面，保证接下来读的位置还是 4K 对齐，不够放 need 字节时扩容
+static int kvs_wal_replay_compact(kvs_wal_replay_t *r, size_t need) {
+	size_t rem = r->len - r->pos;
+	size_t shift = KVS_WAL_ROUNDUP(rem) - rem;
+	size_t size = r->size;
+
+	while (size < shift + need + KVS_WAL_READ_SIZE) {
+		size *= 2;
+	}
+
+	char *buf = r->buf;
+	if (size != r->size) {
+		buf = spdk_zmalloc(size, KVS_WAL_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+		if (buf == NULL) {
+			return -ENOMEM;
+		}
+	}
+	memmove(buf + shift, r->buf + r->pos, rem);
+	if (buf != r->buf) {
+		spdk_free(r->buf);
+		r->buf = buf;
+		r->size = size;
+	}
+
+	r->base += r->pos;
+	r->base -= shift;
+	r->pos = shift;
+	r->len = shift + rem;
+	return 0;
+}
+
+// 解析缓冲区里的记录；数据不够时读下一段，遇到日志结尾时结束
+static void kvs_wal_replay_parse(kvs_wal_t *wal) {
+	kvs_wal_replay_t *r = wal->replay;
+	kvs_wal_rec_t rec;
+	size_t need;
+
+	while (1) {
+		uint64_t off = r->base + r->pos;
+		size_t avail = r->len - r->pos;
+
+		need = sizeof(rec);
+		if (avail < need) {
+			break;
+		}
+		memcpy(&rec, r->buf + r->pos, sizeof(rec));
+
+		// 每批尾部补的零，跳到下一个 4K；4K 边界上就不是记录说明日志到头了
+		if (rec.magic != KVS_WAL_MAGIC) {
+			if (off % KVS_WAL_BLOCK == 0) {
+				kvs_wal_replay_finish(wal, off);
+				return;
+			}
+			r->pos += KVS_WAL_BLOCK - off % KVS_WAL_BLOCK;
+			continue;
+		}
+
+		need = sizeof(rec) + (size_t)rec.key_len + rec.value_len;
+		if (rec.lsn != wal->lsn || off + need > r->start + wal->size) {
+			kvs_wal_replay_finish(wal, off);
+			return;
+		}
+		if (avail < need) {
+			break;
+		}
+
+		char *p = r->buf + r->pos;
+		size_t skip = offsetof(kvs_wal_rec_t, lsn);
+		uint32_t crc = spdk_crc32c_update(p + skip, sizeof(rec) - skip, wal->crc);
+		crc = spdk_crc32c_update(p + sizeof(rec), need - sizeof(rec), crc);
+		if (crc != rec.crc) {
+			kvs_wal_replay_finish(wal, off);
+			return;
+		}
+
+		kvs_slice_t key = { p + sizeof(rec), rec.key_len };
+		kvs_slice_t value = { key.data + key.len, rec.value_len };
+		r->fn(r->arg, rec.engine, rec.type, key, value);
+
+		wal->lsn++;
+		wal->crc = rec.crc;
+		r->pos += need;
+	}
+
+	// 整个日志区都读完了
+	if (r->base + r->len >= r->start + wal->size) {
+		kvs_wal_replay_finish(wal, r->base + r->pos);
+		return;
+	}
+	if (kvs_wal_replay_compact(r, need) != 0) {
+		r->status = -ENOMEM;
+		kvs_wal_replay_finish(wal, r->base + r->pos);
+		return;
+	}
+	kvs_wal_replay_read(wal);
+}
+
+static void kvs_wal_replay_read_done(void *arg, const struct spdk_nvme_cpl *cpl) {
+	kvs_wal_t *wal = arg;
+	kvs_wal_replay_t *r = wal->replay;
+
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		r->status = -EIO;
+	}
+	if (--r->pending > 0) {
+		return;
+	}
+	if (r->status != 0) {
+		SPDK_ERRLOG("WAL read failed at offset %" PRIu64 "\n", r->base + r->len);
+		kvs_wal_replay_finish(wal, r->base + r->pos);
+		return;
+	}
+	kvs_wal_replay_parse(wal);
+}
+
+// 从 base + len 开始读满缓冲区
+static void kvs_wal_replay_read(kvs_wal_t *wal) {
+	kvs_wal_replay_t *r = wal->replay;
+	uint64_t from = r->base + r->len;
+	size_t len = spdk_min(r->size - r->len, r->start + wal->size - from);
+
+	r->pending = 1;
+	int rc = kvs_wal_io(wal, false, r->buf + r->len, from, len, kvs_wal_replay_read_done, wal, &r->pending);
+	if (rc != 0) {
+		r->status = rc;
+	}
+	r->len += len;
+
+	struct spdk_nvme_cpl cpl = {};
+	kvs_wal_replay_read_done(wal, &cpl);
+}
+
+int kvs_wal_replay(kvs_wal_t *wal, const kvs_wal_pos_t *from,
+		kvs_wal_replay_fn fn, void *arg, kvs_wal_done_fn done, void *done_arg) {
+	kvs_wal_replay_t *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return -ENOMEM;
+	}
+
+	r->fn = fn;
+	r->arg = arg;
+	r->done = done;
+	r->done_arg = done_arg;
+	r->size = KVS_WAL_READ_SIZE;
+	r->buf = spdk_zmalloc(r->size, KVS_WAL_BLOCK, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+	if (r->buf == NULL) {
+		free(r);
+		return -ENOMEM;
+	}
+
+	if (from) {
+		wal->lsn = from->lsn;
+		wal->crc = from->crc;
+		wal->head = from->off;
+		wal->tail = from->off;
+	}
+	r->base = r->start = wal->head;
+	r->lsn = wal->lsn;
+
+	wal->replay = r;
+	kvs_wal_replay_read(wal);
+	return 0;
+}
+
+/*
+#############
+lifecycle
+#############
+*/
+
+// 收完成，再把本轮追加的记录作为一批提交；在写的批已满时继续攒，下一轮一起写
+static int kvs_wal_poll(void *arg) {
+	kvs_wal_t *wal = arg;
+	int n = spdk_nvme_qpair_process_completions(wal->qpair, 0);
+	int submitted = 0;
+
+	if (n < 0) {
+		SPDK_ERRLOG("WAL qpair failed: %d\n", n);
+	}
+
+	if (wal->open && wal->open->len > 0 && wal->ninflight < KVS_WAL_MAX_INFLIGHT) {
+		kvs_wal_seal(wal);
+	}
+	kvs_wal_batch_t *batch;
+	while (wal->ninflight < KVS_WAL_MAX_INFLIGHT && (batch = STAILQ_FIRST(&wal->ready)) != NULL) {
+		STAILQ_REMOVE_HEAD(&wal->ready, link);
+		kvs_wal_submit(wal, batch);
+		submitted++;
+	}
+
+	return n > 0 || submitted > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+kvs_wal_t *kvs_wal_create(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns,
+		uint64_t start_lba, uint64_t num_lba, uint32_t seed) {
+	uint32_t sector_size = spdk_nvme_ns_get_sector_size(ns);
+
+	if (sector_size == 0 || KVS_WAL_BLOCK % sector_size != 0) {
+		SPDK_ERRLOG("Unsupported sector size %u for WAL\n", sector_size);
+		return NULL;
+	}
+
+	kvs_wal_t *wal = calloc(1, sizeof(*wal));
+	if (wal == NULL) {
+		return NULL;
+	}
+
+	wal->ns = ns;
+	wal->sector_size = sector_size;
+	wal->max_xfer = spdk_nvme_ns_get_max_io_xfer_size(ns) & ~(KVS_WAL_BLOCK - 1);
+	if (wal->max_xfer == 0 || wal->max_xfer > KVS_WAL_BUF_SIZE) {
+		wal->max_xfer = KVS_WAL_BUF_SIZE;
+	}
+	wal->start_lba = start_lba;
+	wal->size = num_lba * sector_size & ~(uint64_t)(KVS_WAL_BLOCK - 1);
+	wal->lsn = 1;
+	wal->crc = seed;
+	STAILQ_INIT(&wal->ready);
+	STAILQ_INIT(&wal->inflight);
+	STAILQ_INIT(&wal->free);
+
+	wal->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ctrlr, NULL, 0);
+	if (wal->qpair == NULL) {
+		SPDK_ERRLOG("Cannot allocate qpair for WAL\n");
+		free(wal);
+		return NULL;
+	}
+	wal->poller = SPDK_POLLER_REGISTER(kvs_wal_poll, wal, 0);
+	return wal;
+}
+
+static void kvs_wal_batch_list_free(struct kvs_wal_batch_list *list) {
+	kvs_wal_batch_t *batch;
+
+	while ((batch = STAILQ_FIRST(list)) != NULL) {
+		STAILQ_REMOVE_HEAD(list, link);
+		spdk_free(batch->buf);
+		free(batch);
+	}
+}
+
+void kvs_wal_destroy(kvs_wal_t *wal) {
+	if (wal == NULL) {
+		return;
+	}
+
+	// 只在退出时走到这里，等在写的命令完成，qpair 才能释放
+	while (wal->ninflight > 0 || wal->replay) {
+		if (spdk_nvme_qpair_process_completions(wal->qpair, 0) < 0) {
+			break;
+		}
+	}
+
+	spdk_poller_unregister(&wal->poller);
+	if (wal->open) {
+		STAILQ_INSERT_TAIL(&wal->ready, wal->open, link);
+		wal->open = NULL;
+	}
+	kvs_wal_batch_list_free(&wal->ready);
+	kvs_wal_batch_list_free(&wal->inflight);
+	kvs_wal_batch_list_free(&wal->free);
+	spdk_nvme_ctrlr_free_io_qpair(wal->qpair);
+	free(wal);
+}
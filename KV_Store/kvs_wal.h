@@ -0,0 +1,107 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include "spdk/stdinc.h"
+#include "spdk/nvme.h"
+#include "spdk/queue.h"
+
+#include "kv_engine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+#############
+write-ahead log
+#############
+
+每个 shard 一个 WAL，在 namespace 上独占一段连续的 LBA，只在 shard 线程上访问，有自己的 qpair。
+修改 engine 之前先预留日志空间，执行完把结果（PUT、DEL 或 EXPIRE）追加进去，同一轮 poll 里追加的记录攒成一批，
+打包进 4K 对齐的 DMA 缓冲区一次异步写下去（group commit），等这一批写完再回复客户端。
+
+每批从 4K 边界开始，尾部补零。记录头里的 crc 从上一条记录的 crc 接着算，
+重放时 crc 或 lsn 接不上就是日志的结尾，旧的和写了一半的记录都不会被当成有效记录。
+
+日志区是环形的：checkpoint 记下开始时的位置，写完之后这个位置之前的日志就不再需要，空间可以复用
+*/
+
+#define KVS_WAL_BLOCK			0x1000
+#define KVS_WAL_BUF_SIZE		(128 * 1024)	// 一批的缓冲区，放不下时封口，开下一批
+#define KVS_WAL_MAX_INFLIGHT	4				// 同时在写的批数，满了就继续往当前批里攒
+#define KVS_WAL_MAGIC			0x4c57564bu		// "KVWL"
+
+typedef struct kvs_wal_rec_s {
+	uint32_t magic;
+	uint32_t crc;			// crc32c(lsn 之后的头部 + key + value)，种子是上一条记录的 crc
+	uint64_t lsn;			// 从 1 开始连续递增
+	uint8_t engine;			// kvs_engine_type_t
+	uint8_t type;			// kvs_op_type_t
+	uint16_t reserved;
+	uint32_t key_len;
+	uint32_t value_len;
+	uint32_t reserved2;
+} __attribute__((packed)) kvs_wal_rec_t;
+
+typedef struct kvs_wal_s kvs_wal_t;
+
+// 日志里的一个位置：下一条记录的 lsn、它的逻辑偏移（4K 对齐）和前一条记录的 crc
+typedef struct kvs_wal_pos_s {
+	uint64_t lsn;
+	uint64_t off;
+	uint32_t crc;
+} kvs_wal_pos_t;
+
+// 覆盖某条记录的写完成后回调，status 为 0 表示已经落盘
+typedef void (*kvs_wal_cb)(void *arg, int status);
+
+typedef struct kvs_wal_waiter_s {
+	kvs_wal_cb cb;
+	void *arg;
+	STAILQ_ENTRY(kvs_wal_waiter_s) link;
+} kvs_wal_waiter_t;
+
+typedef void (*kvs_wal_replay_fn)(void *arg, uint8_t engine, uint8_t type,
+	kvs_slice_t key, kvs_slice_t value);
+typedef void (*kvs_wal_done_fn)(void *arg, int rc);
+
+typedef struct kvs_wal_stats_s {
+	uint64_t records;
+	uint64_t batches;		// 提交的写批数，records / batches 就是 group commit 的平均批大小
+	uint64_t bytes;			// 记录本身的字节数
+	uint64_t bytes_written;	// 补齐到 4K 之后实际写下去的字节数
+} kvs_wal_stats_t;
+
+// 在 shard 线程上调用：分配 qpair 和 poller，日志占 [start_lba, start_lba + num_lba)
+kvs_wal_t *kvs_wal_create(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns,
+	uint64_t start_lba, uint64_t num_lba, uint32_t seed);
+// 等在写的批完成后释放，还没提交的记录丢弃
+void kvs_wal_destroy(kvs_wal_t *wal);
+
+// 从 from 开始顺序读日志（NULL 表示从头），对每条有效记录调用 fn，读完后调用 done；
+// 之后的追加接在最后一条有效记录后面
+int kvs_wal_replay(kvs_wal_t *wal, const kvs_wal_pos_t *from,
+	kvs_wal_replay_fn fn, void *arg, kvs_wal_done_fn done, void *done_arg);
+
+// 确认接下来 need 字节的记录（每条 sizeof(kvs_wal_rec_t) + key + value）一定能追加成功：
+// 日志满返回 -ENOSPC，WAL 已经不可用时返回写失败的错误
+int kvs_wal_reserve(kvs_wal_t *wal, size_t need);
+// 追加一条记录，本轮 poll 结束时提交
+int kvs_wal_append(kvs_wal_t *wal, uint8_t engine, uint8_t type, kvs_slice_t key, kvs_slice_t value);
+// 到目前为止追加的记录都落盘后调用 cb，已经都落盘时直接调用
+void kvs_wal_wait(kvs_wal_t *wal, kvs_wal_waiter_t *waiter, kvs_wal_cb cb, void *arg);
+
+// 封口当前批，返回下一条记录的位置，checkpoint 开始时调用
+void kvs_wal_mark(kvs_wal_t *wal, kvs_wal_pos_t *pos);
+// off 之前的日志不再需要
+void kvs_wal_truncate(kvs_wal_t *wal, uint64_t off);
+uint64_t kvs_wal_used(const kvs_wal_t *wal);
+uint64_t kvs_wal_size(const kvs_wal_t *wal);
+
+const kvs_wal_stats_t *kvs_wal_get_stats(const kvs_wal_t *wal);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
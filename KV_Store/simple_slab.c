@@ -1,58 +1,760 @@
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "simple_slab.h"
 
-// #define ALIGN_4k 0x1000
-// #define KV_PAGE_SIZE ALIGN_4k
+#define KV_SLAB_HDR_SIZE    ((sizeof(slab_page_t) + 63) & ~(size_t)63)   // 对象从页头后面的第一个 cacheline 开始
 
-// typedef struct slab_s {
-//     int block_size;
-//     int free_count;
+static pthread_once_t g_slab_once = PTHREAD_ONCE_INIT;
+static slab_t g_classes[KV_SLAB_MAX_CLASSES];
+static int g_nclasses;
+#define KV_SLAB_SMALL_SIZE  1024        // 小对象查表找 class，按 8 字节一格
+static uint8_t g_small_class[KV_SLAB_SMALL_SIZE / 8 + 1];
 
-//     char* first_free;
-//     char* mem;
-// }slab_t;
+// 空页池，所有 class 共用
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_page_t *g_pool;
+static int g_pool_count;
+
+// 一个线程的缓存，只有 remote 会被别的线程写
+typedef struct kv_slab_cache_s {
+    slab_t classes[KV_SLAB_MAX_CLASSES];
+    uint32_t allocs;
+    bool dead;                      // 线程已经 fini，等 kv_slab_cache_reap 收走
+    int compact_class;              // 整理停在了哪个 class
+    uint32_t compact_epoch;         // 所有 class 看完一遍加一，之前搬不动的页重新看
+    struct kv_slab_cache_s *next;   // 挂在 g_caches 上，统计和 reap 时要找到所有缓存
+
+    char *remote __attribute__((aligned(64)));  // 别的线程释放的对象，用对象的头 8 字节串起来
+} kv_slab_cache_t;
+
+static __thread kv_slab_cache_t *t_cache;
+
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static kv_slab_cache_t *g_caches;
+
+static const kv_slab_backend_t *g_backend;
+static bool (*g_defer)(void *ptr);
+
+static slab_page_t *slab_page_alloc(size_t size) {
+    const kv_slab_backend_t *b = __atomic_load_n(&g_backend, __ATOMIC_ACQUIRE);
+    slab_page_t *p = NULL;
+
+    if (b) {
+        p = (slab_page_t *)b->alloc(size, KV_PAGE_SIZE);
+    }
+    // 大对象的 size 不是 KV_PAGE_SIZE 的整数倍，aligned_alloc 不保证能用
+    if (!p) {
+        void *mem;
+        b = NULL;
+        p = posix_memalign(&mem, KV_PAGE_SIZE, size) == 0 ? (slab_page_t *)mem : NULL;
+    }
+    if (p) {
+        p->backend = b;
+    }
+    return p;
+}
+
+static void slab_page_free(slab_page_t *p) {
+    if (p->backend) {
+        p->backend->free(p);
+    } else {
+        free(p);
+    }
+}
+
+// 计数只有一个写者，别的线程读时不会读到写了一半的值
+static void slab_count(uint64_t *c, int64_t v) {
+    __atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static slab_page_t *slab_page_of(const void *ptr) {
+    return (slab_page_t *)((uintptr_t)ptr & ~((uintptr_t)KV_PAGE_SIZE - 1));
+}
+
+static slab_page_t *slab_page_get(void) {
+    pthread_mutex_lock(&g_pool_lock);
+    slab_page_t *p = g_pool;
+    if (p) {
+        g_pool = p->next;
+        g_pool_count--;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    if (!p) {
+        p = slab_page_alloc(KV_PAGE_SIZE);
+    }
+    return p;
+}
+
+static void slab_page_put(slab_page_t *p) {
+    pthread_mutex_lock(&g_pool_lock);
+    if (g_pool_count < KV_SLAB_POOL_MAX) {
+        p->next = g_pool;
+        g_pool = p;
+        g_pool_count++;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+    if (p) {
+        slab_page_free(p);
+    }
+}
+
+// 页池里的空页都还掉
+static void slab_pool_flush(void) {
+    pthread_mutex_lock(&g_pool_lock);
+    slab_page_t *p = g_pool;
+    g_pool = NULL;
+    g_pool_count = 0;
+    pthread_mutex_unlock(&g_pool_lock);
+
+    while (p) {
+        slab_page_t *next = p->next;
+        slab_page_free(p);
+        p = next;
+    }
+}
+
+void kv_slab_use_backend(const kv_slab_backend_t *backend) {
+    __atomic_store_n(&g_backend, backend, __ATOMIC_RELEASE);
+    slab_pool_flush();
+}
+
+bool kv_slab_from_backend(const void *ptr) {
+    return slab_page_of(ptr)->backend != NULL;
+}
+
+static void slab_page_link(slab_page_t **head, slab_page_t *p) {
+    p->prev = NULL;
+    p->next = *head;
+    if (*head) {
+        (*head)->prev = p;
+    }
+    *head = p;
+}
+
+static void slab_page_unlink(slab_page_t **head, slab_page_t *p) {
+    if (p->prev) {
+        p->prev->next = p->next;
+    } else {
+        *head = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
+    }
+}
+
+// 按用了多少分桶，没满的页落在 0 到 KV_SLAB_BUCKETS - 1；桶的上下界记在页头里，热路径上不做除法
+static void slab_partial_link(slab_t *s, slab_page_t *p) {
+    int b = p->used * KV_SLAB_BUCKETS / p->total;
+    p->bucket = (uint8_t)b;
+    p->lo = (b * p->total + KV_SLAB_BUCKETS - 1) / KV_SLAB_BUCKETS;
+    p->hi = ((b + 1) * p->total + KV_SLAB_BUCKETS - 1) / KV_SLAB_BUCKETS;
+    slab_page_link(&s->partial[b], p);
+    s->npartial++;
+}
+
+static void slab_partial_unlink(slab_t *s, slab_page_t *p) {
+    slab_page_unlink(&s->partial[p->bucket], p);
+    s->npartial--;
+    if (s->cur == p) {
+        s->cur = NULL;
+    }
+}
+
+static bool slab_bucket_moved(const slab_page_t *p) {
+    return p->used >= p->hi || p->used < p->lo;
+}
+
+// 最满的一页，新对象挤在少数页上，别的页空得出来
+static slab_page_t *slab_partial_first(const slab_t *s) {
+    for (int b = KV_SLAB_BUCKETS - 1; b >= 0; b--) {
+        if (s->partial[b]) return s->partial[b];
+    }
+    return NULL;
+}
 
 int init_slab(slab_t *s, int block_size) {
-    if (!s) return -1;
+    if (!s || block_size <= 0) return -1;
+
+    // 空闲时对象里存链表指针，至少放得下一个指针，按 8 字节对齐
+    if (block_size < (int)sizeof(char*)) {
+        block_size = sizeof(char*);
+    }
+    block_size = (block_size + 7) & ~7;
+    if ((size_t)block_size > KV_PAGE_SIZE - KV_SLAB_HDR_SIZE) return -1;
 
     s->block_size = block_size;
-    s->free_count = KV_PAGE_SIZE / block_size;
-    s->first_free = (char*)malloc(KV_PAGE_SIZE);
-    if (!s->first_free) return -1;
-    s->mem = s->first_free;
-    char* ptr = s->first_free;
-    for (int i = 0; i < s->free_count; i++) {
-        *(char**)ptr = ptr + block_size;
-        ptr += block_size;
-    }
-    *(char**)ptr = NULL;
+    s->per_page = (KV_PAGE_SIZE - KV_SLAB_HDR_SIZE) / block_size;
+    s->cache = NULL;
+    memset(s->partial, 0, sizeof(s->partial));
+    s->cur = NULL;
+    s->npartial = 0;
+    s->full = NULL;
+    s->pages = 0;
+    s->used = 0;
+    s->reclaimed = 0;
+    pthread_mutex_init(&s->lock, NULL);
     return 0;
 }
 
 void delete_slab(slab_t *s) {
     if (!s) return;
-    free(s->mem);
+
+    for (int i = 0; i <= KV_SLAB_BUCKETS; i++) {
+        slab_page_t *p = i < KV_SLAB_BUCKETS ? s->partial[i] : s->full;
+        while (p) {
+            slab_page_t *next = p->next;
+            slab_page_put(p);
+            p = next;
+        }
+    }
+    memset(s->partial, 0, sizeof(s->partial));
+    s->cur = NULL;
+    s->npartial = 0;
+    s->full = NULL;
+    s->pages = 0;
+    s->used = 0;
+    pthread_mutex_destroy(&s->lock);
 }
 
-void* alloc_slab(slab_t *s) {
-    if (!s || s->free_count == 0) {
-        return NULL;
+// 调用方持有 s->lock，或者 s 属于当前线程的缓存
+static void *slab_alloc_locked(slab_t *s) {
+    slab_page_t *p = s->cur;
+
+    if (!p) {
+        p = s->cur = slab_partial_first(s);
+    }
+    if (!p) {
+        p = slab_page_get();
+        if (!p) return NULL;
+        p->slab = s;
+        p->free_list = NULL;
+        p->unused = (char *)p + KV_SLAB_HDR_SIZE;
+        p->used = 0;
+        p->total = s->per_page;
+        p->evacuating = false;
+        p->pinned = 0;
+        p->size = 0;
+        p->block_size = (uint32_t)s->block_size;
+        p->owner = KV_SLAB_NO_OWNER;
+        slab_partial_link(s, p);
+        s->cur = p;
+        slab_count(&s->pages, 1);
+    }
+
+    char *ptr;
+    if (p->free_list) {
+        ptr = p->free_list;
+        p->free_list = *(char**)ptr;
+    } else {
+        ptr = p->unused;
+        p->unused += s->block_size;
+    }
+    p->used++;
+    slab_count(&s->used, 1);
+    if (p->used == p->total) {
+        slab_partial_unlink(s, p);
+        slab_page_link(&s->full, p);
+    } else if (slab_bucket_moved(p)) {
+        slab_partial_unlink(s, p);
+        slab_partial_link(s, p);
+    }
+    return ptr;
+}
+
+static void slab_free_locked(slab_t *s, slab_page_t *p, void *ptr) {
+    *(char**)ptr = p->free_list;
+    p->free_list = (char*)ptr;
+    p->used--;
+    slab_count(&s->used, -1);
+
+    // 正在腾空的页最后一个对象走了就还回页池
+    if (p->evacuating) {
+        if (p->used == 0) {
+            slab_count(&s->pages, -1);
+            slab_count(&s->reclaimed, 1);
+            slab_page_put(p);
+        }
+        return;
+    }
+    if (p->used + 1 == p->total) {
+        slab_page_unlink(&s->full, p);
+        slab_partial_link(s, p);
+    } else if (slab_bucket_moved(p)) {
+        slab_partial_unlink(s, p);
+        slab_partial_link(s, p);
+    }
+
+    // 空页还回页池；class 只剩这一页没满时留着，免得一分配一释放来回拿页
+    if (p->used == 0 && s->npartial > 1) {
+        slab_partial_unlink(s, p);
+        slab_count(&s->pages, -1);
+        slab_page_put(p);
     }
-    void *ptr = s->first_free;
-    s->first_free = *(char**)ptr;
-    s->free_count--;
+}
+
+void* alloc_slab(slab_t *s) {
+    if (!s) return NULL;
+
+    pthread_mutex_lock(&s->lock);
+    void *ptr = slab_alloc_locked(s);
+    pthread_mutex_unlock(&s->lock);
     return ptr;
 }
 
 void free_slab(slab_t *s, void *ptr) {
-    *(char**)ptr = s->first_free;
-    s->first_free = (char*)ptr;
-    s->free_count++;
+    slab_page_t *p = slab_page_of(ptr);
+
+    pthread_mutex_lock(&s->lock);
+    slab_free_locked(s, p, ptr);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+#############
+size class
+#############
+*/
+
+// KV_SLAB_MIN_SIZE 开始每级乘 KV_SLAB_FACTOR，最后一级是 KV_SLAB_MAX_SIZE
+static void kv_slab_init(void) {
+    size_t size = KV_SLAB_MIN_SIZE;
+
+    while (g_nclasses < KV_SLAB_MAX_CLASSES - 1 && size < KV_SLAB_MAX_SIZE) {
+        init_slab(&g_classes[g_nclasses++], (int)size);
+        size_t next = ((size_t)(size * KV_SLAB_FACTOR) + 7) & ~(size_t)7;
+        size = next > size ? next : size + 8;
+    }
+    init_slab(&g_classes[g_nclasses++], KV_SLAB_MAX_SIZE);
+
+    int c = 0;
+    for (size_t i = 0; i <= KV_SLAB_SMALL_SIZE / 8; i++) {
+        while ((size_t)g_classes[c].block_size < i * 8) {
+            c++;
+        }
+        g_small_class[i] = (uint8_t)c;
+    }
+}
+
+int kv_slab_class(size_t size) {
+    pthread_once(&g_slab_once, kv_slab_init);
+
+    if (size <= KV_SLAB_SMALL_SIZE) return g_small_class[(size + 7) / 8];
+    if (size > KV_SLAB_MAX_SIZE) return -1;
+
+    int lo = g_small_class[KV_SLAB_SMALL_SIZE / 8], hi = g_nclasses - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((size_t)g_classes[mid].block_size >= size) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/*
+#############
+thread cache
+#############
+*/
+
+// 把 remote 栈整个摘下来，逐个还给所在的页
+static void kv_slab_cache_drain(kv_slab_cache_t *cache) {
+    char *ptr = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (ptr) {
+        char *next = *(char**)ptr;
+        slab_page_t *p = slab_page_of(ptr);
+        slab_free_locked(p->slab, p, ptr);
+        ptr = next;
+    }
+}
+
+// 只压栈不出栈单个元素，出栈是整个换成 NULL，没有 ABA 问题
+static void kv_slab_cache_push(kv_slab_cache_t *cache, void *ptr) {
+    char *head = __atomic_load_n(&cache->remote, __ATOMIC_RELAXED);
+
+    do {
+        *(char**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&cache->remote, &head, (char*)ptr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void *kv_slab_cache_alloc(kv_slab_cache_t *cache, int c) {
+    slab_t *s = &cache->classes[c];
+
+    // 要拿新页之前先收一次，别的线程还回来的可能就够用
+    if ((++cache->allocs % KV_SLAB_DRAIN_ALLOCS == 0 || s->used == s->pages * s->per_page) &&
+        __atomic_load_n(&cache->remote, __ATOMIC_RELAXED)) {
+        kv_slab_cache_drain(cache);
+    }
+    return slab_alloc_locked(s);
+}
+
+int kv_slab_cache_init(void) {
+    if (t_cache) return 0;
+
+    pthread_once(&g_slab_once, kv_slab_init);
+
+    kv_slab_cache_t *cache = (kv_slab_cache_t *)aligned_alloc(64, sizeof(kv_slab_cache_t));
+    if (!cache) return -1;
+    memset(cache, 0, sizeof(*cache));
+    cache->compact_epoch = 1;       // 新页的 pinned 是 0
+    for (int i = 0; i < g_nclasses; i++) {
+        init_slab(&cache->classes[i], g_classes[i].block_size);
+        cache->classes[i].cache = cache;
+    }
+    t_cache = cache;
+
+    pthread_mutex_lock(&g_cache_lock);
+    cache->next = g_caches;
+    g_caches = cache;
+    pthread_mutex_unlock(&g_cache_lock);
+    return 0;
+}
+
+// 还在用的页挂到全局 class 上
+static void kv_slab_cache_adopt(slab_t *g, slab_page_t *p) {
+    pthread_mutex_lock(&g->lock);
+    p->slab = g;
+    if (p->used == p->total) {
+        slab_page_link(&g->full, p);
+    } else {
+        slab_partial_link(g, p);
+    }
+    slab_count(&g->pages, 1);
+    slab_count(&g->used, p->used);
+    pthread_mutex_unlock(&g->lock);
+}
+
+// 空页还回页池，还在用的页 adopt 时挂到全局 class 上，否则留在原来的 class 里
+static void kv_slab_cache_release(kv_slab_cache_t *cache, bool adopt) {
+    for (int i = 0; i < g_nclasses; i++) {
+        slab_t *s = &cache->classes[i];
+        slab_page_t *lists[KV_SLAB_BUCKETS + 1];
+        memcpy(lists, s->partial, sizeof(s->partial));
+        lists[KV_SLAB_BUCKETS] = s->full;
+        memset(s->partial, 0, sizeof(s->partial));
+        s->cur = NULL;
+        s->npartial = 0;
+        s->full = NULL;
+        for (int j = 0; j <= KV_SLAB_BUCKETS; j++) {
+            slab_page_t *p = lists[j];
+            while (p) {
+                slab_page_t *next = p->next;
+                if (p->used == 0) {
+                    slab_count(&s->pages, -1);
+                    slab_page_put(p);
+                } else if (adopt) {
+                    slab_count(&s->pages, -1);
+                    slab_count(&s->used, -p->used);
+                    kv_slab_cache_adopt(&g_classes[i], p);
+                } else if (p->used == p->total) {
+                    slab_page_link(&s->full, p);
+                } else {
+                    slab_partial_link(s, p);
+                }
+                p = next;
+            }
+        }
+    }
+}
+
+void kv_slab_cache_fini(void) {
+    kv_slab_cache_t *cache = t_cache;
+    if (!cache) return;
+
+    // 别的线程可能还拿着这个缓存的对象，之后释放时照样压进 remote 栈，缓存本身要留到 reap
+    t_cache = NULL;
+    kv_slab_cache_drain(cache);
+    kv_slab_cache_release(cache, false);
+    __atomic_store_n(&cache->dead, true, __ATOMIC_RELEASE);
+}
+
+void kv_slab_cache_reap(void) {
+    kv_slab_cache_t *dead = NULL;
+
+    pthread_mutex_lock(&g_cache_lock);
+    kv_slab_cache_t **pp = &g_caches;
+    while (*pp) {
+        kv_slab_cache_t *c = *pp;
+        if (__atomic_load_n(&c->dead, __ATOMIC_ACQUIRE)) {
+            *pp = c->next;
+            c->next = dead;
+            dead = c;
+        } else {
+            pp = &c->next;
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+
+    while (dead) {
+        kv_slab_cache_t *c = dead;
+        dead = c->next;
+        kv_slab_cache_drain(c);
+        kv_slab_cache_release(c, true);
+        for (int i = 0; i < g_nclasses; i++) {
+            pthread_mutex_destroy(&c->classes[i].lock);
+        }
+        free(c);
+    }
+}
+
+void *kv_slab_alloc(size_t size) {
+    int c = kv_slab_class(size);
+    if (c >= 0) {
+        kv_slab_cache_t *cache = t_cache;
+        return cache ? kv_slab_cache_alloc(cache, c) : alloc_slab(&g_classes[c]);
+    }
+
+    // 大对象：起始地址按 KV_PAGE_SIZE 对齐，才找得到页头；长度只取整到 4KB，不按整页算
+    if (size > SIZE_MAX - KV_SLAB_HDR_SIZE - KV_SLAB_HUGE_ALIGN) return NULL;
+    size_t total = (KV_SLAB_HDR_SIZE + size + KV_SLAB_HUGE_ALIGN - 1) & ~((size_t)KV_SLAB_HUGE_ALIGN - 1);
+    slab_page_t *p = slab_page_alloc(total);
+    if (!p) return NULL;
+    p->slab = NULL;
+    p->size = total;
+    return (char *)p + KV_SLAB_HDR_SIZE;
+}
+
+void kv_slab_free(void *ptr) {
+    if (!ptr) return;
+
+    bool (*defer)(void *) = __atomic_load_n(&g_defer, __ATOMIC_ACQUIRE);
+    if (defer && defer(ptr)) return;
+
+    slab_page_t *p = slab_page_of(ptr);
+    slab_t *s = p->slab;
+    if (!s) {
+        slab_page_free(p);
+    } else if (!s->cache) {
+        free_slab(s, ptr);
+    } else if (s->cache == t_cache) {
+        slab_free_locked(s, p, ptr);
+    } else {
+        kv_slab_cache_push(s->cache, ptr);
+    }
+}
+
+/*
+#############
+compaction
+#############
+*/
+
+// 页上的对象全都搬得动时整页搬走，返回 1 表示页已经回到页池。
+// 还在用的对象不在 free_list 上、在 unused 之前；看过的对象数从 budget 里扣
+static int slab_compact_page(slab_t *s, slab_page_t *p, const kv_slab_mover_t *m, void *arg,
+                             int *budget, uint32_t epoch) {
+    uint64_t freed[KV_PAGE_SIZE / KV_SLAB_MIN_SIZE / 64];
+    char *base = (char *)p + KV_SLAB_HDR_SIZE;
+    int carved = (int)((p->unused - base) / s->block_size);
+    int live = p->used;
+
+    // class 只剩这一页没满时空页会留着，不用搬
+    if (live == 0) {
+        p->pinned = epoch;
+        return 0;
+    }
+    memset(freed, 0, (carved + 63) / 64 * sizeof(freed[0]));
+    for (char *f = p->free_list; f; f = *(char**)f) {
+        int i = (int)((f - base) / s->block_size);
+        freed[i / 64] |= 1ULL << (i % 64);
+    }
+    *budget -= live;
+    for (int i = 0; i < carved; i++) {
+        if (!(freed[i / 64] >> (i % 64) & 1) && !m->movable(arg, base + (size_t)i * s->block_size)) {
+            p->pinned = epoch;
+            return 0;
+        }
+    }
+
+    // 搬的时候拷贝不能分到这一页上；最后一个对象释放时页就回到页池了，之后不能再碰 p
+    slab_partial_unlink(s, p);
+    p->evacuating = true;
+    for (int i = 0; i < carved && live > 0; i++) {
+        if (freed[i / 64] >> (i % 64) & 1) continue;
+        if (m->move(arg, base + (size_t)i * s->block_size) != 0) {
+            p->evacuating = false;
+            p->pinned = epoch;
+            slab_partial_link(s, p);
+            return 0;
+        }
+        live--;
+    }
+    return 1;
+}
+
+// 空闲的对象够一页时，任意一页上的对象都装得进其余的页；只看用了不到一半的桶
+static int slab_compact_class(slab_t *s, const kv_slab_mover_t *m, void *arg, int *budget, uint32_t epoch) {
+    int reclaimed = 0;
+
+    if (s->pages * s->per_page - s->used < (uint64_t)KV_SLAB_COMPACT_MIN * s->per_page) return 0;
+    for (int b = 0; b < KV_SLAB_BUCKETS / 2; b++) {
+        slab_page_t *p = s->partial[b];
+        while (p && *budget > 0 && s->pages * s->per_page - s->used >= (uint64_t)s->per_page) {
+            (*budget)--;
+            if (p->pinned == epoch) {
+                p = p->next;
+                continue;
+            }
+            reclaimed += slab_compact_page(s, p, m, arg, budget, epoch);
+            // 拷贝分配时别的页可能换了桶，从头再来，搬不动的页这一轮直接跳过
+            p = s->partial[b];
+        }
+    }
+    return reclaimed;
+}
+
+int kv_slab_compact(const kv_slab_mover_t *m, void *arg, int budget) {
+    kv_slab_cache_t *cache = t_cache;
+    int reclaimed = 0;
+
+    // 交接期间页随时可能交出去，腾到一半的页不在任何链表上，disown 时找不到
+    if (!cache || __atomic_load_n(&g_defer, __ATOMIC_ACQUIRE)) return 0;
+
+    // 先把别的线程还回来的收了，页上剩下的才都是还在用的
+    kv_slab_cache_drain(cache);
+    for (int n = 0; n < g_nclasses; n++) {
+        reclaimed += slab_compact_class(&cache->classes[cache->compact_class], m, arg, &budget,
+                                        cache->compact_epoch);
+        if (budget <= 0) return reclaimed;
+        cache->compact_class = (cache->compact_class + 1) % g_nclasses;
+    }
+    cache->compact_epoch++;
+    return reclaimed;
+}
+
+static void slab_stats_add(kv_slab_class_stats_t *st, const slab_t *s) {
+    uint64_t pages = __atomic_load_n(&s->pages, __ATOMIC_RELAXED);
+
+    st->pages += pages;
+    st->used += __atomic_load_n(&s->used, __ATOMIC_RELAXED);
+    st->capacity += pages * s->per_page;
+    st->reclaimed += __atomic_load_n(&s->reclaimed, __ATOMIC_RELAXED);
+}
+
+int kv_slab_get_stats(kv_slab_class_stats_t *stats, int max) {
+    pthread_once(&g_slab_once, kv_slab_init);
+
+    int n = g_nclasses < max ? g_nclasses : max;
+    memset(stats, 0, n * sizeof(*stats));
+    for (int i = 0; i < n; i++) {
+        stats[i].size = g_classes[i].block_size;
+        slab_stats_add(&stats[i], &g_classes[i]);
+    }
+    // 缓存拆掉之前会先从 g_caches 上摘下来
+    pthread_mutex_lock(&g_cache_lock);
+    for (kv_slab_cache_t *c = g_caches; c; c = c->next) {
+        for (int i = 0; i < n; i++) {
+            slab_stats_add(&stats[i], &c->classes[i]);
+        }
+    }
+    pthread_mutex_unlock(&g_cache_lock);
+    return n;
+}
+
+int kv_slab_pool_pages(void) {
+    pthread_mutex_lock(&g_pool_lock);
+    int n = g_pool_count;
+    pthread_mutex_unlock(&g_pool_lock);
+    return n;
+}
+
+/*
+#############
+handoff
+#############
+*/
+
+void kv_slab_defer_free(bool (*defer)(void *ptr)) {
+    __atomic_store_n(&g_defer, defer, __ATOMIC_RELEASE);
+}
+
+// 页头记下 owner，链表和计数清空，页从此不归这个 class 管
+static void slab_disown(slab_t *s, uint16_t owner) {
+    for (int i = 0; i <= KV_SLAB_BUCKETS; i++) {
+        for (slab_page_t *p = i < KV_SLAB_BUCKETS ? s->partial[i] : s->full; p; p = p->next) {
+            p->owner = owner;
+        }
+    }
+    memset(s->partial, 0, sizeof(s->partial));
+    s->cur = NULL;
+    s->npartial = 0;
+    s->full = NULL;
+    __atomic_store_n(&s->pages, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->used, 0, __ATOMIC_RELAXED);
+}
+
+void kv_slab_cache_disown(uint16_t owner) {
+    kv_slab_cache_t *cache = t_cache;
+    if (!cache) return;
+
+    kv_slab_cache_drain(cache);
+    for (int i = 0; i < g_nclasses; i++) {
+        slab_disown(&cache->classes[i], owner);
+    }
+}
+
+void kv_slab_disown(void) {
+    pthread_once(&g_slab_once, kv_slab_init);
+
+    slab_pool_flush();
+    for (int i = 0; i < g_nclasses; i++) {
+        pthread_mutex_lock(&g_classes[i].lock);
+        slab_disown(&g_classes[i], KV_SLAB_NO_OWNER);
+        pthread_mutex_unlock(&g_classes[i].lock);
+    }
+}
+
+void kv_slab_adopt(void *page, const kv_slab_backend_t *backend) {
+    slab_page_t *p = (slab_page_t *)page;
+
+    pthread_once(&g_slab_once, kv_slab_init);
+    p->backend = backend;
+    // 页头里的 slab 指针是上一个 owner 的地址，只看是不是 NULL
+    if (!p->slab) return;
+
+    // 两边的 class 表握手时比过，对不上的页只能漏掉
+    int c = kv_slab_class(p->block_size);
+    if (c < 0 || g_classes[c].block_size != (int)p->block_size) return;
+
+    p->evacuating = false;
+    p->pinned = 0;
+    if (p->used == 0) {
+        slab_page_put(p);
+        return;
+    }
+
+    kv_slab_cache_t *cache = t_cache;
+    if (!cache) {
+        kv_slab_cache_adopt(&g_classes[c], p);
+        return;
+    }
+    slab_t *s = &cache->classes[c];
+    p->slab = s;
+    if (p->used == p->total) {
+        slab_page_link(&s->full, p);
+    } else {
+        slab_partial_link(s, p);
+    }
+    slab_count(&s->pages, 1);
+    slab_count(&s->used, p->used);
+}
+
+uint16_t kv_slab_page_owner(const void *page) {
+    const slab_page_t *p = (const slab_page_t *)page;
+
+    return p->slab ? p->owner : KV_SLAB_NO_OWNER;
 }
 
 
@@ -1,23 +1,167 @@
+#ifndef SIMPLE_SLAB_H
+#define SIMPLE_SLAB_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define ALIGN_4k 0x1000
-#define KV_PAGE_SIZE ALIGN_4k
+/*
+#############
+slab
+#############
+
+memcached 风格的分配器：对象按大小分到几何增长的 size class 里，每个 class 从全局的页池里拿页，
+一页切成同样大小的对象；页满了再拿一页挂上，页里的对象全部释放后还回页池，给别的 class 用。
+页按 KV_PAGE_SIZE 对齐，页头在页的开头，释放时对象地址向下取整就找到了所在的页和 class。
+比最大的 class 还大的对象单独分配，同样带一个页头。
+
+class 各有一把锁：value 在一个 shard 上分配，引用放掉的地方可能是任何线程。
+reactor 线程上调用 kv_slab_cache_init 之后，这个线程有自己的一套 class 和页，分配和本线程释放都不加锁、没有原子操作；
+别的线程释放它的对象时压进它的 remote 栈（无锁的多生产者单消费者），它分配时成批收回来。
+
+页默认用 posix_memalign 分配；kv_slab_use_backend 可以换成别的来源，比如 SPDK 的 DMA 大页内存，
+这样的页里的对象可以直接放进 NVMe 命令的 SGL，不用先拷到 DMA 缓冲区里
+
+还有空闲对象的页按用了多少分桶，分配总是从最满的页拿，新对象尽量挤在少数页上。
+value 的大小分布变了以后，旧 class 里还会剩下很多只用了一点的页。kv_slab_compact 从最空的桶里挑页，
+页上的对象全都搬得动时，由持有对象的一方（engine）把它们拷到别的页、换掉自己的引用，页空了就回到页池，给需要的 class 用
+
+热重启时页可以整个交给另一个进程（页从两边映射在同一地址的共享内存里分配）：老进程 disown，页头记下原来属于哪个 shard，
+然后忘掉这些页；新进程逐页 adopt，挂到对应 shard 的缓存上。页归别人之后本进程释放的对象交给 kv_slab_defer_free 的回调，由新的 owner 释放
+*/
+
+#define KV_PAGE_SIZE            (1 << 20)   // 每页 1MB
+#define KV_SLAB_MIN_SIZE        64
+#define KV_SLAB_FACTOR          1.25
+#define KV_SLAB_MAX_SIZE        ((KV_PAGE_SIZE - 4096) / 4)    // 留出页头一页正好放 4 个；再大的单独分配，不然一页空着将近一半
+#define KV_SLAB_HUGE_ALIGN      4096        // 单独分配的大对象长度取整到这么多
+#define KV_SLAB_MAX_CLASSES     64
+#define KV_SLAB_POOL_MAX        64          // 页池最多留多少空页，多的还给系统
+#define KV_SLAB_DRAIN_ALLOCS    256         // 线程缓存每分配这么多次看一下 remote 栈
+#define KV_SLAB_BUCKETS         4           // 还有空闲对象的页按用了几分之几分桶
+#define KV_SLAB_COMPACT_MIN     2           // class 的空闲对象凑得够这么多页才整理
+#define KV_SLAB_NO_OWNER        0xffff      // disown 时不属于哪个线程缓存的页
+
+struct kv_slab_cache_s;
+
+struct slab_s;
+
+// 页的来源，alloc 返回 align 对齐的内存
+typedef struct kv_slab_backend_s {
+    void *(*alloc)(size_t size, size_t align);
+    void (*free)(void *ptr);
+} kv_slab_backend_t;
+
+typedef struct slab_page_s {
+    struct slab_s *slab;        // 单独分配的大对象为 NULL
+    const kv_slab_backend_t *backend;   // 这一页是从哪里分配的，NULL 是 posix_memalign
+    struct slab_page_s *prev;
+    struct slab_page_s *next;
+    char *free_list;            // 释放回来的对象
+    char *unused;               // 还没切过的部分从这里开始，新页不用一次切完
+    int used;                   // 分配出去的对象数
+    int total;
+    bool evacuating;            // 正在腾空，不在任何链表上，不再分配
+    uint8_t bucket;             // 在 partial 的哪个桶里，used 落在 [lo, hi) 时不用换桶
+    int lo;
+    int hi;
+    uint32_t pinned;            // 哪一轮整理发现上面有搬不动的对象，这一轮不再看
+    size_t size;                // 大对象：整块的字节数
+    uint32_t block_size;        // 切成多大的对象，adopt 时按它找 class
+    uint16_t owner;             // disown 时属于哪个线程缓存，adopt 时挂回同一个 shard
+} slab_page_t;
 
 typedef struct slab_s {
     int block_size;
-    int free_count;
+    int per_page;
 
-    char* first_free;
-    char* mem;
-}slab_t;
+    struct kv_slab_cache_s *cache;  // 属于哪个线程缓存，NULL 时由 lock 保护
+    pthread_mutex_t lock;
+    slab_page_t *partial[KV_SLAB_BUCKETS];  // 还有空闲对象的页，第 i 个桶里的页用了 i/KV_SLAB_BUCKETS 以上
+    slab_page_t *cur;           // 正在分配的页，满了或者换了桶再从最满的桶里挑
+    int npartial;
+    slab_page_t *full;
+    // 计数只在持有者那里写，可以在别的线程上读
+    uint64_t pages;
+    uint64_t used;              // 分配出去的对象数
+    uint64_t reclaimed;         // 腾空后还回页池的页数
+} slab_t;
 
+// 单个 class：对象大小固定为 block_size，页不够时自动加页
 int init_slab(slab_t *s, int block_size);
+// 所有页还回页池，还没释放的对象一起作废
 void delete_slab(slab_t *s);
 void* alloc_slab(slab_t *s);
 void free_slab(slab_t *s, void *ptr);
 
+// 按大小挑 class 分配，size 为 0 时也返回一个可以释放的对象。失败返回 NULL
+void *kv_slab_alloc(size_t size);
+// 释放 kv_slab_alloc 或 alloc_slab 拿到的对象，ptr 可以为 NULL
+void kv_slab_free(void *ptr);
+// size 落在哪个 class，返回 -1 表示单独分配
+int kv_slab_class(size_t size);
+
+// 之后新分配的页从 backend 拿，拿不到时退回 posix_memalign；页池里的空页先还掉。
+// backend 为 NULL 时恢复默认，backend 的内存释放之前要这样调一次。backend 要一直有效
+void kv_slab_use_backend(const kv_slab_backend_t *backend);
+// ptr 所在的页是不是从 backend 分配的
+bool kv_slab_from_backend(const void *ptr);
+
+// 给当前线程建一个缓存，之后这个线程的 kv_slab_alloc 都从缓存里分配
+int kv_slab_cache_init(void);
+// 在同一个线程上调用，之后这个线程从全局的 class 分配。空页马上还回页池；
+// 别的线程还拿着的对象照样可以释放，缓存本身和还在用的页留到 kv_slab_cache_reap
+void kv_slab_cache_fini(void);
+// 收走所有已经 fini 的缓存，还在用的页交给全局的 class。
+// 调用时不能有别的线程还在释放这些缓存的对象，比如所有 reactor 都停下之后
+void kv_slab_cache_reap(void);
+
+// 整理时怎么搬对象：movable 只看搬不搬得动；move 把对象拷到别处（kv_slab_alloc 分配）再释放原来的，成功返回 0
+typedef struct kv_slab_mover_s {
+    bool (*movable)(void *arg, void *obj);
+    int (*move)(void *arg, void *obj);
+} kv_slab_mover_t;
+
+// 整理当前线程的缓存：class 的空闲对象凑够 KV_SLAB_COMPACT_MIN 页时，从用了不到一半的页里挑，
+// 页上的对象全都搬得动才搬，一次搬完，页马上回到页池；有搬不动的页这一轮不再看。
+// 缓存里的对象都要是 m 认得的。最多看 budget 个对象，下次从停下的 class 接着来，
+// 返回腾空了多少页，没有缓存时返回 0
+int kv_slab_compact(const kv_slab_mover_t *m, void *arg, int budget);
+
+typedef struct kv_slab_class_stats_s {
+    int size;                   // 对象大小
+    uint64_t pages;
+    uint64_t used;              // 分配出去的对象数
+    uint64_t capacity;          // 这些页一共能放多少个对象
+    uint64_t reclaimed;
+} kv_slab_class_stats_t;
+
+// 所有线程缓存和全局 class 加在一起，按 class 从小到大填最多 max 项，返回填了多少项。任意线程上调用
+int kv_slab_get_stats(kv_slab_class_stats_t *stats, int max);
+// 页池里的空页数
+int kv_slab_pool_pages(void);
+
+// 之后释放对象时先交给 defer，返回 true 表示它接手了（比如对象所在的页已经归别的进程），NULL 时照常释放。
+// 设着的时候不做碎片整理
+void kv_slab_defer_free(bool (*defer)(void *ptr));
+// 在缓存所在的线程上调用：缓存里的页在页头记下 owner，然后全部忘掉，之后分配从新页开始。
+// 调用前先设好 kv_slab_defer_free，并且所有线程都过了一遍，不会再有对象压进 remote 栈
+void kv_slab_cache_disown(uint16_t owner);
+// 全局 class 的页同样忘掉，owner 记为 KV_SLAB_NO_OWNER；页池里的空页还掉
+void kv_slab_disown(void);
+// 接手一页 disown 过的页，可能是另一个进程的：改成从 backend 分配，挂到当前线程的缓存上，没有缓存时挂到全局 class 上，
+// 空页放进页池。大对象只改 backend
+void kv_slab_adopt(void *page, const kv_slab_backend_t *backend);
+// disown 时记下的 owner，大对象返回 KV_SLAB_NO_OWNER
+uint16_t kv_slab_page_owner(const void *page);
+
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif
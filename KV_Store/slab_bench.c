@@ -0,0 +1,192 @@
+// slab 分配器的微基准，和 glibc malloc 对比 1 到 N 个线程的吞吐
+// 用法: ./slab_bench [max_threads] [seconds]
+// local:  每个线程分配一批对象再全部释放，都在本线程上
+// remote: 线程 i 分配的对象交给线程 i+1 释放，测 remote 栈的开销；只有一个线程时跳过
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simple_slab.h"
+
+#define BENCH_BATCH     64
+#define BENCH_RING      4096            // remote 模式下相邻线程之间的单生产者单消费者队列
+#define BENCH_MAX_SIZE  512             // value 大多是几十到几百字节
+
+typedef struct {
+    void *slots[BENCH_RING];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+} bench_ring_t;
+
+typedef struct {
+    int id;
+    int nthreads;
+    int use_slab;
+    int remote;
+    bench_ring_t *in;                   // 从上一个线程收要释放的对象
+    bench_ring_t *out;
+    uint64_t ops;
+} bench_worker_t;
+
+static int g_stop;                  // 主线程写，worker 读，都用 __atomic
+static pthread_barrier_t g_barrier;
+
+static void *bench_alloc(int use_slab, size_t size) {
+    return use_slab ? kv_slab_alloc(size) : malloc(size);
+}
+
+static void bench_free(int use_slab, void *ptr) {
+    if (use_slab) {
+        kv_slab_free(ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+static void bench_pin(int id) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// 把 in 里别的线程分配的对象释放掉
+static void bench_drain_ring(bench_worker_t *w) {
+    bench_ring_t *r = w->in;
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        bench_free(w->use_slab, r->slots[head % BENCH_RING]);
+        w->ops++;
+    }
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+static void *bench_worker(void *arg) {
+    bench_worker_t *w = arg;
+    void *objs[BENCH_BATCH];
+    uint32_t seed = w->id * 2654435761u + 1;
+
+    bench_pin(w->id);
+    if (w->use_slab) {
+        kv_slab_cache_init();
+    }
+    pthread_barrier_wait(&g_barrier);
+
+    while (!__atomic_load_n(&g_stop, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            seed = seed * 1103515245 + 12345;
+            objs[i] = bench_alloc(w->use_slab, 16 + (seed >> 8) % BENCH_MAX_SIZE);
+            *(char *)objs[i] = 1;
+        }
+        if (!w->remote) {
+            for (int i = 0; i < BENCH_BATCH; i++) {
+                bench_free(w->use_slab, objs[i]);
+            }
+            w->ops += 2 * BENCH_BATCH;
+            continue;
+        }
+
+        bench_ring_t *r = w->out;
+        uint64_t tail = r->tail;
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            // 下一个线程跟不上时自己先把收到的释放掉，免得两边互相等
+            while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= BENCH_RING) {
+                bench_drain_ring(w);
+                if (__atomic_load_n(&g_stop, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            }
+            if (__atomic_load_n(&g_stop, __ATOMIC_RELAXED)) {
+                bench_free(w->use_slab, objs[i]);
+                continue;
+            }
+            r->slots[tail % BENCH_RING] = objs[i];
+            tail++;
+            w->ops++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        bench_drain_ring(w);
+    }
+
+    pthread_barrier_wait(&g_barrier);
+    if (w->remote) {
+        bench_drain_ring(w);
+    }
+    pthread_barrier_wait(&g_barrier);
+    if (w->use_slab) {
+        kv_slab_cache_fini();
+    }
+    return NULL;
+}
+
+static double bench_run(int nthreads, int use_slab, int remote, double seconds) {
+    bench_worker_t *ws = calloc(nthreads, sizeof(*ws));
+    bench_ring_t *rings = aligned_alloc(64, nthreads * sizeof(*rings));
+    pthread_t *tids = calloc(nthreads, sizeof(*tids));
+
+    memset(rings, 0, nthreads * sizeof(*rings));
+    __atomic_store_n(&g_stop, 0, __ATOMIC_RELAXED);
+    pthread_barrier_init(&g_barrier, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        ws[i] = (bench_worker_t){
+            .id = i, .nthreads = nthreads, .use_slab = use_slab, .remote = remote,
+            .in = &rings[i], .out = &rings[(i + 1) % nthreads],
+        };
+        pthread_create(&tids[i], NULL, bench_worker, &ws[i]);
+    }
+
+    struct timespec start, end;
+    pthread_barrier_wait(&g_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    usleep((useconds_t)(seconds * 1e6));
+    __atomic_store_n(&g_stop, 1, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_wait(&g_barrier);
+    pthread_barrier_wait(&g_barrier);
+
+    uint64_t ops = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += ws[i].ops;
+    }
+    pthread_barrier_destroy(&g_barrier);
+    kv_slab_cache_reap();
+    free(tids);
+    free(rings);
+    free(ws);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return ops / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    printf("%-8s %-8s %14s %14s %8s\n", "mode", "threads", "malloc Mops/s", "slab Mops/s", "ratio");
+    for (int remote = 0; remote <= 1; remote++) {
+        for (int n = 1; n <= max_threads; n *= 2) {
+            if (remote && n == 1) {
+                continue;
+            }
+            double m = bench_run(n, 0, remote, seconds);
+            double s = bench_run(n, 1, remote, seconds);
+            printf("%-8s %-8d %14.2f %14.2f %8.2f\n", remote ? "remote" : "local", n, m, s, s / m);
+            if (n < max_threads && n * 2 > max_threads) {
+                n = max_threads / 2;
+            }
+        }
+    }
+    return 0;
+}
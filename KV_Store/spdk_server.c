@@ -9,356 +9,4067 @@
 
 #include "spdk/log.h"
 #include "spdk/sock.h"
+#include "spdk/endian.h"
+#include "spdk/queue.h"
+#include "spdk/rpc.h"
 #include "spdk_server.h"
+#include "kv_engine.h"
+#include "kvs_shard.h"
+#include "kvs_stats.h"
+#include "kvs_frame.h"
+#include "kvs_proto.h"
+#include "kvs_resp.h"
+#include "kvs_shm.h"
+#include "kvs_handoff.h"
+#include "kvs_region.h"
+#include "simple_slab.h"
+
+#include <poll.h>
+#include <semaphore.h>
 
 
 
 //
 #define ADDR_STR_LEN		INET6_ADDRSTRLEN
-#define BUFFER_SIZE			1024
-#define MAX_TOKENS          16
+#define MAX_TOKENS          KVS_RESP_MAX_ARGS
+
+#define KVS_REPLY_OK		"OK\r\n"
+#define KVS_REPLY_EXIST		"EXIST\r\n"
+#define KVS_REPLY_NO_EXIST	"NO EXIST\r\n"
+#define KVS_REPLY_ERROR		"ERROR\r\n"
+
+static char *g_host = "0.0.0.0";
+static int g_port = 8888;
+static char *g_sock_impl_name = "posix";
+static bool g_running;
+static bool g_wal;			// -W：写先记到 NVMe 上的 WAL，落盘后再回复
+static uint64_t g_tier_mb;	// -T：value 的内存预算（MB），超出的部分换到 NVMe 上
+static uint32_t g_hot = KVS_HOT_THRESHOLD;	// -K：热 key 复制到每个 shard 的阈值，0 表示不复制
+static char *g_shm_path;	// -U：本机客户端走共享内存环，在这个 Unix socket 上握手
+static char *g_handoff_path;	// -O：热重启，从这个 Unix socket 上的老进程接手，再在上面等下一个进程
+static int g_slist_home = -1;	// 热重启期间跳表的 op 都转到这个 shard 上执行，好记进它的日志；-1 表示就地执行
+
+
+typedef enum {
+	KVS_PROTO_UNKNOWN = 0,	// 还没收到第一个字节
+	KVS_PROTO_TEXT,
+	KVS_PROTO_BINARY,
+	KVS_PROTO_RESP,
+} kvs_proto_t;
+
+// 命令字按字节拼成一个 32 位整数，switch 直接比较整数，不做 strcmp
+#define KVS_CMD_WORD(a, b, c, d) \
+	((uint32_t)(uint8_t)(a) | ((uint32_t)(uint8_t)(b) << 8) | \
+	((uint32_t)(uint8_t)(c) << 16) | ((uint32_t)(uint8_t)(d) << 24))
+
+static kvs_cmd_t kvs_cmd_lookup(const kvs_slice_t *tok) {
+	if (tok->len == 5 && memcmp(tok->data, "STATS", 5) == 0) return KVS_CMD_STATS;
+	if (tok->len == 5 && memcmp(tok->data, "BSCAN", 5) == 0) return KVS_CMD_BSCAN;
+	if (tok->len == 5 && memcmp(tok->data, "SSCAN", 5) == 0) return KVS_CMD_SSCAN;
+	if (tok->len == 5 && memcmp(tok->data, "SETEX", 5) == 0) return KVS_CMD_SETEX;
+	if (tok->len == 6 && memcmp(tok->data, "EXPIRE", 6) == 0) return KVS_CMD_EXPIRE;
+	if (tok->len == 3 && memcmp(tok->data, "TTL", 3) == 0) return KVS_CMD_TTL;
+	if (tok->len == 7 && memcmp(tok->data, "PERSIST", 7) == 0) return KVS_CMD_PERSIST;
+	if (tok->len != 4) return KVS_CMD_COUNT;
+
+	const char *p = tok->data;
+	switch (KVS_CMD_WORD(p[0], p[1], p[2], p[3])) {
+		case KVS_CMD_WORD('B', 'S', 'E', 'T'): return KVS_CMD_BSET;
+		case KVS_CMD_WORD('B', 'G', 'E', 'T'): return KVS_CMD_BGET;
+		case KVS_CMD_WORD('B', 'D', 'E', 'L'): return KVS_CMD_BDEL;
+		case KVS_CMD_WORD('B', 'M', 'O', 'D'): return KVS_CMD_BMOD;
+		case KVS_CMD_WORD('R', 'S', 'E', 'T'): return KVS_CMD_RSET;
+		case KVS_CMD_WORD('R', 'G', 'E', 'T'): return KVS_CMD_RGET;
+		case KVS_CMD_WORD('R', 'D', 'E', 'L'): return KVS_CMD_RDEL;
+		case KVS_CMD_WORD('R', 'M', 'O', 'D'): return KVS_CMD_RMOD;
+		case KVS_CMD_WORD('M', 'G', 'E', 'T'): return KVS_CMD_MGET;
+		case KVS_CMD_WORD('M', 'S', 'E', 'T'): return KVS_CMD_MSET;
+		case KVS_CMD_WORD('M', 'D', 'E', 'L'): return KVS_CMD_MDEL;
+		case KVS_CMD_WORD('H', 'S', 'E', 'T'): return KVS_CMD_HSET;
+		case KVS_CMD_WORD('H', 'G', 'E', 'T'): return KVS_CMD_HGET;
+		case KVS_CMD_WORD('H', 'D', 'E', 'L'): return KVS_CMD_HDEL;
+		case KVS_CMD_WORD('H', 'M', 'O', 'D'): return KVS_CMD_HMOD;
+		case KVS_CMD_WORD('S', 'S', 'E', 'T'): return KVS_CMD_SSET;
+		case KVS_CMD_WORD('S', 'G', 'E', 'T'): return KVS_CMD_SGET;
+		case KVS_CMD_WORD('S', 'D', 'E', 'L'): return KVS_CMD_SDEL;
+		case KVS_CMD_WORD('S', 'M', 'O', 'D'): return KVS_CMD_SMOD;
+	}
+	return KVS_CMD_COUNT;
+}
+
+// 十进制整数，不接受符号和空串
+static bool kvs_slice_u64(const kvs_slice_t *arg, uint64_t *v) {
+	uint64_t n = 0;
+
+	if (arg->len == 0 || arg->len > 19) {
+		return false;
+	}
+	for (size_t i = 0; i < arg->len; i++) {
+		if (arg->data[i] < '0' || arg->data[i] > '9') {
+			return false;
+		}
+		n = n * 10 + (arg->data[i] - '0');
+	}
+	*v = n;
+	return true;
+}
+
+// 相对的过期时间换算成绝对时间，最长 UINT32_MAX 秒
+static bool kvs_expire_after(uint64_t ms, uint64_t *expire) {
+	if (ms > (uint64_t)UINT32_MAX * 1000) {
+		return false;
+	}
+	*expire = kvs_now_ms() + ms;
+	return true;
+}
+
+// TTL 的结果：没有过期时间为 -1，否则是剩余的毫秒数
+static int64_t kvs_expire_left(uint64_t expire) {
+	uint64_t now = kvs_now_ms();
+
+	if (expire == 0) {
+		return -1;
+	}
+	return expire > now ? (int64_t)(expire - now) : 0;
+}
+
+static int kvs_slice_cmp(const kvs_slice_t *a, const kvs_slice_t *b) {
+	size_t n = a->len < b->len ? a->len : b->len;
+	int rc = n ? memcmp(a->data, b->data, n) : 0;
+
+	if (rc != 0) return rc;
+	return a->len < b->len ? -1 : a->len > b->len;
+}
+
+// 按空格切分，tokens 指向 msg 内部，不修改也不拷贝 msg
+static int kvs_split_tokens(kvs_slice_t *tokens, int max, const char *msg, size_t len) {
+	const char *p = msg;
+	const char *end = msg + len;
+	int count = 0;
+
+	while (p < end && (end[-1] == '\n' || end[-1] == '\r')) {
+		end--;
+	}
+	while (p < end && count < max) {
+		while (p < end && *p == ' ') p++;
+		if (p == end) break;
+
+		const char *sep = kvs_scan_byte(p, end, ' ');
+		tokens[count].data = p;
+		tokens[count].len = sep - p;
+		count++;
+		p = sep;
+	}
+
+	return count;
+}
+
+/*
+#############
+request
+#############
+
+一条命令拆成若干个 op，每个 op 按 key 的 hash 落到所属的 shard 上执行。
+op 全部完成后再回复，同一个连接上的回复按命令到达的顺序发出
+*/
+
+#define KVS_REQ_MAX_OPS		KVS_RESP_MAX_ARGS
+
+struct server_conn_t;
+
+typedef struct kvs_req_s {
+	struct server_conn_t *conn;
+	TAILQ_ENTRY(kvs_req_s) link;
+
+	int cmd;				// 文本/二进制为 kvs_cmd_t，RESP 为 kvs_resp_cmd_t
+	uint8_t stat;			// kvs_stat_cmd_t
+	uint64_t tsc;			// 收到请求时的 TSC
+	const char *error;		// 不用访问 engine 就能确定的错误回复
+	uint8_t opcode;			// 二进制协议原样带回
+	uint64_t opaque;
+
+	kvs_slice_t arg;		// RESP: SCAN 的 MATCH，PING 的参数
+	uint64_t count;			// RESP: SCAN 的 COUNT
+
+	int pending;			// 还没完成的 op 数
+	int nops;
+	kvs_op_t *ops;
+
+	int nbatches;
+	kvs_op_t *batches;		// 多 key 请求按 shard 分组，每组一个 BATCH op
+	kvs_op_t **batch_ops;	// 按 shard 排好的 ops 指针，BATCH op 指向其中一段
+} kvs_req_t;
+
+static const struct {
+	uint8_t engine;
+	uint8_t type;
+	uint8_t stat;
+} kvs_cmd_ops[KVS_CMD_COUNT] = {
+	[KVS_CMD_BSET] = { KVS_ENGINE_BPTREE, KVS_OP_SET, KVS_STAT_SET },
+	[KVS_CMD_BGET] = { KVS_ENGINE_BPTREE, KVS_OP_GET, KVS_STAT_GET },
+	[KVS_CMD_BDEL] = { KVS_ENGINE_BPTREE, KVS_OP_DEL, KVS_STAT_DEL },
+	[KVS_CMD_BMOD] = { KVS_ENGINE_BPTREE, KVS_OP_MOD, KVS_STAT_MOD },
+	[KVS_CMD_RSET] = { KVS_ENGINE_RBTREE, KVS_OP_SET, KVS_STAT_SET },
+	[KVS_CMD_RGET] = { KVS_ENGINE_RBTREE, KVS_OP_GET, KVS_STAT_GET },
+	[KVS_CMD_RDEL] = { KVS_ENGINE_RBTREE, KVS_OP_DEL, KVS_STAT_DEL },
+	[KVS_CMD_RMOD] = { KVS_ENGINE_RBTREE, KVS_OP_MOD, KVS_STAT_MOD },
+	[KVS_CMD_STATS] = { 0, 0, KVS_STAT_STATS },
+	[KVS_CMD_MGET] = { KVS_ENGINE_BPTREE, KVS_OP_GET, KVS_STAT_MGET },
+	[KVS_CMD_MSET] = { KVS_ENGINE_BPTREE, KVS_OP_PUT, KVS_STAT_MSET },
+	[KVS_CMD_MDEL] = { KVS_ENGINE_BPTREE, KVS_OP_DEL, KVS_STAT_DEL },
+	[KVS_CMD_BSCAN] = { KVS_ENGINE_BPTREE, KVS_OP_RANGE, KVS_STAT_SCAN },
+	[KVS_CMD_SETEX] = { KVS_ENGINE_BPTREE, KVS_OP_PUT, KVS_STAT_SET },
+	[KVS_CMD_EXPIRE] = { KVS_ENGINE_BPTREE, KVS_OP_EXPIRE, KVS_STAT_TTL },
+	[KVS_CMD_TTL] = { KVS_ENGINE_BPTREE, KVS_OP_TTL, KVS_STAT_TTL },
+	[KVS_CMD_PERSIST] = { KVS_ENGINE_BPTREE, KVS_OP_EXPIRE, KVS_STAT_TTL },
+	[KVS_CMD_HSET] = { KVS_ENGINE_HTABLE, KVS_OP_SET, KVS_STAT_SET },
+	[KVS_CMD_HGET] = { KVS_ENGINE_HTABLE, KVS_OP_GET, KVS_STAT_GET },
+	[KVS_CMD_HDEL] = { KVS_ENGINE_HTABLE, KVS_OP_DEL, KVS_STAT_DEL },
+	[KVS_CMD_HMOD] = { KVS_ENGINE_HTABLE, KVS_OP_MOD, KVS_STAT_MOD },
+	[KVS_CMD_SSET] = { KVS_ENGINE_SKIPLIST, KVS_OP_SET, KVS_STAT_SET },
+	[KVS_CMD_SGET] = { KVS_ENGINE_SKIPLIST, KVS_OP_GET, KVS_STAT_GET },
+	[KVS_CMD_SDEL] = { KVS_ENGINE_SKIPLIST, KVS_OP_DEL, KVS_STAT_DEL },
+	[KVS_CMD_SMOD] = { KVS_ENGINE_SKIPLIST, KVS_OP_MOD, KVS_STAT_MOD },
+	[KVS_CMD_SSCAN] = { KVS_ENGINE_SKIPLIST, KVS_OP_RANGE, KVS_STAT_SCAN },
+};
+
+// key/value 先指向接收缓冲区，提交时如果不能立即执行再拷贝
+static kvs_op_t *kvs_req_add_op(kvs_req_t *req, uint8_t engine, uint8_t type,
+		const kvs_slice_t *key, const kvs_slice_t *value) {
+	kvs_op_t *op = &req->ops[req->nops++];
+
+	memset(op, 0, sizeof(*op));
+	op->engine = engine;
+	op->type = type;
+	if (key) op->key = *key;
+	if (value) op->value = *value;
+	return op;
+}
+
+static kvs_op_t *kvs_req_add_cmd(kvs_req_t *req, kvs_cmd_t cmd, const kvs_slice_t *key, const kvs_slice_t *value) {
+	req->cmd = cmd;
+	req->stat = kvs_cmd_ops[cmd].stat;
+	if (cmd == KVS_CMD_STATS) {
+		return NULL;
+	}
+	return kvs_req_add_op(req, kvs_cmd_ops[cmd].engine, kvs_cmd_ops[cmd].type, key, value);
+}
+
+// 请求和它的 op、分组用的 BATCH op、key/value 放在同一块内存里
+static kvs_req_t *kvs_req_clone(const kvs_req_t *req) {
+	int nbatches = req->nops > 1 ? (req->nops < g_nshards ? req->nops : g_nshards) : 0;
+	size_t size = sizeof(*req) + req->nops * sizeof(kvs_op_t) + req->arg.len;
+
+	if (nbatches > 0) {
+		size += nbatches * sizeof(kvs_op_t) + req->nops * sizeof(kvs_op_t *);
+	}
+
+	for (int i = 0; i < req->nops; i++) {
+		size += req->ops[i].key.len + req->ops[i].value.len;
+	}
+
+	kvs_req_t *r = malloc(size);
+	if (r == NULL) {
+		return NULL;
+	}
+	memcpy(r, req, sizeof(*req));
+	r->ops = (kvs_op_t *)(r + 1);
+	r->nbatches = 0;
+	r->batches = r->ops + r->nops;
+	r->batch_ops = (kvs_op_t **)(r->batches + nbatches);
+
+	char *p = nbatches > 0 ? (char *)(r->batch_ops + r->nops) : (char *)r->batches;
+	for (int i = 0; i < r->nops; i++) {
+		kvs_op_t *op = &r->ops[i];
+
+		*op = req->ops[i];
+		if (op->key.data) {
+			memcpy(p, op->key.data, op->key.len);
+			op->key.data = p;
+			p += op->key.len;
+		}
+		if (op->value.data) {
+			memcpy(p, op->value.data, op->value.len);
+			op->value.data = p;
+			p += op->value.len;
+		}
+	}
+	if (r->arg.data) {
+		memcpy(p, r->arg.data, r->arg.len);
+		r->arg.data = p;
+	}
+	return r;
+}
+
+// 按目标 shard 分组，一个 shard 上只有一个 op 时直接提交，多个时合成一个 BATCH op，
+// 由 engine 一次处理。subs 返回要提交的 op，最多 g_nshards 个
+static int kvs_req_group(kvs_req_t *r, kvs_op_t **subs) {
+	int count[KVS_MAX_SHARDS] = {0};
+	int pos[KVS_MAX_SHARDS];
+	int n = 0, off = 0;
+
+	if (r->nops == 1) {
+		subs[0] = &r->ops[0];
+		return 1;
+	}
+
+	for (int i = 0; i < r->nops; i++) {
+		count[r->ops[i].shard]++;
+	}
+	for (int s = 0; s < g_nshards; s++) {
+		pos[s] = off;
+		off += count[s];
+	}
+	for (int i = 0; i < r->nops; i++) {
+		r->batch_ops[pos[r->ops[i].shard]++] = &r->ops[i];
+	}
+
+	off = 0;
+	for (int s = 0; s < g_nshards; s++) {
+		if (count[s] == 0) {
+			continue;
+		}
+		kvs_op_t **group = &r->batch_ops[off];
+		off += count[s];
+		if (count[s] == 1) {
+			subs[n++] = group[0];
+			continue;
+		}
+
+		kvs_op_t *b = &r->batches[r->nbatches++];
+		memset(b, 0, sizeof(*b));
+		b->engine = group[0]->engine;
+		b->type = KVS_OP_BATCH;
+		b->shard = s;
+		b->batch = group;
+		b->count = count[s];
+		subs[n++] = b;
+	}
+	return n;
+}
+
+// 请求失败时计入错误数
+static bool kvs_req_failed(const kvs_req_t *req) {
+	if (req->error) {
+		return true;
+	}
+	if (req->nops == 0) {
+		return req->stat == KVS_STAT_OTHER;
+	}
+	for (int i = 0; i < req->nops; i++) {
+		if (req->ops[i].rc == KVS_ERROR) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// STATS 的回复文本，生成一个 value 交给各协议回复
+static kvs_value_t *spdk_server_stats_value(void);
+
+static void kvs_req_free_results(kvs_req_t *req) {
+	for (int i = 0; i < req->nops; i++) {
+		kvs_op_free_result(&req->ops[i]);
+	}
+}
+
+static bool kvs_cmd_has_value(kvs_cmd_t cmd) {
+	return cmd == KVS_CMD_BSET || cmd == KVS_CMD_BMOD ||
+		cmd == KVS_CMD_RSET || cmd == KVS_CMD_RMOD || cmd == KVS_CMD_MSET || cmd == KVS_CMD_SETEX ||
+		cmd == KVS_CMD_HSET || cmd == KVS_CMD_HMOD || cmd == KVS_CMD_SSET || cmd == KVS_CMD_SMOD;
+}
+
+// SETEX/EXPIRE 带一个过期秒数
+static bool kvs_cmd_has_ttl(kvs_cmd_t cmd) {
+	return cmd == KVS_CMD_SETEX || cmd == KVS_CMD_EXPIRE;
+}
+
+static bool kvs_cmd_is_multi(kvs_cmd_t cmd) {
+	return cmd == KVS_CMD_MGET || cmd == KVS_CMD_MSET || cmd == KVS_CMD_MDEL;
+}
+
+static bool kvs_cmd_is_range(kvs_cmd_t cmd) {
+	return cmd == KVS_CMD_BSCAN || cmd == KVS_CMD_SSCAN;
+}
+
+/*
+BSCAN：按 key 的顺序取 [start, end] 范围内的 key 和 value。
+key 按 hash 分散在各个 shard 上，每个 shard 沿叶子链表各取 limit + 1 个，回复时归并。
+一次最多 KVS_BSCAN_MAX 个，还有剩余时带回游标（下一个 key），客户端原样传回继续，
+服务端不保存状态，一次请求的内存和 limit 成正比，不随范围变大。
+SSCAN 一样，只是共享的跳表本身就是一个有序的 keyspace，在本 shard 上取一次就够了
+*/
+
+#define KVS_BSCAN_DEFAULT	100
+#define KVS_BSCAN_MAX		512
+
+typedef struct kvs_range_entry_s {
+	kvs_slice_t key;
+	kvs_value_t *value;
+} kvs_range_entry_t;
+
+// start/end 为 NULL 时不限，有 cursor 时从 cursor 开始
+static void kvs_req_add_range(kvs_req_t *req, kvs_cmd_t cmd, const kvs_slice_t *start, const kvs_slice_t *end,
+		uint64_t limit, const kvs_slice_t *cursor) {
+	uint8_t engine = kvs_cmd_ops[cmd].engine;
+	int n = engine == KVS_ENGINE_SKIPLIST ? 1 : g_nshards;
+
+	if (limit == 0) {
+		limit = KVS_BSCAN_DEFAULT;
+	}
+	req->cmd = cmd;
+	req->stat = kvs_cmd_ops[cmd].stat;
+	req->count = limit > KVS_BSCAN_MAX ? KVS_BSCAN_MAX : limit;
+
+	for (int i = 0; i < n; i++) {
+		kvs_op_t *op = kvs_req_add_op(req, engine, KVS_OP_RANGE, cursor ? cursor : start, end);
+		op->shard = i;
+		op->count = req->count + 1;
+	}
+}
+
+// 归并各个 shard 的有序结果，取前 req->count 个；还有剩余时 next 为下一次的起点，返回 true
+static bool kvs_range_merge(kvs_req_t *req, kvs_range_entry_t *entries, size_t *n, kvs_slice_t *next) {
+	size_t off[KVS_MAX_SHARDS] = {};
+	kvs_slice_t key;
+	kvs_value_t *value;
+
+	*n = 0;
+	while (1) {
+		int min = -1;
+		size_t len = 0;
+		kvs_range_entry_t e = {};
+
+		for (int i = 0; i < req->nops; i++) {
+			size_t l = kvs_op_range_peek(&req->ops[i], off[i], &key, &value);
+			if (l > 0 && (min < 0 || kvs_slice_cmp(&key, &e.key) < 0)) {
+				min = i;
+				len = l;
+				e.key = key;
+				e.value = value;
+			}
+		}
+		if (min < 0) {
+			return false;
+		}
+		if (*n == req->count) {
+			*next = e.key;
+			return true;
+		}
+		off[min] += len;
+		entries[(*n)++] = e;
+	}
+}
+
+/*
+#############
+text protocol
+#############
+*/
+
+static int kvs_reply_status(kvs_wbuf_t *out, int rc) {
+	const char *reply;
+	switch (rc) {
+		case KVS_OK:		reply = KVS_REPLY_OK; break;
+		case KVS_EXIST:		reply = KVS_REPLY_EXIST; break;
+		case KVS_NOT_FOUND:	reply = KVS_REPLY_NO_EXIST; break;
+		default:			reply = KVS_REPLY_ERROR; break;
+	}
+	return kvs_wbuf_append(out, reply, strlen(reply));
+}
+
+// value 只挂一个引用，发送时直接从 engine 的内存里读
+static int kvs_reply_value(kvs_wbuf_t *out, int rc, kvs_value_t *value) {
+	if (rc != KVS_OK) {
+		return kvs_reply_status(out, rc);
+	}
+	if (kvs_wbuf_append_ref(out, value) < 0) {
+		return -1;
+	}
+	return kvs_wbuf_append(out, "\r\n", 2);
+}
+
+// 把一行命令转成 op，格式错误时不生成 op，回复 ERROR
+static void kvs_proto_parser(kvs_req_t *req, kvs_slice_t *tokens, int count) {
+	if (count <= 0) return;
+
+	kvs_cmd_t cmd = kvs_cmd_lookup(&tokens[0]);
+	if (cmd == KVS_CMD_STATS) {
+		if (count == 1) kvs_req_add_cmd(req, cmd, NULL, NULL);
+		return;
+	}
+	// BSCAN/SSCAN start end limit [cursor]，start/end 为 - 时不限
+	if (kvs_cmd_is_range(cmd)) {
+		uint64_t limit;
+		if ((count != 4 && count != 5) || !kvs_slice_u64(&tokens[3], &limit)) {
+			return;
+		}
+		bool open_start = tokens[1].len == 1 && tokens[1].data[0] == '-';
+		bool open_end = tokens[2].len == 1 && tokens[2].data[0] == '-';
+		kvs_req_add_range(req, cmd, open_start ? NULL : &tokens[1], open_end ? NULL : &tokens[2],
+			limit, count == 5 ? &tokens[4] : NULL);
+		return;
+	}
+	// MGET k1 k2 ... / MSET k1 v1 k2 v2 ... / MDEL k1 k2 ...
+	if (kvs_cmd_is_multi(cmd)) {
+		int step = kvs_cmd_has_value(cmd) ? 2 : 1;
+		if (count < 1 + step || count > MAX_TOKENS || (count - 1) % step != 0) {
+			return;
+		}
+		for (int i = 1; i < count; i += step) {
+			kvs_req_add_cmd(req, cmd, &tokens[i], step == 2 ? &tokens[i + 1] : NULL);
+		}
+		return;
+	}
+	// SETEX key seconds value / EXPIRE key seconds
+	if (kvs_cmd_has_ttl(cmd)) {
+		uint64_t sec, expire;
+		bool has_value = kvs_cmd_has_value(cmd);
+		if (count != (has_value ? 4 : 3) || !kvs_slice_u64(&tokens[2], &sec) ||
+			!kvs_expire_after(sec * 1000, &expire)) {
+			return;
+		}
+		kvs_op_t *op = kvs_req_add_cmd(req, cmd, &tokens[1], has_value ? &tokens[3] : NULL);
+		op->expire = expire;
+		return;
+	}
+	if (cmd == KVS_CMD_COUNT || count != (kvs_cmd_has_value(cmd) ? 3 : 2)) {
+		return;
+	}
+
+	kvs_req_add_cmd(req, cmd, &tokens[1], count == 3 ? &tokens[2] : NULL);
+}
+
+static void kvs_proto_process(kvs_req_t *req, const char *msg, size_t len) {
+	// 多切一个，超过 MAX_TOKENS 的命令当作格式错误，不截断
+	kvs_slice_t tokens[MAX_TOKENS + 1];
+	int count = kvs_split_tokens(tokens, MAX_TOKENS + 1, msg, len);
+	for (int i = 0; i < count; i++) {
+		KVS_TRACE("token %d : %.*s", i, (int)tokens[i].len, tokens[i].data);
+	}
+	kvs_proto_parser(req, tokens, count);
+}
+
+// 每个 key 一行 "key value"，还有剩余时以 CURSOR <next> 结尾，否则以 END 结尾
+static int kvs_reply_range(kvs_req_t *req, kvs_wbuf_t *out) {
+	kvs_range_entry_t entries[KVS_BSCAN_MAX];
+	kvs_slice_t next;
+	size_t n;
+
+	for (int i = 0; i < req->nops; i++) {
+		if (req->ops[i].rc != KVS_OK) {
+			return kvs_reply_status(out, KVS_ERROR);
+		}
+	}
+
+	bool more = kvs_range_merge(req, entries, &n, &next);
+	for (size_t i = 0; i < n; i++) {
+		if (kvs_wbuf_append(out, entries[i].key.data, entries[i].key.len) < 0 ||
+			kvs_wbuf_append(out, " ", 1) < 0 ||
+			kvs_reply_value(out, KVS_OK, entries[i].value) < 0) {
+			return -1;
+		}
+	}
+	if (!more) {
+		return kvs_wbuf_append(out, "END\r\n", 5);
+	}
+	if (kvs_wbuf_append(out, "CURSOR ", 7) < 0 ||
+		kvs_wbuf_append(out, next.data, next.len) < 0) {
+		return -1;
+	}
+	return kvs_wbuf_append(out, "\r\n", 2);
+}
+
+// 统计信息是多行文本，以 END 结尾
+static int kvs_reply_stats(kvs_wbuf_t *out) {
+	kvs_value_t *v = spdk_server_stats_value();
+	if (v == NULL) {
+		return kvs_reply_status(out, KVS_ERROR);
+	}
+
+	int rc = kvs_wbuf_append_ref(out, v);
+	kvs_value_put(v);
+	if (rc < 0) {
+		return -1;
+	}
+	return kvs_wbuf_append(out, "END\r\n", 5);
+}
+
+// 回复追加到 out，失败返回 -1
+static int kvs_proto_reply(kvs_req_t *req, kvs_wbuf_t *out) {
+	if (req->stat == KVS_STAT_STATS) {
+		return kvs_reply_stats(out);
+	}
+	if (req->nops == 0) {
+		return kvs_reply_status(out, KVS_ERROR);
+	}
+
+	kvs_op_t *op = &req->ops[0];
+	if (kvs_cmd_is_range(req->cmd)) {
+		return kvs_reply_range(req, out);
+	}
+	if (req->cmd == KVS_CMD_MSET) {
+		for (int i = 0; i < req->nops; i++) {
+			if (req->ops[i].rc != KVS_OK) {
+				return kvs_reply_status(out, KVS_ERROR);
+			}
+		}
+		return kvs_reply_status(out, KVS_OK);
+	}
+	// MGET/MDEL 每个 key 一行，以 END 结尾
+	if (kvs_cmd_is_multi(req->cmd)) {
+		for (int i = 0; i < req->nops; i++) {
+			int rc = op[i].type == KVS_OP_GET ?
+				kvs_reply_value(out, op[i].rc, op[i].ref) : kvs_reply_status(out, op[i].rc);
+			if (rc < 0) return -1;
+		}
+		return kvs_wbuf_append(out, "END\r\n", 5);
+	}
+	if (op->type == KVS_OP_GET) {
+		return kvs_reply_value(out, op->rc, op->ref);
+	}
+	// TTL 回复剩余秒数，没有过期时间为 -1
+	if (op->type == KVS_OP_TTL && op->rc == KVS_OK) {
+		char buf[24];
+		int64_t left = kvs_expire_left(op->expire);
+		int len = snprintf(buf, sizeof(buf), "%" PRId64 "\r\n", left < 0 ? left : (left + 500) / 1000);
+		return kvs_wbuf_append(out, buf, len);
+	}
+	return kvs_reply_status(out, op->rc);
+}
+
+/*
+#############
+binary protocol
+#############
+*/
+
+static uint16_t kvs_bin_status(int rc) {
+	switch (rc) {
+		case KVS_OK:		return KVS_BIN_STATUS_OK;
+		case KVS_EXIST:		return KVS_BIN_STATUS_EXIST;
+		case KVS_NOT_FOUND:	return KVS_BIN_STATUS_NOT_FOUND;
+		default:			return KVS_BIN_STATUS_ERROR;
+	}
+}
+
+static int kvs_bin_reply(kvs_wbuf_t *out, uint8_t opcode, uint64_t opaque, int rc, kvs_value_t *value) {
+	kvs_bin_hdr_t hdr = {};
+	uint32_t value_len = (rc == KVS_OK && value) ? value->len : 0;
+
+	hdr.magic = KVS_BIN_MAGIC_RES;
+	hdr.opcode = opcode;
+	to_le16(&hdr.status, kvs_bin_status(rc));
+	to_le32(&hdr.value_len, value_len);
+	hdr.opaque = opaque;	// 原样带回，不做字节序转换
+
+	if (kvs_wbuf_append(out, &hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+	if (value_len > 0) {
+		return kvs_wbuf_append_ref(out, value);
+	}
+	return 0;
+}
+
+// 从 (le32 len | bytes) 序列里取下一项，格式不对返回 false
+static bool kvs_bin_next_item(kvs_slice_t *list, kvs_slice_t *item) {
+	uint32_t len;
+
+	if (list->len < sizeof(len)) {
+		return false;
+	}
+	len = from_le32(list->data);
+	if (list->len - sizeof(len) < len) {
+		return false;
+	}
+	item->data = list->data + sizeof(len);
+	item->len = len;
+	list->data += sizeof(len) + len;
+	list->len -= sizeof(len) + len;
+	return true;
+}
+
+// 多 key 命令的 key 区和 value 区，格式错误时不生成 op，回复 ERROR
+static void kvs_bin_parse_multi(kvs_req_t *req, kvs_cmd_t cmd, const kvs_slice_t *keys, const kvs_slice_t *values) {
+	kvs_slice_t klist = *keys, vlist = *values;
+	kvs_slice_t key, value;
+	bool has_value = kvs_cmd_has_value(cmd);
+
+	if (!has_value && vlist.len != 0) {
+		return;
+	}
+	while (klist.len > 0) {
+		if (req->nops == KVS_REQ_MAX_OPS || !kvs_bin_next_item(&klist, &key) ||
+			(has_value && !kvs_bin_next_item(&vlist, &value))) {
+			break;
+		}
+		kvs_req_add_cmd(req, cmd, &key, has_value ? &value : NULL);
+	}
+	if (klist.len != 0 || vlist.len != 0) {
+		req->nops = 0;
+		req->stat = KVS_STAT_OTHER;
+	}
+}
+
+// 解析一个完整的二进制帧，返回消耗的字节数；数据不完整返回 0，协议错误返回 -1
+static ssize_t kvs_bin_process(kvs_req_t *req, const char *msg, size_t len) {
+	kvs_bin_hdr_t hdr;
+
+	if (len < sizeof(hdr)) {
+		return 0;
+	}
+	memcpy(&hdr, msg, sizeof(hdr));
+	if (hdr.magic != KVS_BIN_MAGIC_REQ) {
+		return -1;
+	}
+
+	uint64_t key_len = from_le32(&hdr.key_len);
+	uint64_t value_len = from_le32(&hdr.value_len);
+	uint64_t total = sizeof(hdr) + key_len + value_len;
+	if (total > KVS_RBUF_MAX_SIZE) {
+		return -1;
+	}
+	if (len < total) {
+		return 0;
+	}
+
+	// key 和 value 直接指向接收缓冲区
+	kvs_slice_t key = { msg + sizeof(hdr), key_len };
+	kvs_slice_t value = { key.data + key_len, value_len };
+	kvs_cmd_t cmd = hdr.opcode;
+
+	req->opcode = hdr.opcode;
+	req->opaque = hdr.opaque;
+	if (kvs_cmd_is_multi(cmd)) {
+		kvs_bin_parse_multi(req, cmd, &key, &value);
+		return total;
+	}
+	// BSCAN/SSCAN: key 是起点（或上次带回的游标），value 是终点，空表示不限；reserved 是 limit
+	if (kvs_cmd_is_range(cmd)) {
+		kvs_req_add_range(req, cmd, key_len ? &key : NULL, value_len ? &value : NULL,
+			from_le32(&hdr.reserved), NULL);
+		return total;
+	}
+	if (cmd < KVS_CMD_COUNT && (kvs_cmd_has_value(cmd) || value_len == 0)) {
+		kvs_op_t *op = kvs_req_add_cmd(req, cmd, &key, kvs_cmd_has_value(cmd) ? &value : NULL);
+		if (kvs_cmd_has_ttl(cmd)) {
+			op->expire = kvs_now_ms() + (uint64_t)from_le32(&hdr.reserved) * 1000;
+		}
+	}
+	return total;
+}
+
+// 带 key 的回复帧：hdr | key | value
+static int kvs_bin_reply_kv(kvs_wbuf_t *out, uint8_t opcode, uint64_t opaque, uint32_t reserved,
+		const kvs_slice_t *key, kvs_value_t *value) {
+	kvs_bin_hdr_t hdr = {};
+
+	hdr.magic = KVS_BIN_MAGIC_RES;
+	hdr.opcode = opcode;
+	to_le16(&hdr.status, KVS_BIN_STATUS_OK);
+	to_le32(&hdr.key_len, key->len);
+	to_le32(&hdr.value_len, value ? value->len : 0);
+	to_le32(&hdr.reserved, reserved);
+	hdr.opaque = opaque;
+
+	if (kvs_wbuf_append(out, &hdr, sizeof(hdr)) < 0 ||
+		kvs_wbuf_append(out, key->data, key->len) < 0) {
+		return -1;
+	}
+	if (value && value->len > 0) {
+		return kvs_wbuf_append_ref(out, value);
+	}
+	return 0;
+}
+
+// 先回一帧：key 是游标（没有剩余时为空），reserved 是后面的帧数；然后每个 key 一帧
+static int kvs_bin_reply_range(kvs_req_t *req, kvs_wbuf_t *out) {
+	kvs_range_entry_t entries[KVS_BSCAN_MAX];
+	kvs_slice_t next = {};
+	size_t n;
+
+	for (int i = 0; i < req->nops; i++) {
+		if (req->ops[i].rc != KVS_OK) {
+			return kvs_bin_reply(out, req->opcode, req->opaque, KVS_ERROR, NULL);
+		}
+	}
+
+	kvs_range_merge(req, entries, &n, &next);
+	if (kvs_bin_reply_kv(out, req->opcode, req->opaque, n, &next, NULL) < 0) {
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (kvs_bin_reply_kv(out, req->opcode, req->opaque, 0, &entries[i].key, entries[i].value) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// TTL 的 value 是 le64 的剩余毫秒数，没有过期时间时为空
+static int kvs_bin_reply_ttl(kvs_wbuf_t *out, uint8_t opcode, uint64_t opaque, const kvs_op_t *op) {
+	kvs_bin_hdr_t hdr = {};
+	uint64_t left;
+	bool has_ttl = op->rc == KVS_OK && op->expire != 0;
+
+	hdr.magic = KVS_BIN_MAGIC_RES;
+	hdr.opcode = opcode;
+	to_le16(&hdr.status, kvs_bin_status(op->rc));
+	to_le32(&hdr.value_len, has_ttl ? sizeof(left) : 0);
+	hdr.opaque = opaque;
+
+	if (kvs_wbuf_append(out, &hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+	if (has_ttl) {
+		to_le64(&left, kvs_expire_left(op->expire));
+		return kvs_wbuf_append(out, &left, sizeof(left));
+	}
+	return 0;
+}
+
+static int kvs_bin_reply_req(kvs_req_t *req, kvs_wbuf_t *out) {
+	if (req->stat == KVS_STAT_STATS) {
+		kvs_value_t *v = spdk_server_stats_value();
+		int rc = kvs_bin_reply(out, req->opcode, req->opaque, v ? KVS_OK : KVS_ERROR, v);
+		if (v) kvs_value_put(v);
+		return rc;
+	}
+	if (req->nops == 0) {
+		return kvs_bin_reply(out, req->opcode, req->opaque, KVS_ERROR, NULL);
+	}
+
+	kvs_op_t *op = &req->ops[0];
+	if (kvs_cmd_is_range(req->cmd)) {
+		return kvs_bin_reply_range(req, out);
+	}
+	if (req->cmd == KVS_CMD_MSET) {
+		int rc = KVS_OK;
+		for (int i = 0; i < req->nops; i++) {
+			if (req->ops[i].rc != KVS_OK) rc = KVS_ERROR;
+		}
+		return kvs_bin_reply(out, req->opcode, req->opaque, rc, NULL);
+	}
+	// MGET/MDEL 每个 key 一帧
+	if (kvs_cmd_is_multi(req->cmd)) {
+		for (int i = 0; i < req->nops; i++) {
+			if (kvs_bin_reply(out, req->opcode, req->opaque, op[i].rc,
+				op[i].type == KVS_OP_GET ? op[i].ref : NULL) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	if (op->type == KVS_OP_TTL) {
+		return kvs_bin_reply_ttl(out, req->opcode, req->opaque, op);
+	}
+	return kvs_bin_reply(out, req->opcode, req->opaque, op->rc,
+		op->type == KVS_OP_GET ? op->ref : NULL);
+}
+
+/*
+#############
+RESP protocol
+#############
+
+RESP2 前端，供 redis-benchmark/memtier 压测。GET/SET/DEL/MGET/MSET/SCAN 和过期相关的命令都落在 B+ 树上
+*/
+
+#define KVS_RESP_MAX_CURSORS	8
+#define KVS_RESP_SCAN_DEFAULT	10
+#define KVS_RESP_SCAN_MAX		1024
+
+typedef enum {
+	KVS_RESP_CMD_GET = 0,
+	KVS_RESP_CMD_SET,
+	KVS_RESP_CMD_DEL,
+	KVS_RESP_CMD_MGET,
+	KVS_RESP_CMD_MSET,
+	KVS_RESP_CMD_SCAN,
+	KVS_RESP_CMD_PING,
+	KVS_RESP_CMD_STATS,
+	KVS_RESP_CMD_SETEX,
+	KVS_RESP_CMD_EXPIRE,
+	KVS_RESP_CMD_PEXPIRE,
+	KVS_RESP_CMD_TTL,
+	KVS_RESP_CMD_PTTL,
+	KVS_RESP_CMD_PERSIST,
+	KVS_RESP_CMD_UNKNOWN,
+} kvs_resp_cmd_t;
+
+static const uint8_t kvs_resp_stats[KVS_RESP_CMD_UNKNOWN + 1] = {
+	KVS_STAT_GET, KVS_STAT_SET, KVS_STAT_DEL, KVS_STAT_MGET,
+	KVS_STAT_MSET, KVS_STAT_SCAN, KVS_STAT_PING, KVS_STAT_STATS,
+	KVS_STAT_SET, KVS_STAT_TTL, KVS_STAT_TTL, KVS_STAT_TTL, KVS_STAT_TTL, KVS_STAT_TTL,
+	KVS_STAT_OTHER,
+};
+
+// SCAN 的游标是数字，真正的续扫位置（下一个 key）保存在连接上
+typedef struct kvs_resp_cursor_s {
+	uint64_t id;
+	char *key;
+	size_t len;
+} kvs_resp_cursor_t;
+
+typedef struct kvs_resp_session_s {
+	kvs_resp_parser_t parser;
+	kvs_resp_cursor_t cursors[KVS_RESP_MAX_CURSORS];
+	uint64_t next_cursor;
+} kvs_resp_session_t;
+
+// 命令名大小写不敏感：字母 | 0x20 转成小写后按整数比较
+static kvs_resp_cmd_t kvs_resp_cmd_lookup(const kvs_slice_t *name) {
+	const char *p = name->data;
+
+	if (name->len == 3) {
+		switch (KVS_CMD_WORD(p[0] | 0x20, p[1] | 0x20, p[2] | 0x20, 0)) {
+			case KVS_CMD_WORD('g', 'e', 't', 0): return KVS_RESP_CMD_GET;
+			case KVS_CMD_WORD('s', 'e', 't', 0): return KVS_RESP_CMD_SET;
+			case KVS_CMD_WORD('d', 'e', 'l', 0): return KVS_RESP_CMD_DEL;
+			case KVS_CMD_WORD('t', 't', 'l', 0): return KVS_RESP_CMD_TTL;
+		}
+	} else if (name->len == 4) {
+		switch (KVS_CMD_WORD(p[0] | 0x20, p[1] | 0x20, p[2] | 0x20, p[3] | 0x20)) {
+			case KVS_CMD_WORD('m', 'g', 'e', 't'): return KVS_RESP_CMD_MGET;
+			case KVS_CMD_WORD('m', 's', 'e', 't'): return KVS_RESP_CMD_MSET;
+			case KVS_CMD_WORD('s', 'c', 'a', 'n'): return KVS_RESP_CMD_SCAN;
+			case KVS_CMD_WORD('p', 'i', 'n', 'g'): return KVS_RESP_CMD_PING;
+			case KVS_CMD_WORD('p', 't', 't', 'l'): return KVS_RESP_CMD_PTTL;
+		}
+	} else if (name->len == 5 && strncasecmp(p, "stats", 5) == 0) {
+		return KVS_RESP_CMD_STATS;
+	} else if (name->len == 5 && strncasecmp(p, "setex", 5) == 0) {
+		return KVS_RESP_CMD_SETEX;
+	} else if (name->len == 6 && strncasecmp(p, "expire", 6) == 0) {
+		return KVS_RESP_CMD_EXPIRE;
+	} else if (name->len == 7 && strncasecmp(p, "pexpire", 7) == 0) {
+		return KVS_RESP_CMD_PEXPIRE;
+	} else if (name->len == 7 && strncasecmp(p, "persist", 7) == 0) {
+		return KVS_RESP_CMD_PERSIST;
+	}
+	return KVS_RESP_CMD_UNKNOWN;
+}
+
+static bool kvs_resp_arg_is(const kvs_slice_t *arg, const char *name) {
+	size_t len = strlen(name);
+	return arg->len == len && strncasecmp(arg->data, name, len) == 0;
+}
+
+// SCAN op 的结果是 (uint32_t len + bytes) 序列
+static bool kvs_resp_scan_peek(const kvs_op_t *op, size_t off, kvs_slice_t *key) {
+	uint32_t len;
+
+	if (off >= op->result.len) {
+		return false;
+	}
+	memcpy(&len, op->result.data + off, sizeof(len));
+	key->data = op->result.data + off + sizeof(len);
+	key->len = len;
+	return true;
+}
+
+static void kvs_resp_session_free(kvs_resp_session_t *session) {
+	if (session == NULL) return;
+	for (int i = 0; i < KVS_RESP_MAX_CURSORS; i++) {
+		free(session->cursors[i].key);
+	}
+	free(session);
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count]
+// key 分散在各个 shard 上，每个 shard 从起点开始各取 count + 1 个，回复时再归并
+static const char *kvs_resp_scan_build(kvs_resp_session_t *session, kvs_req_t *req, const kvs_slice_t *argv, int argc) {
+	kvs_resp_cursor_t *cursor;
+	kvs_slice_t start = {};
+	uint64_t id, count = KVS_RESP_SCAN_DEFAULT;
+
+	if (!kvs_slice_u64(&argv[1], &id)) {
+		return "invalid cursor";
+	}
+	for (int i = 2; i < argc; i += 2) {
+		if (i + 1 >= argc) {
+			return "syntax error";
+		}
+		if (kvs_resp_arg_is(&argv[i], "MATCH")) {
+			req->arg = argv[i + 1];
+		} else if (kvs_resp_arg_is(&argv[i], "COUNT")) {
+			if (!kvs_slice_u64(&argv[i + 1], &count) || count == 0) {
+				return "value is not an integer or out of range";
+			}
+		} else {
+			return "syntax error";
+		}
+	}
+	req->count = count > KVS_RESP_SCAN_MAX ? KVS_RESP_SCAN_MAX : count;
+
+	if (id != 0) {
+		cursor = &session->cursors[id % KVS_RESP_MAX_CURSORS];
+		if (cursor->id != id || cursor->key == NULL) {
+			return "invalid cursor";
+		}
+		start.data = cursor->key;
+		start.len = cursor->len;
+	}
+
+	for (int i = 0; i < g_nshards; i++) {
+		kvs_op_t *op = kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_SCAN, id ? &start : NULL, NULL);
+		op->shard = i;
+		op->count = req->count + 1;
+	}
+	return NULL;
+}
+
+// 归并各个 shard 的有序结果，第 count + 1 个 key 就是下一次的起点
+static int kvs_resp_scan_reply(kvs_resp_session_t *session, kvs_req_t *req, kvs_wbuf_t *out) {
+	kvs_slice_t keys[KVS_RESP_SCAN_MAX];
+	size_t off[KVS_MAX_SHARDS] = {};
+	kvs_slice_t key, next = {};
+	size_t nkeys = 0;
+	bool more = false;
+	char buf[24];
+
+	for (int i = 0; i < req->nops; i++) {
+		if (req->ops[i].rc != KVS_OK) {
+			return kvs_resp_error(out, "out of memory");
+		}
+	}
+
+	for (uint64_t examined = 0; ; examined++) {
+		int min = -1;
+
+		for (int i = 0; i < req->nops; i++) {
+			if (kvs_resp_scan_peek(&req->ops[i], off[i], &key) &&
+				(min < 0 || kvs_slice_cmp(&key, &next) < 0)) {
+				min = i;
+				next = key;
+			}
+		}
+		if (min < 0) {
+			break;
+		}
+		// 和 Redis 一样，COUNT 限制的是检查过的 key 数量，MATCH 在检查之后过滤
+		if (examined == req->count) {
+			more = true;
+			break;
+		}
+		off[min] += sizeof(uint32_t) + next.len;
+		if (req->arg.data == NULL ||
+			kvs_resp_match(req->arg.data, req->arg.len, next.data, next.len)) {
+			keys[nkeys++] = next;
+		}
+	}
+
+	// 记录下一次的起点
+	uint64_t next_id = 0;
+	if (more) {
+		next_id = ++session->next_cursor;
+		kvs_resp_cursor_t *cursor = &session->cursors[next_id % KVS_RESP_MAX_CURSORS];
+		char *p = realloc(cursor->key, next.len + 1);
+		if (p == NULL) {
+			return kvs_resp_error(out, "out of memory");
+		}
+		memcpy(p, next.data, next.len);
+		cursor->key = p;
+		cursor->len = next.len;
+		cursor->id = next_id;
+	}
+
+	int len = snprintf(buf, sizeof(buf), "%" PRIu64, next_id);
+	if (kvs_resp_array(out, 2) < 0 || kvs_resp_bulk(out, buf, len) < 0 ||
+		kvs_resp_array(out, nkeys) < 0) {
+		return -1;
+	}
+	for (size_t i = 0; i < nkeys; i++) {
+		if (kvs_resp_bulk(out, keys[i].data, keys[i].len) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// 过期时间参数：秒或者毫秒，换算成绝对时间，出错时返回错误信息
+static const char *kvs_resp_expire_arg(const kvs_slice_t *arg, uint64_t unit, uint64_t *expire) {
+	uint64_t n;
+
+	if (!kvs_slice_u64(arg, &n) || n > UINT64_MAX / unit || !kvs_expire_after(n * unit, expire)) {
+		return "value is not an integer or out of range";
+	}
+	return NULL;
+}
+
+// Redis 的 SET 会覆盖旧值，对应 KVS_OP_PUT
+static void kvs_resp_build(kvs_resp_session_t *session, kvs_req_t *req, const kvs_slice_t *argv, int argc) {
+	uint64_t expire = 0;
+
+	req->cmd = kvs_resp_cmd_lookup(&argv[0]);
+	req->stat = kvs_resp_stats[req->cmd];
+
+	switch (req->cmd) {
+		case KVS_RESP_CMD_GET:
+			if (argc != 2) break;
+			kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_GET, &argv[1], NULL);
+			return;
+
+		// SET key value [EX seconds | PX milliseconds]
+		case KVS_RESP_CMD_SET:
+			if (argc != 3 && argc != 5) break;
+			if (argc == 5) {
+				if (kvs_resp_arg_is(&argv[3], "EX")) {
+					req->error = kvs_resp_expire_arg(&argv[4], 1000, &expire);
+				} else if (kvs_resp_arg_is(&argv[3], "PX")) {
+					req->error = kvs_resp_expire_arg(&argv[4], 1, &expire);
+				} else {
+					req->error = "syntax error";
+				}
+				if (req->error) return;
+			}
+			kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_PUT, &argv[1], &argv[2])->expire = expire;
+			return;
+
+		case KVS_RESP_CMD_SETEX:
+			if (argc != 4) break;
+			req->error = kvs_resp_expire_arg(&argv[2], 1000, &expire);
+			if (req->error) return;
+			kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_PUT, &argv[1], &argv[3])->expire = expire;
+			return;
+
+		case KVS_RESP_CMD_EXPIRE:
+		case KVS_RESP_CMD_PEXPIRE:
+			if (argc != 3) break;
+			req->error = kvs_resp_expire_arg(&argv[2], req->cmd == KVS_RESP_CMD_EXPIRE ? 1000 : 1, &expire);
+			if (req->error) return;
+			kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_EXPIRE, &argv[1], NULL)->expire = expire;
+			return;
+
+		case KVS_RESP_CMD_PERSIST:
+			if (argc != 2) break;
+			kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_EXPIRE, &argv[1], NULL);
+			return;
+
+		case KVS_RESP_CMD_TTL:
+		case KVS_RESP_CMD_PTTL:
+			if (argc != 2) break;
+			kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_TTL, &argv[1], NULL);
+			return;
+
+		case KVS_RESP_CMD_DEL:
+			if (argc < 2) break;
+			for (int i = 1; i < argc; i++) {
+				kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_DEL, &argv[i], NULL);
+			}
+			return;
+
+		case KVS_RESP_CMD_MGET:
+			if (argc < 2) break;
+			for (int i = 1; i < argc; i++) {
+				kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_GET, &argv[i], NULL);
+			}
+			return;
+
+		case KVS_RESP_CMD_MSET:
+			if (argc < 3 || argc % 2 == 0) break;
+			for (int i = 1; i < argc; i += 2) {
+				kvs_req_add_op(req, KVS_ENGINE_BPTREE, KVS_OP_PUT, &argv[i], &argv[i + 1]);
+			}
+			return;
+
+		case KVS_RESP_CMD_SCAN:
+			if (argc < 2) break;
+			req->error = kvs_resp_scan_build(session, req, argv, argc);
+			return;
+
+		case KVS_RESP_CMD_PING:
+			if (argc == 2) req->arg = argv[1];
+			return;
+
+		case KVS_RESP_CMD_STATS:
+			return;
+
+		default:
+			req->error = "unknown command";
+			return;
+	}
+	req->error = "wrong number of arguments";
+}
+
+static int kvs_resp_reply(kvs_resp_session_t *session, kvs_req_t *req, kvs_wbuf_t *out) {
+	kvs_op_t *op = req->ops;
+
+	if (req->error) {
+		return kvs_resp_error(out, req->error);
+	}
+
+	switch (req->cmd) {
+		case KVS_RESP_CMD_GET:
+			return op->rc == KVS_OK ? kvs_resp_bulk_ref(out, op->ref) : kvs_resp_nil(out);
+
+		case KVS_RESP_CMD_SET:
+		case KVS_RESP_CMD_SETEX:
+			return op->rc == KVS_OK ? kvs_resp_simple(out, "OK") : kvs_resp_error(out, "out of memory");
+
+		// 设置成功为 1，key 不存在（PERSIST：或者本来就没有过期时间）为 0
+		case KVS_RESP_CMD_EXPIRE:
+		case KVS_RESP_CMD_PEXPIRE:
+		case KVS_RESP_CMD_PERSIST:
+			if (op->rc == KVS_ERROR) return kvs_resp_error(out, "out of memory");
+			return kvs_resp_integer(out, op->rc == KVS_OK);
+
+		// key 不存在为 -2，没有过期时间为 -1
+		case KVS_RESP_CMD_TTL:
+		case KVS_RESP_CMD_PTTL: {
+			if (op->rc != KVS_OK) return kvs_resp_integer(out, -2);
+			int64_t left = kvs_expire_left(op->expire);
+			if (left >= 0 && req->cmd == KVS_RESP_CMD_TTL) {
+				left = (left + 500) / 1000;
+			}
+			return kvs_resp_integer(out, left);
+		}
+
+		case KVS_RESP_CMD_DEL: {
+			int64_t deleted = 0;
+			for (int i = 0; i < req->nops; i++) {
+				deleted += op[i].rc == KVS_OK;
+			}
+			return kvs_resp_integer(out, deleted);
+		}
+
+		case KVS_RESP_CMD_MGET:
+			if (kvs_resp_array(out, req->nops) < 0) return -1;
+			for (int i = 0; i < req->nops; i++) {
+				int rc = op[i].rc == KVS_OK ?
+					kvs_resp_bulk_ref(out, op[i].ref) : kvs_resp_nil(out);
+				if (rc < 0) return -1;
+			}
+			return 0;
+
+		case KVS_RESP_CMD_MSET:
+			for (int i = 0; i < req->nops; i++) {
+				if (op[i].rc != KVS_OK) {
+					return kvs_resp_error(out, "out of memory");
+				}
+			}
+			return kvs_resp_simple(out, "OK");
+
+		case KVS_RESP_CMD_SCAN:
+			return kvs_resp_scan_reply(session, req, out);
+
+		case KVS_RESP_CMD_PING:
+			if (req->arg.data) return kvs_resp_bulk(out, req->arg.data, req->arg.len);
+			return kvs_resp_simple(out, "PONG");
+
+		case KVS_RESP_CMD_STATS: {
+			kvs_value_t *v = spdk_server_stats_value();
+			if (v == NULL) {
+				return kvs_resp_error(out, "out of memory");
+			}
+			int rc = kvs_resp_bulk_ref(out, v);
+			kvs_value_put(v);
+			return rc;
+		}
+	}
+	return -1;
+}
+
+// 解析一个完整的 RESP 命令，返回消耗的字节数；数据不完整返回 0，协议错误返回 -1
+static ssize_t kvs_resp_process(kvs_resp_session_t *session, kvs_req_t *req, const char *msg, size_t len, kvs_wbuf_t *out) {
+	kvs_resp_parser_t *parser = &session->parser;
+	kvs_slice_t argv[KVS_RESP_MAX_ARGS];
+
+	ssize_t n = kvs_resp_parse(parser, msg, len);
+	if (n < 0) {
+		kvs_resp_error(out, "Protocol error");
+		return -1;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	for (int i = 0; i < parser->argc; i++) {
+		argv[i].data = msg + parser->argv[i].off;
+		argv[i].len = parser->argv[i].len;
+	}
+	kvs_resp_build(session, req, argv, parser->argc);
+	kvs_resp_parser_reset(parser);
+
+	return n;
+}
+
+/*
+#############
+spdk network
+#############
+
+监听 socket 挂在 shard 0 的 sock group 里，有连接到达时由 epoll 事件触发 accept，
+每次最多 accept KVS_ACCEPT_BATCH 个，新连接轮流交给各个 shard 线程。
+连接的收发、解析都在自己的 shard 上完成，key 不属于本 shard 时把 op 转发过去
+*/
+
+#define KVS_ACCEPT_BATCH		64
+// 监听 socket 加不进 sock group 时退回到轮询 accept，空闲时每 1ms 试一次
+#define KVS_ACCEPT_IDLE_US		1000
+
+struct server_context_t {
+
+	char *host;
+	int port;
+	char *sock_impl_name;
+
+	int rc;
+	bool stopping;
+	uint32_t next_shard;
+
+	struct spdk_sock *sock;
+	struct server_shard_t *listen_shard;	// 负责 accept 的 shard，只在它的线程上访问 sock
+	bool listen_in_group;
+	struct spdk_poller *accept_poller;
+	uint64_t accept_next_tsc;
+
+	char *shm_path;
+	int shm_fd;			// 共享内存客户端握手用的 Unix socket，-1 表示没开
+	struct spdk_poller *shm_accept_poller;
+
+	struct spdk_thread *app_thread;
+	char *handoff_path;
+	int handoff_fd;		// 等下一个进程来接手的 Unix socket，-1 表示没开
+	struct spdk_poller *handoff_poller;
+	struct server_handoff_t *handoff;	// 正在进行的交接，只在 app 线程上访问
+	bool keep_paths;	// Unix socket 文件不是自己的了（交给了新进程，或者接手失败还给老进程），关闭时不删
+	uint16_t tag;		// 本进程的标记，见 kvs_value_set_owner；接手时用老进程的加一
+	struct spdk_poller *region_poller;	// 收回别的进程释放在共享内存里的对象
+
+};
+
+// 一次 spdk_sock_writev_async：把 conn->wbuf 整个换下来发送，写完之前里面的内存和 value 引用都不能动。
+// 部分写由 sock 层记录偏移继续发，全部写完或者连接关闭时回调
+typedef struct server_wreq_s {
+	struct server_conn_t *conn;
+	TAILQ_ENTRY(server_wreq_s) link;
+	kvs_wbuf_t wbuf;
+	int iov_size;
+	struct spdk_sock_request sreq;	// iovec 数组紧跟在后面，见 SPDK_SOCK_REQUEST_IOV
+} server_wreq_t;
+
+// 每个连接的状态，作为 spdk_sock_group_add_sock 的 cb_arg
+struct server_conn_t {
+
+	struct server_context_t *ctx;
+	struct server_shard_t *ss;
+	struct spdk_sock *sock;
+	kvs_shm_t *shm;		// 共享内存连接，和 sock 二选一
+	size_t shm_sent;	// wbuf 里已经写进回复环的字节数
+	kvs_proto_t proto;
+	kvs_resp_session_t *resp;
+
+	bool processing;	// 正在 spdk_server_callback 里，出错由它处理
+	bool failed;		// 异步回复时出错，下次有机会时关闭
+	bool closed;		// socket 已关闭，等转发出去的 op 和发送都完成后释放
+	bool dirty;			// wbuf 里有还没提交的回复
+	uint64_t recv_tsc;	// 最近一次 recv 的 TSC，作为这一批请求的开始时间
+
+	kvs_rbuf_t rbuf;
+	kvs_wbuf_t wbuf;
+
+	int writes;			// 已提交还没完成的 server_wreq_t
+	TAILQ_HEAD(, server_wreq_s) wreqs;	// 发送完成的 server_wreq_t，留着复用
+
+	TAILQ_HEAD(, kvs_req_s) reqs;	// 还有 op 没完成的请求，按到达顺序排队
+	TAILQ_ENTRY(server_conn_t) link;
+	TAILQ_ENTRY(server_conn_t) dirty_link;
+	TAILQ_ENTRY(server_conn_t) shm_link;
+
+};
+
+// 每个 shard 线程上的网络状态
+struct server_shard_t {
+
+	kvs_shard_t *shard;
+	struct spdk_sock_group *group;
+	struct spdk_poller *group_poller;
+	kvs_op_t *ops;		// 解析命令时使用的 op 暂存区
+	kvs_op_t **batch;	// 本地批量执行时的 op 指针
+
+	kvs_stats_t *stats;
+	struct spdk_poller *stats_poller;
+
+	TAILQ_HEAD(, server_conn_t) conns;
+	TAILQ_HEAD(, server_conn_t) dirty;	// 这一轮 poll 产生了回复的连接
+
+	TAILQ_HEAD(, server_conn_t) shm_conns;
+	struct spdk_poller *shm_poller;
+	struct spdk_poller *shm_check_poller;
+	struct iovec *iov;	// 写回复环时 wbuf 展开成的 iovec
+	int iov_size;
+
+	bool draining;		// 热重启：不再解析新的请求，已经收到的回复完，空闲的连接关掉
+	bool quiet;			// 排空后已经报告过没有执行中的请求
+	struct spdk_poller *journal_poller;	// 老进程：遍历索引写日志
+	kvs_replay_t *replay;	// 新进程：跟着日志装索引
+	struct spdk_poller *replay_poller;
+	int replay_state;	// 已经报告过读到了哪一步
+	// 和 app 线程之间的消息，送不出去时排队重发，各用各的节点
+	kvs_msg_t quiesce_msg;
+	kvs_msg_t quiet_msg;
+	kvs_msg_t error_msg;
+	kvs_msg_t synced_msg;
+	kvs_msg_t ended_msg;
+
+};
+
+static struct server_shard_t g_server_shards[KVS_MAX_SHARDS];
+static struct server_context_t *g_server_ctx;
+
+static struct server_conn_t *spdk_server_conn_create(struct server_context_t *ctx,
+		struct server_shard_t *ss, struct spdk_sock *sock) {
+
+	struct server_conn_t *conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	conn->ctx = ctx;
+	conn->ss = ss;
+	conn->sock = sock;
+	TAILQ_INIT(&conn->reqs);
+	TAILQ_INIT(&conn->wreqs);
+	if (kvs_rbuf_init(&conn->rbuf, KVS_RBUF_INIT_SIZE) < 0 ||
+		kvs_wbuf_init(&conn->wbuf, KVS_WBUF_INIT_SIZE) < 0) {
+		kvs_rbuf_free(&conn->rbuf);
+		free(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+static void spdk_server_conn_free(struct server_conn_t *conn) {
+
+	server_wreq_t *w;
+
+	while ((w = TAILQ_FIRST(&conn->wreqs)) != NULL) {
+		TAILQ_REMOVE(&conn->wreqs, w, link);
+		kvs_wbuf_free(&w->wbuf);
+		free(w);
+	}
+	kvs_rbuf_free(&conn->rbuf);
+	kvs_wbuf_free(&conn->wbuf);
+	kvs_resp_session_free(conn->resp);
+	free(conn);
+}
+
+// 关闭之后，等转发出去的 op 和提交的发送都回来才能释放
+static void spdk_server_conn_release(struct server_conn_t *conn) {
+
+	if (conn->closed && TAILQ_EMPTY(&conn->reqs) && conn->writes == 0) {
+		TAILQ_REMOVE(&conn->ss->conns, conn, link);
+		spdk_server_conn_free(conn);
+	}
+}
+
+static void spdk_server_conn_close(struct server_conn_t *conn) {
+
+	if (!conn->closed) {
+		kvs_stat_add(&conn->ss->stats->conns_closed, 1);
+	}
+	if (conn->dirty) {
+		TAILQ_REMOVE(&conn->ss->dirty, conn, dirty_link);
+		conn->dirty = false;
+	}
+	if (conn->sock) {
+		// 尽量把已经提交的回复发出去，剩下的由 close 取消，回调里回收
+		spdk_sock_flush(conn->sock);
+		spdk_sock_group_remove_sock(conn->ss->group, conn->sock);
+		spdk_sock_close(&conn->sock);
+	}
+	if (conn->shm) {
+		// 回复环里没取走的回复随共享内存一起丢掉
+		TAILQ_REMOVE(&conn->ss->shm_conns, conn, shm_link);
+		kvs_shm_close(conn->shm);
+		free(conn->shm);
+		conn->shm = NULL;
+	}
+	conn->closed = true;
+	spdk_server_conn_release(conn);
+}
+
+// 回复的同时记录延迟：从收到请求到回复生成，包括在别的 shard 上排队的时间
+static int spdk_server_req_reply(struct server_conn_t *conn, kvs_req_t *req) {
+
+	kvs_stats_t *st = conn->ss->stats;
+	int rc;
+
+	switch (conn->proto) {
+		case KVS_PROTO_RESP:
+			rc = kvs_resp_reply(conn->resp, req, &conn->wbuf);
+			break;
+		case KVS_PROTO_BINARY:
+			rc = kvs_bin_reply_req(req, &conn->wbuf);
+			break;
+		default:
+			rc = kvs_proto_reply(req, &conn->wbuf);
+			break;
+	}
+
+	kvs_stat_add(&st->ops, 1);
+	if (kvs_req_failed(req)) {
+		kvs_stat_add(&st->errors, 1);
+	}
+	kvs_hist_record(&st->latency[req->stat], spdk_get_ticks() - req->tsc);
+	KVS_TRACE("reply %s rc %d", kvs_stat_names[req->stat], rc);
+
+	return rc;
+}
+
+// 队头的请求完成后才能回复，后面先完成的请求继续等
+static void spdk_server_conn_drain(struct server_conn_t *conn) {
+
+	kvs_req_t *req;
+
+	while ((req = TAILQ_FIRST(&conn->reqs)) != NULL && req->pending == 0) {
+		TAILQ_REMOVE(&conn->reqs, req, link);
+		if (!conn->closed && !conn->failed && spdk_server_req_reply(conn, req) < 0) {
+			conn->failed = true;
+		}
+		kvs_req_free_results(req);
+		free(req);
+	}
+}
+
+static void spdk_server_wreq_done(void *arg, int err) {
+
+	server_wreq_t *w = arg;
+	struct server_conn_t *conn = w->conn;
+
+	if (err == 0) {
+		kvs_stat_add(&conn->ss->stats->bytes_out, w->wbuf.bytes);
+	}
+	kvs_wbuf_reset(&w->wbuf);
+	TAILQ_INSERT_HEAD(&conn->wreqs, w, link);
+	conn->writes--;
+
+	spdk_server_conn_release(conn);
+}
+
+// 取一个至少能放 iovcnt 个 iovec 的 server_wreq_t，优先复用发送完成的
+static server_wreq_t *spdk_server_wreq_get(struct server_conn_t *conn, int iovcnt) {
+
+	server_wreq_t *w = TAILQ_FIRST(&conn->wreqs);
+
+	if (w != NULL) {
+		TAILQ_REMOVE(&conn->wreqs, w, link);
+		if (w->iov_size >= iovcnt) {
+			return w;
+		}
+	}
+
+	int size = w ? w->iov_size : 16;
+	while (size < iovcnt) {
+		size *= 2;
+	}
+	server_wreq_t *n = realloc(w, sizeof(*n) + size * sizeof(struct iovec));
+	if (n == NULL) {
+		if (w) {
+			kvs_wbuf_free(&w->wbuf);
+			free(w);
+		}
+		return NULL;
+	}
+	if (w == NULL && kvs_wbuf_init(&n->wbuf, KVS_WBUF_INIT_SIZE) < 0) {
+		free(n);
+		return NULL;
+	}
+	n->conn = conn;
+	n->iov_size = size;
+	return n;
+}
+
+// 共享内存连接：wbuf 从 shm_sent 开始拷进回复环，放不下的留在 wbuf 里，下次 poll 接着写。
+// 之后的回复只会追加在 wbuf 后面，已经写出去的前缀不会变
+static void spdk_server_shm_flush(struct server_conn_t *conn) {
+
+	struct server_shard_t *ss = conn->ss;
+	int iovcnt = kvs_wbuf_iovcnt(&conn->wbuf);
+
+	if (iovcnt > ss->iov_size) {
+		int size = ss->iov_size ? ss->iov_size : 16;
+		while (size < iovcnt) {
+			size *= 2;
+		}
+		struct iovec *iov = realloc(ss->iov, size * sizeof(*iov));
+		if (iov == NULL) {
+			SPDK_ERRLOG("Cannot allocate write request\n");
+			conn->failed = true;
+			return ;
+		}
+		ss->iov = iov;
+		ss->iov_size = size;
+	}
+
+	iovcnt = kvs_wbuf_to_iov(&conn->wbuf, ss->iov);
+	conn->shm_sent += kvs_shm_writev(conn->shm, ss->iov, iovcnt, conn->shm_sent);
+	if (conn->shm_sent == conn->wbuf.bytes) {
+		kvs_stat_add(&ss->stats->bytes_out, conn->wbuf.bytes);
+		kvs_wbuf_reset(&conn->wbuf);
+		conn->shm_sent = 0;
+	}
+}
+
+// 一次 poll 里这个连接上的所有回复合成一个请求，socket 真正的写在下一次 group poll 时批量完成
+static void spdk_server_conn_flush(struct server_conn_t *conn) {
+
+	if (kvs_wbuf_empty(&conn->wbuf)) {
+		return ;
+	}
+	if (conn->shm) {
+		spdk_server_shm_flush(conn);
+		return ;
+	}
+	if (conn->sock == NULL) {
+		return ;
+	}
+
+	server_wreq_t *w = spdk_server_wreq_get(conn, kvs_wbuf_iovcnt(&conn->wbuf));
+	if (w == NULL) {
+		SPDK_ERRLOG("Cannot allocate write request\n");
+		conn->failed = true;
+		return ;
+	}
+
+	// 换下 conn->wbuf 去发送，换上空的继续接收回复
+	kvs_wbuf_t wbuf = w->wbuf;
+	w->wbuf = conn->wbuf;
+	conn->wbuf = wbuf;
+
+	memset(&w->sreq, 0, sizeof(w->sreq));
+	w->sreq.iovcnt = kvs_wbuf_to_iov(&w->wbuf, SPDK_SOCK_REQUEST_IOV(&w->sreq, 0));
+	w->sreq.cb_fn = spdk_server_wreq_done;
+	w->sreq.cb_arg = w;
+
+	conn->writes++;
+	spdk_sock_writev_async(conn->sock, &w->sreq);
+}
+
+static void spdk_server_conn_mark_dirty(struct server_conn_t *conn) {
+
+	if (!conn->dirty && !conn->closed) {
+		conn->dirty = true;
+		TAILQ_INSERT_TAIL(&conn->ss->dirty, conn, dirty_link);
+	}
+}
+
+// 提交这一轮 poll 里所有连接的回复
+static void spdk_server_flush_dirty(struct server_shard_t *ss) {
+
+	struct server_conn_t *conn;
+
+	while ((conn = TAILQ_FIRST(&ss->dirty)) != NULL) {
+		TAILQ_REMOVE(&ss->dirty, conn, dirty_link);
+		conn->dirty = false;
+		spdk_server_conn_flush(conn);
+		if (conn->failed) {
+			spdk_server_conn_close(conn);
+		}
+	}
+}
+
+static void spdk_server_req_put(kvs_req_t *req) {
+
+	struct server_conn_t *conn = req->conn;
+
+	if (--req->pending > 0) {
+		return ;
+	}
+	spdk_server_conn_drain(conn);
+
+	// 同步完成时还在 spdk_server_callback 里，由它处理
+	if (conn->processing) {
+		return ;
+	}
+	if (conn->closed) {
+		spdk_server_conn_release(conn);
+		return ;
+	}
+	if (conn->failed) {
+		SPDK_ERRLOG("Out of memory, closing connection\n");
+		spdk_server_conn_close(conn);
+		return ;
+	}
+	spdk_server_conn_mark_dirty(conn);
+}
+
+static void spdk_server_op_done(kvs_op_t *op) {
+	spdk_server_req_put(op->cb_arg);
+}
+
+// 执行解析出来的请求，op 和 key/value 还指向暂存区和接收缓冲区
+static int spdk_server_req_submit(struct server_conn_t *conn, kvs_req_t *req) {
+
+	struct server_shard_t *ss = conn->ss;
+	bool local = TAILQ_EMPTY(&conn->reqs);
+
+	for (int i = 0; i < req->nops; i++) {
+		kvs_op_t *op = &req->ops[i];
+		if (op->engine == KVS_ENGINE_SKIPLIST) {
+			// 跳表在哪个线程上都能直接访问
+			int home = __atomic_load_n(&g_slist_home, __ATOMIC_RELAXED);
+			op->shard = home >= 0 ? home : ss->shard->index;
+		} else if (op->type != KVS_OP_SCAN && op->type != KVS_OP_RANGE) {
+			op->shard = kvs_shard_index(&op->key);
+		}
+		local = local && op->shard == ss->shard->index;
+	}
+
+	// 别的 shard 上的热 key 在本 shard 有副本：和本地执行一样直接回复
+	if (!local && req->nops == 1 && TAILQ_EMPTY(&conn->reqs) && kvs_op_replica_get(ss->shard, &req->ops[0])) {
+		int rc = spdk_server_req_reply(conn, req);
+		kvs_req_free_results(req);
+		return rc;
+	}
+
+	// 开了 WAL 时写要等落盘，不能在这里同步回复
+	if (local && ss->shard->wal) {
+		for (int i = 0; i < req->nops; i++) {
+			local = local && !kvs_op_is_logged(&req->ops[i]);
+		}
+	}
+
+	// 分层模式下读到冷 value 要等盘，本 shard 上有冷 value 时读也不能在这里同步回复
+	if (local && ss->shard->vlog) {
+		uint64_t mem, cold;
+		kvs_engine_tier_stats(ss->shard->engine, &mem, &cold);
+		for (int i = 0; cold > 0 && i < req->nops; i++) {
+			local = local && (req->ops[i].engine == KVS_ENGINE_SKIPLIST ||
+				(req->ops[i].type != KVS_OP_GET && req->ops[i].type != KVS_OP_RANGE));
+		}
+	}
+
+	// 所有 key 都在本 shard 上，前面也没有排队的请求：直接执行，直接回复，不拷贝
+	if (local) {
+		for (int i = 0; i < req->nops; i++) {
+			ss->batch[i] = &req->ops[i];
+		}
+		kvs_op_execute_batch(ss->shard->engine, ss->batch, req->nops);
+		for (int i = 0; i < req->nops; i++) {
+			kvs_op_track(ss->shard, &req->ops[i]);
+		}
+		int rc = spdk_server_req_reply(conn, req);
+		kvs_req_free_results(req);
+		return rc;
+	}
+
+	kvs_req_t *r = kvs_req_clone(req);
+	if (r == NULL) {
+		return -1;
+	}
+	r->conn = conn;
+	TAILQ_INSERT_TAIL(&conn->reqs, r, link);
+
+	kvs_op_t *subs[KVS_MAX_SHARDS];
+	int nsubs = kvs_req_group(r, subs);
+	r->pending = nsubs + 1;	// 多持有一次，避免 op 同步完成时提前回复
+
+	for (int i = 0; i < nsubs; i++) {
+		subs[i]->cb = spdk_server_op_done;
+		subs[i]->cb_arg = r;
+		kvs_op_submit(ss->shard, subs[i]);
+	}
+	spdk_server_req_put(r);
+
+	return conn->failed ? -1 : 0;
+}
+
+// 二进制和 RESP 都是按帧解析：返回一帧的长度，不完整返回 0
+static int spdk_server_conn_process_frames(struct server_conn_t *conn) {
+
+	const char *msg;
+	size_t len;
+	int count = 0;
+
+	while ((msg = kvs_rbuf_peek(&conn->rbuf, &len)) != NULL) {
+		kvs_req_t req = { .ops = conn->ss->ops, .stat = KVS_STAT_OTHER, .tsc = conn->recv_tsc };
+		ssize_t n = conn->proto == KVS_PROTO_RESP ?
+			kvs_resp_process(conn->resp, &req, msg, len, &conn->wbuf) :
+			kvs_bin_process(&req, msg, len);
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (spdk_server_req_submit(conn, &req) < 0) {
+			return -1;
+		}
+		kvs_rbuf_consume(&conn->rbuf, n);
+		count++;
+	}
+
+	return count;
+}
+
+// 解析 rbuf 中所有完整的命令，不完整的尾巴留给下一次 recv
+static int spdk_server_conn_process(struct server_conn_t *conn) {
+
+	const char *line;
+	size_t len;
+	int count = 0;
+
+	if (conn->proto == KVS_PROTO_UNKNOWN) {
+		const char *msg = kvs_rbuf_peek(&conn->rbuf, &len);
+		if (msg == NULL) {
+			return 0;
+		}
+		if ((uint8_t)msg[0] == KVS_BIN_MAGIC_REQ) {
+			conn->proto = KVS_PROTO_BINARY;
+		} else if (msg[0] == '*') {
+			conn->resp = calloc(1, sizeof(*conn->resp));
+			if (conn->resp == NULL) {
+				return -1;
+			}
+			kvs_resp_parser_reset(&conn->resp->parser);
+			conn->proto = KVS_PROTO_RESP;
+		} else {
+			conn->proto = KVS_PROTO_TEXT;
+		}
+	}
+
+	if (conn->proto != KVS_PROTO_TEXT) {
+		return spdk_server_conn_process_frames(conn);
+	}
+
+	while (kvs_rbuf_next_line(&conn->rbuf, &line, &len)) {
+		if (len == 0) {
+			continue;
+		}
+		kvs_req_t req = { .ops = conn->ss->ops, .stat = KVS_STAT_OTHER, .tsc = conn->recv_tsc };
+		kvs_proto_process(&req, line, len);
+		if (spdk_server_req_submit(conn, &req) < 0) {
+			return -1;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+// printf();
+// debug
+
+// -H 0.0.0.0 -P 8888 
+static int spdk_server_app_parse(int ch, char *arg) {
+
+	switch (ch) {
+
+	case 'H':
+		g_host = arg;
+		break;
+
+	case 'P':
+		g_port = spdk_strtol(arg, 10);
+		if (g_port < 0) {
+			SPDK_ERRLOG("Invalid port ID\n");
+			return g_port;
+		}
+		break;
+
+	case 'N':
+		g_sock_impl_name = arg; //-N posix or -N uring
+		break;
+
+	case 'W':
+		g_wal = true;
+		break;
+
+	case 'T': {
+		long mb = spdk_strtol(arg, 10);
+		if (mb <= 0) {
+			SPDK_ERRLOG("Invalid memory budget\n");
+			return -EINVAL;
+		}
+		g_tier_mb = mb;
+		break;
+	}
+
+	case 'K': {
+		long reads = spdk_strtol(arg, 10);
+		if (reads < 0 || reads > UINT32_MAX) {
+			SPDK_ERRLOG("Invalid hot key threshold\n");
+			return -EINVAL;
+		}
+		g_hot = reads;
+		break;
+	}
+
+	case 'U':
+		g_shm_path = arg;
+		break;
+	case 'O':
+		g_handoff_path = arg;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+// help
+static void spdk_server_app_usage(void) {
+
+	printf("-H host_addr \n");
+	printf("-P host_port \n");
+	printf("-N sock_impl \n");
+	printf("-W enable NVMe write-ahead log \n");
+	printf("-T mem_mb  keep values within mem_mb of memory, evict the rest to NVMe (not with -W) \n");
+	printf("-K reads   replicate keys read about this often on their shard to every shard, 0 disables (default %d) \n",
+		KVS_HOT_THRESHOLD);
+	printf("-U path    also serve local clients over shared memory rings, handshake on this Unix socket \n");
+	printf("-O path    hot restart: take over from the server on this Unix socket if there is one, then wait there for the next one (not with -W, -T) \n");
+
+}
+
+// 取 rbuf 里可以接收的位置；一条命令超过 KVS_RBUF_MAX_SIZE 时回复错误、关闭连接，返回 NULL
+static char *spdk_server_conn_reserve(struct server_conn_t *conn, size_t *avail) {
+
+	char *buf = kvs_rbuf_reserve(&conn->rbuf, avail);
+	if (buf == NULL) {
+		SPDK_ERRLOG("Request exceeds %d bytes, closing connection\n", KVS_RBUF_MAX_SIZE);
+		kvs_reply_status(&conn->wbuf, KVS_ERROR);
+		spdk_server_conn_flush(conn);
+		spdk_server_conn_close(conn);
+	}
+	return buf;
+}
+
+// rbuf 里新收到 n 字节：解析执行，回复等这一轮 poll 结束后统一提交
+static void spdk_server_conn_input(struct server_conn_t *conn, size_t n) {
+
+	kvs_rbuf_commit(&conn->rbuf, n);
+	kvs_stat_add(&conn->ss->stats->bytes_in, n);
+	conn->recv_tsc = spdk_get_ticks();
+
+	// 一次收到的数据可能包含多条流水线命令，全部处理完再统一回复
+	conn->processing = true;
+	int rc = spdk_server_conn_process(conn);
+	conn->processing = false;
+	if (rc < 0 || conn->failed) {
+		SPDK_ERRLOG("Protocol error or out of memory, closing connection\n");
+		kvs_stat_add(&conn->ss->stats->errors, 1);
+		spdk_server_conn_flush(conn);
+		spdk_server_conn_close(conn);
+		return ;
+	}
+	spdk_server_conn_mark_dirty(conn);
+}
+
+static void spdk_server_callback(void *arg, struct spdk_sock_group *group, struct spdk_sock *sock) {
+
+	struct server_conn_t *conn = arg;
+	size_t avail = 0;
+
+	// 排空时新的请求留在 socket 里，关闭时一起丢掉，客户端重连到新进程上再发
+	if (conn->ss->draining) {
+		return ;
+	}
+
+	char *buf = spdk_server_conn_reserve(conn, &avail);
+	if (buf == NULL) {
+		return ;
+	}
+	
+	ssize_t n =  spdk_sock_recv(sock, buf, avail);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return ;
+		}
+		
+		SPDK_ERRLOG("spdk_sock_recv failed, errno %d: %s",
+				errno, spdk_strerror(errno));
+		spdk_server_conn_close(conn);
+		return ;
+	} else if (n == 0) {
+
+		SPDK_NOTICELOG("Connection closed\n");
+		spdk_server_conn_close(conn);
+
+		return ;
+
+	} else { 
+		KVS_TRACE("ret: %ld, recv: %.*s", n, (int)n, buf);
+		spdk_server_conn_input(conn, n);
+		return ;
+	}  
+
+	// assert(0);
+	
+	return ;
+}
+
+// 在 shard 线程上把连接加入自己的 sock group
+static void spdk_server_conn_attach(void *arg) {
+
+	struct server_conn_t *conn = arg;
+	struct server_shard_t *ss = conn->ss;
+
+	// 停止 accept 之前接到的连接，赶上了热重启的排空
+	int rc = ss->draining ? -1 : spdk_sock_group_add_sock(ss->group, conn->sock,
+		spdk_server_callback, conn);
+	if (rc < 0) {
+		if (!ss->draining) {
+			SPDK_ERRLOG("Cannot add connection to shard %d\n", ss->shard->index);
+		}
+		spdk_sock_close(&conn->sock);
+		spdk_server_conn_free(conn);
+		return ;
+	}
+	TAILQ_INSERT_TAIL(&ss->conns, conn, link);
+	kvs_stat_add(&ss->stats->conns_opened, 1);
+}
+
+// 在监听所在的 shard 线程上执行，返回 accept 到的连接数
+static int spdk_server_accept(struct server_context_t *ctx) {
+
+	char saddr[ADDR_STR_LEN], caddr[ADDR_STR_LEN];
+	uint16_t sport, cport;
+	int count = 0;
+
+	if (!g_running) {
+		return 0;
+	} 
+
+	// 一次最多取 KVS_ACCEPT_BATCH 个，剩下的 epoll 水平触发下一轮还会报上来
+	while (count < KVS_ACCEPT_BATCH) {
+		// accept
+		struct spdk_sock *client_sock = spdk_sock_accept(ctx->sock);
+		if (client_sock == NULL)	{
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				SPDK_ERRLOG("accept failed, errno %d\n", errno);
+			}
+			break;
+		}
+
+		//getpeeraddr();
+		int rc = spdk_sock_getaddr(client_sock, saddr, sizeof(saddr), &sport, 
+				caddr, sizeof(caddr), &cport);
+		if (rc < 0) {
+
+			SPDK_ERRLOG("Cannot get connection address\n");
+			spdk_sock_close(&client_sock);
+			continue;
+
+		}
+		KVS_TRACE("accept %s:%u", caddr, cport);
+
+		// 新连接轮流分给各个 shard
+		struct server_shard_t *ss = &g_server_shards[ctx->next_shard++ % g_nshards];
+		struct server_conn_t *conn = spdk_server_conn_create(ctx, ss, client_sock);
+		if (conn == NULL) {
+
+			SPDK_ERRLOG("Cannot allocate connection\n");
+			spdk_sock_close(&client_sock);
+			continue;
+
+		}
+
+		count ++;
+
+		// 分给自己的直接加进 group，省一次消息
+		if (ss == ctx->listen_shard) {
+			spdk_server_conn_attach(conn);
+			continue;
+		}
+
+		rc = spdk_thread_send_msg(ss->shard->thread, spdk_server_conn_attach, conn);
+		if (rc < 0) {
+
+			SPDK_ERRLOG("Cannot hand connection to shard %d\n", ss->shard->index);
+			spdk_sock_close(&conn->sock);
+			spdk_server_conn_free(conn);
+
+		}
+
+	}
+
+	return count;
+}
+
+// 监听 socket 可读，说明 backlog 里有连接
+static void spdk_server_accept_cb(void *arg, struct spdk_sock_group *group, struct spdk_sock *sock) {
+
+	spdk_server_accept(arg);
+
+}
+
+// 退路：period 为 0 的 poller，有连接时一直忙着 accept，空闲后降到每 KVS_ACCEPT_IDLE_US 试一次
+static int spdk_server_accept_poll(void *arg) {
+
+	struct server_context_t *ctx = arg;
+	uint64_t now = spdk_get_ticks();
+
+	if (now < ctx->accept_next_tsc) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	if (spdk_server_accept(ctx) > 0) {
+		return SPDK_POLLER_BUSY;
+	}
+
+	ctx->accept_next_tsc = now + spdk_get_ticks_hz() * KVS_ACCEPT_IDLE_US / (1000 * 1000);
+	return SPDK_POLLER_IDLE;
+}
+
+/*
+#############
+shared memory
+#############
+
+-U 打开时，本机的客户端可以不走 TCP：在 Unix socket 上握手拿到一块共享内存，请求和回复都经过里面的环，见 kvs_shm.h。
+握手由 listen_shard 轮询 accept，连接和 TCP 连接一样轮流分给各个 shard，
+之后每个 shard 上一个 poller 轮询自己的共享内存连接，收到的字节放进 rbuf，解析、执行、回复都和 TCP 连接共用一套。
+回复环满了就先不读这个连接的请求，等客户端取走回复
+*/
+
+#define KVS_SHM_CHECK_US		(100 * 1000)	// 多久看一次客户端是不是已经退出
+
+static void spdk_server_shm_free(kvs_shm_t *shm) {
+
+	kvs_shm_close(shm);
+	free(shm);
+}
+
+// 在 shard 线程上开始轮询
+static void spdk_server_shm_attach(void *arg) {
+
+	struct server_conn_t *conn = arg;
+	struct server_shard_t *ss = conn->ss;
+
+	if (ss->draining) {
+		spdk_server_shm_free(conn->shm);
+		conn->shm = NULL;
+		spdk_server_conn_free(conn);
+		return ;
+	}
+	TAILQ_INSERT_TAIL(&ss->conns, conn, link);
+	TAILQ_INSERT_TAIL(&ss->shm_conns, conn, shm_link);
+	kvs_stat_add(&ss->stats->conns_opened, 1);
+}
+
+// 握手很少，每 KVS_ACCEPT_IDLE_US 在 listen_shard 上看一次
+static int spdk_server_shm_accept_poll(void *arg) {
+
+	struct server_context_t *ctx = arg;
+	int count = 0;
+
+	if (!g_running) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	for (int i = 0; i < KVS_ACCEPT_BATCH; i++) {
+		kvs_shm_t *shm = calloc(1, sizeof(*shm));
+		if (shm == NULL) {
+			SPDK_ERRLOG("Cannot allocate shared memory connection\n");
+			break;
+		}
+		if (kvs_shm_accept(ctx->shm_fd, shm, KVS_SHM_RING_SIZE) < 0) {
+			free(shm);
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			SPDK_ERRLOG("Shared memory handshake failed, errno %d\n", errno);
+			continue;
+		}
+
+		struct server_shard_t *ss = &g_server_shards[ctx->next_shard++ % g_nshards];
+		struct server_conn_t *conn = spdk_server_conn_create(ctx, ss, NULL);
+		if (conn == NULL) {
+			SPDK_ERRLOG("Cannot allocate connection\n");
+			spdk_server_shm_free(shm);
+			continue;
+		}
+		conn->shm = shm;
+		count++;
+
+		if (ss == ctx->listen_shard) {
+			spdk_server_shm_attach(conn);
+			continue;
+		}
+		if (spdk_thread_send_msg(ss->shard->thread, spdk_server_shm_attach, conn) < 0) {
+			SPDK_ERRLOG("Cannot hand connection to shard %d\n", ss->shard->index);
+			spdk_server_shm_free(conn->shm);
+			conn->shm = NULL;
+			spdk_server_conn_free(conn);
+		}
+	}
+
+	return count > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// period 为 0：请求环里有数据就读进 rbuf 处理，每个连接每轮最多读一次 rbuf 的空闲空间
+static int spdk_server_shm_poll(void *arg) {
+
+	struct server_shard_t *ss = arg;
+	struct server_conn_t *conn, *tmp;
+	int count = 0;
+
+	TAILQ_FOREACH_SAFE(conn, &ss->shm_conns, shm_link, tmp) {
+		// 上次没写完的回复先接着写，还是写不完就不收新的请求
+		if (!kvs_wbuf_empty(&conn->wbuf)) {
+			spdk_server_shm_flush(conn);
+			if (conn->failed) {
+				spdk_server_conn_close(conn);
+				continue;
+			}
+			if (!kvs_wbuf_empty(&conn->wbuf)) {
+				continue;
+			}
+			count++;
+		}
+		if (ss->draining || kvs_shm_readable(conn->shm) == 0) {
+			continue;
+		}
+
+		size_t avail = 0;
+		char *buf = spdk_server_conn_reserve(conn, &avail);
+		if (buf == NULL) {
+			continue;
+		}
+		spdk_server_conn_input(conn, kvs_shm_read(conn->shm, buf, avail));
+		count++;
+	}
+	spdk_server_flush_dirty(ss);
+
+	return count > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// 共享内存上看不出客户端退出，隔一段时间用 Unix socket 查一次
+static int spdk_server_shm_check(void *arg) {
+
+	struct server_shard_t *ss = arg;
+	struct server_conn_t *conn, *tmp;
+	int count = 0;
+
+	TAILQ_FOREACH_SAFE(conn, &ss->shm_conns, shm_link, tmp) {
+		if (kvs_shm_peer_closed(conn->shm)) {
+			SPDK_NOTICELOG("Connection closed\n");
+			spdk_server_conn_close(conn);
+			count++;
+		}
+	}
+
+	return count > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// 在调用线程上打开 Unix socket，之后交给 listen_shard 轮询
+static int spdk_server_shm_listen(struct server_context_t *ctx) {
+
+	ctx->shm_fd = kvs_shm_listen(ctx->shm_path);
+	if (ctx->shm_fd < 0) {
+		SPDK_ERRLOG("Cannot listen on %s, errno %d: %s\n", ctx->shm_path,
+				errno, spdk_strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void spdk_server_shm_listen_close(struct server_context_t *ctx) {
+
+	spdk_poller_unregister(&ctx->shm_accept_poller);
+	if (ctx->shm_fd >= 0) {
+		close(ctx->shm_fd);
+		ctx->shm_fd = -1;
+		if (!ctx->keep_paths) {
+			unlink(ctx->shm_path);
+		}
+	}
+}
+
+// 在 listen_shard 线程上开始 accept
+static void spdk_server_listen_attach(void *arg) {
+
+	struct server_context_t *ctx = arg;
+	struct server_shard_t *ss = ctx->listen_shard;
+
+	if (ctx->shm_fd >= 0) {
+		ctx->shm_accept_poller = SPDK_POLLER_REGISTER(spdk_server_shm_accept_poll, ctx, KVS_ACCEPT_IDLE_US);
+	}
+
+	int rc = spdk_sock_group_add_sock(ss->group, ctx->sock, spdk_server_accept_cb, ctx);
+	if (rc == 0) {
+		ctx->listen_in_group = true;
+		return ;
+	}
+
+	SPDK_NOTICELOG("Listen socket not pollable by sock group, falling back to accept poller\n");
+	ctx->accept_poller = SPDK_POLLER_REGISTER(spdk_server_accept_poll, ctx, 0);
+}
+
+// 在 listen_shard 线程上停止 accept 并关闭监听 socket
+static void spdk_server_listen_close(struct server_context_t *ctx) {
+
+	spdk_poller_unregister(&ctx->accept_poller);
+	if (ctx->listen_in_group) {
+		spdk_sock_group_remove_sock(ctx->listen_shard->group, ctx->sock);
+		ctx->listen_in_group = false;
+	}
+	if (ctx->sock) {
+		spdk_sock_close(&ctx->sock);
+	}
+	spdk_server_shm_listen_close(ctx);
+}
+
+#define KVS_HANDOFF_POLL_US		(100 * 1000)	// 多久看一次有没有新进程来接手
+#define KVS_REGION_POLL_US		(10 * 1000)		// 多久收一次别的进程释放在共享内存里的对象
+
+static void spdk_server_quiet_check(struct server_shard_t *ss);
+static void spdk_server_stop(struct server_context_t *ctx);
+static int spdk_server_handoff_poll(void *arg);
+
+static int spdk_server_group_poll(void *arg) {
+
+	struct server_shard_t *ss = arg;
+
+	bool busy = !TAILQ_EMPTY(&ss->dirty);
+
+	// 其他 shard 送回的 op 在这之前已经处理完，回复和本轮收到的命令一起提交
+	int rc = spdk_sock_group_poll(ss->group);
+	if (rc < 0) {
+		SPDK_ERRLOG("Failed to poll sock_group = %p\n", ss->group);
+	}
+	spdk_server_flush_dirty(ss);
+	if (ss->draining && !ss->quiet) {
+		spdk_server_quiet_check(ss);
+	}
+
+	return rc > 0 || busy ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+
+// 打开监听 socket：TCP 每次新建，两个 Unix socket 从老进程接过来了就不再建
+static int spdk_server_listen_open(struct server_context_t *ctx) {
+
+	ctx->sock = spdk_sock_listen(ctx->host, ctx->port, ctx->sock_impl_name);
+	if (ctx->sock == NULL) {
+		SPDK_ERRLOG("Cannot create server socket");
+		return -1;
+	}
+	if (ctx->shm_path && ctx->shm_fd < 0 && spdk_server_shm_listen(ctx) != 0) {
+		return -1;
+	}
+	if (ctx->handoff_path && ctx->handoff_fd < 0) {
+		ctx->handoff_fd = kvs_handoff_listen(ctx->handoff_path);
+		if (ctx->handoff_fd < 0) {
+			SPDK_ERRLOG("Cannot listen on %s, errno %d: %s\n", ctx->handoff_path,
+					errno, spdk_strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// 在 app 线程上调用，开始 accept
+static int spdk_server_listen_start(struct server_context_t *ctx) {
+
+	g_running = true;
+
+	// accept 交给 shard 0，监听 socket 和连接一起在它的 sock group 里等事件
+	ctx->listen_shard = &g_server_shards[0];
+	if (spdk_thread_send_msg(ctx->listen_shard->shard->thread, spdk_server_listen_attach, ctx) != 0) {
+		SPDK_ERRLOG("Cannot start accept on shard 0\n");
+		ctx->listen_shard = NULL;
+		return -1;
+	}
+	if (ctx->handoff_fd >= 0 && ctx->handoff_poller == NULL) {
+		ctx->handoff_poller = SPDK_POLLER_REGISTER(spdk_server_handoff_poll, ctx, KVS_HANDOFF_POLL_US);
+	}
+
+	printf("spdk_server_listen\n");
+
+	return 0;
+}
+
+// spdk sock 
+static int spdk_server_listen(struct server_context_t *ctx) {
+
+	if (spdk_server_listen_open(ctx) != 0 || spdk_server_listen_start(ctx) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+#############
+hot restart
+#############
+
+交接的过程见 kvs_handoff.h。和另一个进程之间的收发都是阻塞的，放在单独的 pthread 里做；
+中间要在 SPDK 线程上做的几步（开日志、交出和重新监听 TCP 端口、排空、交出和接手共享内存）发消息给 app 线程，做完了再叫醒它。
+shard 上日志和重放的进展发给 app 线程汇总，到了 pthread 在等的地方再通过 event 叫醒它
+*/
+
+#define KVS_HANDOFF_BUDGET		1024			// 每次 poll 日志最多遍历、重放最多装多少个 key
+#define KVS_JOURNAL_RECLAIM_US	1000			// 遍历完以后多久回收一次新进程读完的日志
+#define KVS_HANDOFF_WATCH_MS	10				// 等 shard 的时候多久看一眼对方
+#define KVS_HANDOFF_ROUND_US	1000			// 关连接时还有连接在忙，隔多久再看一轮
+
+struct server_handoff_t {
+
+	struct server_context_t *ctx;
+	int fd;
+	sem_t sem;
+	int rc;				// 上一步的结果
+	sem_t event;		// shard 都到了 pthread 在等的地方，或者出了错
+	bool notified;
+	int status;			// shard 上出的错
+	int pending;		// 老进程：还没排空的 shard 数
+
+	kvs_journal_dir_t *dir;
+	uint16_t tag;		// 新进程的标记
+
+	int busy;			// 老进程：还在忙、下一轮再看的连接数
+
+	// 新进程
+	int fds[KVS_HANDOFF_MAX_FDS];	// 收到的 fd，接过去之后置为 -1
+	int nfds;
+	int synced;			// 过了 SYNCED 的 shard 数
+	int ended;			// 读到 END 的 shard 数
+	bool finishing;		// 收到了 SEALED，等所有 shard 读到 END 再抢共享内存
+
+};
+
+static void spdk_server_handoff_wake(struct server_handoff_t *h, int rc) {
+
+	h->rc = rc;
+	sem_post(&h->sem);
+}
+
+// 在 handoff 线程上调用：让 app 线程执行 fn，等它（或者它发起的异步操作）调用 spdk_server_handoff_wake
+static int spdk_server_handoff_step(struct server_handoff_t *h, spdk_msg_fn fn) {
+
+	if (spdk_thread_send_msg(h->ctx->app_thread, fn, h) != 0) {
+		return -1;
+	}
+	while (sem_wait(&h->sem) != 0 && errno == EINTR) {
+	}
+	return h->rc;
+}
+
+// 在 app 线程上调用：叫醒在 spdk_server_handoff_watch 里等着的 handoff 线程，只叫一次
+static void spdk_server_handoff_notify(struct server_handoff_t *h) {
+
+	if (!h->notified) {
+		h->notified = true;
+		sem_post(&h->event);
+	}
+}
+
+// 在 handoff 线程上等 spdk_server_handoff_notify，同时看着对方：等到了返回 0，对方发来了消息或者关了返回 1
+static int spdk_server_handoff_watch(struct server_handoff_t *h) {
+
+	for (;;) {
+		if (sem_trywait(&h->event) == 0) {
+			return 0;
+		}
+		struct pollfd pfd = { .fd = h->fd, .events = POLLIN };
+		if (poll(&pfd, 1, KVS_HANDOFF_WATCH_MS) > 0) {
+			return 1;
+		}
+	}
+}
+
+// 在 shard 线程上调用：把进展交给 app 线程上的 fn 汇总，m 是这个 shard 上这种进展专用的节点
+static void spdk_server_handoff_report(kvs_msg_t *m, spdk_msg_fn fn, int rc) {
+
+	kvs_msg_send(m, g_server_ctx->app_thread, fn, (void *)(intptr_t)rc);
+}
+
+// shard 上写日志或者重放出了错
+static void spdk_server_handoff_error(void *arg) {
+
+	struct server_handoff_t *h = g_server_ctx->handoff;
+	int rc = (int)(intptr_t)arg;
+
+	if (h == NULL) {
+		return ;
+	}
+	if (h->status == 0) {
+		h->status = rc;
+	}
+	spdk_server_handoff_notify(h);
+	if (h->finishing) {
+		h->finishing = false;
+		spdk_server_handoff_wake(h, rc);
+	}
+}
+
+static void spdk_server_handoff_close_fds(struct server_handoff_t *h) {
+
+	for (int i = 0; i < h->nfds; i++) {
+		if (h->fds[i] >= 0) {
+			close(h->fds[i]);
+		}
+	}
+	h->nfds = 0;
+}
+
+static void spdk_server_handoff_free(struct server_handoff_t *h) {
+
+	spdk_server_handoff_close_fds(h);
+	if (h->fd >= 0) {
+		close(h->fd);
+	}
+	sem_destroy(&h->sem);
+	sem_destroy(&h->event);
+	free(h);
+}
+
+// 在 app 线程上调用，交接结束时（不管成败）由 app 线程清掉 ctx->handoff
+static int spdk_server_handoff_start(struct server_context_t *ctx, int fd, void *(*fn)(void *)) {
+
+	struct server_handoff_t *h = calloc(1, sizeof(*h));
+	if (h == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	h->ctx = ctx;
+	h->fd = fd;
+	sem_init(&h->sem, 0, 0);
+	sem_init(&h->event, 0, 0);
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, fn, h) != 0) {
+		spdk_server_handoff_free(h);
+		return -ENOMEM;
+	}
+	pthread_detach(tid);
+	ctx->handoff = h;
+	return 0;
+}
+
+static int spdk_server_region_poll(void *arg) {
+
+	return kvs_region_reclaim() > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+// 没有老进程时自己建共享内存：value 从一开始就放在里面，下一个进程才接得过去
+static int spdk_server_region_create(struct server_context_t *ctx) {
+
+	int rc = kvs_region_create(ctx->tag);
+	if (rc != 0) {
+		SPDK_ERRLOG("Cannot create the shared region, errno %d: %s\n", -rc, spdk_strerror(-rc));
+		return -1;
+	}
+	kv_slab_use_backend(&kvs_region_backend);
+	ctx->region_poller = SPDK_POLLER_REGISTER(spdk_server_region_poll, ctx, KVS_REGION_POLL_US);
+	return 0;
+}
+
+static void spdk_server_page_adopt(void *arg, void *page) {
+
+	uint16_t owner = *(uint16_t *)arg;
+
+	if (kv_slab_page_owner(page) == owner) {
+		kv_slab_adopt(page, &kvs_region_backend);
+	}
+}
+
+static void spdk_server_shard_adopt(kvs_shard_t *shard, void *arg) {
+
+	uint16_t owner = shard->index;
+
+	kvs_region_walk(KVS_REGION_SLAB, spdk_server_page_adopt, &owner);
+}
+
+// 之后照常释放，交接期间压进 garbage 栈的对象收回来
+static void spdk_server_region_adopted(void *arg) {
+
+	kv_slab_defer_free(NULL);
+	kvs_region_reclaim();
+	spdk_server_handoff_wake(arg, 0);
+}
+
+// 抢到共享内存之后在 app 线程上调用：全局 class 的页和大对象挂在 app 线程上，disown 时属于哪个 shard 的页挂回哪个 shard。
+// 这时两边都不解析请求，不会有新分配的页（owner 也是 KV_SLAB_NO_OWNER）被当成交过来的再接手一遍
+static void spdk_server_region_adopt(struct server_handoff_t *h) {
+
+	uint16_t owner = KV_SLAB_NO_OWNER;
+
+	kvs_region_walk(KVS_REGION_SLAB, spdk_server_page_adopt, &owner);
+	if (kvs_shard_for_each(spdk_server_shard_adopt, h, spdk_server_region_adopted) != 0) {
+		SPDK_ERRLOG("Cannot adopt slab pages on the shards, leaking them\n");
+		spdk_server_region_adopted(h);
+	}
+}
+
+/*
+老进程这一侧
+*/
+
+// 日志遍历完以后只剩回收新进程读完的块，写由 kvs_op_track 记
+static int spdk_server_journal_reclaim(void *arg) {
+
+	struct server_shard_t *ss = arg;
+	int rc = kvs_journal_snapshot(ss->shard->journal, 0, false);
+
+	if (rc < 0) {
+		spdk_poller_unregister(&ss->journal_poller);
+		spdk_server_handoff_report(&ss->error_msg, spdk_server_handoff_error, rc);
+	}
+	return SPDK_POLLER_IDLE;
+}
+
+// period 为 0：每次遍历一小段索引，和请求交替着来
+static int spdk_server_journal_poll(void *arg) {
+
+	struct server_shard_t *ss = arg;
+	int rc = kvs_journal_snapshot(ss->shard->journal, KVS_HANDOFF_BUDGET, ss->shard->index == 0);
+
+	if (rc != 0) {
+		spdk_poller_unregister(&ss->journal_poller);
+	}
+	if (rc < 0) {
+		spdk_server_handoff_report(&ss->error_msg, spdk_server_handoff_error, rc);
+	} else if (rc > 0) {
+		ss->journal_poller = SPDK_POLLER_REGISTER(spdk_server_journal_reclaim, ss, KVS_JOURNAL_RECLAIM_US);
+	}
+	return SPDK_POLLER_BUSY;
+}
+
+static void spdk_server_shard_journal(kvs_shard_t *shard, void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+
+	shard->journal = kvs_journal_open(h->dir, shard);
+	if (shard->journal == NULL) {
+		h->status = -ENOMEM;
+		return ;
+	}
+	ss->journal_poller = SPDK_POLLER_REGISTER(spdk_server_journal_poll, ss, 0);
+}
+
+static void spdk_server_shard_pass(kvs_shard_t *shard, void *arg) {
+}
+
+static void spdk_server_handoff_journaled(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	spdk_server_handoff_wake(h, h->status);
+}
+
+static void spdk_server_handoff_journal_open(void *arg) {
+
+	if (kvs_shard_for_each(spdk_server_shard_journal, arg, spdk_server_handoff_journaled) != 0) {
+		spdk_server_handoff_wake(arg, -ENOMEM);
+	}
+}
+
+// 每个 shard 开一份日志。跳表的写先都转到 shard 0 上，每个 shard 都过了一遍之后才开，不会漏记
+static void spdk_server_handoff_journal(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	if (!kvs_region_owned()) {
+		spdk_server_handoff_wake(h, -EPROTO);
+		return ;
+	}
+	h->dir = kvs_journal_dir_create(g_nshards);
+	if (h->dir == NULL) {
+		spdk_server_handoff_wake(h, -ENOMEM);
+		return ;
+	}
+	h->status = 0;
+	h->notified = false;
+	__atomic_store_n(&g_slist_home, 0, __ATOMIC_RELAXED);
+	if (kvs_shard_for_each(spdk_server_shard_pass, h, spdk_server_handoff_journal_open) != 0) {
+		spdk_server_handoff_wake(h, -ENOMEM);
+	}
+}
+
+static void spdk_server_handoff_released(void *arg) {
+
+	kv_slab_disown();
+	kvs_region_release();
+	spdk_server_handoff_wake(arg, 0);
+}
+
+static void spdk_server_shard_disown(kvs_shard_t *shard, void *arg) {
+
+	kv_slab_cache_disown(shard->index);
+}
+
+static void spdk_server_handoff_sealed(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	// 新进程装的不全，不交了；交接期间压进 garbage 栈的对象还是自己的
+	if (h->status != 0) {
+		kv_slab_defer_free(NULL);
+		kvs_region_reclaim();
+		spdk_server_handoff_wake(h, h->status);
+		return ;
+	}
+	if (kvs_shard_for_each(spdk_server_shard_disown, h, spdk_server_handoff_released) != 0) {
+		kv_slab_defer_free(NULL);
+		kvs_region_reclaim();
+		spdk_server_handoff_wake(h, -ENOMEM);
+	}
+}
+
+static void spdk_server_shard_seal(kvs_shard_t *shard, void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+
+	spdk_poller_unregister(&ss->journal_poller);
+	int rc = kvs_journal_end(shard->journal);
+	if (rc != 0 && h->status == 0) {
+		h->status = rc;
+	}
+	kvs_journal_close(shard->journal);
+	shard->journal = NULL;
+}
+
+static void spdk_server_handoff_seal(void *arg) {
+
+	if (kvs_shard_for_each(spdk_server_shard_seal, arg, spdk_server_handoff_sealed) != 0) {
+		kv_slab_defer_free(NULL);
+		spdk_server_handoff_wake(arg, -ENOMEM);
+	}
+}
+
+// 所有 shard 都排空了，不会再有写：日志写 END，slab 的页 disown，交出共享内存。
+// 之后释放的对象都压进 garbage 栈，每个线程都过了一遍才 disown，不会再有对象压进 remote 栈
+static void spdk_server_handoff_quiet(void *arg) {
+
+	struct server_handoff_t *h = g_server_ctx->handoff;
+
+	if (h == NULL || --h->pending > 0) {
+		return ;
+	}
+	kv_slab_defer_free(kvs_region_defer);
+	if (kvs_shard_for_each(spdk_server_shard_pass, h, spdk_server_handoff_seal) != 0) {
+		kv_slab_defer_free(NULL);
+		spdk_server_handoff_wake(h, -ENOMEM);
+	}
+}
+
+// 排空：所有连接都没有执行中的请求了（转发出去的 op 也都回来了）告诉 app 线程，只报告一次
+static void spdk_server_quiet_check(struct server_shard_t *ss) {
+
+	struct server_conn_t *conn;
+
+	TAILQ_FOREACH(conn, &ss->conns, link) {
+		if (!TAILQ_EMPTY(&conn->reqs)) {
+			return ;
+		}
+	}
+	ss->quiet = true;
+	kvs_msg_send(&ss->quiet_msg, g_server_ctx->app_thread, spdk_server_handoff_quiet, NULL);
+}
+
+static void spdk_server_shard_quiesce(void *arg) {
+
+	struct server_shard_t *ss = arg;
+
+	ss->draining = true;
+	ss->quiet = false;
+}
+
+// 所有 shard 都不再解析新的请求，执行中的请求都回复完再交出共享内存。这时已经不 accept 了
+static void spdk_server_handoff_quiesce(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	h->pending = g_nshards;
+	for (int i = 0; i < g_nshards; i++) {
+		kvs_msg_send(&g_server_shards[i].quiesce_msg, g_shards[i].thread, spdk_server_shard_quiesce,
+			&g_server_shards[i]);
+	}
+}
+
+// 等不到 ACK：新进程还没抢到共享内存就收回来，接着服务；抢不到说明新进程已经接手
+static void spdk_server_handoff_reclaim(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	if (!kvs_region_acquire(h->ctx->tag)) {
+		spdk_server_handoff_wake(h, -EBUSY);
+		return ;
+	}
+	SPDK_NOTICELOG("Took the shared region back from the new process\n");
+	spdk_server_region_adopt(h);
+}
+
+static void spdk_server_shard_resume(kvs_shard_t *shard, void *arg) {
+
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+
+	spdk_poller_unregister(&ss->journal_poller);
+	kvs_journal_close(shard->journal);
+	shard->journal = NULL;
+	ss->draining = false;
+	ss->quiet = false;
+}
+
+static void spdk_server_handoff_resumed(void *arg) {
+
+	spdk_server_handoff_wake(arg, 0);
+}
+
+// 交接失败，接着服务：日志不再写，跳表的 op 回到就地执行。让出过端口的话之后再重新监听
+static void spdk_server_handoff_resume(void *arg) {
+
+	__atomic_store_n(&g_slist_home, -1, __ATOMIC_RELAXED);
+	if (kvs_shard_for_each(spdk_server_shard_resume, arg, spdk_server_handoff_resumed) != 0) {
+		spdk_server_handoff_wake(arg, -ENOMEM);
+	}
+}
+
+// 交接结束；新进程已经不再读日志，日志和里面的引用还掉
+static void spdk_server_handoff_abort(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	kvs_journal_dir_free(h->dir);
+	h->dir = NULL;
+	h->ctx->handoff = NULL;
+	spdk_server_handoff_wake(h, 0);
+}
+
+// 在 listen_shard 上停止 accept：backlog 里已经排着的连接先接下来，再关掉 TCP 监听，新进程好在同一个端口上监听。
+// 共享内存握手的 Unix socket 不关，新进程手里也有一份，ACK 之后由它 accept
+static void spdk_server_listen_pause(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	while (spdk_server_accept(ctx) == KVS_ACCEPT_BATCH) {
+	}
+	g_running = false;
+	spdk_poller_unregister(&ctx->accept_poller);
+	spdk_poller_unregister(&ctx->shm_accept_poller);
+	if (ctx->listen_in_group) {
+		spdk_sock_group_remove_sock(ctx->listen_shard->group, ctx->sock);
+		ctx->listen_in_group = false;
+	}
+	if (ctx->sock) {
+		spdk_sock_close(&ctx->sock);
+	}
+	spdk_server_handoff_wake(h, 0);
+}
+
+// 新进程跟上了日志，把 TCP 端口让给它
+static void spdk_server_handoff_unlisten(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	if (ctx->listen_shard == NULL ||
+		spdk_thread_send_msg(ctx->listen_shard->shard->thread, spdk_server_listen_pause, h) != 0) {
+		spdk_server_handoff_wake(h, -EIO);
+	}
+}
+
+// 交接失败时端口已经让出去了：新进程关了连接（它的监听也关了）之后重新监听，接着 accept
+static void spdk_server_handoff_relisten(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	if (ctx->stopping) {
+		spdk_server_handoff_wake(h, 0);
+		return ;
+	}
+	if (ctx->sock == NULL) {
+		ctx->sock = spdk_sock_listen(ctx->host, ctx->port, ctx->sock_impl_name);
+	}
+	if (ctx->sock == NULL || spdk_server_listen_start(ctx) != 0) {
+		spdk_server_handoff_wake(h, -EADDRINUSE);
+		return ;
+	}
+	spdk_server_handoff_wake(h, 0);
+}
+
+// 关掉这个 shard 上空闲的连接：没有执行中的请求，回复都写出去了。还在忙的数一下，下一轮再看
+static void spdk_server_shard_drain(kvs_shard_t *shard, void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+	struct server_conn_t *conn, *tmp;
+
+	TAILQ_FOREACH_SAFE(conn, &ss->conns, link, tmp) {
+		if (conn->closed) {
+			continue;
+		}
+		if (!TAILQ_EMPTY(&conn->reqs) || conn->writes > 0 || !kvs_wbuf_empty(&conn->wbuf)) {
+			h->busy++;
+			continue;
+		}
+		spdk_server_conn_close(conn);
+	}
+}
+
+static void spdk_server_handoff_drained(void *arg) {
+
+	spdk_server_handoff_wake(arg, 0);
+}
+
+static void spdk_server_handoff_drain(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	h->busy = 0;
+	if (kvs_shard_for_each(spdk_server_shard_drain, h, spdk_server_handoff_drained) != 0) {
+		spdk_server_handoff_wake(h, -ENOMEM);
+	}
+}
+
+static void spdk_server_handoff_done(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	SPDK_NOTICELOG("Handed over to the new process, exiting\n");
+	ctx->handoff = NULL;
+	ctx->keep_paths = true;
+	spdk_server_stop(ctx);
+	spdk_server_handoff_wake(h, 0);
+}
+
+// 收到 ACK 之后一轮一轮地关掉空闲的连接，客户端重连到新进程上；还在忙的最多等 KVS_HANDOFF_LINGER_S，剩下的退出时一起关
+static void spdk_server_handoff_linger(struct server_handoff_t *h) {
+
+	uint64_t deadline = spdk_get_ticks() + spdk_get_ticks_hz() * KVS_HANDOFF_LINGER_S;
+
+	while (spdk_server_handoff_step(h, spdk_server_handoff_drain) == 0 && h->busy > 0) {
+		if (spdk_get_ticks() >= deadline) {
+			SPDK_NOTICELOG("Closing %d connections still busy after %d seconds\n", h->busy, KVS_HANDOFF_LINGER_S);
+			break;
+		}
+		usleep(KVS_HANDOFF_ROUND_US);
+	}
+}
+
+static void *spdk_server_handoff_give(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+	kvs_handoff_msg_t m;
+	int fds[KVS_HANDOFF_MAX_FDS];
+	int nfds = 0;
+	bool journaled = false;
+	bool unlistened = false;
+	int rc;
+
+	if (kvs_handoff_recv(h->fd, KVS_HANDOFF_HELLO, &m, NULL, NULL, NULL) != 0) {
+		goto fail;
+	}
+	// key 按 shard 数分片，value 和 slab 的页原样接手，两边的这些都要一样
+	if (m.arg != (uint64_t)g_nshards || m.arg2 != kvs_handoff_layout()) {
+		SPDK_ERRLOG("New process has %" PRIu64 " shards (%d here) or another memory layout, not handing over\n",
+				m.arg, g_nshards);
+		kvs_handoff_send(h->fd, KVS_HANDOFF_REJECT, EINVAL, 0, NULL, 0, NULL, 0);
+		errno = EINVAL;
+		goto fail;
+	}
+
+	journaled = true;
+	rc = spdk_server_handoff_step(h, spdk_server_handoff_journal);
+	if (rc != 0) {
+		errno = rc < 0 ? -rc : ENOMEM;
+		goto fail;
+	}
+
+	// 都是自己打开的 fd，TCP 监听不在里面：spdk_sock 不给 fd，新进程自己在端口上监听
+	fds[nfds++] = kvs_region_fd();
+	fds[nfds++] = ctx->handoff_fd;
+	if (ctx->shm_fd >= 0) {
+		fds[nfds++] = ctx->shm_fd;
+	}
+	if (kvs_handoff_send(h->fd, KVS_HANDOFF_READY, (uintptr_t)h->dir, (uint16_t)(ctx->tag + 1),
+			NULL, 0, fds, nfds) != 0) {
+		goto fail;
+	}
+
+	// 数据多时遍历要一阵子，这期间照常服务，不设超时；日志出了错就不等了
+	if (spdk_server_handoff_watch(h) == 0) {
+		errno = -h->status;
+		goto fail;
+	}
+	if (kvs_handoff_recv(h->fd, KVS_HANDOFF_CAUGHT_UP, &m, NULL, NULL, NULL) != 0) {
+		goto fail;
+	}
+
+	// 让出 TCP 端口：新进程监听着先不 accept，新的连接排在它的 backlog 里，等它接手了再处理
+	rc = spdk_server_handoff_step(h, spdk_server_handoff_unlisten);
+	if (rc != 0) {
+		errno = -rc;
+		goto fail;
+	}
+	unlistened = true;
+	if (kvs_handoff_send(h->fd, KVS_HANDOFF_UNLISTENED, 0, 0, NULL, 0, NULL, 0) != 0) {
+		goto fail;
+	}
+
+	// 从排空到新进程 ACK 不解析请求；失败时共享内存还没交出去
+	rc = spdk_server_handoff_step(h, spdk_server_handoff_quiesce);
+	if (rc != 0) {
+		errno = rc < 0 ? -rc : ENOMEM;
+		goto fail;
+	}
+	if (kvs_handoff_send(h->fd, KVS_HANDOFF_SEALED, 0, 0, NULL, 0, NULL, 0) != 0 ||
+		kvs_handoff_recv(h->fd, KVS_HANDOFF_ACK, &m, NULL, NULL, NULL) != 0) {
+		SPDK_ERRLOG("New process did not acknowledge, errno %d: %s\n", errno, spdk_strerror(errno));
+		if (spdk_server_handoff_step(h, spdk_server_handoff_reclaim) == 0) {
+			goto resume;
+		}
+		SPDK_NOTICELOG("New process has taken the shared region over\n");
+	}
+
+	spdk_server_handoff_linger(h);
+	spdk_server_handoff_step(h, spdk_server_handoff_done);
+	spdk_server_handoff_free(h);
+	return NULL;
+
+fail:
+	SPDK_ERRLOG("Hot restart failed, errno %d: %s\n", errno, spdk_strerror(errno));
+resume:
+	if (journaled) {
+		for (int i = 0; spdk_server_handoff_step(h, spdk_server_handoff_resume) != 0; i++) {
+			if (i % 10 == 0) {
+				SPDK_ERRLOG("Cannot resume after a failed hot restart, retrying\n");
+			}
+			usleep(KVS_HANDOFF_POLL_US);
+		}
+		// 新进程可能还在读日志，等它关了连接再还掉；等不到只能漏掉
+		if (kvs_handoff_wait_close(h->fd) != 0) {
+			SPDK_ERRLOG("New process did not go away, leaking the journal\n");
+			h->dir = NULL;
+		}
+	}
+	// 新进程在关连接之前关掉监听；还没走的话端口还占着，一直重试
+	for (int i = 0; unlistened && spdk_server_handoff_step(h, spdk_server_handoff_relisten) != 0; i++) {
+		if (i % 10 == 0) {
+			SPDK_ERRLOG("Cannot listen on port %d again, retrying\n", ctx->port);
+		}
+		usleep(KVS_HANDOFF_POLL_US);
+	}
+	if (journaled) {
+		SPDK_NOTICELOG("Serving on after a failed hot restart\n");
+	}
+	spdk_server_handoff_step(h, spdk_server_handoff_abort);
+	spdk_server_handoff_free(h);
+	return NULL;
+}
+
+// 在 app 线程上看有没有新进程来接手
+static int spdk_server_handoff_poll(void *arg) {
+
+	struct server_context_t *ctx = arg;
+
+	if (ctx->handoff || !g_running) {
+		return SPDK_POLLER_IDLE;
+	}
+
+	int fd = kvs_handoff_accept(ctx->handoff_fd);
+	if (fd < 0) {
+		return SPDK_POLLER_IDLE;
+	}
+	SPDK_NOTICELOG("New process connected on %s, handing over\n", ctx->handoff_path);
+	if (spdk_server_handoff_start(ctx, fd, spdk_server_handoff_give) != 0) {
+		SPDK_ERRLOG("Cannot start hot restart\n");
+	}
+	return SPDK_POLLER_BUSY;
+}
+
+/*
+新进程这一侧
+*/
+
+static void spdk_server_replay_stop(struct server_shard_t *ss) {
+
+	spdk_poller_unregister(&ss->replay_poller);
+	kvs_replay_close(ss->replay);
+	ss->replay = NULL;
+}
+
+static void spdk_server_handoff_synced(void *arg) {
+
+	struct server_handoff_t *h = g_server_ctx->handoff;
+
+	if (h && ++h->synced == g_nshards) {
+		spdk_server_handoff_notify(h);
+	}
+}
+
+// 所有 shard 都读到 END 时抢共享内存，接手 slab 的页
+static void spdk_server_handoff_acquire(struct server_handoff_t *h) {
+
+	if (h->ended < g_nshards) {
+		return ;
+	}
+	h->finishing = false;
+	// 老进程等不及，已经收回去了
+	if (!kvs_region_acquire(h->tag)) {
+		spdk_server_handoff_wake(h, -EBUSY);
+		return ;
+	}
+	spdk_server_region_adopt(h);
+}
+
+static void spdk_server_handoff_ended(void *arg) {
+
+	struct server_handoff_t *h = g_server_ctx->handoff;
+
+	if (h == NULL) {
+		return ;
+	}
+	h->ended++;
+	if (h->finishing) {
+		spdk_server_handoff_acquire(h);
+	}
+}
+
+// period 为 0：跟着日志往索引里装，和老进程写日志同步进行
+static int spdk_server_replay_poll(void *arg) {
+
+	struct server_shard_t *ss = arg;
+	int rc = kvs_replay_poll(ss->replay, KVS_HANDOFF_BUDGET);
+
+	if (rc < 0) {
+		spdk_server_replay_stop(ss);
+		spdk_server_handoff_report(&ss->error_msg, spdk_server_handoff_error, rc);
+		return SPDK_POLLER_BUSY;
+	}
+	if (rc >= KVS_JOURNAL_SYNCED && ss->replay_state < KVS_JOURNAL_SYNCED) {
+		spdk_server_handoff_report(&ss->synced_msg, spdk_server_handoff_synced, 0);
+	}
+	ss->replay_state = rc;
+	if (rc == KVS_JOURNAL_END) {
+		spdk_server_replay_stop(ss);
+		spdk_server_handoff_report(&ss->ended_msg, spdk_server_handoff_ended, 0);
+	}
+	return SPDK_POLLER_BUSY;
+}
+
+static void spdk_server_shard_replay(kvs_shard_t *shard, void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+
+	ss->replay = kvs_replay_open(h->dir, shard);
+	if (ss->replay == NULL) {
+		h->status = -EPROTO;
+		return ;
+	}
+	ss->replay_state = 0;
+	ss->replay_poller = SPDK_POLLER_REGISTER(spdk_server_replay_poll, ss, 0);
+}
+
+static void spdk_server_handoff_replaying(void *arg) {
+
+	struct server_handoff_t *h = arg;
+
+	spdk_server_handoff_wake(h, h->status);
+}
+
+// 映射共享内存，接过两个 Unix socket，在每个 shard 上开始重放；TCP 等老进程让出端口再监听
+static void spdk_server_handoff_attach(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	int rc = kvs_region_attach(h->fds[KVS_HANDOFF_FD_REGION]);
+	if (rc != 0) {
+		spdk_server_handoff_wake(h, rc);
+		return ;
+	}
+	h->fds[KVS_HANDOFF_FD_REGION] = -1;
+	// 抢到共享内存之前分配的页不在里面，释放共享内存里的对象都交给老进程
+	kv_slab_defer_free(kvs_region_defer);
+	kv_slab_use_backend(&kvs_region_backend);
+	ctx->tag = h->tag;
+	kvs_value_set_owner(h->tag);
+	ctx->region_poller = SPDK_POLLER_REGISTER(spdk_server_region_poll, ctx, KVS_REGION_POLL_US);
+
+	ctx->handoff_fd = h->fds[KVS_HANDOFF_FD_HANDOFF];
+	h->fds[KVS_HANDOFF_FD_HANDOFF] = -1;
+	if (h->nfds > KVS_HANDOFF_FD_SHM && ctx->shm_path) {
+		ctx->shm_fd = h->fds[KVS_HANDOFF_FD_SHM];
+		h->fds[KVS_HANDOFF_FD_SHM] = -1;
+	}
+	if (ctx->shm_path && ctx->shm_fd < 0 && spdk_server_shm_listen(ctx) != 0) {
+		spdk_server_handoff_wake(h, -1);
+		return ;
+	}
+
+	h->status = 0;
+	if (kvs_shard_for_each(spdk_server_shard_replay, h, spdk_server_handoff_replaying) != 0) {
+		spdk_server_handoff_wake(h, -ENOMEM);
+	}
+}
+
+// 收到 UNLISTENED：在老进程让出来的端口上监听，先不 accept，连接排在 backlog 里
+static void spdk_server_handoff_bind(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	ctx->sock = spdk_sock_listen(ctx->host, ctx->port, ctx->sock_impl_name);
+	if (ctx->sock == NULL) {
+		SPDK_ERRLOG("Cannot listen on port %d\n", ctx->port);
+		spdk_server_handoff_wake(h, -EADDRINUSE);
+		return ;
+	}
+	spdk_server_handoff_wake(h, 0);
+}
+
+// 收到 SEALED：老进程不会再写日志，共享内存已经交出来了
+static void spdk_server_handoff_finish(void *arg) {
 
-// static char *g_host;
-// static int g_port;
-// static char *g_sock_impl_name;
-static bool g_running;
+	struct server_handoff_t *h = arg;
+
+	if (h->status != 0) {
+		spdk_server_handoff_wake(h, h->status);
+		return ;
+	}
+	h->finishing = true;
+	spdk_server_handoff_acquire(h);
+}
 
+static void spdk_server_handoff_started(void *arg) {
 
-typedef enum {
-	KVS_CMD_START = 0,
-	KVS_CMD_BSET = KVS_CMD_START,
-	KVS_CMD_BGET,
-	KVS_CMD_BDEL,
-	KVS_CMD_BMOD,
-	KVS_CMD_RSET,
-	KVS_CMD_RGET,
-	KVS_CMD_RDEL,
-	KVS_CMD_RMOD,
-	KVS_CMD_COUNT
-} kvs_cmd_t;
-
-const char *commands[] = {
-	"BSET", "BGET", "BDEL", "BMOD",
-	"RSET", "RGET", "RDEL", "RMOD",
-};
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	if (!ctx->stopping && spdk_server_listen_start(ctx) != 0) {
+		ctx->rc = -1;
+		spdk_server_stop(ctx);
+	}
+	spdk_server_handoff_wake(h, 0);
+}
 
+static void spdk_server_handoff_taken(void *arg) {
 
+	struct server_handoff_t *h = arg;
 
-static int kvs_split_tokens(char** tokens, char* msg) {
-	int count = 0;
-	char *token = strtok(msg, " ");
-	while (token != NULL) {
-		tokens[count++] = token;
-		token = strtok(NULL, " ");
+	h->ctx->handoff = NULL;
+	spdk_server_handoff_wake(h, 0);
+}
+
+static void spdk_server_handoff_exit(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	struct server_context_t *ctx = h->ctx;
+
+	ctx->handoff = NULL;
+	ctx->keep_paths = true;
+	ctx->rc = -1;
+	spdk_server_stop(ctx);
+	spdk_server_handoff_wake(h, 0);
+}
+
+static void spdk_server_shard_unreplay(kvs_shard_t *shard, void *arg) {
+
+	spdk_server_replay_stop(&g_server_shards[shard->index]);
+}
+
+// 接手失败就退出：先停掉重放，老进程等这边关了连接才回收日志。监听的端口在 stop 里关，在关连接之前，
+// 老进程等到连接关了就能重新监听。收到的 Unix socket 老进程手里也有，它会接着用，文件不能删
+static void spdk_server_handoff_failed(void *arg) {
+
+	if (kvs_shard_for_each(spdk_server_shard_unreplay, arg, spdk_server_handoff_exit) != 0) {
+		spdk_server_handoff_exit(arg);
 	}
+}
 
-	return count;
+static void *spdk_server_handoff_take(void *arg) {
+
+	struct server_handoff_t *h = arg;
+	kvs_handoff_msg_t m;
+	int rc;
+
+	if (kvs_handoff_send(h->fd, KVS_HANDOFF_HELLO, g_nshards, kvs_handoff_layout(), NULL, 0, NULL, 0) != 0 ||
+		kvs_handoff_recv(h->fd, KVS_HANDOFF_READY, &m, NULL, h->fds, &h->nfds) != 0) {
+		goto fail;
+	}
+	if (h->nfds <= KVS_HANDOFF_FD_HANDOFF) {
+		errno = EPROTO;
+		goto fail;
+	}
+	h->dir = (kvs_journal_dir_t *)(uintptr_t)m.arg;
+	h->tag = m.arg2;
+	rc = spdk_server_handoff_step(h, spdk_server_handoff_attach);
+	if (rc != 0) {
+		errno = rc < 0 ? -rc : EPROTO;
+		goto fail;
+	}
+
+	// 老进程遍历索引时照常服务，这边跟着装；它关了连接或者回了别的消息就不等了
+	if (spdk_server_handoff_watch(h) != 0) {
+		errno = EPIPE;
+		goto fail;
+	}
+	if (h->status != 0) {
+		errno = -h->status;
+		goto fail;
+	}
+	if (kvs_handoff_send(h->fd, KVS_HANDOFF_CAUGHT_UP, 0, 0, NULL, 0, NULL, 0) != 0 ||
+		kvs_handoff_recv(h->fd, KVS_HANDOFF_UNLISTENED, &m, NULL, NULL, NULL) != 0) {
+		goto fail;
+	}
+	rc = spdk_server_handoff_step(h, spdk_server_handoff_bind);
+	if (rc != 0) {
+		errno = -rc;
+		goto fail;
+	}
+	if (kvs_handoff_recv(h->fd, KVS_HANDOFF_SEALED, &m, NULL, NULL, NULL) != 0) {
+		goto fail;
+	}
+	rc = spdk_server_handoff_step(h, spdk_server_handoff_finish);
+	if (rc != 0) {
+		errno = rc < 0 ? -rc : EPROTO;
+		goto fail;
+	}
+
+	// 共享内存已经是自己的了，从这里开始不能再退回去
+	kvs_journal_dir_free(h->dir);
+	h->dir = NULL;
+	if (kvs_handoff_send(h->fd, KVS_HANDOFF_ACK, 0, 0, NULL, 0, NULL, 0) != 0) {
+		SPDK_ERRLOG("Cannot acknowledge the old process, errno %d: %s\n", errno, spdk_strerror(errno));
+	}
+	SPDK_NOTICELOG("Took over from the old process, accepting\n");
+	spdk_server_handoff_step(h, spdk_server_handoff_started);
+
+	spdk_server_handoff_step(h, spdk_server_handoff_taken);
+	spdk_server_handoff_free(h);
+	return NULL;
+
+fail:
+	SPDK_ERRLOG("Cannot take over from the running server, errno %d: %s\n", errno, spdk_strerror(errno));
+	spdk_server_handoff_step(h, spdk_server_handoff_failed);
+	spdk_server_handoff_free(h);
+	return NULL;
 }
 
-static int kvs_proto_parser(char *msg, char **tokens, int count) {
-	if (msg == NULL || tokens == NULL || count <= 0) return -1;
-	int cmd = 0;
-	for(cmd = 0; cmd < KVS_CMD_COUNT; cmd++) {
-		if (strcmp(tokens[0], commands[cmd]) == 0) {
-			break;
+// 启动时 -O 上有老进程在监听就去接手，返回 1；没有返回 0，照常启动
+static int spdk_server_handoff_connect(struct server_context_t *ctx) {
+
+	int fd = kvs_handoff_connect(ctx->handoff_path);
+	if (fd < 0) {
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			SPDK_NOTICELOG("No server to take over from on %s, starting empty\n", ctx->handoff_path);
+			return 0;
 		}
+		SPDK_ERRLOG("Cannot connect to %s, errno %d: %s\n", ctx->handoff_path, errno, spdk_strerror(errno));
+		return -1;
 	}
-	switch (cmd) {
-		case KVS_CMD_BSET:
-			break;
-		case KVS_CMD_BGET:
-			break;
-		case KVS_CMD_BDEL:
-			break;
-		case KVS_CMD_BMOD:
-			break;
-		case KVS_CMD_RSET:
-			break;
-		case KVS_CMD_RGET:
-			break;
-		case KVS_CMD_RDEL:
-			break;
-		case KVS_CMD_RMOD:
-			break;
+
+	if (spdk_server_handoff_start(ctx, fd, spdk_server_handoff_take) != 0) {
+		return -ENOMEM;
 	}
-	return 0;
+	SPDK_NOTICELOG("Taking over from the server on %s\n", ctx->handoff_path);
+	return 1;
 }
 
-static int kvs_proto_process(char *msg, ssize_t len) {
-	char *tokens[MAX_TOKENS] = { 0 };
-	int count = kvs_split_tokens(tokens, msg);
-	for (int i = 0; i < count; i++) {
-		printf("token %d : %s\n", i, tokens[i]);
+// 关掉等下一个进程的 Unix socket
+static void spdk_server_handoff_close(struct server_context_t *ctx) {
+
+	spdk_poller_unregister(&ctx->handoff_poller);
+	if (ctx->handoff_fd >= 0) {
+		close(ctx->handoff_fd);
+		ctx->handoff_fd = -1;
+		if (!ctx->keep_paths) {
+			unlink(ctx->handoff_path);
+		}
 	}
-	return kvs_proto_parser(msg, tokens, count);
 }
 
 /*
 #############
-spdk network
+stats
 #############
+
+每个 shard 的计数只在自己的线程上写，STATS 命令和 RPC 在任意线程上直接读，不发消息也不加锁
 */
 
-struct server_context_t {
+static int spdk_server_stats_poll(void *arg) {
 
-	char *host;
-	int port;
-	char *sock_impl_name;
+	struct server_shard_t *ss = arg;
+	kvs_stats_t *st = ss->stats;
+	uint64_t ops = st->ops;
 
-	int bytes_in;
-	int bytes_out;
-	
-	struct spdk_sock *sock;
-	struct spdk_sock_group *group;
+	__atomic_store_n(&st->ops_per_sec, ops - st->last_ops, __ATOMIC_RELAXED);
+	st->last_ops = ops;
 
-};
+	return SPDK_POLLER_BUSY;
+}
 
-// printf();
-// debug
+struct server_stats_sum {
+	uint64_t ttl_entries;	// 时间轮里的项数，包括过时的
+	uint64_t expired;		// 到期删掉的 key 数
+	uint64_t mem_bytes;		// 在内存里的 value 字节数
+	uint64_t cold_keys;		// value 只在 value log 里的 key 数
+	uint64_t ops;
+	uint64_t ops_per_sec;
+	uint64_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t conns_opened;
+	uint64_t conns_closed;
+};
 
-static void spdk_server_shutdown_callback(void) {
+static void spdk_server_stats_sum(struct server_stats_sum *sum) {
 
-	g_running = false;
+	memset(sum, 0, sizeof(*sum));
+	for (int i = 0; i < g_nshards; i++) {
+		kvs_stats_t *st = g_server_shards[i].stats;
+		if (st == NULL) continue;
 
+		sum->ops += kvs_stat_read(&st->ops);
+		sum->ops_per_sec += kvs_stat_read(&st->ops_per_sec);
+		sum->errors += kvs_stat_read(&st->errors);
+		sum->bytes_in += kvs_stat_read(&st->bytes_in);
+		sum->bytes_out += kvs_stat_read(&st->bytes_out);
+		sum->conns_opened += kvs_stat_read(&st->conns_opened);
+		sum->conns_closed += kvs_stat_read(&st->conns_closed);
+	}
+	for (int i = 0; i < g_nshards; i++) {
+		uint64_t entries, expired;
+		if (g_shards[i].engine == NULL) continue;
+
+		kvs_engine_ttl_stats(g_shards[i].engine, &entries, &expired);
+		sum->ttl_entries += entries;
+		sum->expired += expired;
+
+		uint64_t mem, cold;
+		kvs_engine_tier_stats(g_shards[i].engine, &mem, &cold);
+		sum->mem_bytes += mem;
+		sum->cold_keys += cold;
+	}
 }
 
-// -H 0.0.0.0 -P 8888 
-// static int spdk_server_app_parse(int ch, char *arg) {
+static void spdk_server_stats_latency(kvs_stat_cmd_t cmd, kvs_hist_t *h) {
 
-// 	printf("spdk_server_app_parse: %s\n", arg);
-// 	switch (ch) {
+	memset(h, 0, sizeof(*h));
+	for (int i = 0; i < g_nshards; i++) {
+		if (g_server_shards[i].stats) {
+			kvs_hist_merge(h, &g_server_shards[i].stats->latency[cmd]);
+		}
+	}
+}
 
-// 	case 'H':
-// 		g_host = arg;
-// 		break;
+static double spdk_server_ticks_to_us(uint64_t ticks) {
+	return (double)ticks * 1000000.0 / spdk_get_ticks_hz();
+}
 
-// 	case 'P':
-// 		g_port = spdk_strtol(arg, 10);
-// 		if (g_port < 0) {
-// 			SPDK_ERRLOG("Invalid port ID\n");
-// 			return g_port;
-// 		}
-// 		break;
+static int kvs_wbuf_printf(kvs_wbuf_t *b, const char *fmt, ...) {
 
-// 	case 'N':
-// 		g_sock_impl_name = arg; //-N posix or -N uring
-// 		break;
+	char line[256];
+	va_list ap;
 
-// 	default:
-// 		return -EINVAL;
-// 	}
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0) {
+		return -1;
+	}
+	return kvs_wbuf_append(b, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
 
-// 	return 0;
-// }
+static const char *kvs_engine_names[] = { "bptree", "rbtree", "htable", "skiplist" };
 
+struct server_hot_key {
+	kvs_hot_entry_t e;
+	int shard;
+};
 
-// help
-// static void spdk_server_app_usage(void) {
+// 合并每个 shard 的 top-k，取估计次数最高的 KVS_HOT_TOPK 个，按次数从高到低；顺便累加复制的统计
+static int spdk_server_hot_keys(struct server_hot_key *out, kvs_hot_stats_t *sum) {
 
-// 	printf("-H host_addr \n");
-// 	printf("-P host_port \n");
-// 	printf("-N sock_impl \n");
+	kvs_hot_entry_t top[KVS_HOT_TOPK];
+	int n = 0;
 
-// }
+	memset(sum, 0, sizeof(*sum));
+	for (int i = 0; i < g_nshards; i++) {
+		kvs_hot_t *hot = g_shards[i].hot;
+		if (hot == NULL) continue;
 
-static void spdk_server_callback(void *arg, struct spdk_sock_group *group, struct spdk_sock *sock) {
+		const kvs_hot_stats_t *st = kvs_hot_get_stats(hot);
+		sum->replicated += kvs_stat_read(&st->replicated);
+		sum->invalidated += kvs_stat_read(&st->invalidated);
+		sum->replica_hits += kvs_stat_read(&st->replica_hits);
 
-	struct server_context_t *ctx = arg;
-	char buf[BUFFER_SIZE] = { 0 };
-	struct iovec iov;
-	
-	ssize_t n =  spdk_sock_recv(sock, buf, sizeof(buf));
-	if (n < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			SPDK_ERRLOG("spdk_sock_recv failed, errno %d: %s",
-				errno, spdk_strerror(errno));
-			return ;
+		int m = kvs_hot_snapshot(hot, top, KVS_HOT_TOPK);
+		for (int j = 0; j < m; j++) {
+			if (n == KVS_HOT_TOPK && top[j].count <= out[n - 1].e.count) {
+				break;
+			}
+			int pos = n < KVS_HOT_TOPK ? n++ : n - 1;
+			for (; pos > 0 && out[pos - 1].e.count < top[j].count; pos--) {
+				out[pos] = out[pos - 1];
+			}
+			out[pos].e = top[j];
+			out[pos].shard = i;
 		}
-		
-		SPDK_ERRLOG("spdk_sock_recv failed, errno %d: %s",
-				errno, spdk_strerror(errno));
-	} else if (n == 0) {
+	}
+	return n;
+}
 
-		SPDK_NOTICELOG("Connection closed\n");
-		spdk_sock_group_remove_sock(group, sock);
-		spdk_sock_close(&sock);
+// key 是任意字节，显示时不可打印的字符和分隔符换成 '?'
+static void spdk_server_hot_key_str(char *buf, const kvs_hot_entry_t *e) {
 
-		return ;
+	for (int i = 0; i < e->len; i++) {
+		char c = e->key[i];
+		buf[i] = c > ' ' && c < 0x7f && c != ',' ? c : '?';
+	}
+	buf[e->len] = '\0';
+}
 
-	} else { 
-		printf("ret: %ld, recv: %s\n", n, buf);
-		kvs_proto_process(buf, n);
-		ctx->bytes_in += n;
+// 和 Redis INFO 一样的 "name:value" 行
+static kvs_value_t *spdk_server_stats_value(void) {
+
+	struct server_stats_sum sum;
+	struct server_hot_key hot[KVS_HOT_TOPK];
+	kvs_hot_stats_t hs;
+	char key[KVS_HOT_KEY_MAX + 1];
+	kvs_hist_t h;
+	kv_slab_class_stats_t slab[KV_SLAB_MAX_CLASSES];
+	kvs_wbuf_t b;
+	int rc = 0;
+
+	if (kvs_wbuf_init(&b, KVS_WBUF_INIT_SIZE) < 0) {
+		return NULL;
+	}
 
-		iov.iov_base = buf;
-		iov.iov_len = n;
+	spdk_server_stats_sum(&sum);
+	rc |= kvs_wbuf_printf(&b, "# Stats\r\n");
+	rc |= kvs_wbuf_printf(&b, "shards:%d\r\n", g_nshards);
+	rc |= kvs_wbuf_printf(&b, "skiplist_keys:%zu\r\n", g_slist ? kvs_slist_count(g_slist) : 0);
+	rc |= kvs_wbuf_printf(&b, "connected_clients:%" PRIu64 "\r\n", sum.conns_opened - sum.conns_closed);
+	rc |= kvs_wbuf_printf(&b, "total_connections:%" PRIu64 "\r\n", sum.conns_opened);
+	rc |= kvs_wbuf_printf(&b, "total_commands:%" PRIu64 "\r\n", sum.ops);
+	rc |= kvs_wbuf_printf(&b, "ops_per_sec:%" PRIu64 "\r\n", sum.ops_per_sec);
+	rc |= kvs_wbuf_printf(&b, "errors:%" PRIu64 "\r\n", sum.errors);
+	rc |= kvs_wbuf_printf(&b, "bytes_in:%" PRIu64 "\r\n", sum.bytes_in);
+	rc |= kvs_wbuf_printf(&b, "bytes_out:%" PRIu64 "\r\n", sum.bytes_out);
+
+	rc |= kvs_wbuf_printf(&b, "# Latency\r\n");
+	for (int c = 0; c < KVS_STAT_COUNT; c++) {
+		spdk_server_stats_latency(c, &h);
+		if (h.count == 0) continue;
+
+		rc |= kvs_wbuf_printf(&b, "latency_%s:calls=%" PRIu64 ",p50_us=%.2f,p99_us=%.2f,p999_us=%.2f,max_us=%.2f\r\n",
+			kvs_stat_names[c], h.count,
+			spdk_server_ticks_to_us(kvs_hist_percentile(&h, 0.5)),
+			spdk_server_ticks_to_us(kvs_hist_percentile(&h, 0.99)),
+			spdk_server_ticks_to_us(kvs_hist_percentile(&h, 0.999)),
+			spdk_server_ticks_to_us(h.max));
+	}
+
+	rc |= kvs_wbuf_printf(&b, "# TTL\r\n");
+	rc |= kvs_wbuf_printf(&b, "ttl_entries:%" PRIu64 "\r\n", sum.ttl_entries);
+	rc |= kvs_wbuf_printf(&b, "expired_keys:%" PRIu64 "\r\n", sum.expired);
+
+	// used 和 capacity 是字节数，两者的差就是 class 里空着的内存
+	int nslab = kv_slab_get_stats(slab, KV_SLAB_MAX_CLASSES);
+	uint64_t slab_pages = 0, slab_used = 0, slab_capacity = 0, slab_reclaimed = 0;
+	for (int i = 0; i < nslab; i++) {
+		slab_pages += slab[i].pages;
+		slab_used += slab[i].used * slab[i].size;
+		slab_capacity += slab[i].capacity * slab[i].size;
+		slab_reclaimed += slab[i].reclaimed;
+	}
+	rc |= kvs_wbuf_printf(&b, "# Slab\r\n");
+	rc |= kvs_wbuf_printf(&b, "slab_pages:%" PRIu64 "\r\n", slab_pages);
+	rc |= kvs_wbuf_printf(&b, "slab_pool_pages:%d\r\n", kv_slab_pool_pages());
+	rc |= kvs_wbuf_printf(&b, "slab_used_bytes:%" PRIu64 "\r\n", slab_used);
+	rc |= kvs_wbuf_printf(&b, "slab_capacity_bytes:%" PRIu64 "\r\n", slab_capacity);
+	rc |= kvs_wbuf_printf(&b, "slab_reclaimed_pages:%" PRIu64 "\r\n", slab_reclaimed);
+	for (int i = 0; i < nslab; i++) {
+		if (slab[i].pages == 0) continue;
+
+		rc |= kvs_wbuf_printf(&b, "slab_class_%d:pages=%" PRIu64 ",used=%" PRIu64 ",capacity=%" PRIu64
+			",reclaimed=%" PRIu64 "\r\n", slab[i].size, slab[i].pages, slab[i].used, slab[i].capacity,
+			slab[i].reclaimed);
+	}
 
-		int n = spdk_sock_writev(sock, &iov, 1);
-		if (n > 0) {
-			ctx->bytes_out += n;
+	if (g_hot && g_nshards > 1) {
+		int nhot = spdk_server_hot_keys(hot, &hs);
+		rc |= kvs_wbuf_printf(&b, "# Hot keys\r\n");
+		rc |= kvs_wbuf_printf(&b, "hot_replicated:%" PRIu64 "\r\n", hs.replicated);
+		rc |= kvs_wbuf_printf(&b, "hot_invalidated:%" PRIu64 "\r\n", hs.invalidated);
+		rc |= kvs_wbuf_printf(&b, "hot_replica_hits:%" PRIu64 "\r\n", hs.replica_hits);
+		for (int i = 0; i < nhot; i++) {
+			spdk_server_hot_key_str(key, &hot[i].e);
+			rc |= kvs_wbuf_printf(&b, "hot_key_%d:key=%s,engine=%s,shard=%d,reads=%u,replicated=%d\r\n",
+				i, key, kvs_engine_names[hot[i].e.engine], hot[i].shard, hot[i].e.count, hot[i].e.replicated);
 		}
-		return ;
-	}  
+	}
 
-	// assert(0);
-	
-	return ;
+	if (g_wal) {
+		kvs_wal_stats_t ws = {};
+		uint64_t used = 0, size = 0;
+		for (int i = 0; i < g_nshards; i++) {
+			if (g_shards[i].wal == NULL) continue;
+			const kvs_wal_stats_t *st = kvs_wal_get_stats(g_shards[i].wal);
+			ws.records += kvs_stat_read(&st->records);
+			ws.batches += kvs_stat_read(&st->batches);
+			ws.bytes += kvs_stat_read(&st->bytes);
+			ws.bytes_written += kvs_stat_read(&st->bytes_written);
+			used += kvs_wal_used(g_shards[i].wal);
+			size += kvs_wal_size(g_shards[i].wal);
+		}
+		rc |= kvs_wbuf_printf(&b, "# WAL\r\n");
+		rc |= kvs_wbuf_printf(&b, "wal_records:%" PRIu64 "\r\n", ws.records);
+		rc |= kvs_wbuf_printf(&b, "wal_batches:%" PRIu64 "\r\n", ws.batches);
+		rc |= kvs_wbuf_printf(&b, "wal_bytes:%" PRIu64 "\r\n", ws.bytes);
+		rc |= kvs_wbuf_printf(&b, "wal_bytes_written:%" PRIu64 "\r\n", ws.bytes_written);
+		rc |= kvs_wbuf_printf(&b, "wal_used:%" PRIu64 "\r\n", used);
+		rc |= kvs_wbuf_printf(&b, "wal_size:%" PRIu64 "\r\n", size);
+	}
+
+	if (g_tier_mb) {
+		kvs_vlog_stats_t vs = {};
+		uint64_t used = 0, size = 0;
+		for (int i = 0; i < g_nshards; i++) {
+			if (g_shards[i].vlog == NULL) continue;
+			const kvs_vlog_stats_t *st = kvs_vlog_get_stats(g_shards[i].vlog);
+			vs.evicted += kvs_stat_read(&st->evicted);
+			vs.evicted_bytes += kvs_stat_read(&st->evicted_bytes);
+			vs.zcopy += kvs_stat_read(&st->zcopy);
+			vs.reads += kvs_stat_read(&st->reads);
+			vs.coalesced += kvs_stat_read(&st->coalesced);
+			vs.read_bytes += kvs_stat_read(&st->read_bytes);
+			vs.relocated += kvs_stat_read(&st->relocated);
+			vs.reclaimed += kvs_stat_read(&st->reclaimed);
+			used += kvs_vlog_used(g_shards[i].vlog);
+			size += kvs_vlog_size(g_shards[i].vlog);
+		}
+		rc |= kvs_wbuf_printf(&b, "# Tiering\r\n");
+		rc |= kvs_wbuf_printf(&b, "mem_budget:%" PRIu64 "\r\n", g_tier_mb << 20);
+		rc |= kvs_wbuf_printf(&b, "mem_bytes:%" PRIu64 "\r\n", sum.mem_bytes);
+		rc |= kvs_wbuf_printf(&b, "cold_keys:%" PRIu64 "\r\n", sum.cold_keys);
+		rc |= kvs_wbuf_printf(&b, "vlog_evicted:%" PRIu64 "\r\n", vs.evicted);
+		rc |= kvs_wbuf_printf(&b, "vlog_evicted_bytes:%" PRIu64 "\r\n", vs.evicted_bytes);
+		rc |= kvs_wbuf_printf(&b, "vlog_zcopy:%" PRIu64 "\r\n", vs.zcopy);
+		rc |= kvs_wbuf_printf(&b, "vlog_reads:%" PRIu64 "\r\n", vs.reads);
+		rc |= kvs_wbuf_printf(&b, "vlog_coalesced:%" PRIu64 "\r\n", vs.coalesced);
+		rc |= kvs_wbuf_printf(&b, "vlog_read_bytes:%" PRIu64 "\r\n", vs.read_bytes);
+		rc |= kvs_wbuf_printf(&b, "vlog_relocated:%" PRIu64 "\r\n", vs.relocated);
+		rc |= kvs_wbuf_printf(&b, "vlog_reclaimed:%" PRIu64 "\r\n", vs.reclaimed);
+		rc |= kvs_wbuf_printf(&b, "vlog_used:%" PRIu64 "\r\n", used);
+		rc |= kvs_wbuf_printf(&b, "vlog_size:%" PRIu64 "\r\n", size);
+	}
+
+	kvs_value_t *v = rc == 0 ? kvs_value_create(b.data, b.len) : NULL;
+	kvs_wbuf_free(&b);
+	return v;
 }
 
+static uint64_t spdk_server_ticks_to_ns(uint64_t ticks) {
+	return (uint64_t)((double)ticks * 1000000000.0 / spdk_get_ticks_hz());
+}
 
-// 
-static int spdk_server_accept(void *arg) {
+// scripts/rpc.py 可以用 -> rpc.py kvs_get_stats
+static void rpc_kvs_get_stats(struct spdk_jsonrpc_request *request, const struct spdk_json_val *params) {
 
-	struct server_context_t *ctx = arg;
-	char saddr[ADDR_STR_LEN], caddr[ADDR_STR_LEN];
-	uint16_t sport, cport;
-	int count = 0;
+	struct server_stats_sum sum;
+	struct server_hot_key hot[KVS_HOT_TOPK];
+	kvs_hot_stats_t hs;
+	char key[KVS_HOT_KEY_MAX + 1];
+	kvs_hist_t h;
 
-	// printf("spdk_server_accept\n");
-	if (!g_running) {
-		//...
-	} 
+	if (params != NULL) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INVALID_PARAMS,
+			"kvs_get_stats requires no parameters");
+		return ;
+	}
 
-	while (1) {
-		// accept
-		struct spdk_sock *client_sock = spdk_sock_accept(ctx->sock);
-		if (client_sock == NULL)	{
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				
-			}
-			break;
-		}
+	spdk_server_stats_sum(&sum);
+
+	struct spdk_json_write_ctx *w = spdk_jsonrpc_begin_result(request);
+	spdk_json_write_object_begin(w);
+	spdk_json_write_named_uint32(w, "shards", g_nshards);
+	spdk_json_write_named_uint64(w, "connected_clients", sum.conns_opened - sum.conns_closed);
+	spdk_json_write_named_uint64(w, "total_connections", sum.conns_opened);
+	spdk_json_write_named_uint64(w, "total_commands", sum.ops);
+	spdk_json_write_named_uint64(w, "ops_per_sec", sum.ops_per_sec);
+	spdk_json_write_named_uint64(w, "errors", sum.errors);
+	spdk_json_write_named_uint64(w, "bytes_in", sum.bytes_in);
+	spdk_json_write_named_uint64(w, "bytes_out", sum.bytes_out);
+	spdk_json_write_named_uint64(w, "ttl_entries", sum.ttl_entries);
+	spdk_json_write_named_uint64(w, "expired_keys", sum.expired);
+	spdk_json_write_named_uint64(w, "mem_bytes", sum.mem_bytes);
+	spdk_json_write_named_uint64(w, "cold_keys", sum.cold_keys);
+
+	spdk_json_write_named_object_begin(w, "latency_ns");
+	for (int c = 0; c < KVS_STAT_COUNT; c++) {
+		spdk_server_stats_latency(c, &h);
+		if (h.count == 0) continue;
+
+		spdk_json_write_named_object_begin(w, kvs_stat_names[c]);
+		spdk_json_write_named_uint64(w, "calls", h.count);
+		spdk_json_write_named_uint64(w, "p50", spdk_server_ticks_to_ns(kvs_hist_percentile(&h, 0.5)));
+		spdk_json_write_named_uint64(w, "p99", spdk_server_ticks_to_ns(kvs_hist_percentile(&h, 0.99)));
+		spdk_json_write_named_uint64(w, "p999", spdk_server_ticks_to_ns(kvs_hist_percentile(&h, 0.999)));
+		spdk_json_write_named_uint64(w, "max", spdk_server_ticks_to_ns(h.max));
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_object_end(w);
+
+	spdk_json_write_named_array_begin(w, "per_shard");
+	for (int i = 0; i < g_nshards; i++) {
+		kvs_stats_t *st = g_server_shards[i].stats;
+		if (st == NULL) continue;
+
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_uint32(w, "shard", i);
+		spdk_json_write_named_uint32(w, "core", g_shards[i].core);
+		spdk_json_write_named_uint64(w, "total_commands", kvs_stat_read(&st->ops));
+		spdk_json_write_named_uint64(w, "ops_per_sec", kvs_stat_read(&st->ops_per_sec));
+		spdk_json_write_named_uint64(w, "connected_clients",
+			kvs_stat_read(&st->conns_opened) - kvs_stat_read(&st->conns_closed));
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_array_end(w);
+
+	int nhot = spdk_server_hot_keys(hot, &hs);
+	spdk_json_write_named_uint64(w, "hot_replicated", hs.replicated);
+	spdk_json_write_named_uint64(w, "hot_invalidated", hs.invalidated);
+	spdk_json_write_named_uint64(w, "hot_replica_hits", hs.replica_hits);
+	spdk_json_write_named_array_begin(w, "hot_keys");
+	for (int i = 0; i < nhot; i++) {
+		spdk_server_hot_key_str(key, &hot[i].e);
+		spdk_json_write_object_begin(w);
+		spdk_json_write_named_string(w, "key", key);
+		spdk_json_write_named_string(w, "engine", kvs_engine_names[hot[i].e.engine]);
+		spdk_json_write_named_uint32(w, "shard", hot[i].shard);
+		spdk_json_write_named_uint32(w, "reads", hot[i].e.count);
+		spdk_json_write_named_bool(w, "replicated", hot[i].e.replicated);
+		spdk_json_write_object_end(w);
+	}
+	spdk_json_write_array_end(w);
 
-		//getpeeraddr();
-		int rc = spdk_sock_getaddr(client_sock, saddr, sizeof(saddr), &sport, 
-				caddr, sizeof(caddr), &cport);
-		if (rc < 0) {
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(request, w);
+}
+SPDK_RPC_REGISTER("kvs_get_stats", rpc_kvs_get_stats, SPDK_RPC_RUNTIME)
 
-			SPDK_ERRLOG("Cannot get connection address\n");
-			spdk_sock_close(&ctx->sock);
-			return SPDK_POLLER_IDLE;
+struct rpc_kvs_checkpoint_ctx {
+	struct spdk_jsonrpc_request *request;
+	int started;
+	int busy;
+};
 
-		}
+static void rpc_kvs_checkpoint_shard(kvs_shard_t *shard, void *arg) {
+	struct rpc_kvs_checkpoint_ctx *ctx = arg;
+	int rc = kvs_shard_checkpoint(shard);
 
-		rc = spdk_sock_group_add_sock(ctx->group, client_sock, 
-			spdk_server_callback, ctx);
-		if (rc < 0) {
+	if (rc == 0) {
+		ctx->started++;
+	} else if (rc == -EBUSY) {
+		ctx->busy++;
+	}
+}
 
-			SPDK_ERRLOG("Cannot get connection address\n");
-			spdk_sock_close(&client_sock);
-			return SPDK_POLLER_IDLE;
+static void rpc_kvs_checkpoint_done(void *arg) {
+	struct rpc_kvs_checkpoint_ctx *ctx = arg;
 
-		}
+	struct spdk_json_write_ctx *w = spdk_jsonrpc_begin_result(ctx->request);
+	spdk_json_write_object_begin(w);
+	spdk_json_write_named_uint32(w, "started", ctx->started);
+	spdk_json_write_named_uint32(w, "busy", ctx->busy);
+	spdk_json_write_object_end(w);
+	spdk_jsonrpc_end_result(ctx->request, w);
+	free(ctx);
+}
 
-		count ++;
+// rpc.py kvs_checkpoint：让每个 shard 马上开始写 checkpoint，不等写完就返回，进度看日志
+static void rpc_kvs_checkpoint(struct spdk_jsonrpc_request *request, const struct spdk_json_val *params) {
 
+	if (params != NULL) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INVALID_PARAMS,
+			"kvs_checkpoint requires no parameters");
+		return ;
+	}
+	if (!g_wal) {
+		spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INVALID_STATE,
+			"WAL is not enabled (-W)");
+		return ;
 	}
 
-	return count > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+	struct rpc_kvs_checkpoint_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		spdk_jsonrpc_send_error_response(request, -ENOMEM, spdk_strerror(ENOMEM));
+		return ;
+	}
+	ctx->request = request;
+	if (kvs_shard_for_each(rpc_kvs_checkpoint_shard, ctx, rpc_kvs_checkpoint_done) != 0) {
+		spdk_jsonrpc_send_error_response(request, -ENOMEM, spdk_strerror(ENOMEM));
+		free(ctx);
+	}
 }
+SPDK_RPC_REGISTER("kvs_checkpoint", rpc_kvs_checkpoint, SPDK_RPC_RUNTIME)
 
+// 在每个 shard 线程上创建 sock group 和 poller
+static void spdk_server_shard_init(kvs_shard_t *shard, void *arg) {
 
-static int spdk_server_group_poll(void *arg) {
+	struct server_context_t *ctx = arg;
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+
+	ss->shard = shard;
+	TAILQ_INIT(&ss->conns);
+	TAILQ_INIT(&ss->dirty);
+	TAILQ_INIT(&ss->shm_conns);
+
+	ss->ops = calloc(KVS_REQ_MAX_OPS, sizeof(kvs_op_t));
+	ss->batch = calloc(KVS_REQ_MAX_OPS, sizeof(kvs_op_t *));
+	ss->stats = calloc(1, sizeof(kvs_stats_t));
+	ss->group = spdk_sock_group_create(NULL); //epoll
+	if (ss->ops == NULL || ss->batch == NULL || ss->stats == NULL || ss->group == NULL) {
+		SPDK_ERRLOG("Cannot create sock group on shard %d\n", shard->index);
+		ctx->rc = -1;
+		return ;
+	}
+	ss->group_poller = SPDK_POLLER_REGISTER(spdk_server_group_poll, ss, 0);
+	ss->stats_poller = SPDK_POLLER_REGISTER(spdk_server_stats_poll, ss, 1000 * 1000);
+	if (ctx->shm_path) {
+		ss->shm_poller = SPDK_POLLER_REGISTER(spdk_server_shm_poll, ss, 0);
+		ss->shm_check_poller = SPDK_POLLER_REGISTER(spdk_server_shm_check, ss, KVS_SHM_CHECK_US);
+	}
+}
+
+static void spdk_server_shard_fini(kvs_shard_t *shard, void *arg) {
 
 	struct server_context_t *ctx = arg;
+	struct server_shard_t *ss = &g_server_shards[shard->index];
+	struct server_conn_t *conn, *tmp;
 
-	int rc = spdk_sock_group_poll(ctx->group);
-	if (rc < 0) {
-		SPDK_ERRLOG("Failed to poll sock_group = %p\n", ctx->group);
+	if (ctx->listen_shard == ss) {
+		spdk_server_listen_close(ctx);
+	}
+
+	TAILQ_FOREACH_SAFE(conn, &ss->conns, link, tmp) {
+		if (!conn->closed) {
+			spdk_server_conn_close(conn);
+		}
+	}
+
+	spdk_poller_unregister(&ss->group_poller);
+	spdk_poller_unregister(&ss->stats_poller);
+	spdk_poller_unregister(&ss->shm_poller);
+	spdk_poller_unregister(&ss->shm_check_poller);
+	spdk_poller_unregister(&ss->journal_poller);
+	kvs_journal_close(shard->journal);
+	shard->journal = NULL;
+	spdk_server_replay_stop(ss);
+	if (ss->group) {
+		spdk_sock_group_close(&ss->group);
 	}
-	return rc > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+	free(ss->ops);
+	ss->ops = NULL;
+	free(ss->batch);
+	ss->batch = NULL;
+	free(ss->iov);
+	ss->iov = NULL;
+	ss->iov_size = 0;
 }
 
+static void spdk_server_stopped(void *arg) {
 
-// spdk sock 
-static int spdk_server_listen(struct server_context_t *ctx) {
+	struct server_context_t *ctx = arg;
 
-	ctx->sock = spdk_sock_listen(ctx->host, ctx->port, ctx->sock_impl_name);
-	if (ctx->sock == NULL) {
-		SPDK_ERRLOG("Cannot create server socket");
-		return -1;
+	// RPC 也在 app 线程上读统计，这里释放不会冲突
+	for (int i = 0; i < g_nshards; i++) {
+		free(g_server_shards[i].stats);
+		g_server_shards[i].stats = NULL;
+	}
+	// shard 的 WAL、value log 和 qpair 已经在 kvs_shard_fini 里释放
+	if (g_wal || g_tier_mb) {
+		kvs_nvme_detach();
+	}
+	// 所有 shard 都停了，没有线程再释放它们缓存里的对象
+	kv_slab_cache_reap();
+	// 页池里的 DMA 页在 SPDK 的内存释放之前还掉
+	if (g_tier_mb) {
+		kv_slab_use_backend(NULL);
 	}
 
-	ctx->group = spdk_sock_group_create(NULL); //epoll
+	spdk_app_stop(ctx->rc);
+}
 
-	g_running = true;
+static void spdk_server_shards_closed(void *arg) {
 
-	SPDK_POLLER_REGISTER(spdk_server_accept, ctx, 2000 * 1000);
-	SPDK_POLLER_REGISTER(spdk_server_group_poll, ctx, 0);
+	kvs_shards_stop(spdk_server_stopped, arg);
+}
 
-	printf("spdk_server_listen\n");
+// 先停 accept，再关闭每个 shard 上的连接，最后销毁 shard；accept 在 shard 0 的 fini 里最先停掉
+static void spdk_server_stop(struct server_context_t *ctx) {
 
-	return 0;
+	if (ctx->stopping) {
+		return ;
+	}
+	ctx->stopping = true;
+	g_running = false;
+
+	// 监听 socket 交出去之后由 listen_shard 在 shard_fini 里关
+	if (ctx->listen_shard == NULL) {
+		if (ctx->sock) {
+			spdk_sock_close(&ctx->sock);
+		}
+		spdk_server_shm_listen_close(ctx);
+	}
+	spdk_server_handoff_close(ctx);
+	spdk_poller_unregister(&ctx->region_poller);
+
+	if (g_nshards == 0 ||
+		kvs_shard_for_each(spdk_server_shard_fini, ctx, spdk_server_shards_closed) != 0) {
+		spdk_app_stop(ctx->rc);
+	}
 }
 
+static void spdk_server_shutdown_callback(void) {
 
-static void sdpk_server_start(void *arg) {
+	spdk_server_stop(g_server_ctx);
+
+}
+
+static void spdk_server_shards_ready(void *arg) {
 
 	struct server_context_t *ctx = arg;
-	
-	printf("sdpk_server_start\n");
-	int rc = spdk_server_listen(ctx);
-	if (rc) {
-		spdk_app_stop(-1);
-	}
+	int rc = ctx->rc;
 
-	return ;
+	// 有老进程时从它那里接过数据，接完了再 accept；没有时自己建共享内存，等下一个进程来接
+	if (rc == 0 && ctx->handoff_path) {
+		rc = spdk_server_handoff_connect(ctx);
+		if (rc > 0) {
+			return ;
+		}
+		if (rc == 0) {
+			rc = spdk_server_region_create(ctx);
+		}
+	}
+	if (rc != 0 || spdk_server_listen(ctx) != 0) {
+		ctx->rc = -1;
+		spdk_server_stop(ctx);
+	}
 }
 
-#if 0
-int main(int argc, char *argv[]) {
+static void spdk_server_shards_started(void *arg, int rc) {
 
-	struct spdk_app_opts opts = {};
+	struct server_context_t *ctx = arg;
 
-	spdk_app_opts_init(&opts, sizeof(opts));
-	opts.name = "spdk_server";
-	opts.shutdown_cb = spdk_server_shutdown_callback;
-    opts.reactor_mask = "0x1";  // 使用第一个核
-    opts.mem_size = 512;        // 512MB内存
-    opts.no_huge = true;
+	if (rc != 0) {
+		ctx->rc = rc;
+		spdk_server_stop(ctx);
+		return ;
+	}
 
-	printf("spdk_app_parse_args\n");
-	spdk_app_parse_args(argc, argv, &opts, "H:P:N:SVzZ", NULL,
-		spdk_server_app_parse, spdk_server_app_usage);
+	if (kvs_shard_for_each(spdk_server_shard_init, ctx, spdk_server_shards_ready) != 0) {
+		ctx->rc = -ENOMEM;
+		spdk_server_stop(ctx);
+	}
+}
 
-	printf("spdk_app_parse_args 11\n");
-	struct server_context_t server_context = {};
-	// server_context.host = g_host;
-	// server_context.port = g_port;
-	// server_context.sock_impl_name = g_sock_impl_name;
+static void *spdk_server_dma_alloc(size_t size, size_t align) {
+	return spdk_malloc(size, align, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+}
+
+// value 的 slab 页从大页上分配，换出时 value 直接放进写命令，不用拷到批里
+static const kv_slab_backend_t g_dma_backend = {
+	.alloc = spdk_server_dma_alloc,
+	.free = spdk_free,
+};
+
+static void sdpk_server_start(void *arg) {
+
+	struct server_context_t *ctx = arg;
 	
-	server_context.host = "0.0.0.0";
-	server_context.port = 8888;
-	server_context.sock_impl_name = "posix";
-	printf("host: %s, port: %d, impl_name: %s\n", g_host, g_port, g_sock_impl_name);
-	//sdpk_server_start(&server_context);
+	printf("sdpk_server_start\n");
+	g_server_ctx = ctx;
+	ctx->app_thread = spdk_get_thread();
+
+	if (g_wal || g_tier_mb) {
+		struct spdk_nvme_ctrlr *ctrlr;
+		struct spdk_nvme_ns *ns;
+		if (kvs_nvme_probe(&ctrlr, &ns) != 0) {
+			SPDK_ERRLOG("No NVMe namespace for %s\n", g_wal ? "WAL" : "value log");
+			ctx->rc = -ENODEV;
+			spdk_app_stop(ctx->rc);
+			return ;
+		}
+		if (g_wal) {
+			kvs_shards_use_nvme(ctrlr, ns);
+		} else {
+			kvs_shards_use_tiering(ctrlr, ns, g_tier_mb << 20);
+			kv_slab_use_backend(&g_dma_backend);
+		}
+	}
+
+	kvs_shards_use_hot(g_hot);
 
-	int rc = spdk_app_start(&opts, sdpk_server_start, &server_context); // ?
+	// reactor_mask 里的每个核一个 shard
+	int rc = kvs_shards_start(spdk_server_shards_started, ctx);
 	if (rc) {
-		SPDK_ERRLOG("Error starting application\n");
+		SPDK_ERRLOG("Cannot start kv shards\n");
+		ctx->rc = rc;
+		spdk_server_stop(ctx);
 	}
 
-	spdk_app_fini();
+	return ;
 }
-#elif 1
-void start_server(void) {
+
+// -m 0xf 启动 4 个 reactor，keyspace 按 hash 分成 4 个 shard
+void start_server(int argc, char *argv[]) {
 	struct spdk_app_opts opts = {};
 
 	spdk_app_opts_init(&opts, sizeof(opts));
 	opts.name = "spdk_server";
 	opts.shutdown_cb = spdk_server_shutdown_callback;
-    opts.reactor_mask = "0x1";  // 使用第一个核
+    opts.reactor_mask = "0x1";  // 默认使用第一个核，-m 覆盖
     opts.mem_size = 512;        // 512MB内存
     opts.no_huge = true;
 
+	int rc = spdk_app_parse_args(argc, argv, &opts, "H:P:N:WT:K:U:O:", NULL,
+		spdk_server_app_parse, spdk_server_app_usage);
+	if (rc != SPDK_APP_PARSE_ARGS_SUCCESS) {
+		return;
+	}
+	// 换出的 value 重启后就没了，checkpoint 也装不下比内存大的数据集，两个不能一起开
+	if (g_wal && g_tier_mb) {
+		SPDK_ERRLOG("-T cannot be used together with -W\n");
+		return;
+	}
+	// 交接时只传内存里的数据，WAL 和 value log 的盘上位置不跟着走
+	if (g_handoff_path && (g_wal || g_tier_mb)) {
+		SPDK_ERRLOG("-O cannot be used together with -W or -T\n");
+		return;
+	}
+	// NVMe 的 DMA 内存要用大页
+	if (g_wal || g_tier_mb) {
+		opts.no_huge = false;
+	}
+	// 分层时 value 也放在大页上，预算之外再留 1/4 给 slab 的碎片和正在换出的 value；大页不够时 slab 退回普通内存
+	if (g_tier_mb) {
+		opts.mem_size += g_tier_mb + g_tier_mb / 4;
+	}
+
 	struct server_context_t server_context = {};
 	
-	server_context.host = "0.0.0.0";
-	server_context.port = 8888;
-	server_context.sock_impl_name = "posix";
-	// printf("host: %s, port: %d, impl_name: %s\n", g_host, g_port, g_sock_impl_name);
+	server_context.host = g_host;
+	server_context.port = g_port;
+	server_context.sock_impl_name = g_sock_impl_name;
+	server_context.shm_path = g_shm_path;
+	server_context.shm_fd = -1;
+	server_context.handoff_path = g_handoff_path;
+	server_context.handoff_fd = -1;
+	printf("host: %s, port: %d, impl_name: %s\n", g_host, g_port, g_sock_impl_name);
 
-	int rc = spdk_app_start(&opts, sdpk_server_start, &server_context); // ?
+	rc = spdk_app_start(&opts, sdpk_server_start, &server_context); // ?
 	if (rc) {
 		SPDK_ERRLOG("Error starting application\n");
 	}
@@ -367,6 +4078,3 @@ void start_server(void) {
 	return;	
 }
 
-#endif
-
-
@@ -2,8 +2,14 @@
 extern "C" {
 #endif
 
-void start_server(void);
+void start_server(int argc, char *argv[]);
+
+// kv_main.cpp：-W 时在 app 线程上 probe 第一个 NVMe namespace 给 WAL 用，退出时 detach
+struct spdk_nvme_ctrlr;
+struct spdk_nvme_ns;
+int kvs_nvme_probe(struct spdk_nvme_ctrlr **ctrlr, struct spdk_nvme_ns **ns);
+void kvs_nvme_detach(void);
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
@@ -1,89 +1,885 @@
+// KV 服务的压测客户端：YCSB A~F 的读写比例和 key 分布，走二进制协议。
+// 每个线程一个 epoll 和若干连接，每个连接上最多 depth 个请求在路上，回复按请求顺序到达。
+//
+// 给了 -R 时按固定速率开环发请求：第 i 个请求本该在 start + i / rate 发出，
+// 延迟从这个时间算起，连接都占满时排队等的时间也算进去，服务端卡顿不会被 coordinated omission 藏掉；
+// 同时单独统计从真正发出到收到回复的 service time。不给 -R 时是闭环，连接一直压满。
+//
+// 用法: ./client [-H host] [-P port] [-t threads] [-c conns_per_thread] [-d depth]
+//               [-w a|b|c|d|e|f] [-n records] [-o ops | -T seconds] [-R ops_per_sec]
+//               [-D uniform|zipfian|latest] [-V fixed:N|uniform:MIN-MAX|zipfian:MIN-MAX]
+//               [-S max_scan_len] [-L | -l] [-j result.json] [-s seed]
+// -L 跳过装载阶段（数据已经在了），-l 只装载不跑
 #include <iostream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
 #include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
-int main(int argc, char* argv[]) {
-    // 默认连接参数
+#include "kvs_proto.h"
+#include "kvs_stats.h"
+
+enum op_type {
+    OP_READ = 0,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,
+    OP_RMW,
+    OP_LOAD,        // 装载阶段，一个 MSET 带 load_batch 个 key
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "read", "update", "insert", "scan", "read_modify_write", "load",
+};
+
+enum key_dist { DIST_UNIFORM, DIST_ZIPFIAN, DIST_LATEST };
+static const char *dist_names[] = { "uniform", "zipfian", "latest" };
+
+struct workload {
+    char name;
+    double mix[OP_COUNT];   // read, update, insert, scan, rmw
+    key_dist dist;
+};
+
+// YCSB core workloads
+static const workload workloads[] = {
+    { 'a', { 0.50, 0.50, 0,    0,    0    }, DIST_ZIPFIAN },
+    { 'b', { 0.95, 0.05, 0,    0,    0    }, DIST_ZIPFIAN },
+    { 'c', { 1.00, 0,    0,    0,    0    }, DIST_ZIPFIAN },
+    { 'd', { 0.95, 0,    0.05, 0,    0    }, DIST_LATEST  },
+    { 'e', { 0,    0,    0.05, 0.95, 0    }, DIST_ZIPFIAN },
+    { 'f', { 0.50, 0,    0,    0,    0.50 }, DIST_ZIPFIAN },
+};
+
+struct value_spec {
+    key_dist dist = DIST_UNIFORM;   // 复用：uniform / zipfian（偏向小的）
+    uint32_t min = 100;
+    uint32_t max = 100;
+};
+
+struct options {
     std::string host = "127.0.0.1";
     int port = 8888;
-    std::string message = "Hello SPDK Server!";
-    
-    // 解析命令行参数
-    if (argc > 1) {
-        host = argv[1];
-    }
-    if (argc > 2) {
-        port = std::stoi(argv[2]);
-    }
-    if (argc > 3) {
-        message = argv[3];
-    }
-    
-    std::cout << "Connecting to " << host << ":" << port << std::endl;
-    
-    // 创建socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        std::cerr << "Error creating socket: " << strerror(errno) << std::endl;
-        return 1;
+    int threads = 4;
+    int conns = 4;
+    int depth = 16;
+    workload wl = workloads[0];
+    uint64_t records = 100000;
+    uint64_t ops = 0;
+    double seconds = 10;
+    double rate = 0;
+    value_spec value;
+    uint32_t max_scan = 100;
+    bool load = true;
+    bool run = true;
+    std::string json;
+    uint64_t seed = 1;
+    uint32_t load_batch = 32;
+};
+
+static options opt;
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t fnv64(uint64_t v) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; i++) {
+        h ^= v & 0xff;
+        h *= 0x100000001b3ULL;
+        v >>= 8;
     }
-    
-    // 设置服务器地址
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    
-    // 解析主机地址
-    if (inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr) <= 0) {
-        if (host == "localhost") {
-            server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-        } else {
-            std::cerr << "Invalid address: " << host << std::endl;
-            close(sockfd);
+    return h;
+}
+
+// 和 YCSB 一样 key 是 user + hash(序号)，插入顺序和 key 的顺序无关
+static int make_key(char *buf, uint64_t id) {
+    return sprintf(buf, "user%019llu", (unsigned long long)(fnv64(id) % 10000000000000000000ULL));
+}
+
+/*
+#############
+key 分布
+#############
+*/
+
+// YCSB 的 zipfian（Gray et al.），theta = 0.99；zeta(n) 启动时算一次，各线程共用
+struct zipfian {
+    uint64_t n = 0;
+    double theta = 0.99;
+    double alpha = 0, zetan = 0, eta = 0;
+
+    void init(uint64_t items) {
+        n = items;
+        double zeta2 = 1.0 + std::pow(0.5, theta);
+        zetan = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            zetan += 1.0 / std::pow((double)i, theta);
+        }
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    // 返回 [0, n) 的秩，0 最热
+    uint64_t next(double u) const {
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta)) {
             return 1;
         }
+        uint64_t r = (uint64_t)(n * std::pow(eta * u - eta + 1.0, alpha));
+        return std::min(r, n - 1);
+    }
+};
+
+static zipfian g_key_zipf;
+static zipfian g_value_zipf;
+// 已经插入的 key 数，insert 从这里取下一个序号
+static std::atomic<uint64_t> g_inserted;
+
+/*
+#############
+统计
+#############
+*/
+
+struct op_stats {
+    uint64_t ok = 0;
+    uint64_t miss = 0;      // GET 不存在、SET 已存在这类正常的结果
+    uint64_t errors = 0;
+    kvs_hist_t latency;     // 从本该发出的时间算起，ns
+    kvs_hist_t service;     // 从真正发出算起，ns
+};
+
+struct thread_stats {
+    op_stats ops[OP_COUNT];
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+};
+
+/*
+#############
+连接
+#############
+*/
+
+struct pending {
+    uint8_t type;
+    uint8_t stage;          // RMW: 0 等 GET，1 等 MOD；SCAN: 0 等第一帧
+    uint32_t frames;        // SCAN 还要收的帧数
+    uint64_t id;
+    uint64_t opaque;
+    uint64_t intended;
+    uint64_t sent;
+};
+
+struct conn {
+    int fd = -1;
+    bool want_out = false;
+    std::vector<char> wbuf;
+    size_t woff = 0;
+    std::vector<char> rbuf;
+    size_t rlen = 0;
+    std::deque<pending> inflight;
+};
+
+struct worker {
+    int index;
+    int epfd = -1;
+    std::vector<conn> conns;
+    std::mt19937_64 rng;
+    std::uniform_real_distribution<double> uni{0.0, 1.0};
+    std::vector<char> values;   // value 从这里随机截一段
+    uint64_t next_opaque = 1;
+    thread_stats stats;
+    bool failed = false;
+};
+
+static int connect_one(const sockaddr_in &addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void put_hdr(std::vector<char> &b, uint8_t opcode, uint32_t key_len, uint32_t value_len,
+                    uint32_t reserved, uint64_t opaque) {
+    kvs_bin_hdr_t hdr = {};
+    hdr.magic = KVS_BIN_MAGIC_REQ;
+    hdr.opcode = opcode;
+    hdr.key_len = htole32(key_len);
+    hdr.value_len = htole32(value_len);
+    hdr.reserved = htole32(reserved);
+    hdr.opaque = opaque;
+    const char *p = (const char *)&hdr;
+    b.insert(b.end(), p, p + sizeof(hdr));
+}
+
+static void put_le32(std::vector<char> &b, uint32_t v) {
+    v = htole32(v);
+    const char *p = (const char *)&v;
+    b.insert(b.end(), p, p + sizeof(v));
+}
+
+static uint32_t value_size(worker &w) {
+    const value_spec &v = opt.value;
+    if (v.min == v.max) {
+        return v.min;
+    }
+    if (v.dist == DIST_ZIPFIAN) {
+        return v.min + (uint32_t)g_value_zipf.next(w.uni(w.rng));
+    }
+    return v.min + (uint32_t)(w.rng() % (v.max - v.min + 1));
+}
+
+static const char *value_data(worker &w, uint32_t len) {
+    return w.values.data() + w.rng() % (w.values.size() - len + 1);
+}
+
+// 按分布取一个已经存在的 key 的序号
+static uint64_t choose_key(worker &w) {
+    uint64_t n = g_inserted.load(std::memory_order_relaxed);
+    switch (opt.wl.dist) {
+    case DIST_UNIFORM:
+        return w.rng() % n;
+    case DIST_ZIPFIAN:
+        // 打散热点，最热的 key 不会都挤在同一段序号上
+        return fnv64(g_key_zipf.next(w.uni(w.rng))) % n;
+    case DIST_LATEST:
+    default: {
+        // 最近插入的最热；zeta 按初始 key 数算，插入增长不多时误差可以忽略
+        uint64_t r = g_key_zipf.next(w.uni(w.rng));
+        return r < n ? n - 1 - r : w.rng() % n;
+    }
+    }
+}
+
+static op_type choose_op(worker &w) {
+    double u = w.uni(w.rng);
+    for (int t = 0; t < OP_LOAD; t++) {
+        if (u < opt.wl.mix[t]) {
+            return (op_type)t;
+        }
+        u -= opt.wl.mix[t];
+    }
+    return OP_READ;
+}
+
+// 把一个请求编码进连接的写缓冲区
+static void encode(worker &w, conn &c, pending &p) {
+    char key[32];
+    int kl;
+    uint32_t vl;
+
+    p.opaque = w.next_opaque++;
+    switch (p.type) {
+    case OP_READ:
+        kl = make_key(key, p.id);
+        put_hdr(c.wbuf, KVS_CMD_BGET, kl, 0, 0, p.opaque);
+        c.wbuf.insert(c.wbuf.end(), key, key + kl);
+        break;
+    case OP_RMW:
+        kl = make_key(key, p.id);
+        if (p.stage == 0) {
+            put_hdr(c.wbuf, KVS_CMD_BGET, kl, 0, 0, p.opaque);
+            c.wbuf.insert(c.wbuf.end(), key, key + kl);
+            break;
+        }
+        /* fallthrough */
+    case OP_UPDATE:
+    case OP_INSERT: {
+        kl = make_key(key, p.id);
+        vl = value_size(w);
+        const char *v = value_data(w, vl);
+        put_hdr(c.wbuf, p.type == OP_INSERT ? KVS_CMD_BSET : KVS_CMD_BMOD, kl, vl, 0, p.opaque);
+        c.wbuf.insert(c.wbuf.end(), key, key + kl);
+        c.wbuf.insert(c.wbuf.end(), v, v + vl);
+        break;
+    }
+    case OP_SCAN: {
+        kl = make_key(key, p.id);
+        uint32_t len = 1 + w.rng() % opt.max_scan;
+        put_hdr(c.wbuf, KVS_CMD_BSCAN, kl, 0, len, p.opaque);
+        c.wbuf.insert(c.wbuf.end(), key, key + kl);
+        break;
+    }
+    case OP_LOAD: {
+        // p.id 是这一批的第一个序号，key 区和 value 区都是 (le32 len | bytes) 序列
+        uint64_t end = std::min(p.id + opt.load_batch, opt.records);
+        std::vector<char> keys, vals;
+        for (uint64_t id = p.id; id < end; id++) {
+            kl = make_key(key, id);
+            put_le32(keys, kl);
+            keys.insert(keys.end(), key, key + kl);
+            vl = value_size(w);
+            const char *v = value_data(w, vl);
+            put_le32(vals, vl);
+            vals.insert(vals.end(), v, v + vl);
+        }
+        put_hdr(c.wbuf, KVS_CMD_MSET, keys.size(), vals.size(), 0, p.opaque);
+        c.wbuf.insert(c.wbuf.end(), keys.begin(), keys.end());
+        c.wbuf.insert(c.wbuf.end(), vals.begin(), vals.end());
+        break;
+    }
+    }
+}
+
+static void issue(worker &w, conn &c, op_type type, uint64_t intended) {
+    pending p = {};
+    p.type = type;
+    p.intended = intended;
+    p.sent = now_ns();
+    if (type == OP_INSERT) {
+        p.id = g_inserted.fetch_add(1, std::memory_order_relaxed);
+    } else if (type != OP_LOAD) {
+        p.id = choose_key(w);
+    }
+    encode(w, c, p);
+    c.inflight.push_back(p);
+}
+
+static void flush(worker &w, conn &c) {
+    while (c.woff < c.wbuf.size()) {
+        ssize_t n = write(c.fd, c.wbuf.data() + c.woff, c.wbuf.size() - c.woff);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            w.failed = true;
+            return;
+        }
+        c.woff += n;
+        w.stats.bytes_out += n;
+    }
+    if (c.woff == c.wbuf.size()) {
+        c.wbuf.clear();
+        c.woff = 0;
+    }
+
+    // 写不完时才关注 EPOLLOUT
+    bool want = !c.wbuf.empty();
+    if (want != c.want_out) {
+        epoll_event ev = {};
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.ptr = &c;
+        epoll_ctl(w.epfd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.want_out = want;
+    }
+}
+
+static void complete(worker &w, pending &p, uint16_t status) {
+    op_stats &s = w.stats.ops[p.type];
+    uint64_t now = now_ns();
+
+    if (status == KVS_BIN_STATUS_OK) {
+        s.ok++;
+    } else if (status == KVS_BIN_STATUS_ERROR) {
+        s.errors++;
+    } else {
+        s.miss++;
+    }
+    kvs_hist_record(&s.latency, now - p.intended);
+    kvs_hist_record(&s.service, now - p.sent);
+}
+
+// 处理一帧回复，返回 false 表示协议出错
+static bool on_frame(worker &w, conn &c, const kvs_bin_hdr_t &hdr) {
+    if (c.inflight.empty() || hdr.magic != KVS_BIN_MAGIC_RES || hdr.opaque != c.inflight.front().opaque) {
+        return false;
+    }
+    pending &p = c.inflight.front();
+    uint16_t status = le16toh(hdr.status);
+
+    if (p.type == OP_SCAN) {
+        if (p.stage == 0) {
+            p.stage = 1;
+            p.frames = le32toh(hdr.reserved);
+            if (status == KVS_BIN_STATUS_OK && p.frames > 0) {
+                return true;
+            }
+        } else if (--p.frames > 0) {
+            return true;
+        }
+    } else if (p.type == OP_RMW && p.stage == 0 && status == KVS_BIN_STATUS_OK) {
+        // 读到了再写回去；排到队尾，回复的顺序和发出的顺序一致
+        pending next = p;
+        next.stage = 1;
+        c.inflight.pop_front();
+        encode(w, c, next);
+        c.inflight.push_back(next);
+        return true;
+    }
+
+    complete(w, p, status);
+    c.inflight.pop_front();
+    return true;
+}
+
+static void on_readable(worker &w, conn &c) {
+    for (;;) {
+        if (c.rbuf.size() - c.rlen < 64 * 1024) {
+            c.rbuf.resize(std::max(c.rbuf.size() * 2, (size_t)256 * 1024));
+        }
+        ssize_t n = read(c.fd, c.rbuf.data() + c.rlen, c.rbuf.size() - c.rlen);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            w.failed = true;
+            return;
+        }
+        if (n < 0) {
+            break;
+        }
+        c.rlen += n;
+        w.stats.bytes_in += n;
+    }
+
+    size_t off = 0;
+    while (c.rlen - off >= sizeof(kvs_bin_hdr_t)) {
+        kvs_bin_hdr_t hdr;
+        memcpy(&hdr, c.rbuf.data() + off, sizeof(hdr));
+        size_t total = sizeof(hdr) + le32toh(hdr.key_len) + le32toh(hdr.value_len);
+        if (c.rlen - off < total) {
+            break;
+        }
+        if (!on_frame(w, c, hdr)) {
+            std::cerr << "unexpected reply on worker " << w.index << std::endl;
+            w.failed = true;
+            return;
+        }
+        off += total;
+    }
+    memmove(c.rbuf.data(), c.rbuf.data() + off, c.rlen - off);
+    c.rlen -= off;
+}
+
+static bool worker_connect(worker &w, const sockaddr_in &addr) {
+    w.epfd = epoll_create1(0);
+    if (w.epfd < 0) {
+        return false;
+    }
+    w.conns.resize(opt.conns);
+    for (conn &c : w.conns) {
+        c.fd = connect_one(addr);
+        if (c.fd < 0) {
+            std::cerr << "connect failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c;
+        epoll_ctl(w.epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+    return true;
+}
+
+static size_t inflight(const worker &w) {
+    size_t n = 0;
+    for (const conn &c : w.conns) {
+        n += c.inflight.size();
+    }
+    return n;
+}
+
+// 发 quota 个请求（0 表示按时间）然后等回复收完。
+// load 阶段发 [first, first + quota * load_batch) 的 key，闭环
+static void worker_phase(worker &w, bool load, uint64_t first, uint64_t quota, uint64_t deadline) {
+    double rate = load ? 0 : opt.rate / opt.threads;
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 / rate) : 0;
+    uint64_t start = now_ns();
+    uint64_t next_due = start;
+    uint64_t issued = 0;
+    size_t rr = 0;
+    epoll_event events[64];
+
+    while (!w.failed) {
+        uint64_t now = now_ns();
+        // 开环按计划时间算：deadline 之前到点的请求过了 deadline 也要发完，
+        // 连接占满时积压的请求不能丢，它们的延迟从计划时间算起，正是要量的尾延迟
+        uint64_t clock = interval > 0 ? next_due : now;
+        bool more = (quota == 0 || issued < quota) && (deadline == 0 || clock < deadline);
+        bool blocked = false;
+
+        if (more && interval > 0) {
+            // 开环：到点的请求找一个有空位的连接发出去，intended 用它本该发出的时间
+            while (next_due <= now && (quota == 0 || issued < quota) && (deadline == 0 || next_due < deadline)) {
+                size_t i = 0;
+                for (; i < w.conns.size(); i++) {
+                    conn &c = w.conns[(rr + i) % w.conns.size()];
+                    if ((int)c.inflight.size() < opt.depth) {
+                        issue(w, c, choose_op(w), next_due);
+                        break;
+                    }
+                }
+                if (i == w.conns.size()) {
+                    blocked = true;
+                    break;
+                }
+                rr = (rr + i + 1) % w.conns.size();
+                next_due += interval;
+                issued++;
+            }
+        } else if (more) {
+            for (conn &c : w.conns) {
+                while ((int)c.inflight.size() < opt.depth && (quota == 0 || issued < quota)) {
+                    if (load) {
+                        pending p = {};
+                        p.type = OP_LOAD;
+                        p.id = first + issued * opt.load_batch;
+                        p.intended = p.sent = now;
+                        encode(w, c, p);
+                        c.inflight.push_back(p);
+                    } else {
+                        issue(w, c, choose_op(w), now);
+                    }
+                    issued++;
+                }
+            }
+        }
+        for (conn &c : w.conns) {
+            if (!c.wbuf.empty()) {
+                flush(w, c);
+            }
+        }
+
+        if (!more && inflight(w) == 0) {
+            break;
+        }
+
+        int timeout = 100;
+        if (more && interval > 0 && !blocked) {
+            uint64_t wait = next_due > now ? next_due - now : 0;
+            timeout = wait < 1000000 ? 0 : (int)(wait / 1000000);
+        } else if (blocked) {
+            timeout = 1;
+        }
+        int n = epoll_wait(w.epfd, events, 64, timeout);
+        for (int i = 0; i < n; i++) {
+            conn &c = *(conn *)events[i].data.ptr;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                w.failed = true;
+                break;
+            }
+            if (events[i].events & EPOLLIN) {
+                on_readable(w, c);
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush(w, c);
+            }
+        }
+    }
+}
+
+/*
+#############
+结果
+#############
+*/
+
+static double ns_to_us(uint64_t ns) {
+    return ns / 1000.0;
+}
+
+static void print_op(const char *name, const op_stats &s, double secs) {
+    uint64_t n = s.ok + s.miss + s.errors;
+    if (n == 0) {
+        return;
+    }
+    printf("%-18s ops=%-10llu ops/s=%-10.0f miss=%-8llu err=%-6llu "
+           "p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus (service p99=%.1fus)\n",
+           name, (unsigned long long)n, n / secs, (unsigned long long)s.miss, (unsigned long long)s.errors,
+           ns_to_us(kvs_hist_percentile(&s.latency, 0.5)), ns_to_us(kvs_hist_percentile(&s.latency, 0.99)),
+           ns_to_us(kvs_hist_percentile(&s.latency, 0.999)), ns_to_us(s.latency.max),
+           ns_to_us(kvs_hist_percentile(&s.service, 0.99)));
+}
+
+static void json_hist(FILE *f, const char *name, const kvs_hist_t &h) {
+    fprintf(f, "\"%s\":{\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"p9999\":%.2f,\"max\":%.2f}",
+            name, ns_to_us(kvs_hist_percentile(&h, 0.5)), ns_to_us(kvs_hist_percentile(&h, 0.9)),
+            ns_to_us(kvs_hist_percentile(&h, 0.99)), ns_to_us(kvs_hist_percentile(&h, 0.999)),
+            ns_to_us(kvs_hist_percentile(&h, 0.9999)), ns_to_us(h.max));
+}
+
+static void json_phase(FILE *f, const char *name, const thread_stats &t, double secs, bool last) {
+    uint64_t total = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        total += t.ops[i].ok + t.ops[i].miss + t.ops[i].errors;
+    }
+    fprintf(f, "  \"%s\": {\"seconds\":%.3f,\"ops\":%llu,\"ops_per_sec\":%.1f,"
+               "\"bytes_out\":%llu,\"bytes_in\":%llu,\"ops_by_type\":{",
+            name, secs, (unsigned long long)total, total / secs,
+            (unsigned long long)t.bytes_out, (unsigned long long)t.bytes_in);
+    bool first = true;
+    for (int i = 0; i < OP_COUNT; i++) {
+        const op_stats &s = t.ops[i];
+        if (s.ok + s.miss + s.errors == 0) {
+            continue;
+        }
+        fprintf(f, "%s\n    \"%s\":{\"ok\":%llu,\"miss\":%llu,\"errors\":%llu,\"latency_us\":{",
+                first ? "" : ",", op_names[i], (unsigned long long)s.ok,
+                (unsigned long long)s.miss, (unsigned long long)s.errors);
+        first = false;
+        json_hist(f, "intended", s.latency);
+        fprintf(f, ",");
+        json_hist(f, "service", s.service);
+        fprintf(f, "}}");
+    }
+    fprintf(f, "}}%s\n", last ? "" : ",");
+}
+
+static void merge(thread_stats &dst, const thread_stats &src) {
+    for (int i = 0; i < OP_COUNT; i++) {
+        dst.ops[i].ok += src.ops[i].ok;
+        dst.ops[i].miss += src.ops[i].miss;
+        dst.ops[i].errors += src.ops[i].errors;
+        kvs_hist_merge(&dst.ops[i].latency, &src.ops[i].latency);
+        kvs_hist_merge(&dst.ops[i].service, &src.ops[i].service);
+    }
+    dst.bytes_out += src.bytes_out;
+    dst.bytes_in += src.bytes_in;
+}
+
+/*
+#############
+main
+#############
+*/
+
+static bool parse_value_spec(const char *s, value_spec &v) {
+    unsigned a, b;
+    if (sscanf(s, "fixed:%u", &a) == 1) {
+        v.dist = DIST_UNIFORM;
+        v.min = v.max = a;
+        return a > 0;
+    }
+    if (sscanf(s, "uniform:%u-%u", &a, &b) == 2) {
+        v.dist = DIST_UNIFORM;
+    } else if (sscanf(s, "zipfian:%u-%u", &a, &b) == 2) {
+        v.dist = DIST_ZIPFIAN;
+    } else {
+        return false;
+    }
+    v.min = a;
+    v.max = b;
+    return a > 0 && a <= b;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-H host] [-P port] [-t threads] [-c conns_per_thread] [-d depth]\n"
+              << "    [-w a|b|c|d|e|f] [-n records] [-o ops | -T seconds] [-R ops_per_sec]\n"
+              << "    [-D uniform|zipfian|latest] [-V fixed:N|uniform:MIN-MAX|zipfian:MIN-MAX]\n"
+              << "    [-S max_scan_len] [-L skip load | -l load only] [-j result.json] [-s seed]" << std::endl;
+}
+
+static bool parse_args(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "H:P:t:c:d:w:n:o:T:R:D:V:S:Llj:s:")) != -1) {
+        switch (ch) {
+        case 'H': opt.host = optarg; break;
+        case 'P': opt.port = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'c': opt.conns = atoi(optarg); break;
+        case 'd': opt.depth = atoi(optarg); break;
+        case 'w': {
+            auto it = std::find_if(std::begin(workloads), std::end(workloads),
+                                   [](const workload &w) { return w.name == tolower(optarg[0]); });
+            if (it == std::end(workloads) || optarg[1] != '\0') {
+                return false;
+            }
+            opt.wl = *it;
+            break;
+        }
+        case 'n': opt.records = strtoull(optarg, NULL, 10); break;
+        case 'o': opt.ops = strtoull(optarg, NULL, 10); break;
+        case 'T': opt.seconds = atof(optarg); break;
+        case 'R': opt.rate = atof(optarg); break;
+        case 'D': {
+            int i = 0;
+            for (; i < 3 && strcmp(optarg, dist_names[i]) != 0; i++) {
+            }
+            if (i == 3) {
+                return false;
+            }
+            opt.wl.dist = (key_dist)i;
+            break;
+        }
+        case 'V':
+            if (!parse_value_spec(optarg, opt.value)) {
+                return false;
+            }
+            break;
+        case 'S': opt.max_scan = atoi(optarg); break;
+        case 'L': opt.load = false; break;
+        case 'l': opt.run = false; break;
+        case 'j': opt.json = optarg; break;
+        case 's': opt.seed = strtoull(optarg, NULL, 10); break;
+        default: return false;
+        }
+    }
+    return opt.threads > 0 && opt.conns > 0 && opt.depth > 0 && opt.records > 0 &&
+           opt.max_scan > 0 && (opt.ops > 0 || opt.seconds > 0);
+}
+
+// 各线程并行跑一个阶段，返回合并的统计和耗时
+static bool run_phase(std::vector<std::unique_ptr<worker>> &workers, bool load,
+                      thread_stats &total, double &secs) {
+    std::vector<std::thread> threads;
+    uint64_t batches = (opt.records + opt.load_batch - 1) / opt.load_batch;
+    uint64_t start = now_ns();
+    uint64_t deadline = !load && opt.ops == 0 ? start + (uint64_t)(opt.seconds * 1e9) : 0;
+
+    for (int i = 0; i < opt.threads; i++) {
+        worker *w = workers[i].get();
+        w->stats = thread_stats();
+        uint64_t first = 0, quota = 0;
+        if (load) {
+            uint64_t lo = batches * i / opt.threads, hi = batches * (i + 1) / opt.threads;
+            first = lo * opt.load_batch;
+            quota = hi - lo;
+            if (quota == 0) {
+                continue;
+            }
+        } else if (opt.ops > 0) {
+            quota = opt.ops * (i + 1) / opt.threads - opt.ops * i / opt.threads;
+            if (quota == 0) {
+                continue;
+            }
+        }
+        threads.emplace_back(worker_phase, std::ref(*w), load, first, quota, deadline);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    total = thread_stats();
+    bool ok = true;
+    for (auto &w : workers) {
+        merge(total, w->stats);
+        ok = ok && !w->failed;
     }
-    
-    // 连接到服务器
-    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Connection failed: " << strerror(errno) << std::endl;
-        close(sockfd);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
         return 1;
     }
-    
-    std::cout << "Connected successfully!" << std::endl;
-    
-    // 发送消息
-    std::cout << "Sending message: " << message << std::endl;
-    ssize_t bytes_sent = send(sockfd, message.c_str(), message.length(), 0);
-    if (bytes_sent < 0) {
-        std::cerr << "Send failed: " << strerror(errno) << std::endl;
-        close(sockfd);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address: " << opt.host << std::endl;
         return 1;
     }
-    
-    std::cout << "Sent " << bytes_sent << " bytes" << std::endl;
-    
-    // 接收回显
-    char buffer[1024];
-    ssize_t bytes_received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received < 0) {
-        std::cerr << "Receive failed: " << strerror(errno) << std::endl;
-    } else if (bytes_received == 0) {
-        std::cout << "Connection closed by server" << std::endl;
-    } else {
-        buffer[bytes_received] = '\0';
-        std::cout << "Received echo: " << buffer << std::endl;
-    }
-    
-    // 关闭连接
-    close(sockfd);
-    std::cout << "Connection closed" << std::endl;
-    
-    return 0;
-}
\ No newline at end of file
+
+    g_key_zipf.init(opt.records);
+    if (opt.value.dist == DIST_ZIPFIAN) {
+        g_value_zipf.init(opt.value.max - opt.value.min + 1);
+    }
+    g_inserted = opt.records;
+
+    std::vector<std::unique_ptr<worker>> workers;
+    for (int i = 0; i < opt.threads; i++) {
+        std::unique_ptr<worker> w(new worker());
+        w->index = i;
+        w->rng.seed(opt.seed * 1000003 + i);
+        w->values.resize(opt.value.max + 4096);
+        for (char &ch : w->values) {
+            ch = 'a' + w->rng() % 26;
+        }
+        if (!worker_connect(*w, addr)) {
+            return 1;
+        }
+        workers.push_back(std::move(w));
+    }
+
+    printf("workload %c: %s keys, %llu records, %d threads x %d conns x depth %d, %s\n",
+           opt.wl.name, dist_names[opt.wl.dist], (unsigned long long)opt.records,
+           opt.threads, opt.conns, opt.depth,
+           opt.rate > 0 ? ("open loop " + std::to_string((uint64_t)opt.rate) + " ops/s").c_str() : "closed loop");
+
+    thread_stats load_stats, run_stats;
+    double load_secs = 0, run_secs = 0;
+    bool ok = true;
+
+    if (opt.load) {
+        ok = run_phase(workers, true, load_stats, load_secs);
+        printf("[load] %.2fs, %.0f keys/s\n", load_secs, opt.records / load_secs);
+        print_op("load", load_stats.ops[OP_LOAD], load_secs);
+    }
+    if (ok && opt.run) {
+        ok = run_phase(workers, false, run_stats, run_secs);
+        printf("[run] %.2fs\n", run_secs);
+        for (int i = 0; i < OP_LOAD; i++) {
+            print_op(op_names[i], run_stats.ops[i], run_secs);
+        }
+    }
+    if (!ok) {
+        std::cerr << "connection failed during the run, results are partial" << std::endl;
+    }
+
+    if (!opt.json.empty()) {
+        FILE *f = opt.json == "-" ? stdout : fopen(opt.json.c_str(), "w");
+        if (f == NULL) {
+            std::cerr << "cannot open " << opt.json << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        fprintf(f, "{\n  \"config\": {\"host\":\"%s\",\"port\":%d,\"workload\":\"%c\",\"distribution\":\"%s\","
+                   "\"records\":%llu,\"threads\":%d,\"connections_per_thread\":%d,\"depth\":%d,"
+                   "\"target_rate\":%.1f,\"value_min\":%u,\"value_max\":%u,\"seed\":%llu},\n",
+                opt.host.c_str(), opt.port, opt.wl.name, dist_names[opt.wl.dist],
+                (unsigned long long)opt.records, opt.threads, opt.conns, opt.depth, opt.rate,
+                opt.value.min, opt.value.max, (unsigned long long)opt.seed);
+        if (opt.load) {
+            json_phase(f, "load", load_stats, load_secs, !opt.run);
+        }
+        if (opt.run) {
+            json_phase(f, "run", run_stats, run_secs, true);
+        }
+        fprintf(f, "}\n");
+        if (f != stdout) {
+            fclose(f);
+        }
+    }
+
+    for (auto &w : workers) {
+        for (conn &c : w->conns) {
+            close(c.fd);
+        }
+        close(w->epfd);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+// 连接风暴测试：多个线程同时反复建连，测从 connect 到收到第一个回复的时间
+// 用法: ./connect_storm [host] [port] [threads] [conns_per_thread] [keep]
+// keep 为 1 时连接全部保持到结束，模拟发布后大量客户端重连；为 0 时每次测完就关
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const char ping_cmd[] = "*1\r\n$4\r\nPING\r\n";
+static const char pong_reply[] = "+PONG\r\n";
+
+struct worker_result {
+    std::vector<uint64_t> connect_ns;   // connect 返回
+    std::vector<uint64_t> setup_ns;     // PING 的回复到达，说明连接已经被 accept 并挂到 shard 上
+    std::vector<int> fds;
+    int errors = 0;
+};
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int connect_one(const sockaddr_in &addr, worker_result &res) {
+    uint64_t start = now_ns();
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    uint64_t connected = now_ns();
+
+    if (write(fd, ping_cmd, sizeof(ping_cmd) - 1) != (ssize_t)(sizeof(ping_cmd) - 1)) {
+        close(fd);
+        return -1;
+    }
+
+    char buf[64];
+    size_t got = 0;
+    while (got < sizeof(pong_reply) - 1) {
+        ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        got += n;
+    }
+    if (memcmp(buf, pong_reply, sizeof(pong_reply) - 1) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    res.connect_ns.push_back(connected - start);
+    res.setup_ns.push_back(now_ns() - start);
+    return fd;
+}
+
+static void worker(sockaddr_in addr, int conns, bool keep, worker_result *res) {
+    for (int i = 0; i < conns; i++) {
+        int fd = connect_one(addr, *res);
+        if (fd < 0) {
+            res->errors++;
+            continue;
+        }
+        if (keep) {
+            res->fds.push_back(fd);
+        } else {
+            close(fd);
+        }
+    }
+}
+
+static void report(const char *name, std::vector<uint64_t> &v) {
+    if (v.empty()) {
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    auto pct = [&](double p) {
+        size_t idx = std::min(v.size() - 1, (size_t)(p * v.size()));
+        return v[idx] / 1000.0;
+    };
+    std::cout << name << ": p50=" << pct(0.50) << "us p99=" << pct(0.99)
+              << "us p999=" << pct(0.999) << "us max=" << v.back() / 1000.0 << "us" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string host = "127.0.0.1";
+    int port = 8888;
+    int nthreads = 8;
+    int conns = 1000;
+    bool keep = false;
+
+    if (argc > 1) host = argv[1];
+    if (argc > 2) port = std::stoi(argv[2]);
+    if (argc > 3) nthreads = std::stoi(argv[3]);
+    if (argc > 4) conns = std::stoi(argv[4]);
+    if (argc > 5) keep = std::stoi(argv[5]) != 0;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address: " << host << std::endl;
+        return 1;
+    }
+
+    std::cout << "connect storm: " << nthreads << " threads x " << conns
+              << " conns to " << host << ":" << port << (keep ? " (keep)" : "") << std::endl;
+
+    std::vector<worker_result> results(nthreads);
+    std::vector<std::thread> threads;
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+        threads.emplace_back(worker, addr, conns, keep, &results[i]);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    std::vector<uint64_t> connect_ns, setup_ns;
+    int errors = 0;
+    for (auto &r : results) {
+        connect_ns.insert(connect_ns.end(), r.connect_ns.begin(), r.connect_ns.end());
+        setup_ns.insert(setup_ns.end(), r.setup_ns.begin(), r.setup_ns.end());
+        errors += r.errors;
+        for (int fd : r.fds) {
+            close(fd);
+        }
+    }
+
+    std::cout << "connections: " << setup_ns.size() << " ok, " << errors << " failed, "
+              << (uint64_t)(setup_ns.size() / secs) << " conn/s" << std::endl;
+    report("connect", connect_ns);
+    report("setup  ", setup_ns);
+
+    return errors ? 1 : 0;
+}